@@ -0,0 +1,236 @@
+/*
+ * cagi-arena.c
+ *
+ * This source file contains the session arena. Every string that the session functions
+ * return is carved out of it, and it is released in one go when the session ends, so a
+ * long-running server can't leak them and never pays for a free() per string.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * _ARENA_ALIGN is the alignment of every arena allocation. It is enough for
+ * pointers, integers and doubles, so callers can put structures in the
+ * arena too.
+ */
+#define _ARENA_ALIGN 8
+
+/*
+ * arena_embedded
+ *	Tell whether <block> is the first block of <session>'s arena, which is
+ *	allocated along with the session by cagi_session_new() and thus must
+ *	never be free'd on its own.
+ * params (required)
+ *	<session> <block>
+ * returns
+ *	Success: 1 if it is, 0 otherwise.
+ *	Failure: Never fails. :)
+ */
+static int arena_embedded(cagi_session *session, cagi_arena_block *block) {
+
+	return ((char *)block == (char *)(session + 1));
+
+}
+
+/*
+ * arena_init
+ *	Set up the arena of <session>, which has just been allocated by
+ *	cagi_session_new() with room for a block of _ARENA_BLOCK_SIZE bytes
+ *	right after it.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void arena_init(cagi_session *session) {
+
+	session->arena = (cagi_arena_block *)(session + 1);
+	session->arena->prev = NULL;
+	session->arena->size = _ARENA_BLOCK_SIZE;
+	session->arena->used = 0;
+
+}
+
+/*
+ * cagi_arena_alloc
+ *	Allocate <size> bytes from <session>'s arena. When the current block is
+ *	full a new one is chained in front of it, large enough for <size>.
+ * params (required)
+ *	<session> <size>
+ * returns
+ *	Success: A pointer to the memory, valid until the session is freed or
+ *		the arena is reset or rolled back past it. It must NOT be
+ *		free'd by the user!
+ *	Failure: Quits the program with exit status 1.
+ */
+void * cagi_arena_alloc(cagi_session *session, size_t size) {
+
+	size_t used;
+	cagi_arena_block *block = session->arena;
+
+	size = (size + _ARENA_ALIGN - 1) & ~(size_t)(_ARENA_ALIGN - 1);
+
+	if (block == NULL || block->size - block->used < size) {
+		block = safe_malloc(sizeof(struct cagi_arena_block) +
+				(size > _ARENA_BLOCK_SIZE ? size :
+							_ARENA_BLOCK_SIZE));
+		block->prev = session->arena;
+		block->size = (size > _ARENA_BLOCK_SIZE ? size :
+							_ARENA_BLOCK_SIZE);
+		block->used = 0;
+		session->arena = block;
+	}
+
+	used = block->used;
+	block->used += size;
+
+	return block->data + used;
+
+}
+
+/*
+ * cagi_arena_strdup
+ *	Copy <str> into <session>'s arena.
+ * params (required)
+ *	<session> <str>
+ * returns
+ *	Success: The copy (see cagi_arena_alloc()).
+ *	Failure: Quits the program with exit status 1.
+ */
+char * cagi_arena_strdup(cagi_session *session, const char *str) {
+
+	cagi_view view;
+
+	view.str = str;
+	view.len = strlen(str);
+
+	return cagi_arena_viewdup(session, view);
+
+}
+
+/*
+ * cagi_arena_viewdup
+ *	Copy <view> into <session>'s arena as a null-terminated string. This is
+ *	how a piece of a response is kept past the next command.
+ * params (required)
+ *	<session> <view>
+ * returns
+ *	Success: The copy (see cagi_arena_alloc()).
+ *	Failure: Quits the program with exit status 1.
+ */
+char * cagi_arena_viewdup(cagi_session *session, const cagi_view view) {
+
+	char *str;
+
+	str = cagi_arena_alloc(session, view.len + 1);
+	memcpy(str, view.str, view.len);
+	str[view.len] = '\0';
+
+	return str;
+
+}
+
+/*
+ * cagi_arena_checkpoint
+ *	Remember the current position of <session>'s arena. A handler that
+ *	loops (a menu, for instance) takes a checkpoint before the loop and
+ *	rolls back to it on every iteration, so that the arena doesn't grow
+ *	with the length of the call.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: The position, to be passed to cagi_arena_rollback().
+ *	Failure: Never fails. :)
+ */
+cagi_arena_mark cagi_arena_checkpoint(cagi_session *session) {
+
+	cagi_arena_mark mark;
+
+	mark.block = session->arena;
+	mark.used = (session->arena ? session->arena->used : 0);
+
+	return mark;
+
+}
+
+/*
+ * cagi_arena_rollback
+ *	Release everything allocated from <session>'s arena since <mark> was
+ *	taken. Blocks chained in since then go back to the system, the block
+ *	that was current at the time is kept.
+ * params (required)
+ *	<session> <mark>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ * NOTE: Every string returned since the checkpoint is invalid afterwards.
+ */
+void cagi_arena_rollback(cagi_session *session, cagi_arena_mark mark) {
+
+	cagi_arena_block *block;
+
+	while (session->arena != mark.block) {
+		block = session->arena;
+		session->arena = block->prev;
+		if (!arena_embedded(session, block))
+			free(block);
+	}
+
+	if (session->arena != NULL)
+		session->arena->used = mark.used;
+
+}
+
+/*
+ * cagi_arena_reset
+ *	Release everything in <session>'s arena, while keeping its first block
+ *	around for what comes next.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_arena_reset(cagi_session *session) {
+
+	cagi_arena_mark mark;
+
+	mark.block = session->arena;
+	while (mark.block != NULL && mark.block->prev != NULL)
+		mark.block = mark.block->prev;
+	mark.used = 0;
+
+	cagi_arena_rollback(session, mark);
+
+}
+
+/*
+ * arena_free
+ *	Release every block of <session>'s arena. For cagi_session_free() only,
+ *	the arena is unusable afterwards.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void arena_free(cagi_session *session) {
+
+	cagi_arena_mark mark;
+
+	mark.block = NULL;
+	mark.used = 0;
+
+	cagi_arena_rollback(session, mark);
+
+}
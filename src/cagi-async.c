@@ -0,0 +1,859 @@
+/*
+ * cagi-async.c
+ *
+ * This source file contains the asynchronous command interface. Commands are submitted on a
+ * session without waiting for asterisk, and their responses are handed back by an event loop
+ * (cagi_async_poll()) as they arrive, either to a callback or as entries of a completion
+ * queue. A single thread can thus drive thousands of sessions, where the blocking functions
+ * need one thread (or fiber, see cagi-pool.c) per session. On an attached session the
+ * blocking functions are wrappers over this: the command is submitted like any other, and
+ * they wait for it (see async_run()). The responses to the commands submitted before it,
+ * which asterisk sends first, are held and delivered by the next cagi_async_poll().
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+#include "wpbx-cagi-trace.h"
+
+/*
+ * struct async_pending
+ *	A command which has been sent, and whose response hasn't arrived yet.
+ */
+struct async_pending {
+	cagi_callback callback;
+	void *arg;
+	int keyed;			// the result is a key (see response_key())
+	int verb;			// see enum cagi_verb
+	unsigned long start;		// see latency_now()
+};
+
+/*
+ * struct cagi_async_state
+ *	The asynchronous side of a session attached to a loop. Asterisk answers
+ *	commands strictly in order, so <pending> is a ring buffer of <size>
+ *	entries, <count> of them in use starting at <first>.
+ */
+struct cagi_async_state {
+	cagi_async *loop;
+	struct async_pending *pending;
+	int first;
+	int count;
+	int size;
+	int usage;			// skipping the usage lines of a 520
+	int closed;			// asterisk closed the connection
+	char *obuf;			// commands asterisk couldn't take yet
+	int olen;
+	int osize;
+	int watching;			// waiting for out_fd to be writable
+	int waiting;			// a blocking command is waiting
+	unsigned long polled;		// the last poll that read the session
+};
+
+/*
+ * struct async_held
+ *	A response which arrived while a blocking command was waiting, to be
+ *	delivered by the next cagi_async_poll(). Its views point into the
+ *	session's arena.
+ */
+struct async_held {
+	cagi_session *session;
+	cagi_response response;
+	cagi_callback callback;
+	void *arg;
+};
+
+/*
+ * struct cagi_async
+ *	An event loop. <done> holds the completions of the last call to
+ *	cagi_async_poll(), and <held> the responses waiting for the next one.
+ */
+struct cagi_async {
+	int epfd;
+	cagi_completion *done;
+	int ndone;
+	int donesize;
+	struct async_held *held;
+	int nheld;
+	int heldsize;
+	unsigned long polls;
+};
+
+/*
+ * cagi_async_new
+ *	Create an event loop for driving sessions asynchronously.
+ * params
+ *	none
+ * returns
+ *	Success: A new loop, which must be released with cagi_async_free().
+ *	Failure: NULL
+ */
+cagi_async * cagi_async_new(void) {
+
+	cagi_async *loop;
+
+	loop = safe_malloc(sizeof(struct cagi_async));
+	memset(loop, 0, sizeof(struct cagi_async));
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1) {
+		log_error("ERROR! Cannot create event loop.");
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+
+}
+
+/*
+ * cagi_async_attach
+ *	Attach <session> to <loop>, so that commands can be submitted on it
+ *	with cagi_async_<name>(). Its descriptors are made non-blocking, so
+ *	that neither reading nor writing can ever stall the loop.
+ * params (required)
+ *	<loop> <session>
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the session is already attached, or epoll refused it).
+ * NOTE: A session stays attached until it is freed. Sessions must be freed
+ *	before their loop, and never from within cagi_async_poll() (a
+ *	callback, for instance). The blocking functions still work on an
+ *	attached session: they wait for the commands submitted before them,
+ *	whose responses are delivered by the next poll.
+ */
+int cagi_async_attach(cagi_async *loop, cagi_session *session) {
+
+	int flags;
+	struct epoll_event event;
+	struct cagi_async_state *state;
+
+	if (session->async != NULL) {
+		log_error("ERROR! Session is already attached.");
+		return -1;
+	}
+
+	flags = fcntl(session->in_fd, F_GETFL);
+	if (flags != -1 && !(flags & O_NONBLOCK))
+		fcntl(session->in_fd, F_SETFL, flags | O_NONBLOCK);
+	flags = fcntl(session->out_fd, F_GETFL);
+	if (flags != -1 && !(flags & O_NONBLOCK))
+		fcntl(session->out_fd, F_SETFL, flags | O_NONBLOCK);
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = session;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, session->in_fd, &event)
+									== -1) {
+		log_error("ERROR! Cannot watch session.");
+		return -1;
+	}
+
+	state = safe_malloc(sizeof(struct cagi_async_state));
+	memset(state, 0, sizeof(struct cagi_async_state));
+	state->loop = loop;
+	session->async = state;
+
+	return 0;
+
+}
+
+/*
+ * async_watch
+ *	Start (or stop, if <on> isn't set) waiting for <session>'s output
+ *	descriptor to take more commands. When it is the same socket as the
+ *	input, the one registration covers both.
+ * params (required)
+ *	<session> <on>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void async_watch(cagi_session *session, const int on) {
+
+	struct epoll_event event;
+	struct cagi_async_state *state = session->async;
+
+	if (state->watching == on)
+		return;
+
+	memset(&event, 0, sizeof(event));
+	event.data.ptr = session;
+	if (session->out_fd == session->in_fd) {
+		event.events = EPOLLIN | (on ? EPOLLOUT : 0);
+		epoll_ctl(state->loop->epfd, EPOLL_CTL_MOD, session->in_fd,
+								&event);
+	} else {
+		event.events = EPOLLOUT;
+		epoll_ctl(state->loop->epfd, (on ? EPOLL_CTL_ADD :
+				EPOLL_CTL_DEL), session->out_fd, &event);
+	}
+	state->watching = on;
+
+}
+
+/*
+ * async_write
+ *	Write as much of <len> bytes of <str> to <session> as asterisk takes
+ *	right now, without waiting.
+ * params (required)
+ *	<session> <str> <len>
+ * returns
+ *	Success: The number of bytes written, 0 if none could be.
+ *	Failure: -1 (asterisk is gone).
+ */
+static int async_write(cagi_session *session, const char *str, const int
+								len) {
+
+	ssize_t n;
+
+	do {
+		n = write(session->out_fd, str, len);
+	} while (n == -1 && errno == EINTR);
+	session->stats.writes++;
+
+	if (n == -1)
+		return (errno == EAGAIN ? 0 : -1);
+
+	session->stats.bytes_out += n;
+	return n;
+
+}
+
+/*
+ * async_send
+ *	Send the command being encoded on <session> (see cagi-encode.c), like
+ *	cmd_send() does but without ever waiting. Whatever asterisk can't take
+ *	yet is kept, behind any commands that are already waiting, and sent by
+ *	cagi_async_poll() once the descriptor is writable again.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: 0
+ *	Failure: -1 (asterisk is gone). Nothing is sent.
+ */
+static int async_send(cagi_session *session) {
+
+	int len, n = 0;
+	char *cmd;
+	struct cagi_async_state *state = session->async;
+
+	cmd_raw(session, "\n", 1);
+	len = session->wcmd;
+	session->wcmd = 0;
+	cmd = session->wbuf + session->wlen;
+
+	if (state->olen == 0 && (n = async_write(session, cmd, len)) == -1)
+		return -1;
+
+	if (n < len) {
+		if (state->olen + len - n > state->osize) {
+			state->osize = (state->olen + len - n) * 2;
+			state->obuf = realloc(state->obuf, state->osize);
+			if (state->obuf == NULL) {
+				log_error("ERROR! Cannot allocate memory. "
+								"Exiting.");
+				exit(1);
+			}
+		}
+		memcpy(state->obuf + state->olen, cmd + n, len - n);
+		state->olen += len - n;
+		async_watch(session, 1);
+	}
+
+	session->stats.commands++;
+	TRACE_COMMAND_SEND(session, cagi_verb_name(session->wverb), len);
+
+	if (session->varcache != NULL)
+		varcache_sent(session, session->wverb, cmd, len);
+
+	return 0;
+
+}
+
+/*
+ * async_submit
+ *	Send the command being encoded on <session> (see cagi-encode.c), and
+ *	remember to hand its response to <callback> (or the completion queue,
+ *	if <callback> is NULL) along with <arg>. If <keyed> is set, the result
+ *	is decoded as a key (see response_key()), where 0 means nothing was
+ *	entered in time if <keyed> is 2.
+ * params (required, required, optional, optional)
+ *	<session> <keyed> [<callback>] [<arg>]
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the session isn't attached, or asterisk is gone). Nothing
+ *		is sent, and <callback> is never called.
+ */
+int async_submit(cagi_session *session, const int keyed, cagi_callback
+							callback, void *arg) {
+
+	int i;
+	struct async_pending *pending;
+	struct cagi_async_state *state = session->async;
+
+	if (state == NULL || state->closed) {
+		log_error("ERROR! Session is not attached to a loop.");
+		session->wcmd = 0;
+		return -1;
+	}
+
+	/*
+	 * Unroll the ring into a bigger buffer when it is full, so that the
+	 * oldest command is at the front again.
+	 */
+	if (state->count == state->size) {
+		pending = safe_malloc((state->size ? state->size * 2 : 8) *
+						sizeof(struct async_pending));
+		for (i = 0; i < state->count; i++)
+			pending[i] = state->pending[(state->first + i) %
+								state->size];
+		free(state->pending);
+		state->pending = pending;
+		state->first = 0;
+		state->size = (state->size ? state->size * 2 : 8);
+	}
+
+	pending = &state->pending[(state->first + state->count) % state->size];
+	pending->callback = callback;
+	pending->arg = arg;
+	pending->keyed = keyed;
+	pending->verb = session->wverb;
+	pending->start = latency_now();
+
+	if (async_send(session) == -1) {
+		log_error("ERROR! Cannot write to asterisk.");
+		return -1;
+	}
+	state->count++;
+
+	return 0;
+
+}
+
+/*
+ * cagi_async_command
+ *	Submit a raw AGI command (Ex: "GET VARIABLE foo") on <session>, like
+ *	the generated cagi_async_<name>() functions do.
+ * params (required, required, optional, optional)
+ *	<session> <command> [<callback>] [<arg>]
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the command is empty, see async_submit() otherwise).
+ */
+int cagi_async_command(cagi_session *session, const char *command,
+	cagi_callback callback, void *arg) {
+
+	int len = strlen(command);
+
+	if (len > 0 && command[len-1] == '\n')
+		len--;
+
+	if (len == 0) {
+		log_error("ERROR! <command> must not be empty.");
+		return -1;
+	}
+
+	session->wcmd = 0;
+	cmd_raw(session, command, len);
+	session->wverb = latency_verb(command);
+
+	return async_submit(session, 0, callback, arg);
+
+}
+
+/*
+ * async_caught
+ *	The callback of a blocking command (see async_run()): copy <response>
+ *	into the one it is waiting with, <arg>, unless it is the dummy of a
+ *	closed connection.
+ */
+static void async_caught(cagi_session *session, cagi_response *response,
+								void *arg) {
+
+	if (!session->async->closed)
+		*(cagi_response *)arg = *response;
+
+}
+
+/*
+ * async_hold
+ *	Keep <response> to the command <callback> and <arg> were submitted with
+ *	for the next cagi_async_poll(), copying what it points to into
+ *	<session>'s arena, since the read buffer is about to be reused.
+ * params (required, required, required, optional, optional)
+ *	<loop> <session> <response> [<callback>] [<arg>]
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1 (out of memory).
+ */
+static void async_hold(cagi_async *loop, cagi_session *session,
+	cagi_response *response, cagi_callback callback, void *arg) {
+
+	struct async_held *held;
+
+	if (loop->nheld == loop->heldsize) {
+		loop->heldsize = (loop->heldsize ? loop->heldsize * 2 : 16);
+		loop->held = realloc(loop->held, loop->heldsize *
+						sizeof(struct async_held));
+		if (loop->held == NULL) {
+			log_error("ERROR! Cannot allocate memory. Exiting.");
+			exit(1);
+		}
+	}
+
+	held = &loop->held[loop->nheld++];
+	held->session = session;
+	held->response = *response;
+	held->callback = callback;
+	held->arg = arg;
+
+	held->response.result_text.str = cagi_arena_viewdup(session,
+							response->result_text);
+	held->response.data.str = cagi_arena_viewdup(session, response->data);
+	held->response.value.str = cagi_arena_viewdup(session, response->value);
+
+}
+
+/*
+ * async_hand
+ *	Call <callback> with <response> and <arg>, or add them to <loop>'s
+ *	completions if there is no callback.
+ * params (required, required, required, optional, optional)
+ *	<loop> <session> <response> [<callback>] [<arg>]
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1 (out of memory).
+ */
+static void async_hand(cagi_async *loop, cagi_session *session,
+	cagi_response *response, cagi_callback callback, void *arg) {
+
+	if (callback != NULL) {
+		callback(session, response, arg);
+		return;
+	}
+
+	if (loop->ndone == loop->donesize) {
+		loop->donesize = (loop->donesize ? loop->donesize * 2 : 64);
+		loop->done = realloc(loop->done, loop->donesize *
+						sizeof(struct cagi_completion));
+		if (loop->done == NULL) {
+			log_error("ERROR! Cannot allocate memory. Exiting.");
+			exit(1);
+		}
+	}
+
+	loop->done[loop->ndone].session = session;
+	loop->done[loop->ndone].response = *response;
+	loop->done[loop->ndone].arg = arg;
+	loop->ndone++;
+
+}
+
+/*
+ * async_deliver
+ *	Hand <response> to whoever is waiting for the oldest pending command
+ *	of <session>, and file the command's latency. While a blocking command
+ *	waits, nobody else may run (a callback could send a command of its own
+ *	in the middle of it), so the others are held for the next poll.
+ * params (required)
+ *	<loop> <session> <response>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1 (out of memory).
+ */
+static void async_deliver(cagi_async *loop, cagi_session *session,
+	cagi_response *response) {
+
+	struct async_pending pending;
+	struct cagi_async_state *state = session->async;
+
+	pending = state->pending[state->first];
+	state->first = (state->first + 1) % state->size;
+	state->count--;
+
+	/*
+	 * Commands failed by async_close() never made the round trip.
+	 */
+	if (!state->closed)
+		latency_record(pending.verb, pending.start);
+
+	if (pending.keyed)
+		response_key(response, (pending.keyed == 2));
+
+	if (state->waiting && pending.callback != async_caught)
+		async_hold(loop, session, response, pending.callback,
+								pending.arg);
+	else
+		async_hand(loop, session, response, pending.callback,
+								pending.arg);
+
+}
+
+/*
+ * async_close
+ *	Stop watching <session>, whose connection is gone, and complete each of
+ *	its pending commands with a hangup.
+ * params (required)
+ *	<loop> <session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void async_close(cagi_async *loop, cagi_session *session) {
+
+	cagi_response response;
+	struct cagi_async_state *state = session->async;
+
+	session->hungup = 1;
+	state->closed = 1;
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, session->in_fd, NULL);
+	if (state->watching && session->out_fd != session->in_fd)
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, session->out_fd, NULL);
+	state->watching = 0;
+	state->olen = 0;
+
+	while (state->count > 0) {
+		response_dummy(&response, "200", "-1", "(hangup)");
+		async_deliver(loop, session, &response);
+	}
+
+}
+
+/*
+ * async_flush
+ *	Send as much of what asterisk couldn't take of <session>'s commands as
+ *	it takes now, and stop waiting for the descriptor once it is all out.
+ * params (required)
+ *	<loop> <session>
+ * returns
+ *	Success: void.
+ *	Failure: void (the session is closed, see async_close()).
+ */
+static void async_flush(cagi_async *loop, cagi_session *session) {
+
+	int n;
+	struct cagi_async_state *state = session->async;
+
+	if ((n = async_write(session, state->obuf, state->olen)) == -1) {
+		log_error("ERROR! Cannot write to asterisk.");
+		async_close(loop, session);
+		return;
+	}
+
+	memmove(state->obuf, state->obuf + n, state->olen - n);
+	state->olen -= n;
+	if (state->olen == 0)
+		async_watch(session, 0);
+
+}
+
+/*
+ * async_read
+ *	Read what asterisk sent on <session>, and deliver every response that
+ *	is complete. Like read_response(), HANGUP notifications are noted and
+ *	the usage lines of a 520 response are skipped.
+ * params (required)
+ *	<loop> <session>
+ * returns
+ *	Success: void.
+ *	Failure: void (the session is closed, see async_close()).
+ */
+static void async_read(cagi_async *loop, cagi_session *session) {
+
+	int n, len;
+	char *line;
+	cagi_response response;
+	struct cagi_async_state *state = session->async;
+
+	/*
+	 * The responses delivered by the previous poll are released here, as
+	 * promised by cagi_async_poll().
+	 */
+	session_reset_input(session);
+	if ((n = session_fill(session)) == -1)
+		return;
+
+	while ((line = session_nextline(session, &len)) != NULL) {
+
+		if (state->usage) {
+			if (len >= 4 && memcmp(line, "520 ", 4) == 0)
+				state->usage = 0;
+			continue;
+		}
+
+		if (len == 6 && memcmp(line, "HANGUP", 6) == 0) {
+			session->hungup = 1;
+			continue;
+		}
+
+		/*
+		 * Nobody is waiting for this one (asterisk answered more than
+		 * it was asked), so there is nobody to give it to.
+		 */
+		if (state->count == 0)
+			continue;
+
+		if (parse_response(line, len, &response) == -1) {
+			TRACE_PARSE_ERROR(session, line, len);
+			log_error("ERROR! Problem parsing input.");
+			async_close(loop, session);
+			return;
+		}
+
+		if (response.code == 520 && len > 3 && line[3] == '-')
+			state->usage = 1;
+
+		TRACE_RESPONSE_RECEIVE(session, cagi_verb_name(
+			state->pending[state->first].verb), len + 1, &response);
+		async_deliver(loop, session, &response);
+	}
+
+	if (n == 0)
+		async_close(loop, session);
+
+}
+
+/*
+ * async_settle
+ *	Wait until every command of <session> is sent and answered, like a
+ *	blocking command would, holding their responses (see async_deliver()).
+ *	The session must be waiting (see struct cagi_async_state).
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void (the session may have been closed in the meantime).
+ *	Failure: Ends the session (see session_fatal()).
+ */
+static void async_settle(cagi_session *session) {
+
+	int len;
+	struct cagi_async_state *state = session->async;
+
+	while (!state->closed && (state->olen > 0 || state->count > 0)) {
+		if (state->olen > 0) {
+			len = state->olen;
+			state->olen = 0;
+			async_watch(session, 0);
+			session_write(session, state->obuf, len);
+		}
+		if (state->count > 0) {
+			session_wait(session, session->in_fd, POLLIN);
+			async_read(state->loop, session);
+		}
+	}
+
+}
+
+/*
+ * async_drain
+ *	Send every command of <session> that asterisk couldn't take yet, and
+ *	wait for their responses, before a blocking command goes out on its
+ *	own (a batch, for instance). It must not overtake them, or the
+ *	responses would be handed to the wrong commands.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: Ends the session (see session_fatal()).
+ */
+void async_drain(cagi_session *session) {
+
+	struct cagi_async_state *state = session->async;
+
+	if (state == NULL || state->waiting)
+		return;
+
+	state->waiting = 1;
+	async_settle(session);
+	state->waiting = 0;
+
+}
+
+/*
+ * async_run
+ *	Submit the command being encoded on <session>, and wait for its
+ *	response, which is parsed into <response>. This is what the blocking
+ *	functions do on a session attached to a loop (see cmd_run()).
+ * params (required)
+ *	<session> <response>
+ * returns
+ *	Success: The result of the command (response->result).
+ *	Failure: Ends the session (see session_fatal()).
+ */
+int async_run(cagi_session *session, cagi_response *response) {
+
+	struct cagi_async_state *state = session->async;
+
+	if (async_submit(session, 0, async_caught, response) == -1)
+		session_fatal(session, "ERROR! Cannot write to asterisk.");
+
+	response->code = 0;
+	state->waiting = 1;
+	async_settle(session);
+	state->waiting = 0;
+
+	/*
+	 * Every response has a code, so none means the connection closed
+	 * before the answer came.
+	 */
+	if (response->code == 0)
+		session_fatal(session, "ERROR! Connection closed.");
+
+	return response->result;
+
+}
+
+/*
+ * cagi_async_poll
+ *	Wait up to <timeout> milliseconds (-1 for ever, 0 not at all) for
+ *	responses on the sessions attached to <loop>, and deliver them.
+ *	Commands submitted with a callback have it called from here. The
+ *	others are returned as completions.
+ * params (required)
+ *	<loop> <timeout> <completions>
+ * returns
+ *	Success: The number of completions, which <completions> is set to
+ *		point to. They, and the responses in them, are valid until the
+ *		next call to cagi_async_poll(), or until a blocking command is
+ *		sent on their session. A response passed to a callback is only
+ *		valid during the call.
+ *	Failure: -1
+ * NOTE: When asterisk closes a session's connection, every command pending
+ *	on it completes with an outcome of CAGI_OUTCOME_HANGUP.
+ */
+int cagi_async_poll(cagi_async *loop, int timeout, cagi_completion
+							**completions) {
+
+	int i, n;
+	cagi_session *session;
+	struct async_held held;
+	struct epoll_event events[_FASTAGI_BACKLOG];
+
+	loop->ndone = 0;
+	loop->polls++;
+	*completions = loop->done;
+
+	/*
+	 * What arrived while blocking commands waited comes first, in order.
+	 * A callback may hold more (by running a blocking command), which
+	 * waits for the next poll.
+	 */
+	n = loop->nheld;
+	for (i = 0; i < n; i++) {
+		held = loop->held[i];
+		async_hand(loop, held.session, &held.response, held.callback,
+								held.arg);
+	}
+	if (loop->nheld > n)
+		memmove(loop->held, loop->held + n, (loop->nheld - n) *
+						sizeof(struct async_held));
+	loop->nheld -= n;
+
+	n = epoll_wait(loop->epfd, events, _FASTAGI_BACKLOG, timeout);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		log_error("ERROR! Event loop failed.");
+		return -1;
+	}
+
+	/*
+	 * Both of a session's descriptors point back to it, so an event may be
+	 * about either one, and a session may get two events in one go. It is
+	 * read only once per poll: reading again would reset its read buffer
+	 * under the responses already delivered (see async_read()).
+	 */
+	for (i = 0; i < n; i++) {
+		session = events[i].data.ptr;
+		if ((events[i].events & (EPOLLOUT | EPOLLERR)) &&
+						session->async->olen > 0)
+			async_flush(loop, session);
+		if (session->async->closed || session->async->polled ==
+				loop->polls || !(events[i].events & (EPOLLIN |
+						EPOLLHUP | EPOLLERR)))
+			continue;
+		session->async->polled = loop->polls;
+		async_read(loop, session);
+	}
+
+	*completions = loop->done;
+	return loop->ndone;
+
+}
+
+/*
+ * async_free
+ *	Detach <session> from its loop, if it is attached. For
+ *	cagi_session_free() only. Pending commands are dropped.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void async_free(cagi_session *session) {
+
+	int i, j;
+	cagi_async *loop;
+	struct cagi_async_state *state = session->async;
+
+	if (state == NULL)
+		return;
+
+	if (!state->closed)
+		epoll_ctl(state->loop->epfd, EPOLL_CTL_DEL, session->in_fd,
+									NULL);
+	if (!state->closed && state->watching && session->out_fd !=
+							session->in_fd)
+		epoll_ctl(state->loop->epfd, EPOLL_CTL_DEL, session->out_fd,
+									NULL);
+
+	/*
+	 * Responses held for the next poll can't be delivered any more.
+	 */
+	loop = state->loop;
+	for (i = j = 0; i < loop->nheld; i++)
+		if (loop->held[i].session != session)
+			loop->held[j++] = loop->held[i];
+	loop->nheld = j;
+
+	free(state->obuf);
+	free(state->pending);
+	free(state);
+	session->async = NULL;
+
+}
+
+/*
+ * cagi_async_free
+ *	Release <loop>. Every session attached to it must have been freed.
+ * params (required)
+ *	<loop>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_async_free(cagi_async *loop) {
+
+	if (loop == NULL)
+		return;
+
+	close(loop->epfd);
+	free(loop->done);
+	free(loop->held);
+	free(loop);
+
+}
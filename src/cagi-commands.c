@@ -0,0 +1,209 @@
+/*
+ * cagi-commands.c
+ *
+ * This source file contains the table driven command functions. Each row of the command
+ * table (cagi-commands.def) is expanded here into an encoder that knows its command's
+ * arguments, and the cagi_cmd_<name>() and cagi_queue_<name>() functions built on top of it.
+ * Which arguments are required, which are optional and how the result is decoded are all
+ * decided at compile time, so all that is left to do per call is check for empty arguments
+ * and copy them out.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * CAGI_EMPTY
+ *	Whether an argument is empty. NULL counts as empty, so that callers
+ *	can leave optional arguments out either way.
+ */
+#define CAGI_EMPTY(name)		((name) == NULL || *(name) == '\0')
+
+/*
+ * CAGI_BREAKS
+ *	Whether an argument contains a line break. Asterisk reads one command
+ *	per line, and quoting doesn't change that, so such an argument would
+ *	end the command early and make asterisk answer twice.
+ */
+#define CAGI_BREAKS(name)	((name) != NULL && strpbrk(name, "\r\n") != NULL)
+
+/*
+ * CAGI_CHECK
+ *	Make the encoder fail if a required argument is empty, or if any
+ *	argument contains a line break.
+ */
+#define CAGI_CHECK(kind, name)		CAGI_CHECK_##kind(name)
+#define CAGI_CHECK_REQ(name) \
+	if (CAGI_EMPTY(name)) \
+		return cmd_missing(#name); \
+	CAGI_CHECK_ANY(name)
+#define CAGI_CHECK_TEXT(name)		CAGI_CHECK_REQ(name)
+#define CAGI_CHECK_ANY(name) \
+	if (CAGI_BREAKS(name)) \
+		return cmd_broken(#name);
+#define CAGI_CHECK_TIMEOUT(name)	CAGI_CHECK_ANY(name)
+#define CAGI_CHECK_OPT(name)		CAGI_CHECK_ANY(name)
+
+/*
+ * CAGI_ENCODE
+ *	Append an argument to the command being encoded. <skip> is set by the
+ *	first empty optional argument, and drops all of the ones after it.
+ */
+#define CAGI_ENCODE(kind, name)		CAGI_ENCODE_##kind(name)
+#define CAGI_ENCODE_REQ(name)		cmd_arg(session, name);
+#define CAGI_ENCODE_TEXT(name)		cmd_quoted(session, name);
+#define CAGI_ENCODE_ANY(name) \
+	cmd_arg(session, (name != NULL ? name : ""));
+#define CAGI_ENCODE_TIMEOUT(name) \
+	cmd_arg(session, (!CAGI_EMPTY(name) ? name : _DEFAULT_TIMEOUT));
+#define CAGI_ENCODE_OPT(name) \
+	skip |= CAGI_EMPTY(name); \
+	if (!skip) \
+		cmd_arg(session, name);
+
+/*
+ * CAGI_NAME
+ *	Pass an argument on to the encoder.
+ */
+#define CAGI_NAME(kind, name)		, name
+
+/*
+ * CAGI_DECODE
+ *	Turn the response to a command into what cagi_cmd_<name>() returns.
+ */
+#define CAGI_DECODE_RESULT(response)	((response)->result)
+#define CAGI_DECODE_ONE(response)	((response)->result == 1)
+#define CAGI_DECODE_ZERO(response)	((response)->result == 0)
+#define CAGI_DECODE_KEY(response)	response_key(response, 0)
+#define CAGI_DECODE_DIGIT(response)	response_key(response, 1)
+
+/*
+ * CAGI_KEYED
+ *	Whether a command's result is a key, which tells async_submit() to
+ *	decode it as one when the response arrives (2 if 0 is a timeout).
+ */
+#define CAGI_KEYED_RESULT		0
+#define CAGI_KEYED_ONE			0
+#define CAGI_KEYED_ZERO			0
+#define CAGI_KEYED_KEY			1
+#define CAGI_KEYED_DIGIT		2
+
+/*
+ * cmd_dummies
+ *	The response cagi_cmd_<name>() fills in when its command can't be
+ *	encoded. Most commands answer "200 result=-1", the ones below have
+ *	always answered something else (see their wrappers in cagi.c).
+ */
+static const struct cmd_dummy {
+	const char *result;
+	const char *data;
+} cmd_dummies[CAGI_VERB_COUNT] = {
+	[CAGI_VERB_exec] =		{"-2", ""},
+	[CAGI_VERB_get_option] =	{"-1", "endpos=0"},
+	[CAGI_VERB_record_file] =	{"-1", "(randomerror) endpos=0"},
+	[CAGI_VERB_stream_file] =	{"0", "endpos=0"},
+	[CAGI_VERB_control_stream_file] = {"0", "endpos=0"},
+};
+
+/*
+ * cmd_dummy
+ *	Fill in <response> for the command <verb> which couldn't be encoded,
+ *	as if asterisk had answered it (see cmd_dummies).
+ * params (required)
+ *	<response> <verb>
+ * returns
+ *	Success: The dummy result.
+ *	Failure: Never fails.
+ */
+static int cmd_dummy(cagi_response *response, const int verb) {
+
+	const struct cmd_dummy *dummy = &cmd_dummies[verb];
+
+	if (dummy->result == NULL)
+		return response_dummy(response, "200", "-1", "");
+
+	return response_dummy(response, "200", dummy->result, dummy->data);
+
+}
+
+/*
+ * cmd_missing
+ *	Report that the required argument <name> of a command is empty.
+ * params (required)
+ *	<name>
+ * returns
+ *	Success: Never succeeds.
+ *	Failure: -1
+ */
+static int cmd_missing(const char *name) {
+
+	log_error("ERROR! <%s> must not be empty.", name);
+
+	return -1;
+
+}
+
+/*
+ * cmd_broken
+ *	Report that the argument <name> of a command contains a line break.
+ * params (required)
+ *	<name>
+ * returns
+ *	Success: Never succeeds.
+ *	Failure: -1
+ */
+static int cmd_broken(const char *name) {
+
+	log_error("ERROR! <%s> must not contain line breaks.", name);
+
+	return -1;
+
+}
+
+/*
+ * Every row of the table gives:
+ *	encode_<name>(): Check the arguments and encode the command on the
+ *		session (see cagi-encode.c). Returns 0, or -1 if a required
+ *		argument is empty or an argument contains a line break, in
+ *		which case nothing is encoded.
+ *	cagi_cmd_<name>(), cagi_queue_<name>() and cagi_async_<name>(): See
+ *		cagi.h.
+ */
+#define CAGI_COMMAND(name, verb, decode, params, checks, encoders, names) \
+static int encode_##name(cagi_session *session params) { \
+	int skip = 0; \
+	checks \
+	cmd_start(session, verb); \
+	session->wverb = CAGI_VERB_##name; \
+	encoders \
+	(void)skip; \
+	return 0; \
+} \
+int cagi_cmd_##name(cagi_session *session params, cagi_response *response) { \
+	if (encode_##name(session names) != 0) \
+		cmd_dummy(response, CAGI_VERB_##name); \
+	else \
+		cmd_run(session, response); \
+	return CAGI_DECODE_##decode(response); \
+} \
+int cagi_queue_##name(cagi_session *session params) { \
+	if (encode_##name(session names) != 0) \
+		return -1; \
+	return cmd_queue(session); \
+} \
+int cagi_async_##name(cagi_session *session params, cagi_callback callback, \
+								void *arg) { \
+	if (encode_##name(session names) != 0) \
+		return -1; \
+	return async_submit(session, CAGI_KEYED_##decode, callback, arg); \
+}
+#include "wpbx-cagi-commands.def"
+#undef CAGI_COMMAND
@@ -0,0 +1,619 @@
+/*
+ * cagi-dbcache.c
+ *
+ * This source file contains the AstDB cache. Scripts tend to look up the same few database
+ * keys (feature flags, settings per number) on every call, and every database_get() is a
+ * round trip through asterisk. A session with a cache attached (see cagi_set_dbcache())
+ * answers repeated lookups from it instead, until they expire. One cache may be attached to
+ * a single session, or shared by all the sessions of a FastAGI server, from any thread.
+ *
+ * The cache is read through and written through: cagi_database_get() fills it (including
+ * keys that don't exist), cagi_database_put() updates it, and cagi_database_del() and
+ * cagi_database_deltree() invalidate what they delete. Commands sent any other way
+ * (cagi_cmd_database_put(), raw commands, other programs writing to the database) go around
+ * it, which is what the time to live is for.
+ *
+ * A cache can be backed by a shared memory cache (see cagi_dbcache_share()), so that the
+ * keys are shared by every process on the machine, as classic AGI scripts need.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * struct dbcache_entry
+ *	A cached key. <data> holds the family, key and value, each followed by
+ *	a '\0'. A key that doesn't exist in the database has a <vlen> of -1.
+ */
+struct dbcache_entry {
+	struct dbcache_entry *hnext;		// next in its bucket
+	struct dbcache_entry *older;		// insertion order, for eviction
+	struct dbcache_entry *newer;
+	unsigned int hash;
+	long expires;				// see dbcache_now()
+	int flen;
+	int klen;
+	int vlen;
+	char data[];
+};
+
+/*
+ * struct dbcache_ttl
+ *	The time to live of the keys of one family, if it isn't the cache's.
+ */
+struct dbcache_ttl {
+	char *family;
+	int ttl;
+};
+
+/*
+ * struct cagi_dbcache
+ *	The cache. <lock> guards everything else, so that sessions on any
+ *	thread can share it.
+ */
+struct cagi_dbcache {
+	pthread_mutex_t lock;
+	struct dbcache_entry **buckets;
+	unsigned int mask;			// number of buckets - 1
+	int size;				// most entries kept
+	int ttl;				// default, in milliseconds
+	struct dbcache_entry *oldest;
+	struct dbcache_entry *newest;
+	struct dbcache_ttl *ttls;
+	int nttls;
+	cagi_shmcache *shm;			// see cagi_dbcache_share()
+	cagi_cache_stats stats;
+};
+
+/*
+ * dbcache_now
+ *	The time entries expire by, in milliseconds. The coarse clock is plenty
+ *	for that, and costs next to nothing.
+ */
+static long dbcache_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
+/*
+ * dbcache_hash
+ *	Hash <family> and <key> (FNV-1a).
+ */
+static unsigned int dbcache_hash(const char *family, const int flen, const
+						char *key, const int klen) {
+
+	int i;
+	unsigned int hash = 2166136261u;
+
+	for (i = 0; i < flen; i++)
+		hash = (hash ^ (unsigned char)family[i]) * 16777619u;
+	hash = (hash ^ '/') * 16777619u;
+	for (i = 0; i < klen; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+
+	return hash;
+
+}
+
+/*
+ * dbcache_find
+ *	Find the entry of <family> and <key>. Must be called with the lock
+ *	held.
+ * returns
+ *	Success: The entry.
+ *	Failure: NULL if it isn't cached.
+ */
+static struct dbcache_entry * dbcache_find(cagi_dbcache *cache, const char
+	*family, const int flen, const char *key, const int klen, const
+							unsigned int hash) {
+
+	struct dbcache_entry *entry;
+
+	for (entry = cache->buckets[hash & cache->mask]; entry != NULL;
+							entry = entry->hnext)
+		if (entry->hash == hash && entry->flen == flen &&
+			entry->klen == klen &&
+			memcmp(entry->data, family, flen) == 0 &&
+			memcmp(entry->data + flen + 1, key, klen) == 0)
+			return entry;
+
+	return NULL;
+
+}
+
+/*
+ * dbcache_remove
+ *	Remove <entry> from the cache and free it. Must be called with the
+ *	lock held.
+ */
+static void dbcache_remove(cagi_dbcache *cache, struct dbcache_entry *entry) {
+
+	struct dbcache_entry **link;
+
+	for (link = &cache->buckets[entry->hash & cache->mask]; *link != entry;
+							link = &(*link)->hnext)
+		;
+	*link = entry->hnext;
+
+	if (entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+	if (entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+
+	cache->stats.entries--;
+	free(entry);
+
+}
+
+/*
+ * dbcache_family_ttl
+ *	The time to live of the keys of <family>. Must be called with the lock
+ *	held.
+ */
+static int dbcache_family_ttl(cagi_dbcache *cache, const char *family) {
+
+	int i;
+
+	for (i = 0; i < cache->nttls; i++)
+		if (strcmp(cache->ttls[i].family, family) == 0)
+			return cache->ttls[i].ttl;
+
+	return cache->ttl;
+
+}
+
+/*
+ * dbcache_path
+ *	Write the key of <family> and <key> in the shared cache into <buff>,
+ *	which has room for <size> bytes. AstDB keys are kept by their path in
+ *	the database, under "astdb/".
+ * returns
+ *	Success: The length of the key.
+ *	Failure: -1 if it doesn't fit.
+ */
+static int dbcache_path(char *buff, const int size, const char *family, const
+							char *key) {
+
+	int len;
+
+	len = snprintf(buff, size, "astdb/%s%s%s", family, (key != NULL ? "/" :
+						""), (key != NULL ? key : ""));
+
+	return (len < size ? len : -1);
+
+}
+
+/*
+ * cagi_dbcache_new
+ *	Create a cache which keeps up to <size> keys, for <ttl> milliseconds
+ *	each. When it is full, the keys that were cached first are dropped.
+ * params (required)
+ *	<ttl> <size>
+ * returns
+ *	Success: A new cache, which must be released with cagi_dbcache_free()
+ *		once no session uses it anymore.
+ *	Failure: Quits the program with exit status 1.
+ */
+cagi_dbcache * cagi_dbcache_new(const int ttl, const int size) {
+
+	unsigned int buckets = 16;
+	cagi_dbcache *cache;
+
+	/*
+	 * About one bucket per entry, so that chains stay short.
+	 */
+	while (buckets < (unsigned int)size)
+		buckets *= 2;
+
+	cache = safe_malloc(sizeof(struct cagi_dbcache));
+	memset(cache, 0, sizeof(struct cagi_dbcache));
+	cache->buckets = safe_malloc(buckets * sizeof(struct dbcache_entry *));
+	memset(cache->buckets, 0, buckets * sizeof(struct dbcache_entry *));
+	cache->mask = buckets - 1;
+	cache->size = (size > 0 ? size : 1);
+	cache->ttl = ttl;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	return cache;
+
+}
+
+/*
+ * cagi_dbcache_free
+ *	Release <cache> and everything in it.
+ * params (required)
+ *	<cache>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_dbcache_free(cagi_dbcache *cache) {
+
+	int i;
+
+	if (cache == NULL)
+		return;
+
+	cagi_dbcache_clear(cache);
+	for (i = 0; i < cache->nttls; i++)
+		free(cache->ttls[i].family);
+	free(cache->ttls);
+	free(cache->buckets);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+
+}
+
+/*
+ * cagi_dbcache_ttl
+ *	Keep the keys of <family> for <ttl> milliseconds instead of the
+ *	cache's default. A <ttl> of 0 doesn't cache the family at all.
+ * params (required)
+ *	<cache> <family> <ttl>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ * NOTE: Keys that are already cached keep the time they were given.
+ */
+void cagi_dbcache_ttl(cagi_dbcache *cache, const char *family, const int ttl) {
+
+	int i;
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (i = 0; i < cache->nttls; i++)
+		if (strcmp(cache->ttls[i].family, family) == 0)
+			break;
+
+	if (i == cache->nttls) {
+		cache->ttls = realloc(cache->ttls, (i + 1) *
+						sizeof(struct dbcache_ttl));
+		if (cache->ttls == NULL) {
+			log_error("ERROR! Cannot allocate memory. Exiting.");
+			exit(1);
+		}
+		cache->ttls[i].family = safe_malloc(strlen(family) + 1);
+		strcpy(cache->ttls[i].family, family);
+		cache->nttls++;
+	}
+	cache->ttls[i].ttl = ttl;
+
+	pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+ * cagi_dbcache_clear
+ *	Drop every key from <cache>.
+ * params (required)
+ *	<cache>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_dbcache_clear(cagi_dbcache *cache) {
+
+	pthread_mutex_lock(&cache->lock);
+	while (cache->oldest != NULL)
+		dbcache_remove(cache, cache->oldest);
+	pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+ * cagi_dbcache_stats
+ *	Copy the counters of <cache> into <stats>.
+ * params (required)
+ *	<cache> <stats>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_dbcache_stats(cagi_dbcache *cache, cagi_cache_stats *stats) {
+
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+ * cagi_dbcache_share
+ *	Back <cache> with the shared memory cache <shm> (see cagi-shmcache.c),
+ *	or stop doing so if <shm> is NULL. Lookups that <cache> can't answer
+ *	are looked up in <shm> before they go to asterisk, and everything that
+ *	is cached or invalidated in <cache> is in <shm> too.
+ * params (required)
+ *	<cache> <shm>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ * NOTE: <shm> can't tell a key that doesn't exist from an empty one, which
+ *	cagi_database_get() doesn't either.
+ */
+void cagi_dbcache_share(cagi_dbcache *cache, cagi_shmcache *shm) {
+
+	pthread_mutex_lock(&cache->lock);
+	cache->shm = shm;
+	pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+ * cagi_set_dbcache
+ *	Answer the database lookups of <session> from <cache> (see
+ *	cagi-dbcache.c), or stop doing so if <cache> is NULL.
+ * params (required)
+ *	<session> <cache>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_set_dbcache(cagi_session *session, cagi_dbcache *cache) {
+
+	session->dbcache = cache;
+
+}
+
+/*
+ * dbcache_get
+ *	Look <family> and <key> up in <session>'s cache, and in the shared
+ *	cache behind it if it has one.
+ * params (required)
+ *	<session> <family> <key>
+ * returns
+ *	Success: 1, and <value> is set to a copy of the value in the session's
+ *		arena ("" for a key that doesn't exist).
+ *	Failure: 0 if it isn't cached (or has expired).
+ */
+int dbcache_get(cagi_session *session, const char *family, const char *key,
+								char **value) {
+
+	int len, flen = strlen(family), klen = strlen(key);
+	unsigned int hash = dbcache_hash(family, flen, key, klen);
+	char path[256], shared[256];
+	cagi_dbcache *cache = session->dbcache;
+	struct dbcache_entry *entry;
+
+	pthread_mutex_lock(&cache->lock);
+
+	entry = dbcache_find(cache, family, flen, key, klen, hash);
+	if (entry != NULL && entry->expires - dbcache_now() <= 0) {
+		dbcache_remove(cache, entry);
+		cache->stats.expirations++;
+		entry = NULL;
+	}
+
+	/*
+	 * The shared cache is only looked at on a miss. What it has isn't
+	 * copied into ours, so that it doesn't outlive its time there.
+	 */
+	if (entry == NULL) {
+		len = -1;
+		if (cache->shm != NULL && dbcache_path(path, sizeof(path),
+							family, key) != -1)
+			len = cagi_shmcache_get(cache->shm, path, shared,
+							sizeof(shared));
+		if (len == -1) {
+			cache->stats.misses++;
+			pthread_mutex_unlock(&cache->lock);
+			return 0;
+		}
+
+		cache->stats.hits++;
+		pthread_mutex_unlock(&cache->lock);
+		*value = cagi_arena_alloc(session, len + 1);
+		memcpy(*value, shared, len + 1);
+		return 1;
+	}
+
+	cache->stats.hits++;
+	*value = cagi_arena_alloc(session, (entry->vlen > 0 ? entry->vlen : 0)
+									+ 1);
+	memcpy(*value, entry->data + flen + klen + 2, (entry->vlen > 0 ?
+							entry->vlen : 0) + 1);
+
+	pthread_mutex_unlock(&cache->lock);
+	return 1;
+
+}
+
+/*
+ * dbcache_put
+ *	Cache <value> (NULL for a key that doesn't exist) as the value of
+ *	<family> and <key> in <session>'s cache, replacing what was there.
+ * params (required)
+ *	<session> <family> <key> <value>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ */
+void dbcache_put(cagi_session *session, const char *family, const char *key,
+							const char *value) {
+
+	int ttl, shared = -1, flen = strlen(family), klen = strlen(key);
+	int vlen = (value != NULL ? (int)strlen(value) : -1);
+	unsigned int hash = dbcache_hash(family, flen, key, klen);
+	char path[256];
+	cagi_dbcache *cache = session->dbcache;
+	struct dbcache_entry *entry, **bucket;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if ((entry = dbcache_find(cache, family, flen, key, klen, hash)) !=
+									NULL)
+		dbcache_remove(cache, entry);
+
+	/*
+	 * If the new value can't be shared (too long, or its slots are busy),
+	 * the old one mustn't stay behind for the other processes either.
+	 */
+	ttl = dbcache_family_ttl(cache, family);
+	if (cache->shm != NULL && dbcache_path(path, sizeof(path), family,
+								key) != -1) {
+		if (ttl > 0)
+			shared = cagi_shmcache_put(cache->shm, path, (value !=
+						NULL ? value : ""), ttl);
+		if (shared == -1 && cagi_shmcache_del(cache->shm, path, 0) ==
+									-1)
+			log_error("ERROR! Cannot drop %s from the shared "
+							"cache.", path);
+	}
+
+	if (ttl <= 0) {
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	while (cache->stats.entries >= (unsigned long)cache->size) {
+		dbcache_remove(cache, cache->oldest);
+		cache->stats.evictions++;
+	}
+
+	entry = safe_malloc(sizeof(struct dbcache_entry) + flen + klen +
+					(vlen > 0 ? vlen : 0) + 3);
+	entry->hash = hash;
+	entry->expires = dbcache_now() + ttl;
+	entry->flen = flen;
+	entry->klen = klen;
+	entry->vlen = vlen;
+	memcpy(entry->data, family, flen + 1);
+	memcpy(entry->data + flen + 1, key, klen + 1);
+	memcpy(entry->data + flen + klen + 2, (value != NULL ? value : ""),
+						(vlen > 0 ? vlen : 0) + 1);
+
+	bucket = &cache->buckets[hash & cache->mask];
+	entry->hnext = *bucket;
+	*bucket = entry;
+	entry->older = cache->newest;
+	entry->newer = NULL;
+	if (cache->newest != NULL)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+	cache->newest = entry;
+
+	cache->stats.entries++;
+	cache->stats.stores++;
+
+	pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+ * dbcache_under
+ *	Tell whether the path of <entry> (family/key) starts with <family>,
+ *	followed by /<keytree> if <keytree> isn't empty.
+ */
+static int dbcache_under(const struct dbcache_entry *entry, const char
+		*family, const int flen, const char *keytree, const int tlen) {
+
+	int i, len = flen + (tlen > 0 ? tlen + 1 : 0);
+	char c;
+
+	if (len > entry->flen + 1 + entry->klen)
+		return 0;
+
+	/*
+	 * The '\0' between the family and key in <data> stands for the '/'.
+	 */
+	for (i = 0; i < len; i++) {
+		c = (i < flen ? family[i] : i == flen ? '/' :
+							keytree[i - flen - 1]);
+		if ((i == entry->flen ? '/' : entry->data[i]) != c)
+			return 0;
+	}
+
+	return 1;
+
+}
+
+/*
+ * dbcache_invalidate
+ *	Drop what <session>'s cache holds under <family> and <key>. With a NULL
+ *	<key>, drop everything that DATABASE DELTREE of <family> and <keytree>
+ *	deletes: every key whose path (family/key) starts with family/keytree,
+ *	or with family alone if <keytree> is empty. Families are hierarchical
+ *	in the database, so that includes the keys of sub-families too.
+ * params (required, required, required, optional)
+ *	<session> <family> <key> [<keytree>]
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void dbcache_invalidate(cagi_session *session, const char *family, const char
+					*key, const char *keytree) {
+
+	int flen = strlen(family), klen, tlen;
+	char path[256];
+	const char *sub;
+	cagi_dbcache *cache = session->dbcache;
+	struct dbcache_entry *entry, *newer;
+
+	/*
+	 * Nothing is cached under an empty family, and the command that was
+	 * meant to change it was never sent. Going on would wipe every key
+	 * from the shared cache.
+	 */
+	if (flen == 0)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/*
+	 * A path too long for the shared cache was never put in it.
+	 */
+	if (key == NULL && keytree != NULL && *keytree != '\0')
+		sub = keytree;
+	else
+		sub = key;
+	if (cache->shm != NULL &&
+			dbcache_path(path, sizeof(path), family, sub) != -1 &&
+			cagi_shmcache_del(cache->shm, path, key == NULL) == -1)
+		log_error("ERROR! Cannot drop %s from the shared cache.", path);
+
+	if (key != NULL) {
+		klen = strlen(key);
+		entry = dbcache_find(cache, family, flen, key, klen,
+					dbcache_hash(family, flen, key, klen));
+		if (entry != NULL) {
+			dbcache_remove(cache, entry);
+			cache->stats.invalidations++;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	/*
+	 * Deleting a tree is rare, a walk over the whole cache will do.
+	 */
+	tlen = (keytree != NULL ? strlen(keytree) : 0);
+	for (entry = cache->oldest; entry != NULL; entry = newer) {
+		newer = entry->newer;
+		if (dbcache_under(entry, family, flen, keytree, tlen)) {
+			dbcache_remove(cache, entry);
+			cache->stats.invalidations++;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+}
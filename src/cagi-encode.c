@@ -0,0 +1,241 @@
+/*
+ * cagi-encode.c
+ *
+ * This source file contains the command encoder. Commands are written piece by piece
+ * straight into the session's output buffer, quoting and escaping arguments on the way, and
+ * then either sent right away or queued for a batch. There is no intermediate string to
+ * allocate and free for every command.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+#include "wpbx-cagi-trace.h"
+
+/*
+ * cmd_reserve
+ *	Make sure there is room for <len> more bytes in the command being
+ *	encoded on <session>. The buffer grows by doubling, so a session
+ *	quickly stops allocating.
+ * params (required)
+ *	<session> <len>
+ * returns
+ *	Success: A pointer to where the next byte of the command goes.
+ *	Failure: Quits the program with exit status 1.
+ */
+static char * cmd_reserve(cagi_session *session, const int len) {
+
+	int need = session->wlen + session->wcmd + len;
+
+	if (need > session->wsize) {
+		session->wsize = (session->wsize ? session->wsize * 2 :
+								_BUFF_SIZE);
+		while (need > session->wsize)
+			session->wsize *= 2;
+
+		session->wbuf = realloc(session->wbuf, session->wsize);
+		if (session->wbuf == NULL) {
+			log_error("ERROR! Cannot allocate memory. Exiting.");
+			exit(1);
+		}
+	}
+
+	return session->wbuf + session->wlen + session->wcmd;
+
+}
+
+/*
+ * cmd_start
+ *	Start encoding a new command on <session>, which begins with <verb>
+ *	(Ex: STREAM FILE). Anything left over from a command that was never
+ *	sent is dropped.
+ * params (required)
+ *	<session> <verb>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ */
+void cmd_start(cagi_session *session, const char *verb) {
+
+	session->wcmd = 0;
+	cmd_raw(session, verb, strlen(verb));
+
+}
+
+/*
+ * cmd_raw
+ *	Append <len> bytes of <str> to the command being encoded on <session>,
+ *	as they are.
+ * params (required)
+ *	<session> <str> <len>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ */
+void cmd_raw(cagi_session *session, const char *str, const int len) {
+
+	memcpy(cmd_reserve(session, len), str, len);
+	session->wcmd += len;
+
+}
+
+/*
+ * cmd_arg
+ *	Append <arg> to the command being encoded on <session>, after a space.
+ *	Asterisk splits commands on whitespace, so an argument which is empty
+ *	or contains whitespace, quotes or backslashes is quoted (see
+ *	cmd_quoted()). Everything else goes out as is.
+ * NOTE: Line breaks can't be quoted, cmd_quoted() drops them. Callers are
+ *	expected to refuse such arguments before encoding anything.
+ * params (required)
+ *	<session> <arg>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ */
+void cmd_arg(cagi_session *session, const char *arg) {
+
+	int len;
+	char *out;
+
+	/*
+	 * strcspn() stops at the first byte that needs quoting, which for
+	 * nearly every argument is the terminating null, so it doubles as the
+	 * argument's length.
+	 */
+	len = strcspn(arg, " \t\r\n\"\\");
+	if (len == 0 || arg[len] != '\0') {
+		cmd_quoted(session, arg);
+		return;
+	}
+
+	out = cmd_reserve(session, len + 1);
+	out[0] = ' ';
+	memcpy(out + 1, arg, len);
+	session->wcmd += len + 1;
+
+}
+
+/*
+ * cmd_quoted
+ *	Append <arg> to the command being encoded on <session>, after a space,
+ *	in double quotes. Quotes and backslashes in <arg> are escaped with a
+ *	backslash, which asterisk removes again. Line breaks are dropped, as
+ *	asterisk would take them for the end of the command whatever the
+ *	quotes say.
+ * params (required)
+ *	<session> <arg>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ */
+void cmd_quoted(cagi_session *session, const char *arg) {
+
+	int len = strlen(arg);
+	char *out, *p;
+
+	/*
+	 * Every byte is escaped at worst, plus the space and the quotes.
+	 */
+	p = out = cmd_reserve(session, len * 2 + 3);
+
+	*p++ = ' ';
+	*p++ = '"';
+	for (; *arg != '\0'; arg++) {
+		if (*arg == '\r' || *arg == '\n')
+			continue;
+		if (*arg == '"' || *arg == '\\')
+			*p++ = '\\';
+		*p++ = *arg;
+	}
+	*p++ = '"';
+
+	session->wcmd += p - out;
+
+}
+
+/*
+ * cmd_send
+ *	Finish the command being encoded on <session>, and send it without
+ *	waiting for the response.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: Ends the session (see session_fatal()).
+ * NOTE: Commands queued with cagi_batch_add() are NOT sent, they stay queued.
+ */
+void cmd_send(cagi_session *session) {
+
+	int len;
+
+	cmd_raw(session, "\n", 1);
+	len = session->wcmd;
+	session->wcmd = 0;
+
+	session_write(session, session->wbuf + session->wlen, len);
+	session->stats.commands++;
+	TRACE_COMMAND_SEND(session, cagi_verb_name(session->wverb), len);
+
+	if (session->varcache != NULL)
+		varcache_sent(session, session->wverb, session->wbuf +
+							session->wlen, len);
+
+}
+
+/*
+ * cmd_run
+ *	Send the command being encoded on <session> (see cmd_send()), and wait
+ *	for asterisk's response, which is parsed into <response>. The round
+ *	trip is filed under the command's verb (see cagi-latency.c). On a
+ *	session attached to a loop, the command goes through it instead (see
+ *	async_run()).
+ * params (required)
+ *	<session> <response>
+ * returns
+ *	Success: The result of the command (response->result).
+ *	Failure: Ends the session (see session_fatal()).
+ */
+int cmd_run(cagi_session *session, cagi_response *response) {
+
+	unsigned long start;
+
+	session_reset_input(session);
+	if (session->async != NULL)
+		return async_run(session, response);
+
+	start = latency_now();
+	cmd_send(session);
+
+	read_response(session, response);
+	latency_record(session->wverb, start);
+	return response->result;
+
+}
+
+/*
+ * cmd_queue
+ *	Finish the command being encoded on <session>, and queue it for the
+ *	next cagi_batch_run() instead of sending it.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: The position of the command in the batch (0 for the first).
+ *	Failure: Quits the program with exit status 1.
+ */
+int cmd_queue(cagi_session *session) {
+
+	cmd_raw(session, "\n", 1);
+	session->wlen += session->wcmd;
+	session->wcmd = 0;
+
+	return session->queued++;
+
+}
@@ -0,0 +1,396 @@
+/*
+ * cagi-getvars.c
+ *
+ * This source file contains cagi_get_variables(), which fetches many channel variables in a
+ * single round trip by packing them into as few GET FULL VARIABLE commands as will do, and
+ * sending all of those before reading any answer. Sending and receiving are separate steps
+ * (vars_send() and vars_receive()), so that the prefetcher (see cagi-prefetch.c) can fetch
+ * variables in the same round trip as its database lookups.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * VARS_OVERHEAD is what a GET FULL VARIABLE command of cagi_get_variables()
+ * takes besides its expression: the verb, a space, the quotes and the \n.
+ */
+#define VARS_OVERHEAD	(sizeof("GET FULL VARIABLE \"\"\n") - 1)
+
+/*
+ * struct vars_chunk
+ *	One GET FULL VARIABLE of cagi_get_variables(), for the <n> variables in
+ *	[first, last) that weren't cached. Asterisk's answer is <len> bytes at
+ *	<off> in the read buffer, or <len> is -1 if there is none, and -2 if it
+ *	can't be split.
+ */
+struct vars_chunk {
+	int first;
+	int last;
+	int n;
+	int off;
+	int len;
+};
+
+/*
+ * vars_quoted_len
+ *	The length of <str> once it is quoted (see cmd_quoted()), quotes left
+ *	out.
+ */
+static int vars_quoted_len(const char *str) {
+
+	int len;
+
+	for (len = 0; *str != '\0'; str++)
+		len += (*str == '"' || *str == '\\' ? 2 : 1);
+
+	return len;
+
+}
+
+/*
+ * vars_chunk
+ *	Write the expression for the variables still to fetch (a value.len of
+ *	-1) from <first> on into <expr>: ${<name>}<delimiter> for as many of
+ *	them as fit on one command line. The trailing delimiter lets us see
+ *	that the answer wasn't cut short.
+ * params (required)
+ *	<variables> <count> <first> <expr> <chunk>
+ * returns
+ *	Success: void. <chunk> is filled in, but for <off> and <len>.
+ *	Failure: void.
+ */
+static void vars_chunk(const cagi_variable *variables, const int count, const
+		int first, char *expr, struct vars_chunk *chunk) {
+
+	int i, len, room = _VARS_LINE_SIZE - VARS_OVERHEAD;
+	int dlen = vars_quoted_len(_VARS_DELIMITER);
+
+	chunk->first = first;
+	chunk->n = 0;
+
+	for (i = first; i < count; i++) {
+		if (variables[i].value.len != -1)
+			continue;
+		len = vars_quoted_len(variables[i].name) + 3 + dlen;
+		if (len > room)
+			break;
+		room -= len;
+		expr += sprintf(expr, "${%s}%s", variables[i].name,
+							_VARS_DELIMITER);
+		chunk->n++;
+	}
+
+	chunk->last = i;
+
+}
+
+/*
+ * vars_split
+ *	Tell whether the <len> bytes of <value> are <n> values, each followed
+ *	by the delimiter.
+ */
+static int vars_split(const char *value, const int len, const int n) {
+
+	int found = 0, dlen = strlen(_VARS_DELIMITER);
+	const char *p, *end = value + len;
+
+	for (p = value; p + dlen <= end; p++)
+		if (memcmp(p, _VARS_DELIMITER, dlen) == 0) {
+			found++;
+			p += dlen - 1;
+			if (p + 1 == end)
+				return (found == n);
+		}
+
+	return 0;
+
+}
+
+/*
+ * vars_next
+ *	Find the next delimiter from <value> on, which vars_split() made sure
+ *	is there.
+ */
+static const char * vars_next(const char *value) {
+
+	int dlen = strlen(_VARS_DELIMITER);
+
+	while (memcmp(value, _VARS_DELIMITER, dlen) != 0)
+		value++;
+
+	return value;
+
+}
+
+/*
+ * vars_unwrap
+ *	Point the value of <variable> at <value>, as cagi_get_full_variable()
+ *	returns it, without the parentheses.
+ */
+static void vars_unwrap(cagi_variable *variable, const char *value) {
+
+	int len = strlen(value);
+
+	if (len >= 2 && value[0] == '(') {
+		variable->value.str = value + 1;
+		variable->value.len = len - 2;
+	} else {
+		variable->value.str = value;
+		variable->value.len = len;
+	}
+
+}
+
+/*
+ * vars_check
+ *	Tell whether <name> can be fetched by cagi_get_variables(): it must
+ *	not be empty or contain line breaks, and must fit in a command on its
+ *	own. Names are expanded as ${<name>} inside a larger expression, so
+ *	braces and dollar signs, which would end or nest the expansion, aren't
+ *	allowed either.
+ * params (required)
+ *	<name>
+ * returns
+ *	Success: 1
+ *	Failure: 0, and the problem is logged.
+ */
+int vars_check(const char *name) {
+
+	if (strcmp(name, "") == 0) {
+		log_error("ERROR! <name> must not be empty.");
+		return 0;
+	} else if (strpbrk(name, "\r\n") != NULL) {
+		log_error("ERROR! <name> must not contain line breaks.");
+		return 0;
+	} else if (strpbrk(name, "{}$") != NULL) {
+		log_error("ERROR! <name> must not contain '{', '}' or '$'.");
+		return 0;
+	} else if (vars_quoted_len(name) + 3 + vars_quoted_len(_VARS_DELIMITER)
+				> (int)(_VARS_LINE_SIZE - VARS_OVERHEAD)) {
+		log_error("ERROR! <name> is too long.");
+		return 0;
+	}
+
+	return 1;
+
+}
+
+/*
+ * vars_send
+ *	Send the GET FULL VARIABLE commands of cagi_get_variables() for
+ *	<variables>, without reading the answers, which vars_receive() does.
+ *	Variables in the session's variable cache are filled in right away.
+ *	Other commands may be sent in between, as long as their answers are
+ *	read in the same order.
+ * params (required)
+ *	<session> <variables> <count> <chunks>
+ * returns
+ *	Success: The commands that were sent, <chunks> of them, to be handed to
+ *		vars_receive().
+ *	Failure: Ends the session (see session_fatal()).
+ * NOTE: Every name must have passed vars_check().
+ */
+struct vars_chunk * vars_send(cagi_session *session, cagi_variable
+				*variables, const int count, int *chunks) {
+
+	int i;
+	char key[_VARS_LINE_SIZE], expr[_VARS_LINE_SIZE], *value;
+	struct vars_chunk *chunk;
+
+	/*
+	 * A value.len of -1 marks the variables that are still to fetch.
+	 */
+	for (i = 0; i < count; i++) {
+		variables[i].value.str = "";
+		variables[i].value.len = -1;
+		if (session->varcache == NULL)
+			continue;
+		snprintf(key, sizeof(key), "${%s}", variables[i].name);
+		if (varcache_get(session, VARCACHE_FULL, key, &value))
+			vars_unwrap(&variables[i], value);
+	}
+
+	chunk = cagi_arena_alloc(session, (count ? count : 1) * sizeof(struct
+								vars_chunk));
+	*chunks = 0;
+	for (i = 0; i < count; i = chunk[(*chunks)++].last) {
+		vars_chunk(variables, count, i, expr, &chunk[*chunks]);
+		if (chunk[*chunks].n == 0)
+			break;
+		cmd_start(session, "GET FULL VARIABLE");
+		cmd_arg(session, expr);
+		session->wverb = CAGI_VERB_get_full_variable;
+		cmd_send(session);
+	}
+
+	return chunk;
+
+}
+
+/*
+ * vars_receive
+ *	Read the answers to the commands vars_send() sent, and fill in the
+ *	values of <variables>.
+ * params (required)
+ *	<session> <variables> <count> <chunk> <chunks>
+ * returns
+ *	Success: The number of variables whose values were fetched (or
+ *		cached). The others are left empty.
+ *	Failure: Ends the session (see session_fatal()).
+ */
+int vars_receive(cagi_session *session, cagi_variable *variables, const int
+		count, struct vars_chunk *chunk, const int chunks) {
+
+	int i, j, fetched = 0, retry = 0;
+	int dlen = strlen(_VARS_DELIMITER);
+	char key[_VARS_LINE_SIZE], *value;
+	const char *p;
+	cagi_response response;
+
+	/*
+	 * Nothing before the first answer is dropped from the read buffer
+	 * until the next command, and it doesn't move within the buffer when
+	 * it grows, so answers are remembered by their offset in it.
+	 */
+	for (j = 0; j < chunks; j++) {
+		read_response(session, &response);
+		chunk[j].len = -1;
+		if (response.code == 200 && response.result == 1 &&
+						response.value.len > 0) {
+			chunk[j].off = response.value.str - session->rbuf;
+			chunk[j].len = response.value.len;
+		}
+	}
+
+	/*
+	 * Split every answer into the values of its variables.
+	 */
+	for (j = 0; j < chunks; j++) {
+		if (chunk[j].len == -1)
+			continue;
+
+		p = session->rbuf + chunk[j].off;
+		if (!vars_split(p, chunk[j].len, chunk[j].n)) {
+			chunk[j].len = -2;
+			retry = 1;
+			continue;
+		}
+
+		for (i = chunk[j].first; i < chunk[j].last; i++) {
+			if (variables[i].value.len != -1)
+				continue;
+			variables[i].value.str = p;
+			variables[i].value.len = vars_next(p) - p;
+			p += variables[i].value.len + dlen;
+
+			if (session->varcache != NULL) {
+				snprintf(key, sizeof(key), "${%s}",
+							variables[i].name);
+				value = cagi_arena_alloc(session,
+						variables[i].value.len + 3);
+				sprintf(value, "(%.*s)", variables[i].value.len,
+						variables[i].value.str);
+				varcache_put(session, VARCACHE_FULL, key,
+									value);
+
+				/*
+				 * GET VARIABLE gets the same value, but tells
+				 * a variable that isn't set from an empty
+				 * one, which we can't.
+				 */
+				if (variables[i].value.len > 0)
+					varcache_put(session, VARCACHE_PLAIN,
+						variables[i].name, value);
+			}
+		}
+	}
+
+	/*
+	 * Fetching the variables we couldn't split one by one sends more
+	 * commands, after which the read buffer is no place for the values we
+	 * already have, so those are copied into the arena first.
+	 */
+	if (retry) {
+		for (j = 0; j < chunks; j++)
+			for (i = chunk[j].first; chunk[j].len >= 0 && i <
+							chunk[j].last; i++) {
+				value = cagi_arena_alloc(session,
+						variables[i].value.len + 1);
+				memcpy(value, variables[i].value.str,
+						variables[i].value.len);
+				value[variables[i].value.len] = '\0';
+				variables[i].value.str = value;
+			}
+
+		for (j = 0; j < chunks; j++)
+			for (i = chunk[j].first; chunk[j].len == -2 && i <
+							chunk[j].last; i++) {
+				if (variables[i].value.len != -1)
+					continue;
+				snprintf(key, sizeof(key), "${%s}",
+							variables[i].name);
+				value = cagi_get_full_variable(session, key,
+									"");
+				if (value[0] == '(')
+					vars_unwrap(&variables[i], value);
+			}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (variables[i].value.len == -1)
+			variables[i].value.len = 0;
+		else
+			fetched++;
+	}
+
+	return fetched;
+
+}
+
+/*
+ * cagi_get_variables
+ *	Fetches the values of many channel variables at once. Every
+ *	GET FULL VARIABLE command asks for as many of them as fit on its line
+ *	(see _VARS_LINE_SIZE), joined by _VARS_DELIMITER, and the commands are
+ *	all sent before the first answer is read, so the whole lot costs a
+ *	single round trip.
+ * params (required)
+ *	<variables> <count>
+ * returns
+ *	Success: The number of variables that were fetched, whose values are
+ *		filled in. Like every response, they point into the session's
+ *		read buffer (or arena), and are valid until the next command is
+ *		sent.
+ *	Failure: -1 if a name is empty, too long or has characters that can't
+ *		be expanded (see vars_check()), and nothing is sent.
+ * NOTE: A value that contains the delimiter, or an answer that asterisk cut
+ *	short (it expands at most 4095 bytes), is spotted, and the variables
+ *	of that command are fetched one by one instead. Variables that are in
+ *	the session's variable cache (see cagi-varcache.c) aren't fetched at
+ *	all, and the others are cached.
+ */
+int cagi_get_variables(cagi_session *session, cagi_variable *variables,
+	const int count) {
+
+	int i, chunks;
+	struct vars_chunk *chunk;
+
+	for (i = 0; i < count; i++)
+		if (!vars_check(variables[i].name))
+			return -1;
+
+	session_reset_input(session);
+	chunk = vars_send(session, variables, count, &chunks);
+
+	return vars_receive(session, variables, count, chunk, chunks);
+
+}
@@ -17,205 +17,7 @@
 #include <stdlib.h>
 #include "wpbx-cagi.h"
 #include "wpbx-cagi-internals.h"
-
-/*
- * readvars
- *	Read in all asterisk pre-defined variables for the AGI script to use
- *	and store them in a asterisk_vars struct.
- * params
- *	none
- * returns
- *	Success: Populated asterisk_vars structure (which needs to be free()'d
- *		by the user.
- *	Failure: Quits the program with exit status 1.
- *
- */
-asterisk_vars * readvars(void) {
-
-	int i, j;
-	char *value, *ptr;
-	char buff[_BUFF_SIZE];
-	asterisk_vars *session_vars;
-
-	/*
-	 * The session_vars is a asterisk_vars struct which holds all of the
-	 * variables and their values that asterisk passes to our AGI script
-	 * during initial execution. IT MUST BE FREE()'d BY THE USER AT PROGRAM
-	 * TERMINATION!
-	 */
-	session_vars = safe_malloc(sizeof(struct asterisk_vars));
-
-	fgets(buff, _BUFF_SIZE, stdin);
-
-	/*
-	 * Keep reading variables from stdin that asterisk is passing us until
-	 * we have completely retrieved all values. Each variable is of the
-	 * form:
-	 *      variablename: value\n
-	 *
-	 * Asterisk signals that it is finished sending variables by sending a
-	 * trailing \n character.
-	 */
-	for (i = 0, j = 0; buff[0] != '\n' && buff != NULL; i++) {
-
-		/*
-		 * All variable values follow a semicolon character, so remove
-		 * the stuff before it and the space after it. Some values may
-		 * be empty (a \n character), so check for that special case as
-		 * well.
-		 */
-		value = strchr(buff, ':');
-		if (value == NULL) {
-			print_debug("ERROR! Problem reading variables.");
-			exit(1);
-		}
-		value+=2;       // skip space chars, go directly to value
-
-		/*
-		 * Special case where the variable has no assigned value. In
-		 * this case we assign a single space character ' ' to the
-		 * variable as its value. We also remove the trailing \n from
-		 * all variables.
-		 */
-		if (value[0] == '\n')
-			value = " ";
-		else {
-			ptr = strchr(value, '\n');
-			if (value == NULL) {
-				print_debug("ERROR! Variable has incorrect "
-						"formatting. Exiting.");
-				exit(1);
-			}
-			*ptr = '\0';
-		}
-
-		/*
-		 * Assign the incoming values to their correct variables and
-		 * popular the variable structure. Our strncpy() uses the len
-		 * argument as _BUFF_SIZE-1 to guarantee null-termination. =)
-		 */
-		switch (i) {
-			case 0:
-				strncpy(session_vars->agi_request, value,
-								_BUFF_SIZE-1);
-				break;
-			case 1:
-				strncpy(session_vars->agi_channel, value,
-								_BUFF_SIZE-1);
-				break;
-			case 2:
-				strncpy(session_vars->agi_language, value,
-								_BUFF_SIZE-1);
-				break;
-			case 3:
-				strncpy(session_vars->agi_type, value,
-								_BUFF_SIZE-1);
-				break;
-			case 4:
-				strncpy(session_vars->agi_uniqueid, value,
-								_BUFF_SIZE-1);
-				break;
-			case 5:
-				strncpy(session_vars->agi_version, value,
-								_BUFF_SIZE-1);
-				break;
-			case 6:
-				strncpy(session_vars->agi_callerid, value,
-								_BUFF_SIZE-1);
-				break;
-			case 7:
-				strncpy(session_vars->agi_calleridname, value,
-								_BUFF_SIZE-1);
-				break;
-			case 8:
-				strncpy(session_vars->agi_callingpres, value,
-								_BUFF_SIZE-1);
-				break;
-			case 9:
-				strncpy(session_vars->agi_callingani2, value,
-								_BUFF_SIZE-1);
-				break;
-			case 10:
-				strncpy(session_vars->agi_callington, value,
-								_BUFF_SIZE-1);
-				break;
-			case 11:
-				strncpy(session_vars->agi_callingtns, value,
-								_BUFF_SIZE-1);
-				break;
-			case 12:
-				strncpy(session_vars->agi_dnid, value,
-								_BUFF_SIZE-1);
-				break;
-			case 13:
-				strncpy(session_vars->agi_rdnis, value,
-								_BUFF_SIZE-1);
-				break;
-			case 14:
-				strncpy(session_vars->agi_context, value,
-								_BUFF_SIZE-1);
-				break;
-			case 15:
-				strncpy(session_vars->agi_extension, value,
-								_BUFF_SIZE-1);
-				break;
-			case 16:
-				strncpy(session_vars->agi_priority, value,
-								_BUFF_SIZE-1);
-				break;
-			case 17:
-				strncpy(session_vars->agi_enhanced, value,
-								_BUFF_SIZE-1);
-				break;
-			case 18:
-				strncpy(session_vars->agi_accountcode, value,
-								_BUFF_SIZE-1);
-				break;
-			case 19:
-				strncpy(session_vars->agi_threadid, value,
-								_BUFF_SIZE-1);
-				break;
-			/*
-			 * If we got to the default option, it means these are
-			 * user-passed AGI variables. There can be at most
-			 * _MAX_ARGS of these. And they are of the form:
-			 * agi_arg_1 -> agi_arg_127. Since C standards dictate
-			 * NOT to start arrays with 1, we will rename these
-			 * args agi_arg_0 -> agi_arg_126.
-			 */
-			default:
-				strncpy(session_vars->agi_args[j++], value,
-								_BUFF_SIZE);
-		}
-
-		/*
-		 * Continue reading from stdin until we have exhausted the list
-		 * of variables that asterisk is passing to us.
-		 */
-		fgets(buff, _BUFF_SIZE, stdin);
-	}
-
-	return session_vars;
-
-}
-
-/*
- * print_debug
- *	Print debug messages to STDERR and flush the output. Auto adds a
- *	newline character (\n) to the end of the message. This will show up in
- *	the asterisk root console. (Useful debug tool).
- * params (required)
- *	<debugmsg>
- * returns
- *	Success: void.
- *	Failure: void.
- */
-void print_debug(const char *debugmsg) {
-
-	fprintf(stderr, "%s\n", debugmsg);
-	fflush(stderr);
-
-}
+#include "wpbx-cagi-trace.h"
 
 /*
  * safe_malloc
@@ -233,7 +35,7 @@ void * safe_malloc(const int size) {
 	void *mem;
 
 	if ((mem = malloc(size)) == NULL) {
-		print_debug("ERROR! Cannot allocate memory. Exiting.");
+		log_error("ERROR! Cannot allocate memory. Exiting.");
 		exit(1);
 	}
 
@@ -255,111 +57,350 @@ void * safe_malloc(const int size) {
  */
 char ** evaluate(const char *command) {
 
-	int i;
-	char buff[_BUFF_SIZE];
-	char *begin, *end, **data;
+	return session_evaluate(cagi_default_session(), command);
+
+}
+
+/*
+ * session_evaluate
+ *	Evaluates an AGI command on <session> and returns useful information.
+ *	This is the allocating version of session_command(), used by evaluate().
+ * params (required)
+ *	<session> <command>
+ * returns:
+ *	Success: Returns a two-dimensional array of values (see evaluate()).
+ *	Failure: Ends the session (see session_fatal()).
+ */
+char ** session_evaluate(cagi_session *session, const char *command) {
+
+	cagi_response response;
+
+	session_command(session, command, &response);
+	return response_array(&response);
+
+}
+
+/*
+ * session_command
+ *	Evaluates an AGI command on <session> and parses asterisk's response
+ *	into <response>. Nothing is copied or allocated, the response points
+ *	into the session's read buffer (see cagi_response).
+ * params (required)
+ *	<session> <command> <response>
+ * returns:
+ *	Success: The result of the command (response->result).
+ *	Failure: Ends the session (see session_fatal()).
+ */
+int session_command(cagi_session *session, const char *command, cagi_response
+								*response) {
+
+	unsigned long start;
+	struct iovec iov[2];
 
 	/*
-	 * The data array is an array of strings which will be returned to the
-	 * calling function for processing. IT MUST BE FREE'd BY THE USER!
+	 * Whatever the previous command left in the read buffer is no longer
+	 * needed, so make room before sending this one.
 	 */
-	data = safe_malloc(_RETURN_ELEMENTS * sizeof(char *));
-	for (i = 0; i < _RETURN_ELEMENTS; i++)
-		data[i] = safe_malloc(_BUFF_SIZE);
+	session_reset_input(session);
 
 	/*
 	 * Start by sending the command to asterisk to evaluate. Commands are
-	 * sent raw, however they are passed to this function. Make sure that
-	 * all commands are terminated with \n so that asterisk reads the
-	 * command alone. We flush stdout and stdin to ensure that the command
-	 * was received by asterisk, and also that asterisk's return data is
-	 * put into stdin for our retrieval.
+	 * sent raw, however they are passed to this function. Commands must
+	 * be terminated with \n so that asterisk reads the command alone, so
+	 * one is sent along (in the same system call) if it is missing.
+	 * Sessions are unbuffered on the way out, so once the write returns
+	 * the command is on its way to asterisk.
+	 *
+	 * Commands queued with cagi_batch_add() haven't been sent yet, so they
+	 * can't get in the way of our response.
+	 */
+	iov[0].iov_base = (char *)command;
+	iov[0].iov_len = strlen(command);
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = (iov[0].iov_len && command[iov[0].iov_len-1] == '\n' ?
+									0 : 1);
+	start = latency_now();
+	session_writev(session, iov, 2);
+	session->stats.commands++;
+
+	/*
+	 * Raw commands have no verb until we look for one, which is only worth
+	 * it if the latency is being recorded or traced, or the variable cache
+	 * needs to know what the command may change.
 	 */
-	fprintf(stdout, "%s", command);
-	fflush(stdout);
-	fflush(stdin);
+	session->wverb = CAGI_VERB_OTHER;
+	if (start != 0 || TRACE_ENABLED(command__send) ||
+		TRACE_ENABLED(response__receive) || session->varcache != NULL)
+		session->wverb = latency_verb(command);
+	TRACE_COMMAND_SEND(session, cagi_verb_name(session->wverb),
+					iov[0].iov_len + iov[1].iov_len);
+	if (session->varcache != NULL)
+		varcache_sent(session, session->wverb, command, iov[0].iov_len);
+
+	read_response(session, response);
+	latency_record(session->wverb, start);
+
+	return response->result;
+
+}
+
+/*
+ * response_next
+ *	Read the next response from <session> and parse it into <response>.
+ *	Asynchronous HANGUP notifications that asterisk slips in before a
+ *	response are noted on the session and skipped, and so are the usage
+ *	lines which follow a 520 response.
+ * params (required)
+ *	<session> <response>
+ * returns:
+ *	Success: The length of the response line, newline included.
+ *	Failure: Ends the session (see session_fatal()).
+ */
+static int response_next(cagi_session *session, cagi_response *response) {
+
+	int len, bytes, off;
+	char *line;
 
 	/*
 	 * Read the returned data from asterisk. This is what we will parse to
-	 * get the required information.
+	 * get the required information. If the other end went away (a hangup
+	 * on a FastAGI socket, for instance) there is nothing left to parse.
 	 */
-	fgets(buff, _BUFF_SIZE, stdin);
+	do {
+		if ((line = session_readline(session, &len)) == NULL)
+			session_fatal(session, "ERROR! Connection closed.");
+
+		if (len == 6 && memcmp(line, "HANGUP", 6) == 0) {
+			session->hungup = 1;
+			continue;
+		}
+	} while (len == 6 && memcmp(line, "HANGUP", 6) == 0);
+
+	bytes = len + 1;
 
 	/*
-	 * The first thing we parse for is the code element. It is the first
-	 * block of text before the space character ' '.
+	 * "520-Invalid command syntax." is followed by the command's usage,
+	 * which ends with a line starting with "520 ". Skip it before parsing:
+	 * reading it may grow (and so move) the read buffer, which would leave
+	 * the response pointing into freed memory. The line itself stays put
+	 * relative to the start of the buffer, so we find it again by offset.
 	 */
-	begin = buff;
-	end = strchr(buff, ' ');
-	if (end == NULL) {
-		print_debug("ERROR! Problem parsing input.");
-		exit(1);
+	if (len > 3 && memcmp(line, "520-", 4) == 0) {
+		off = line - session->rbuf;
+		do {
+			if ((line = session_readline(session, &len)) == NULL)
+				session_fatal(session, "ERROR! Connection "
+								"closed.");
+		} while (len < 4 || memcmp(line, "520 ", 4) != 0);
+		line = session->rbuf + off;
+		len = bytes - 1;
 	}
-	*end = '\0';
-	end++;
 
-	strncpy(data[0], begin, _BUFF_SIZE-1);
+	if (parse_response(line, len, response) == -1) {
+		TRACE_PARSE_ERROR(session, line, len);
+		session_fatal(session, "ERROR! Problem parsing input.");
+	}
+
+	return bytes;
+
+}
+
+/*
+ * read_response
+ *	Read the response to the command that was just sent on <session> (see
+ *	response_next()), and parse it into <response>.
+ * params (required)
+ *	<session> <response>
+ * returns:
+ *	Success: void.
+ *	Failure: Ends the session (see session_fatal()).
+ */
+void read_response(cagi_session *session, cagi_response *response) {
+
+	int bytes;
+
+	bytes = response_next(session, response);
+	TRACE_RESPONSE_RECEIVE(session, cagi_verb_name(session->wverb), bytes,
+								response);
+
+}
+
+/*
+ * response_array
+ *	Copy <response> into a two-dimensional array of values, like the one
+ *	evaluate() returns.
+ * params (required)
+ *	<response>
+ * returns
+ *	Success: Returns a two-dimensional array of values. The values are:
+ *		char *data[0] = <code>
+ *		char *data[1] = <result>
+ *		char *data[2] = <data>
+ *	Failure: Quits the program with exit status 1.
+ * NOTE: The array MUST BE FREED BY THE USER with free_2d_array()!
+ */
+char ** response_array(const cagi_response *response) {
+
+	int i, len;
+	char **data;
+	const cagi_view *views[2];
+
+	data = safe_malloc(_RETURN_ELEMENTS * sizeof(char *));
+	for (i = 0; i < _RETURN_ELEMENTS; i++)
+		data[i] = safe_malloc(_BUFF_SIZE);
+
+	snprintf(data[0], _BUFF_SIZE, "%d", response->code);
 
 	/*
-	 * Now we parse the result. It follows the code element by a space
-	 * character. The actual result, however, directly follows the '='
-	 * character.
+	 * Views aren't null-terminated, and may be longer than the fixed size
+	 * strings of the array, so copy at most _BUFF_SIZE-1 bytes of each.
 	 */
-	begin = strchr(end, '=');
-	if (begin == NULL) {
-		print_debug("ERROR! Problem parsing input.");
-		exit(1);
+	views[0] = &response->result_text;
+	views[1] = &response->data;
+	for (i = 0; i < 2; i++) {
+		len = (views[i]->len < _BUFF_SIZE-1 ? views[i]->len :
+								_BUFF_SIZE-1);
+		memcpy(data[i+1], views[i]->str, len);
+		data[i+1][len] = '\0';
+	}
+
+	return data;
+
+}
+
+/*
+ * response_dummy
+ *	Fill in <response> with the given values without asking asterisk, much
+ *	like create_dummy() does for arrays. The values must outlive the
+ *	response (string literals, typically).
+ * params (required)
+ *	<response> <code> <result> <data>
+ * returns
+ *	Success: The result (as an integer).
+ *	Failure: Never fails. :)
+ */
+int response_dummy(cagi_response *response, const char *code, const char
+						*result, const char *data) {
+
+	response->code = atoi(code);
+	response->result = atoi(result);
+	response->result_text.str = result;
+	response->result_text.len = strlen(result);
+	response->data.str = data;
+	response->data.len = strlen(data);
+	parse_tail(response);
+
+	return response->result;
+
+}
+
+/*
+ * cagi_batch_add
+ *	Queue an AGI command on <session> without sending it. Queued commands
+ *	are all sent at once by cagi_batch_run(), which saves a round trip to
+ *	asterisk for every command but the first. Useful for a burst of
+ *	commands whose results aren't needed to build the next one (setting a
+ *	bunch of variables, for instance).
+ * params (required)
+ *	<session> <command>
+ * returns
+ *	Success: The position of the command in the batch (0 for the first).
+ *	Failure: -1 (the command is empty).
+ * NOTE: Commands are queued raw, like evaluate() takes them. A trailing \n is
+ *	added if the command doesn't have one.
+ */
+int cagi_batch_add(cagi_session *session, const char *command) {
+
+	int len;
+
+	if (strcmp(command, "") == 0) {
+		log_error("ERROR! <command> must not be empty.");
+		return -1;
 	}
-	begin++;
 
 	/*
-	 * Not all commands return the third (last) field. The last field is
-	 * optionally returned by asterisk. If there is no space character,
-	 * then we look for the trailing \n character which signals the end of
-	 * data given to us by asterisk.
+	 * The command is queued as is, the encoder adds the \n.
 	 */
-	end = strchr(begin, ' ');
-	if (end == NULL) {
-
-		/*
-		 * If we reach this point in the code, this means that asterisk
-		 * only passed us the code and result, and that the third
-		 * option, data, was not specified. This means that we should
-		 * end early since there is nothing else to read.
-		 */
-		end = strrchr(begin, '\n');
-		if (end == NULL) {
-			print_debug("ERROR! Problem parsing input.");
-			exit(1);
-		}
-		*end = '\0';
+	len = strlen(command);
+	if (command[len-1] == '\n')
+		len--;
+
+	session->wcmd = 0;
+	cmd_raw(session, command, len);
+	return cmd_queue(session);
+
+}
+
+/*
+ * cagi_batch_run
+ *	Send every command queued with cagi_batch_add() in a single write, then
+ *	read their responses. Asterisk answers commands strictly in order, so
+ *	results[i] is the response to the i-th queued command.
+ * params (required)
+ *	<session> <results>
+ * returns
+ *	Success: The number of commands that were run (0 if none were queued).
+ *		Like every response, results[] point into the session's read
+ *		buffer and are valid until the next command is sent.
+ *	Failure: Ends the session (see session_fatal()).
+ * NOTE: <results> must have room for as many entries as commands were
+ *	queued.
+ */
+int cagi_batch_run(cagi_session *session, cagi_response *results) {
+
+	int i, len, start, size, count = session->queued;
+	char *line, *next, *end;
 
-		strncpy(data[1], begin, _BUFF_SIZE-1);
-		strncpy(data[2], "", _BUFF_SIZE-1);
+	if (count == 0)
+		return 0;
 
-		return data;
+	/*
+	 * Queued commands are raw, so the variable cache (if any) looks for the
+	 * verb of each one.
+	 */
+	end = session->wbuf + session->wlen;
+	for (line = session->wbuf; session->varcache != NULL && line < end;
+								line = next) {
+		next = (char *)memchr(line, '\n', end - line) + 1;
+		varcache_sent(session, latency_verb(line), line, next - 1 -
+									line);
 	}
-	*end = '\0';
-	end++;
 
-	strncpy(data[1], begin, _BUFF_SIZE-1);
+	/*
+	 * Reset the queue before anything can fail, so that a session which
+	 * survives (see session_fatal()) doesn't send the batch twice.
+	 */
+	len = session->wlen;
+	session->queued = 0;
+	session->wlen = 0;
+
+	session_reset_input(session);
+	session_write(session, session->wbuf, len);
+	session->stats.commands += count;
+	TRACE_COMMAND_SEND(session, "BATCH", len);
+
+	start = session->rpos;
+	size = session->rsize;
+	for (i = 0; i < count; i++) {
+		len = response_next(session, &results[i]);
+		TRACE_RESPONSE_RECEIVE(session, "BATCH", len, &results[i]);
+	}
 
 	/*
-	 * Now we parse the last values passed to us--the data. We'll pass all
-	 * data as a single string. Don't forget, we don't return ANYTHING with
-	 * a trailing \n character. We only return printable, null-terminated
-	 * single line strings for clarity.
+	 * If the read buffer had to grow to hold all of the responses, the
+	 * ones we parsed first point into the old buffer. The lines are still
+	 * in the new one though, and the buffer is never modified, so parsing
+	 * them again from the start is all it takes to fix them up.
 	 */
-	begin = end;
-	end = strrchr(begin, '\n');
-	if (end == NULL) {
-		print_debug("ERROR! Problem parsing input.");
-		exit(1);
+	if (session->rsize != size) {
+		len = session->rpos;
+		session->rpos = start;
+		for (i = 0; i < count; i++)
+			response_next(session, &results[i]);
+		session->rpos = len;
 	}
-	*end = '\0';
 
-	strncpy(data[2], begin, _BUFF_SIZE-1);
-	return data;
+	return count;
 
 }
 
@@ -395,6 +436,8 @@ void free_2d_array(char **data) {
  *	Success: A string object which has been malloc'ed. IT MUST BE FREE'd by
  *		the user!
  *	Failure: Quits the program with exit status 1.
+ * NOTE: Commands are no longer built with this (see cagi-encode.c). It is
+ *	kept for programs that use it.
  */
 char * format_str(const int count, const char *str1, ...) {
 
@@ -12,11 +12,78 @@
  */
 
 #include <stdio.h>
+#include <sys/uio.h>
 
 asterisk_vars * readvars(void);
 void print_debug(const char *debugmsg);
+#define log_error(...)	cagi_log(CAGI_LOG_ERROR, __VA_ARGS__)
 void * safe_malloc(const int size);
 char ** evaluate(const char *command);
+char ** session_evaluate(cagi_session *session, const char *command);
+int session_command(cagi_session *session, const char *command, cagi_response
+								*response);
+void read_response(cagi_session *session, cagi_response *response);
+void cmd_start(cagi_session *session, const char *verb);
+void cmd_raw(cagi_session *session, const char *str, const int len);
+void cmd_arg(cagi_session *session, const char *arg);
+void cmd_quoted(cagi_session *session, const char *arg);
+void cmd_send(cagi_session *session);
+int cmd_run(cagi_session *session, cagi_response *response);
+int cmd_queue(cagi_session *session);
+int parse_response(const char *line, const int len, cagi_response
+								*response);
+void parse_tail(cagi_response *response);
+int response_key(cagi_response *response, const int waits);
+char ** response_array(const cagi_response *response);
+int response_dummy(cagi_response *response, const char *code, const char
+						*result, const char *data);
+int session_fill(cagi_session *session);
+char * session_nextline(cagi_session *session, int *len);
+char * session_readline(cagi_session *session, int *len);
+void session_reset_input(cagi_session *session);
+void arena_init(cagi_session *session);
+void arena_free(cagi_session *session);
+int async_submit(cagi_session *session, const int keyed, cagi_callback
+							callback, void *arg);
+void async_drain(cagi_session *session);
+int async_run(cagi_session *session, cagi_response *response);
+void async_free(cagi_session *session);
+int dbcache_get(cagi_session *session, const char *family, const char *key,
+								char **value);
+void dbcache_put(cagi_session *session, const char *family, const char *key,
+							const char *value);
+void dbcache_invalidate(cagi_session *session, const char *family, const char
+					*key, const char *keytree);
+
+/*
+ * The two kinds of names that variables are cached under (see
+ * cagi-varcache.c): GET VARIABLE's, and GET FULL VARIABLE's expressions.
+ */
+#define VARCACHE_PLAIN	0
+#define VARCACHE_FULL	1
+
+void varcache_free(cagi_session *session);
+int varcache_get(cagi_session *session, const int kind, const char *name,
+								char **value);
+void varcache_put(cagi_session *session, const int kind, const char *name,
+							const char *value);
+void varcache_sent(cagi_session *session, const int verb, const char
+						*command, const int len);
+struct vars_chunk;
+int vars_check(const char *name);
+struct vars_chunk * vars_send(cagi_session *session, cagi_variable
+				*variables, const int count, int *chunks);
+int vars_receive(cagi_session *session, cagi_variable *variables, const int
+		count, struct vars_chunk *chunk, const int chunks);
+void prefetch_start(cagi_session *session);
+unsigned long latency_now(void);
+void latency_record(const int verb, const unsigned long start);
+int latency_verb(const char *command);
+char * session_gets(cagi_session *session, char *buff, const int size);
+void session_writev(cagi_session *session, struct iovec *iov, int count);
+void session_write(cagi_session *session, const char *str, const int len);
+void session_fatal(cagi_session *session, const char *debugmsg);
+void session_wait(cagi_session *session, int fd, int events);
 void free_2d_array(char **data);
 char * format_str(const int count, const char *str1, ...);
 char ** create_dummy(const char *code, const char *result, const char *data);
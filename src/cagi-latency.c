@@ -0,0 +1,405 @@
+/*
+ * cagi-latency.c
+ *
+ * This source file contains the command latency histograms. The round trip of every command
+ * (from sending it to having asterisk's response) is filed under its verb (ANSWER, STREAM
+ * FILE, DATABASE GET, ...) in a histogram that belongs to the thread which ran it, so that
+ * recording is a couple of plain stores with no lock and no shared cache line. The histograms
+ * of all threads are only merged when somebody asks for a snapshot (cagi_latency_snapshot()).
+ *
+ * Histograms are log-linear, like HDR histograms: every power of two of microseconds is split
+ * into 16 buckets, so percentiles are within about 6% of the truth from 1 microsecond to
+ * several hours, in a fixed amount of memory.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * LATENCY_SUB is the number of buckets per power of two, and LATENCY_BUCKETS
+ * the number of buckets per verb. Anything past the last bucket (about 4.7
+ * hours) goes in it.
+ */
+#define LATENCY_SUB_BITS	4
+#define LATENCY_SUB		(1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS		512
+
+/*
+ * LATENCY_BUMP
+ *	Add <n> to a counter of the calling thread's histograms. Only the owner
+ *	ever writes its counters, so this needs no atomic read-modify-write,
+ *	only a store that readers can't see half done.
+ */
+#define LATENCY_BUMP(counter, n) \
+	__atomic_store_n(&(counter), __atomic_load_n(&(counter), \
+				__ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/*
+ * struct latency_thread
+ *	The histograms of one thread. Histograms are never freed: when their
+ *	thread exits they are retired, and the next new thread takes them over,
+ *	counts and all.
+ */
+struct latency_thread {
+	struct latency_thread *next;
+	int retired;
+	unsigned int counts[CAGI_VERB_COUNT][LATENCY_BUCKETS];
+	unsigned long total[CAGI_VERB_COUNT];	// sum, in microseconds
+	unsigned long max[CAGI_VERB_COUNT];
+};
+
+/*
+ * latency_verbs holds the verb of every command in enum cagi_verb.
+ */
+#define CAGI_COMMAND(name, verb, decode, params, checks, encoders, names) \
+	verb,
+static const char *latency_verbs[CAGI_VERB_COUNT] = {
+#include "wpbx-cagi-commands.def"
+	"OTHER"
+};
+#undef CAGI_COMMAND
+
+/*
+ * latency_threads is the list of every thread's histograms, which only ever
+ * grows (at its head). latency_mine are the calling thread's.
+ */
+static struct latency_thread *latency_threads = NULL;
+static __thread struct latency_thread *latency_mine = NULL;
+static pthread_key_t latency_key;
+static pthread_once_t latency_once = PTHREAD_ONCE_INIT;
+static int latency_on = 1;
+
+/*
+ * latency_retire
+ *	Retire the histograms of a thread which is exiting.
+ */
+static void latency_retire(void *mine) {
+
+	__atomic_store_n(&((struct latency_thread *)mine)->retired, 1,
+							__ATOMIC_RELEASE);
+
+}
+
+static void latency_init(void) {
+
+	pthread_key_create(&latency_key, latency_retire);
+
+}
+
+/*
+ * latency_thread
+ *	Return the calling thread's histograms, taking over retired ones or
+ *	allocating new ones the first time.
+ * params
+ *	none
+ * returns
+ *	Success: The histograms.
+ *	Failure: NULL (out of memory, the latency isn't recorded).
+ */
+static struct latency_thread * latency_thread(void) {
+
+	struct latency_thread *mine;
+
+	if (latency_mine != NULL)
+		return latency_mine;
+
+	pthread_once(&latency_once, latency_init);
+
+	for (mine = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE);
+					mine != NULL; mine = mine->next)
+		if (__sync_bool_compare_and_swap(&mine->retired, 1, 0))
+			break;
+
+	/*
+	 * calloc() of something this big comes straight from mmap(), so only
+	 * the pages of the buckets that are actually used cost any memory.
+	 */
+	if (mine == NULL) {
+		if ((mine = calloc(1, sizeof(struct latency_thread))) == NULL)
+			return NULL;
+		do
+			mine->next = latency_threads;
+		while (!__sync_bool_compare_and_swap(&latency_threads,
+							mine->next, mine));
+	}
+
+	pthread_setspecific(latency_key, mine);
+	latency_mine = mine;
+	return mine;
+
+}
+
+/*
+ * latency_bucket
+ *	Find the bucket of <us> microseconds.
+ */
+static int latency_bucket(const unsigned long us) {
+
+	int e, bucket;
+
+	if (us < LATENCY_SUB)
+		return us;
+
+	e = 63 - __builtin_clzl(us);
+	bucket = (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+			((us >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+
+	return (bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1);
+
+}
+
+/*
+ * latency_value
+ *	The microseconds that <bucket> stands for (the middle of it).
+ */
+static double latency_value(const int bucket) {
+
+	int e, sub;
+
+	if (bucket < LATENCY_SUB)
+		return bucket;
+
+	e = bucket / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+	sub = bucket % LATENCY_SUB;
+
+	return (double)((unsigned long)(LATENCY_SUB + sub) <<
+		(e - LATENCY_SUB_BITS)) + (double)(1UL << (e -
+						LATENCY_SUB_BITS)) / 2;
+
+}
+
+/*
+ * latency_now
+ *	Take the time a command is sent at, for latency_record().
+ * params
+ *	none
+ * returns
+ *	Success: A timestamp in nanoseconds.
+ *	Failure: 0 if latencies aren't being recorded.
+ */
+unsigned long latency_now(void) {
+
+	struct timespec ts;
+
+	if (!__atomic_load_n(&latency_on, __ATOMIC_RELAXED))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+
+}
+
+/*
+ * latency_record
+ *	File the round trip of a command with <verb> (see enum cagi_verb),
+ *	which was sent at <start> (see latency_now()), under the calling
+ *	thread's histograms.
+ * params (required)
+ *	<verb> <start>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void latency_record(const int verb, const unsigned long start) {
+
+	unsigned long us;
+	struct latency_thread *mine;
+
+	if (start == 0 || verb < 0 || verb >= CAGI_VERB_COUNT ||
+					(mine = latency_thread()) == NULL)
+		return;
+
+	us = (latency_now() - start) / 1000;
+
+	LATENCY_BUMP(mine->counts[verb][latency_bucket(us)], 1);
+	LATENCY_BUMP(mine->total[verb], us);
+	if (us > mine->max[verb])
+		__atomic_store_n(&mine->max[verb], us, __ATOMIC_RELAXED);
+
+}
+
+/*
+ * latency_verb
+ *	Find the verb of the raw command <command> (Ex: "GET VARIABLE foo"),
+ *	the longest one of the command table that it starts with.
+ * params (required)
+ *	<command>
+ * returns
+ *	Success: The verb (see enum cagi_verb).
+ *	Failure: CAGI_VERB_OTHER if it isn't in the table.
+ */
+int latency_verb(const char *command) {
+
+	int i, len, best = CAGI_VERB_OTHER, bestlen = 0;
+
+	for (i = 0; i < CAGI_VERB_OTHER; i++) {
+		if ((latency_verbs[i][0] ^ command[0]) & ~0x20)
+			continue;
+		len = strlen(latency_verbs[i]);
+		if (len <= bestlen || strncasecmp(command, latency_verbs[i],
+								len) != 0)
+			continue;
+		if (command[len] == ' ' || command[len] == '\n' ||
+							command[len] == '\0') {
+			best = i;
+			bestlen = len;
+		}
+	}
+
+	return best;
+
+}
+
+/*
+ * cagi_verb_name
+ *	Return the name of <verb> (see enum cagi_verb). Ex: "STREAM FILE"
+ * params (required)
+ *	<verb>
+ * returns
+ *	Success: The verb's name.
+ *	Failure: "OTHER" if <verb> is out of range.
+ */
+const char * cagi_verb_name(const int verb) {
+
+	if (verb < 0 || verb >= CAGI_VERB_COUNT)
+		return latency_verbs[CAGI_VERB_OTHER];
+
+	return latency_verbs[verb];
+
+}
+
+/*
+ * cagi_latency_enable
+ *	Turn the recording of command latencies on or off (it is on to begin
+ *	with). Recording costs two reads of the clock per command.
+ * params (required)
+ *	<on>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_latency_enable(const int on) {
+
+	__atomic_store_n(&latency_on, on, __ATOMIC_RELAXED);
+
+}
+
+/*
+ * cagi_latency_snapshot
+ *	Merge the latency histograms of every thread, and fill <latency> in
+ *	with the numbers of every verb that has been recorded at least once.
+ * params (required)
+ *	<latency> <size>
+ * returns
+ *	Success: The number of entries filled in, at most <size>.
+ *	Failure: -1 (out of memory).
+ * NOTE: Threads go on recording while the snapshot is taken, so it is a
+ *	little fuzzy under load, but never off by more than the commands that
+ *	completed meanwhile.
+ */
+int cagi_latency_snapshot(cagi_latency *latency, const int size) {
+
+	int verb, i, n = 0, q;
+	unsigned long count, seen, target, total, max;
+	unsigned long *merged;
+	struct latency_thread *t;
+	static const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+	double values[4];
+
+	merged = malloc(LATENCY_BUCKETS * sizeof(unsigned long));
+	if (merged == NULL) {
+		log_error("ERROR! Cannot allocate memory.");
+		return -1;
+	}
+
+	for (verb = 0; verb < CAGI_VERB_COUNT && n < size; verb++) {
+		memset(merged, 0, LATENCY_BUCKETS * sizeof(unsigned long));
+		count = total = max = 0;
+
+		for (t = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE);
+						t != NULL; t = t->next) {
+			for (i = 0; i < LATENCY_BUCKETS; i++)
+				merged[i] += __atomic_load_n(
+					&t->counts[verb][i], __ATOMIC_RELAXED);
+			total += __atomic_load_n(&t->total[verb],
+							__ATOMIC_RELAXED);
+			if (t->max[verb] > max)
+				max = t->max[verb];
+		}
+
+		for (i = 0; i < LATENCY_BUCKETS; i++)
+			count += merged[i];
+		if (count == 0)
+			continue;
+
+		/*
+		 * The n-th percentile is the bucket where the running count
+		 * crosses n% of the total.
+		 */
+		for (q = 0, i = 0, seen = 0; q < 4; q++) {
+			target = (unsigned long)(quantiles[q] * count);
+			if (target == 0)
+				target = 1;
+			while (seen + merged[i] < target) {
+				seen += merged[i];
+				i++;
+			}
+			values[q] = latency_value(i);
+			if (values[q] > max)
+				values[q] = max;
+		}
+
+		latency[n].verb = latency_verbs[verb];
+		latency[n].count = count;
+		latency[n].mean = (double)total / count;
+		latency[n].p50 = values[0];
+		latency[n].p90 = values[1];
+		latency[n].p99 = values[2];
+		latency[n].p999 = values[3];
+		latency[n].max = max;
+		n++;
+	}
+
+	free(merged);
+	return n;
+
+}
+
+/*
+ * cagi_latency_reset
+ *	Forget every latency recorded so far, on every thread.
+ * params
+ *	none
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ * NOTE: Commands that complete while this runs may or may not be kept.
+ */
+void cagi_latency_reset(void) {
+
+	int verb, i;
+	struct latency_thread *t;
+
+	for (t = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE); t != NULL;
+								t = t->next) {
+		for (verb = 0; verb < CAGI_VERB_COUNT; verb++) {
+			for (i = 0; i < LATENCY_BUCKETS; i++)
+				__atomic_store_n(&t->counts[verb][i], 0,
+							__ATOMIC_RELAXED);
+			__atomic_store_n(&t->total[verb], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&t->max[verb], 0, __ATOMIC_RELAXED);
+		}
+	}
+
+}
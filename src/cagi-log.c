@@ -0,0 +1,563 @@
+/*
+ * cagi-log.c
+ *
+ * This source file contains the logger. Messages used to be written straight to stderr (which
+ * is the asterisk console) and flushed, so a console that couldn't keep up stalled every call
+ * that had something to say. Now a message is formatted into a ring buffer that belongs to the
+ * calling thread, which takes no lock and no system call, and a background thread drains the
+ * rings of all threads into the log (stderr unless cagi_log_open() says otherwise). A thread
+ * whose ring is full drops its messages rather than wait, and the drops are counted and
+ * reported in the log once there is room again.
+ *
+ * Messages of a level above _LOG_LEVEL are compiled out altogether (see cagi_log()), and
+ * cagi_log_set_level() filters the rest at run time. The messages of one thread are logged in
+ * order, but those of different threads may be interleaved a little differently than they
+ * happened.
+ *
+ * The drain thread is started by the first message, and whatever is left in the rings is
+ * written out when the program exits.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * LOG_IDLE_WAIT is how long (in milliseconds) the drain thread sleeps when
+ * there is nothing to log. Errors and warnings wake it up right away, other
+ * messages wait for it.
+ */
+#define LOG_IDLE_WAIT	100
+
+/*
+ * struct log_entry
+ *	A message waiting in a ring.
+ */
+struct log_entry {
+	int level;
+	int len;
+	struct timespec when;
+	char text[_LOG_LINE_SIZE];
+};
+
+/*
+ * struct log_ring
+ *	The ring buffer of one thread. Only its thread writes <head> and
+ *	<dropped>, and only the drain thread writes <tail> and <reported>. Like
+ *	latency histograms, rings are never freed: when their thread exits they
+ *	are retired, and the next new thread takes them over.
+ */
+struct log_ring {
+	struct log_ring *next;
+	int retired;
+	unsigned int head;		// next entry to write
+	unsigned int tail;		// next entry to log
+	unsigned long dropped;		// messages dropped so far
+	unsigned long reported;		// of which the log has been told
+	struct log_entry entries[_LOG_RING_SIZE];
+};
+
+/*
+ * log_rings is the list of every thread's ring, which only ever grows (at its
+ * head). log_mine is the calling thread's.
+ */
+static struct log_ring *log_rings = NULL;
+static __thread struct log_ring *log_mine = NULL;
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The drain thread and where it writes to. <log_lock> is only ever taken by
+ * whoever drains the rings (the drain thread, cagi_log_close() and exit()),
+ * never by a thread that logs.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t log_thread;
+static int log_running = 0;
+static int log_stopping = 0;
+static int log_sleeping = 0;
+static int log_wake_fd = -1;
+static int log_fd = STDERR_FILENO;
+static int log_threshold = _LOG_LEVEL;
+static const char *log_names[] = { "ERROR", "WARNING", "NOTICE", "DEBUG" };
+
+/*
+ * log_retire
+ *	Retire the ring of a thread which is exiting. Its messages are still
+ *	logged.
+ */
+static void log_retire(void *mine) {
+
+	__atomic_store_n(&((struct log_ring *)mine)->retired, 1,
+							__ATOMIC_RELEASE);
+
+}
+
+static void log_flush(void);
+static void log_atfork_child(void);
+
+static void log_init(void) {
+
+	pthread_key_create(&log_key, log_retire);
+	pthread_atfork(NULL, NULL, log_atfork_child);
+	atexit(log_flush);
+
+}
+
+/*
+ * log_ring
+ *	Return the calling thread's ring, taking over a retired one or
+ *	allocating a new one the first time.
+ * params
+ *	none
+ * returns
+ *	Success: The ring.
+ *	Failure: NULL (out of memory, the message is lost).
+ */
+static struct log_ring * log_ring(void) {
+
+	struct log_ring *mine;
+
+	if (log_mine != NULL)
+		return log_mine;
+
+	pthread_once(&log_once, log_init);
+
+	for (mine = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+					mine != NULL; mine = mine->next)
+		if (__sync_bool_compare_and_swap(&mine->retired, 1, 0))
+			break;
+
+	if (mine == NULL) {
+		if ((mine = calloc(1, sizeof(struct log_ring))) == NULL)
+			return NULL;
+		do
+			mine->next = log_rings;
+		while (!__sync_bool_compare_and_swap(&log_rings, mine->next,
+									mine));
+	}
+
+	pthread_setspecific(log_key, mine);
+	log_mine = mine;
+	return mine;
+
+}
+
+/*
+ * log_output
+ *	Write <len> bytes of <buff> to the log, however long it takes. Errors
+ *	are ignored, there is nowhere to report them.
+ */
+static void log_output(const char *buff, int len) {
+
+	int n;
+
+	while (len > 0) {
+		n = write(log_fd, buff, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buff += n;
+		len -= n;
+	}
+
+}
+
+/*
+ * log_format
+ *	Append the line of <entry> to <buff>, which holds <len> bytes of the
+ *	<size> it has. Files get a timestamp and the level, stderr gets the
+ *	message alone like it always has (asterisk adds its own).
+ * returns
+ *	The new length of <buff>.
+ */
+static int log_format(char *buff, int len, const int size, const struct
+							log_entry *entry) {
+
+	struct tm tm;
+
+	if (log_fd != STDERR_FILENO) {
+		localtime_r(&entry->when.tv_sec, &tm);
+		len += strftime(buff + len, size - len, "%Y-%m-%d %H:%M:%S",
+									&tm);
+		len += snprintf(buff + len, size - len, ".%03ld %-7s ",
+				entry->when.tv_nsec / 1000000,
+				log_names[entry->level]);
+	}
+
+	memcpy(buff + len, entry->text, entry->len);
+	len += entry->len;
+	buff[len++] = '\n';
+
+	return len;
+
+}
+
+/*
+ * log_drain
+ *	Log every message waiting in the rings, and the drops nobody has been
+ *	told about yet. Must be called with <log_lock> held.
+ * params
+ *	none
+ * returns
+ *	The number of lines logged.
+ */
+static int log_drain(void) {
+
+	static char buff[16384];
+	int len = 0, lines = 0;
+	unsigned int head, tail;
+	unsigned long dropped;
+	struct log_ring *ring;
+
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL;
+							ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++) {
+			if (sizeof(buff) - len < _LOG_LINE_SIZE + 64) {
+				log_output(buff, len);
+				len = 0;
+			}
+			len = log_format(buff, len, sizeof(buff),
+				&ring->entries[tail % _LOG_RING_SIZE]);
+			lines++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		/*
+		 * The drops are reported after the messages that made it, which
+		 * is where they happened.
+		 */
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			if (sizeof(buff) - len < 64) {
+				log_output(buff, len);
+				len = 0;
+			}
+			len += snprintf(buff + len, sizeof(buff) - len,
+				"cagi: %lu log messages dropped\n",
+				dropped - ring->reported);
+			ring->reported = dropped;
+			lines++;
+		}
+	}
+
+	log_output(buff, len);
+	return lines;
+
+}
+
+/*
+ * log_flush
+ *	Log whatever is waiting in the rings right now. This runs at exit, so
+ *	that the messages of a program which quits (like session_fatal() does)
+ *	aren't lost.
+ */
+static void log_flush(void) {
+
+	pthread_mutex_lock(&log_lock);
+	log_drain();
+	pthread_mutex_unlock(&log_lock);
+
+}
+
+/*
+ * log_main
+ *	The drain thread. It drains the rings until there is nothing left,
+ *	then sleeps until woken up (see log_write()) or LOG_IDLE_WAIT passes.
+ */
+static void * log_main(void *arg) {
+
+	int lines;
+	uint64_t count;
+	struct pollfd pfd;
+
+	(void)arg;
+	pfd.fd = log_wake_fd;
+	pfd.events = POLLIN;
+
+	while (!__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&log_lock);
+		lines = log_drain();
+		pthread_mutex_unlock(&log_lock);
+		if (lines > 0)
+			continue;
+
+		/*
+		 * Say we are going to sleep before looking one last time, so
+		 * that a message logged in between either is seen now or wakes
+		 * us up.
+		 */
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&log_lock);
+		lines = log_drain();
+		pthread_mutex_unlock(&log_lock);
+		/*
+		 * An eventfd which can't be read stays readable, and poll()
+		 * would never sleep again: nap on the timeout alone instead.
+		 */
+		if (lines == 0 && poll(&pfd, 1, LOG_IDLE_WAIT) > 0 &&
+			read(log_wake_fd, &count, sizeof(count)) == -1 &&
+						errno != EAGAIN && errno != EINTR)
+			pfd.fd = -1;
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+
+}
+
+/*
+ * log_start
+ *	Start the drain thread, if it isn't running. Must be called with
+ *	<log_lock> held.
+ * params
+ *	none
+ * returns
+ *	Success: 0
+ *	Failure: -1 (messages stay in the rings until exit).
+ */
+static int log_start(void) {
+
+	if (log_running)
+		return 0;
+
+	if (log_wake_fd == -1 &&
+		(log_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return -1;
+
+	log_stopping = 0;
+	if (pthread_create(&log_thread, NULL, log_main, NULL) != 0)
+		return -1;
+
+	__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+	return 0;
+
+}
+
+/*
+ * log_atfork_child
+ *	A forked child has none of its parent's threads, and the lock may have
+ *	been held by one of them. Start over, the first message of the child
+ *	starts its own drain thread.
+ */
+static void log_atfork_child(void) {
+
+	pthread_mutex_init(&log_lock, NULL);
+	log_running = 0;
+	log_sleeping = 0;
+
+}
+
+/*
+ * log_write
+ *	Queue the message <format> (like printf()) of <level> on the calling
+ *	thread's ring. This is what cagi_log() calls, use that instead.
+ * params (required)
+ *	<level> <format>
+ * returns
+ *	Success: void.
+ *	Failure: void (the message is dropped and counted if the ring is full).
+ * NOTE: Messages longer than _LOG_LINE_SIZE are truncated.
+ */
+void log_write(const int level, const char *format, ...) {
+
+	int len;
+	unsigned int head;
+	uint64_t one = 1;
+	va_list ap;
+	struct log_ring *mine;
+	struct log_entry *entry;
+
+	if (level > __atomic_load_n(&log_threshold, __ATOMIC_RELAXED) ||
+						(mine = log_ring()) == NULL)
+		return;
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&log_lock);
+		log_start();
+		pthread_mutex_unlock(&log_lock);
+	}
+
+	head = mine->head;
+	if (head - __atomic_load_n(&mine->tail, __ATOMIC_ACQUIRE) ==
+							_LOG_RING_SIZE) {
+		__atomic_store_n(&mine->dropped, mine->dropped + 1,
+							__ATOMIC_RELAXED);
+		return;
+	}
+
+	entry = &mine->entries[head % _LOG_RING_SIZE];
+	entry->level = level;
+	clock_gettime(CLOCK_REALTIME, &entry->when);
+	va_start(ap, format);
+	len = vsnprintf(entry->text, _LOG_LINE_SIZE, format, ap);
+	va_end(ap);
+	entry->len = (len < 0 ? 0 : len < _LOG_LINE_SIZE ? len :
+							_LOG_LINE_SIZE - 1);
+	__atomic_store_n(&mine->head, head + 1, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Wake the drain thread for errors and warnings, and when the ring is
+	 * filling up. Only one thread gets to write to the eventfd per nap;
+	 * if that write fails, the next message tries again (and the thread
+	 * wakes up after LOG_IDLE_WAIT regardless).
+	 */
+	if (level > CAGI_LOG_WARNING && head + 1 - __atomic_load_n(&mine->tail,
+				__ATOMIC_RELAXED) < _LOG_RING_SIZE / 2)
+		return;
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST) &&
+			__sync_bool_compare_and_swap(&log_sleeping, 1, 0) &&
+			write(log_wake_fd, &one, sizeof(one)) != sizeof(one))
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+
+}
+
+/*
+ * print_debug
+ *	Log <debugmsg> as a notice (see cagi_log()). This used to write
+ *	straight to stderr, and is kept for the programs that call it.
+ * params (required)
+ *	<debugmsg>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void print_debug(const char *debugmsg) {
+
+	cagi_log(CAGI_LOG_NOTICE, "%s", debugmsg);
+
+}
+
+/*
+ * cagi_log_open
+ *	Log to the file <path> (appending to it) instead of stderr, or back to
+ *	stderr if <path> is NULL. Lines logged to a file start with the time
+ *	and level.
+ * params (required)
+ *	<path>
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the log stays where it was).
+ */
+int cagi_log_open(const char *path) {
+
+	int fd = STDERR_FILENO;
+
+	if (path != NULL &&
+		(fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+								0644)) == -1)
+		return -1;
+
+	pthread_once(&log_once, log_init);
+
+	/*
+	 * Whatever was logged so far goes where it was meant to go.
+	 */
+	pthread_mutex_lock(&log_lock);
+	log_drain();
+	if (log_fd != STDERR_FILENO)
+		close(log_fd);
+	log_fd = fd;
+	log_start();
+	pthread_mutex_unlock(&log_lock);
+
+	return 0;
+
+}
+
+/*
+ * cagi_log_close
+ *	Stop the drain thread, once everything logged so far is written out,
+ *	and go back to logging to stderr. The next message starts the thread
+ *	again.
+ * params
+ *	none
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_log_close(void) {
+
+	ssize_t ret;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&log_lock);
+	if (log_running) {
+		__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+		/*
+		 * If the wake up can't be written, the thread still sees
+		 * <log_stopping> once its nap (LOG_IDLE_WAIT) is over, so the
+		 * join below only takes longer.
+		 */
+		ret = write(log_wake_fd, &one, sizeof(one));
+		(void)ret;
+		pthread_mutex_unlock(&log_lock);
+		pthread_join(log_thread, NULL);
+		pthread_mutex_lock(&log_lock);
+		__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+	}
+
+	log_drain();
+	if (log_fd != STDERR_FILENO)
+		close(log_fd);
+	log_fd = STDERR_FILENO;
+	pthread_mutex_unlock(&log_lock);
+
+}
+
+/*
+ * cagi_log_set_level
+ *	Only log messages of <level> (see cagi_log()) and below from now on.
+ *	Levels above _LOG_LEVEL are compiled out, and can't be turned back on.
+ * params (required)
+ *	<level>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_log_set_level(const int level) {
+
+	__atomic_store_n(&log_threshold, level, __ATOMIC_RELAXED);
+
+}
+
+/*
+ * cagi_log_dropped
+ *	Return the number of messages every thread has dropped so far, because
+ *	its ring was full.
+ * params
+ *	none
+ * returns
+ *	Success: The number of messages dropped.
+ *	Failure: Never fails.
+ */
+unsigned long cagi_log_dropped(void) {
+
+	unsigned long dropped = 0;
+	struct log_ring *ring;
+
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL;
+							ring = ring->next)
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	return dropped;
+
+}
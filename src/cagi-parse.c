@@ -0,0 +1,335 @@
+/*
+ * cagi-parse.c
+ *
+ * This source file contains the response parser. Every response asterisk sends is split up
+ * in a single pass over the line, in place, and the structured part that many commands tack
+ * on at the end (a value in parentheses, endpos=<offset>) is decoded along the way. The scan
+ * for delimiters uses SSE2 or AVX2 when the compiler targets them.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * _SCAN_WIDTH is the number of bytes scan_chunk() classifies at once: a
+ * whole vector register, or 16 bytes one by one without SIMD.
+ */
+#if defined(__AVX2__)
+#define _SCAN_WIDTH 32
+#else
+#define _SCAN_WIDTH 16
+#endif
+
+/*
+ * scan_chunk
+ *	Classify _SCAN_WIDTH bytes starting at <p>, looking for the two bytes
+ *	that delimit the tail of a response: spaces and closing parentheses.
+ * params (required)
+ *	<p>
+ * returns
+ *	Success: A bit mask with bit i set if p[i] is a delimiter.
+ *	Failure: Never fails. :)
+ */
+static unsigned scan_chunk(const char *p) {
+
+#if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+	return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(')'))));
+#elif defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+	return (unsigned)_mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(')'))));
+#else
+	int i;
+	unsigned mask = 0;
+
+	for (i = 0; i < _SCAN_WIDTH; i++)
+		if (p[i] == ' ' || p[i] == ')')
+			mask |= 1u << i;
+
+	return mask;
+#endif
+
+}
+
+/*
+ * parse_digit
+ *	Append the decimal digit <c> to <value>. Asterisk sends whatever the
+ *	application returned, so a number too big for us saturates at <max>
+ *	rather than overflowing.
+ * params (required)
+ *	<value> <c> <max>
+ * returns
+ *	Success: The new value, at most <max>.
+ *	Failure: Never fails. :)
+ */
+static long parse_digit(const long value, const char c, const long max) {
+
+	int digit = c - '0';
+
+	if (value > (max - digit) / 10)
+		return max;
+
+	return value * 10 + digit;
+
+}
+
+/*
+ * parse_outcome
+ *	Classify <response> (see enum cagi_outcome), once its flags are known.
+ *	A key is only reported when the response says "(dtmf)", since the
+ *	result alone can't tell a key from a number (see response_key()).
+ * params (required)
+ *	<response>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void parse_outcome(cagi_response *response) {
+
+	response->digit = '\0';
+
+	if (response->code != 200)
+		response->outcome = CAGI_OUTCOME_FAILURE;
+	else if (response->flags & CAGI_HANGUP)
+		response->outcome = CAGI_OUTCOME_HANGUP;
+	else if (response->flags & CAGI_TIMEOUT)
+		response->outcome = CAGI_OUTCOME_TIMEOUT;
+	else if (response->result < 0)
+		response->outcome = CAGI_OUTCOME_FAILURE;
+	else if ((response->flags & CAGI_DTMF) && response->result > 0) {
+		response->outcome = CAGI_OUTCOME_DTMF;
+		response->digit = (char)response->result;
+	} else
+		response->outcome = CAGI_OUTCOME_SUCCESS;
+
+}
+
+/*
+ * response_key
+ *	Finish decoding the response to a command whose result is the key that
+ *	was pressed, if any (STREAM FILE, WAIT FOR DIGIT, ...). A positive
+ *	result makes the outcome CAGI_OUTCOME_DTMF. If <waits> is set, the
+ *	command only waits for a key (WAIT FOR DIGIT, GET OPTION), so a result
+ *	of 0 means nothing was entered in time and the outcome is
+ *	CAGI_OUTCOME_TIMEOUT.
+ * params (required)
+ *	<response> <waits>
+ * returns
+ *	Success: The result.
+ *	Failure: The result.
+ */
+int response_key(cagi_response *response, const int waits) {
+
+	if (response->outcome == CAGI_OUTCOME_SUCCESS && response->result > 0) {
+		response->outcome = CAGI_OUTCOME_DTMF;
+		response->digit = (char)response->result;
+	} else if (response->outcome == CAGI_OUTCOME_SUCCESS && waits &&
+						response->result == 0)
+		response->outcome = CAGI_OUTCOME_TIMEOUT;
+
+	return response->result;
+
+}
+
+/*
+ * parse_tail
+ *	Decode the data of <response>, which many commands use for more than
+ *	free text:
+ *		(<value>) [endpos=<offset>]
+ *	where <value> is a variable's value, or timeout, dtmf, hangup and
+ *	friends for the commands that play or record something. Fills in the
+ *	value, endpos, flags, outcome and digit fields of <response>.
+ * params (required)
+ *	<response>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ * NOTE: Values may contain spaces and parentheses themselves, so the value
+ *	runs up to the LAST closing parenthesis of the line.
+ */
+void parse_tail(cagi_response *response) {
+
+	char tail[_SCAN_WIDTH];
+	unsigned mask;
+	const char *p, *c, *close = NULL, *endpos = NULL;
+	const char *start = response->data.str;
+	const char *end = start + response->data.len;
+
+	response->value.str = "";
+	response->value.len = 0;
+	response->endpos = -1;
+	response->flags = 0;
+
+	if (response->code != 200 || start == end) {
+		parse_outcome(response);
+		return;
+	}
+
+	/*
+	 * One pass over the data finds the last closing parenthesis and the
+	 * endpos= that follows a space (if any). The last few bytes are copied
+	 * out so that we never load past the end of the read buffer.
+	 */
+	if (*start == 'e' && end - start > 7 && memcmp(start, "endpos=", 7)
+									== 0)
+		endpos = start;
+
+	for (p = start; p < end; p += _SCAN_WIDTH) {
+
+		if (end - p >= _SCAN_WIDTH)
+			mask = scan_chunk(p);
+		else {
+			memset(tail, 0, _SCAN_WIDTH);
+			memcpy(tail, p, end - p);
+			mask = scan_chunk(tail);
+		}
+
+		while (mask) {
+			c = p + __builtin_ctz(mask);
+			mask &= mask - 1;
+
+			if (*c == ')')
+				close = c;
+			else if (end - c > 8 && c[1] == 'e' &&
+					memcmp(c + 1, "endpos=", 7) == 0)
+				endpos = c + 1;
+		}
+	}
+
+	if (*start == '(' && close != NULL) {
+		response->value.str = start + 1;
+		response->value.len = close - (start + 1);
+
+		if (response->value.len == 7 && memcmp(start + 1, "timeout", 7)
+									== 0)
+			response->flags |= CAGI_TIMEOUT;
+		else if (response->value.len == 4 && memcmp(start + 1, "dtmf",
+								4) == 0)
+			response->flags |= CAGI_DTMF;
+		else if (response->value.len == 6 && memcmp(start + 1,
+							"hangup", 6) == 0)
+			response->flags |= CAGI_HANGUP;
+	}
+
+	/*
+	 * An endpos= inside the parentheses is part of the value, not ours.
+	 */
+	if (endpos != NULL && (close == NULL || endpos > close ||
+							*start != '(')) {
+		response->endpos = 0;
+		for (p = endpos + 7; p < end && *p >= '0' && *p <= '9'; p++)
+			response->endpos = parse_digit(response->endpos, *p,
+								LONG_MAX);
+	}
+
+	parse_outcome(response);
+
+}
+
+/*
+ * parse_response
+ *	Split up a single response line (without its trailing \n). Responses
+ *	are of the form:
+ *		<code> result=<result> [<data>]
+ *	Error responses (510, 511, 520, ...) carry a message instead of a
+ *	result. Those get a result of -1, and the message as their data.
+ * params (required)
+ *	<line> <len> <response>
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the line doesn't start with a response code).
+ * NOTE: The line is never modified, everything in <response> points into
+ *	it.
+ */
+int parse_response(const char *line, const int len, cagi_response
+								*response) {
+
+	long value = 0;
+	const char *p = line, *end = line + len, *num;
+
+	/*
+	 * The first thing we parse for is the code element. It is always
+	 * three digits, followed by a space (or a dash for multi-line
+	 * responses) unless it is the whole line.
+	 */
+	if (len < 3 || p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9' ||
+							p[2] < '0' || p[2] > '9')
+		return -1;
+
+	response->code = (p[0]-'0') * 100 + (p[1]-'0') * 10 + (p[2]-'0');
+	response->result = -1;
+	response->result_text.str = "";
+	response->result_text.len = 0;
+	response->data.str = "";
+	response->data.len = 0;
+
+	p += 3;
+	if (p == end) {
+		parse_tail(response);
+		return 0;
+	} else if (*p != ' ' && *p != '-')
+		return -1;
+	p++;
+
+	if (response->code != 200 || end - p < 7 || memcmp(p, "result=", 7)
+									!= 0) {
+		response->data.str = p;
+		response->data.len = end - p;
+		parse_tail(response);
+		return 0;
+	}
+	p += 7;
+
+	/*
+	 * Now we parse the result. It runs up to the next space character (or
+	 * the end of the line), and is converted to an integer on the way if
+	 * it is numeric. Some commands put text there, in which case result is
+	 * 0 and only result_text is meaningful. A number too big for an int
+	 * saturates (see parse_digit()).
+	 */
+	num = p + (p < end && *p == '-');
+	response->result_text.str = p;
+	for (p = num; p < end && *p >= '0' && *p <= '9'; p++)
+		value = parse_digit(value, *p, INT_MAX);
+
+	if (p > num && (p == end || *p == ' '))
+		response->result = (*response->result_text.str == '-' ? -value :
+									value);
+	else
+		response->result = 0;
+
+	while (p < end && *p != ' ')
+		p++;
+	response->result_text.len = p - response->result_text.str;
+
+	/*
+	 * Not all commands return the third (last) field. If there is one, it
+	 * is everything after the space that follows the result.
+	 */
+	if (p < end) {
+		response->data.str = p + 1;
+		response->data.len = end - (p + 1);
+	}
+
+	parse_tail(response);
+	return 0;
+
+}
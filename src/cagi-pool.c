@@ -0,0 +1,658 @@
+/*
+ * cagi-pool.c
+ *
+ * This source file contains the session worker pool. Each session runs as a lightweight
+ * fiber with its own small stack, on one of a handful of worker threads (one per core by
+ * default). When a session would block waiting on asterisk (which is most of the time, an
+ * AGI script mostly sits in stream_file() or get_data()), its fiber is parked and the worker
+ * moves on to another session. An epoll thread wakes parked sessions up once asterisk
+ * answers, and hands them back to the worker that ran them last so their state stays warm
+ * in that core's cache. Idle workers steal sessions from busy ones.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#define _GNU_SOURCE	// pthread_setaffinity_np(), CPU_SET()
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * struct pool_task
+ *	A session running (or parked) on the pool.
+ */
+struct pool_task {
+	cagi_session *session;
+	fastagi_handler handler;
+	ucontext_t ctx;
+	void *stack;
+	struct pool_worker *worker;	// worker currently running the task
+	int home;			// worker to queue the task on
+	int park_fd;			// fd to wait on, or -1 if not parking
+	int park_events;
+	int registered;			// bit 0: in_fd, bit 1: out_fd in epoll
+	int done;
+};
+
+/*
+ * struct pool_worker
+ *	A worker thread and its run queue. The run queue is a ring buffer of
+ *	tasks which are ready to run. The worker takes tasks from the head, and
+ *	other workers steal from the tail.
+ */
+struct pool_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pool_task **queue;
+	int head;
+	int count;
+	int size;
+	int index;
+	ucontext_t sched_ctx;
+	struct cagi_pool *pool;
+};
+
+/*
+ * struct cagi_pool
+ *	The pool itself. <active> counts the tasks that have been submitted and
+ *	haven't finished yet.
+ */
+struct cagi_pool {
+	int nworkers;
+	struct pool_worker *workers;
+	size_t stack_size;
+	int epfd;
+	int stop_fd;
+	pthread_t poller;
+	pthread_mutex_t lock;
+	pthread_cond_t drained;
+	int active;
+	unsigned int next;
+	volatile int stopping;
+};
+
+/*
+ * current_task is only used to hand a new task over to its fiber the first
+ * time it runs.
+ */
+static __thread struct pool_task *current_task = NULL;
+
+/*
+ * queue_push
+ *	Add <task> to the tail of <worker>'s run queue and wake the worker up.
+ * params (required)
+ *	<worker> <task>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1 (out of memory).
+ */
+static void queue_push(struct pool_worker *worker, struct pool_task *task) {
+
+	int i;
+	struct pool_task **queue;
+
+	pthread_mutex_lock(&worker->lock);
+
+	/*
+	 * Grow the ring buffer when it is full. The tasks are copied over in
+	 * order so that the head starts at 0 again.
+	 */
+	if (worker->count == worker->size) {
+		queue = safe_malloc(worker->size * 2 *
+						sizeof(struct pool_task *));
+		for (i = 0; i < worker->count; i++)
+			queue[i] = worker->queue[(worker->head + i) %
+								worker->size];
+		free(worker->queue);
+		worker->queue = queue;
+		worker->head = 0;
+		worker->size *= 2;
+	}
+
+	worker->queue[(worker->head + worker->count) % worker->size] = task;
+	worker->count++;
+
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+}
+
+/*
+ * queue_pop
+ *	Take a task from the head (our own end) of <worker>'s run queue.
+ * params (required)
+ *	<worker>
+ * returns
+ *	Success: The task.
+ *	Failure: NULL if the queue is empty.
+ */
+static struct pool_task * queue_pop(struct pool_worker *worker) {
+
+	struct pool_task *task = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->count > 0) {
+		task = worker->queue[worker->head];
+		worker->head = (worker->head + 1) % worker->size;
+		worker->count--;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return task;
+
+}
+
+/*
+ * queue_steal
+ *	Take a task from the tail of another worker's run queue. Victims are
+ *	visited starting with our neighbour, so that idle workers don't all
+ *	pile onto the same one. A stolen task moves home to <thief>.
+ * params (required)
+ *	<thief>
+ * returns
+ *	Success: The task.
+ *	Failure: NULL if every other queue is empty.
+ */
+static struct pool_task * queue_steal(struct pool_worker *thief) {
+
+	int i;
+	struct pool_worker *victim;
+	struct pool_task *task = NULL;
+	struct cagi_pool *pool = thief->pool;
+
+	for (i = 1; i < pool->nworkers && task == NULL; i++) {
+
+		victim = &pool->workers[(thief->index + i) % pool->nworkers];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->count > 0) {
+			victim->count--;
+			task = victim->queue[(victim->head + victim->count) %
+								victim->size];
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	if (task != NULL)
+		task->home = thief->index;
+
+	return task;
+
+}
+
+/*
+ * task_main
+ *	Entry point of every fiber. Runs the handler, and switches back to the
+ *	scheduler of whichever worker is running the fiber at the end (which is
+ *	not necessarily the one it started on).
+ * params
+ *	none
+ * returns
+ *	Never returns.
+ */
+static void task_main(void) {
+
+	jmp_buf unwind;
+	struct pool_task *task = current_task;
+
+	task->session->unwind = &unwind;
+	if (setjmp(unwind) == 0)
+		task->handler(task->session);
+	task->session->unwind = NULL;
+
+	task->done = 1;
+	swapcontext(&task->ctx, &task->worker->sched_ctx);
+
+}
+
+/*
+ * task_park
+ *	Session park hook (see struct cagi_session). Suspends the running fiber
+ *	until <fd> is ready for <events>.
+ * params (required)
+ *	<session> <fd> <events>
+ * returns
+ *	Success: void (once the fd is ready).
+ *	Failure: void.
+ */
+static void task_park(cagi_session *session, int fd, int events) {
+
+	struct pool_task *task = session->sched;
+
+	/*
+	 * We can't register the fd with epoll from here: the poller could wake
+	 * us up and another worker could resume this fiber before we are done
+	 * switching away from it. The scheduler registers it for us instead,
+	 * once we're off the stack.
+	 */
+	task->park_fd = fd;
+	task->park_events = events;
+	swapcontext(&task->ctx, &task->worker->sched_ctx);
+
+}
+
+/*
+ * task_free
+ *	Release a finished task, its stack, and the session it ran.
+ * params (required)
+ *	<pool> <task>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void task_free(struct cagi_pool *pool, struct pool_task *task) {
+
+	if (task->registered & 1)
+		epoll_ctl(pool->epfd, EPOLL_CTL_DEL, task->session->in_fd,
+									NULL);
+	if (task->registered & 2)
+		epoll_ctl(pool->epfd, EPOLL_CTL_DEL, task->session->out_fd,
+									NULL);
+
+	close(task->session->in_fd);
+	if (task->session->out_fd != task->session->in_fd)
+		close(task->session->out_fd);
+
+	cagi_session_free(task->session);
+	munmap(task->stack, pool->stack_size);
+	free(task);
+
+	pthread_mutex_lock(&pool->lock);
+	if (--pool->active == 0)
+		pthread_cond_broadcast(&pool->drained);
+	pthread_mutex_unlock(&pool->lock);
+
+}
+
+/*
+ * run_task
+ *	Run <task> on <worker> until it finishes or parks.
+ * params (required)
+ *	<worker> <task>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void run_task(struct pool_worker *worker, struct pool_task *task) {
+
+	int bit, op;
+	struct epoll_event ev;
+	struct cagi_pool *pool = worker->pool;
+
+	task->worker = worker;
+	task->park_fd = -1;
+	current_task = task;
+	cagi_set_default_session(task->session);
+
+	swapcontext(&worker->sched_ctx, &task->ctx);
+
+	cagi_set_default_session(NULL);
+
+	if (task->done) {
+		task_free(pool, task);
+		return;
+	}
+
+	/*
+	 * The task parked. Ask the poller to wake it up once its fd is ready.
+	 * EPOLLONESHOT disarms the fd after one wakeup, so a task is never
+	 * queued twice. Once the fd is armed the task may be resumed, and even
+	 * freed, by another worker, so it must be all set up before that and
+	 * not touched after.
+	 */
+	ev.events = EPOLLONESHOT | EPOLLRDHUP |
+		((task->park_events & POLLIN) ? EPOLLIN : 0) |
+		((task->park_events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = task;
+
+	bit = (task->park_fd == task->session->in_fd ? 1 : 2);
+	op = ((task->registered & bit) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+	task->registered |= bit;
+
+	if (epoll_ctl(pool->epfd, op, task->park_fd, &ev) == -1) {
+		log_error("ERROR! Cannot park session.");
+		if (op == EPOLL_CTL_ADD)
+			task->registered &= ~bit;
+		queue_push(worker, task);
+	}
+
+}
+
+/*
+ * worker_main
+ *	Worker thread body. Runs tasks from its own queue, steals from the
+ *	other workers when it runs dry, and sleeps when there is nothing to do
+ *	anywhere.
+ * params (required)
+ *	<arg>
+ * returns
+ *	Success: NULL
+ *	Failure: NULL
+ */
+static void * worker_main(void *arg) {
+
+	struct timespec ts;
+	struct pool_task *task;
+	struct pool_worker *worker = arg;
+	struct cagi_pool *pool = worker->pool;
+
+	while (!pool->stopping) {
+
+		if ((task = queue_pop(worker)) == NULL)
+			task = queue_steal(worker);
+
+		if (task != NULL) {
+			run_task(worker, task);
+			continue;
+		}
+
+		/*
+		 * Nothing to run anywhere. Sleep until a task is queued on
+		 * us, but not for too long, since work may show up on another
+		 * worker's queue for us to steal.
+		 */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&worker->lock);
+		if (worker->count == 0 && !pool->stopping)
+			pthread_cond_timedwait(&worker->cond, &worker->lock,
+									&ts);
+		pthread_mutex_unlock(&worker->lock);
+	}
+
+	return NULL;
+
+}
+
+/*
+ * poller_main
+ *	Poller thread body. Waits for parked sessions' fds to become ready and
+ *	queues each session back on its home worker.
+ * params (required)
+ *	<arg>
+ * returns
+ *	Success: NULL
+ *	Failure: NULL
+ */
+static void * poller_main(void *arg) {
+
+	int i, n;
+	struct pool_task *task;
+	struct cagi_pool *pool = arg;
+	struct epoll_event events[_FASTAGI_BACKLOG];
+
+	for (;;) {
+
+		n = epoll_wait(pool->epfd, events, _FASTAGI_BACKLOG, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log_error("ERROR! Pool event loop failed.");
+			return NULL;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				return NULL;	// the stop event
+
+			task = events[i].data.ptr;
+			queue_push(&pool->workers[task->home], task);
+		}
+	}
+
+}
+
+/*
+ * pool_release
+ *	Stop the first <started> workers of <pool> (the poller must be stopped
+ *	already, or never started), and release the pool.
+ * params (required)
+ *	<pool> <started>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void pool_release(struct cagi_pool *pool, const int started) {
+
+	int i;
+
+	pool->stopping = 1;
+	for (i = 0; i < pool->nworkers; i++) {
+		if (i < started) {
+			pthread_mutex_lock(&pool->workers[i].lock);
+			pthread_cond_signal(&pool->workers[i].cond);
+			pthread_mutex_unlock(&pool->workers[i].lock);
+			pthread_join(pool->workers[i].thread, NULL);
+		}
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		pthread_cond_destroy(&pool->workers[i].cond);
+		free(pool->workers[i].queue);
+	}
+
+	close(pool->stop_fd);
+	close(pool->epfd);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->drained);
+	free(pool->workers);
+	free(pool);
+
+}
+
+/*
+ * cagi_pool_new
+ *	Create a pool of <workers> worker threads for running sessions. Each
+ *	worker is pinned to its own CPU when there are enough of them.
+ * params (optional, optional)
+ *	[<workers>] [<stack_size>]
+ * returns
+ *	Success: A new pool, which must be released with cagi_pool_free().
+ *	Failure: NULL
+ * NOTE: If <workers> is 0, one worker per online CPU is started. If
+ *	<stack_size> is 0, _POOL_STACK_SIZE is used. Stacks are only backed by
+ *	memory as far as a handler actually uses them.
+ */
+cagi_pool * cagi_pool_new(int workers, size_t stack_size) {
+
+	int i;
+	long ncpu;
+	cpu_set_t cpus;
+	struct epoll_event ev;
+	struct cagi_pool *pool;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+
+	pool = safe_malloc(sizeof(struct cagi_pool));
+	memset(pool, 0, sizeof(struct cagi_pool));
+
+	pool->nworkers = (workers > 0 ? workers : ncpu);
+	pool->stack_size = (stack_size ? stack_size : _POOL_STACK_SIZE);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->drained, NULL);
+
+	pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+	pool->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->epfd == -1 || pool->stop_fd == -1) {
+		log_error("ERROR! Cannot create pool event loop.");
+		if (pool->epfd != -1)
+			close(pool->epfd);
+		if (pool->stop_fd != -1)
+			close(pool->stop_fd);
+		free(pool);
+		return NULL;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(pool->epfd, EPOLL_CTL_ADD, pool->stop_fd, &ev);
+
+	pool->workers = safe_malloc(pool->nworkers *
+						sizeof(struct pool_worker));
+	memset(pool->workers, 0, pool->nworkers * sizeof(struct pool_worker));
+
+	for (i = 0; i < pool->nworkers; i++) {
+		pool->workers[i].index = i;
+		pool->workers[i].pool = pool;
+		pool->workers[i].size = 64;
+		pool->workers[i].queue = safe_malloc(64 *
+						sizeof(struct pool_task *));
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+		pthread_cond_init(&pool->workers[i].cond, NULL);
+	}
+
+	for (i = 0; i < pool->nworkers; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, worker_main,
+						&pool->workers[i]) != 0)
+			break;
+
+		/*
+		 * Pin workers to a core each, so that a session's affinity to
+		 * its worker is also an affinity to a core. If there are more
+		 * workers than cores, leave scheduling to the kernel.
+		 */
+		if (pool->nworkers <= ncpu) {
+			CPU_ZERO(&cpus);
+			CPU_SET(i, &cpus);
+			pthread_setaffinity_np(pool->workers[i].thread,
+						sizeof(cpu_set_t), &cpus);
+		}
+	}
+
+	if (i < pool->nworkers ||
+		pthread_create(&pool->poller, NULL, poller_main, pool) != 0) {
+		log_error("ERROR! Cannot start the pool's threads.");
+		pool_release(pool, i);
+		return NULL;
+	}
+
+	return pool;
+
+}
+
+/*
+ * cagi_pool_submit
+ *	Run <handler> with <session> on <pool>. The pool takes ownership of the
+ *	session: its descriptors are made non-blocking, and once the handler
+ *	returns (or the session fails) they are closed and the session is
+ *	free()'d. Inside the handler the session is also the default session,
+ *	so the unprefixed AGI functions work as usual.
+ * params (required)
+ *	<pool> <session> <handler>
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the session is left untouched).
+ */
+int cagi_pool_submit(cagi_pool *pool, cagi_session *session, fastagi_handler
+								handler) {
+
+	void *stack;
+	struct pool_task *task;
+
+	if (pool == NULL || session == NULL || handler == NULL) {
+		log_error("ERROR! <pool>, <session> and <handler> must not "
+								"be empty.");
+		return -1;
+	}
+
+	/*
+	 * Stacks are mapped (not malloc()'d) so that untouched pages don't cost
+	 * any memory. The lowest page is a guard page, so that a handler which
+	 * overflows its stack crashes instead of corrupting its neighbours.
+	 */
+	stack = mmap(NULL, pool->stack_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		log_error("ERROR! Cannot allocate session stack.");
+		return -1;
+	}
+	mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+	task = safe_malloc(sizeof(struct pool_task));
+	memset(task, 0, sizeof(struct pool_task));
+	task->session = session;
+	task->handler = handler;
+	task->stack = stack;
+
+	getcontext(&task->ctx);
+	task->ctx.uc_stack.ss_sp = stack;
+	task->ctx.uc_stack.ss_size = pool->stack_size;
+	task->ctx.uc_link = NULL;
+	makecontext(&task->ctx, task_main, 0);
+
+	fcntl(session->in_fd, F_SETFL, fcntl(session->in_fd, F_GETFL, 0) |
+								O_NONBLOCK);
+	fcntl(session->out_fd, F_SETFL, fcntl(session->out_fd, F_GETFL, 0) |
+								O_NONBLOCK);
+	session->park = task_park;
+	session->sched = task;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->active++;
+	pthread_mutex_unlock(&pool->lock);
+
+	/*
+	 * New sessions are spread round-robin. From here on a session stays
+	 * on the worker it was queued on, unless it gets stolen.
+	 */
+	task->home = __sync_fetch_and_add(&pool->next, 1) % pool->nworkers;
+	queue_push(&pool->workers[task->home], task);
+
+	return 0;
+
+}
+
+/*
+ * cagi_pool_free
+ *	Wait for every session on <pool> to finish, then stop the workers and
+ *	release the pool.
+ * params (required)
+ *	<pool>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_pool_free(cagi_pool *pool) {
+
+	uint64_t one = 1;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active > 0)
+		pthread_cond_wait(&pool->drained, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool->stopping = 1;
+	if (write(pool->stop_fd, &one, sizeof(one)) != sizeof(one))
+		log_error("ERROR! Cannot wake the pool's poller up.");
+	pthread_join(pool->poller, NULL);
+
+	pool_release(pool, pool->nworkers);
+
+}
@@ -0,0 +1,432 @@
+/*
+ * cagi-prefetch.c
+ *
+ * This source file contains the prefetch profiles. Most scripts start by looking up the
+ * same channel variables and AstDB keys on every call, one round trip each, before the
+ * caller hears anything. A profile lists what a script (an agi_request) is going to need,
+ * and all of it is fetched in a single burst when the session starts: every DATABASE GET
+ * and GET FULL VARIABLE (see cagi_get_variables()) is sent before the first answer is read.
+ *
+ * Nothing is handed to the script directly. What is fetched goes into the session's caches
+ * (see cagi-varcache.c and cagi-dbcache.c), so cagi_get_variable(), cagi_database_get() and
+ * friends answer from them without the script knowing about the profile at all. Sessions
+ * that don't have caches of their own are given the ones of the profiles.
+ *
+ * Profiles are looked up by the agi_request of the call, either as a whole, or by its
+ * script name: the last part of its path, without any ?arguments. Ex: "ivr" is the script
+ * name of agi://10.0.0.1/ivr?lang=en. A profile named "*" is for the calls no other
+ * profile is for.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * struct prefetch_key
+ *	An AstDB key to prefetch.
+ */
+struct prefetch_key {
+	char *family;
+	char *key;
+};
+
+/*
+ * struct prefetch_profile
+ *	What to prefetch for one agi_request (or script name).
+ */
+struct prefetch_profile {
+	char *request;
+	char **names;
+	int nnames;
+	struct prefetch_key *keys;
+	int nkeys;
+};
+
+/*
+ * struct cagi_prefetch
+ *	The profiles, and the caches that sessions without caches of their own
+ *	are given.
+ */
+struct cagi_prefetch {
+	cagi_varcache *varcache;
+	cagi_dbcache *dbcache;
+	struct prefetch_profile *profiles;
+	int nprofiles;
+};
+
+/*
+ * prefetch_enabled holds the profiles that every session runs when its
+ * variables are read (see cagi_prefetch_enable()).
+ */
+static cagi_prefetch *prefetch_enabled = NULL;
+
+/*
+ * prefetch_grow
+ *	Make room for <n> elements of <size> bytes in <array>.
+ * returns
+ *	Success: The (maybe moved) array.
+ *	Failure: Quits the program with exit status 1.
+ */
+static void * prefetch_grow(void *array, const int n, const size_t size) {
+
+	array = realloc(array, n * size);
+	if (array == NULL) {
+		log_error("ERROR! Cannot allocate memory. Exiting.");
+		exit(1);
+	}
+
+	return array;
+
+}
+
+/*
+ * prefetch_strdup
+ *	Copy <str> onto the heap.
+ * returns
+ *	Success: The copy.
+ *	Failure: Quits the program with exit status 1.
+ */
+static char * prefetch_strdup(const char *str) {
+
+	char *copy = safe_malloc(strlen(str) + 1);
+
+	strcpy(copy, str);
+	return copy;
+
+}
+
+/*
+ * prefetch_profile
+ *	Find the profile called <request> in <prefetch>, and add it if there
+ *	isn't one yet.
+ * returns
+ *	Success: The profile.
+ *	Failure: Quits the program with exit status 1.
+ */
+static struct prefetch_profile * prefetch_profile(cagi_prefetch *prefetch,
+							const char *request) {
+
+	int i;
+	struct prefetch_profile *profile;
+
+	for (i = 0; i < prefetch->nprofiles; i++)
+		if (strcmp(prefetch->profiles[i].request, request) == 0)
+			return &prefetch->profiles[i];
+
+	prefetch->profiles = prefetch_grow(prefetch->profiles,
+		prefetch->nprofiles + 1, sizeof(struct prefetch_profile));
+	profile = &prefetch->profiles[prefetch->nprofiles++];
+	memset(profile, 0, sizeof(struct prefetch_profile));
+	profile->request = prefetch_strdup(request);
+
+	return profile;
+
+}
+
+/*
+ * prefetch_find
+ *	Find the profile of <request> (an agi_request) in <prefetch>: the one
+ *	named after it, or after its script name, or else "*".
+ * returns
+ *	Success: The profile.
+ *	Failure: NULL if there is none.
+ */
+static struct prefetch_profile * prefetch_find(cagi_prefetch *prefetch, const
+							char *request) {
+
+	int i, len;
+	const char *name, *end;
+	struct prefetch_profile *fallback = NULL;
+
+	if (request == NULL)
+		request = "";
+
+	end = request + strcspn(request, "?");
+	for (name = end; name > request && name[-1] != '/'; name--)
+		;
+	len = end - name;
+
+	for (i = 0; i < prefetch->nprofiles; i++) {
+		if (strcmp(prefetch->profiles[i].request, request) == 0 ||
+			((int)strlen(prefetch->profiles[i].request) == len &&
+			memcmp(prefetch->profiles[i].request, name, len) == 0))
+			return &prefetch->profiles[i];
+		if (strcmp(prefetch->profiles[i].request, "*") == 0)
+			fallback = &prefetch->profiles[i];
+	}
+
+	return fallback;
+
+}
+
+/*
+ * cagi_prefetch_new
+ *	Create an empty set of prefetch profiles. Sessions that run one but
+ *	have no caches of their own are given <varcache> and <dbcache>, either
+ *	of which may be NULL, in which case those sessions skip the variables,
+ *	or the AstDB keys.
+ * params (required)
+ *	<varcache> <dbcache>
+ * returns
+ *	Success: The profiles, which must be released with cagi_prefetch_free()
+ *		once no session uses them anymore (the caches aren't, they
+ *		still belong to the caller).
+ *	Failure: Quits the program with exit status 1.
+ */
+cagi_prefetch * cagi_prefetch_new(cagi_varcache *varcache, cagi_dbcache
+								*dbcache) {
+
+	cagi_prefetch *prefetch;
+
+	prefetch = safe_malloc(sizeof(struct cagi_prefetch));
+	memset(prefetch, 0, sizeof(struct cagi_prefetch));
+	prefetch->varcache = varcache;
+	prefetch->dbcache = dbcache;
+
+	return prefetch;
+
+}
+
+/*
+ * cagi_prefetch_free
+ *	Release the profiles <prefetch>.
+ * params (required)
+ *	<prefetch>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_prefetch_free(cagi_prefetch *prefetch) {
+
+	int i, j;
+	struct prefetch_profile *profile;
+
+	if (prefetch == NULL)
+		return;
+
+	if (prefetch_enabled == prefetch)
+		prefetch_enabled = NULL;
+
+	for (i = 0; i < prefetch->nprofiles; i++) {
+		profile = &prefetch->profiles[i];
+		for (j = 0; j < profile->nnames; j++)
+			free(profile->names[j]);
+		for (j = 0; j < profile->nkeys; j++) {
+			free(profile->keys[j].family);
+			free(profile->keys[j].key);
+		}
+		free(profile->names);
+		free(profile->keys);
+		free(profile->request);
+	}
+	free(prefetch->profiles);
+	free(prefetch);
+
+}
+
+/*
+ * cagi_prefetch_variable
+ *	Prefetch the channel variable <name> (as cagi_get_variable() takes it)
+ *	for the calls of <request> (see cagi-prefetch.c).
+ * params (required)
+ *	<prefetch> <request> <name>
+ * returns
+ *	Success: 0
+ *	Failure: -1 if <name> is empty, too long or has characters that can't
+ *		be expanded (see vars_check()).
+ * NOTE: Profiles must be set up before sessions run them.
+ */
+int cagi_prefetch_variable(cagi_prefetch *prefetch, const char *request,
+							const char *name) {
+
+	struct prefetch_profile *profile;
+
+	if (!vars_check(name))
+		return -1;
+
+	profile = prefetch_profile(prefetch, request);
+	profile->names = prefetch_grow(profile->names, profile->nnames + 1,
+								sizeof(char *));
+	profile->names[profile->nnames++] = prefetch_strdup(name);
+
+	return 0;
+
+}
+
+/*
+ * cagi_prefetch_database
+ *	Prefetch the AstDB key of <family> and <key> for the calls of <request>
+ *	(see cagi-prefetch.c).
+ * params (required)
+ *	<prefetch> <request> <family> <key>
+ * returns
+ *	Success: 0
+ *	Failure: -1 if <family> or <key> is empty or contains a line break.
+ * NOTE: Profiles must be set up before sessions run them.
+ */
+int cagi_prefetch_database(cagi_prefetch *prefetch, const char *request,
+				const char *family, const char *key) {
+
+	struct prefetch_profile *profile;
+	struct prefetch_key *entry;
+
+	if (strcmp(family, "") == 0) {
+		log_error("ERROR! <family> must not be empty.");
+		return -1;
+	} else if (strcmp(key, "") == 0) {
+		log_error("ERROR! <key> must not be empty.");
+		return -1;
+	} else if (strpbrk(family, "\r\n") != NULL ||
+					strpbrk(key, "\r\n") != NULL) {
+		log_error("ERROR! <family> and <key> must not contain line "
+								"breaks.");
+		return -1;
+	}
+
+	profile = prefetch_profile(prefetch, request);
+	profile->keys = prefetch_grow(profile->keys, profile->nkeys + 1,
+						sizeof(struct prefetch_key));
+	entry = &profile->keys[profile->nkeys++];
+	entry->family = prefetch_strdup(family);
+	entry->key = prefetch_strdup(key);
+
+	return 0;
+
+}
+
+/*
+ * cagi_prefetch_enable
+ *	Run the profiles of <prefetch> on every session, as soon as its
+ *	variables are read (see cagi_readvars()), or stop doing so if
+ *	<prefetch> is NULL.
+ * params (required)
+ *	<prefetch>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ * NOTE: This is for the whole program, and must be done before sessions
+ *	start (before fastagi_serve(), for instance).
+ */
+void cagi_prefetch_enable(cagi_prefetch *prefetch) {
+
+	prefetch_enabled = prefetch;
+
+}
+
+/*
+ * cagi_prefetch_run
+ *	Fetch what the profile of <session>'s agi_request lists, in a single
+ *	round trip, into the session's caches. Whatever they already hold
+ *	isn't fetched again.
+ * params (required)
+ *	<session> <prefetch>
+ * returns
+ *	Success: The number of variables and keys that are now cached (0 if
+ *		there is no profile for the call).
+ *	Failure: Ends the session (see session_fatal()).
+ * NOTE: The session's variables must have been read.
+ */
+int cagi_prefetch_run(cagi_session *session, cagi_prefetch *prefetch) {
+
+	int i, chunks, fetched = 0;
+	char *value, *pending = NULL;
+	cagi_response response;
+	cagi_variable *variables = NULL;
+	struct vars_chunk *chunk = NULL;
+	struct prefetch_profile *profile;
+
+	profile = prefetch_find(prefetch, cagi_getvar_id(session,
+							CAGI_VAR_REQUEST));
+	if (profile == NULL)
+		return 0;
+
+	if (session->varcache == NULL && prefetch->varcache != NULL &&
+							profile->nnames > 0)
+		cagi_set_varcache(session, prefetch->varcache);
+	if (session->dbcache == NULL && prefetch->dbcache != NULL &&
+							profile->nkeys > 0)
+		cagi_set_dbcache(session, prefetch->dbcache);
+
+	session_reset_input(session);
+
+	/*
+	 * Send everything first: the keys that aren't cached yet (<pending>
+	 * tells which), then the variables.
+	 */
+	if (session->dbcache != NULL && profile->nkeys > 0) {
+		pending = cagi_arena_alloc(session, profile->nkeys);
+		for (i = 0; i < profile->nkeys; i++) {
+			pending[i] = !dbcache_get(session,
+					profile->keys[i].family,
+					profile->keys[i].key, &value);
+			if (!pending[i]) {
+				fetched++;
+				continue;
+			}
+			cmd_start(session, "DATABASE GET");
+			cmd_arg(session, profile->keys[i].family);
+			cmd_arg(session, profile->keys[i].key);
+			session->wverb = CAGI_VERB_database_get;
+			cmd_send(session);
+		}
+	}
+
+	if (session->varcache != NULL && profile->nnames > 0) {
+		variables = cagi_arena_alloc(session, profile->nnames *
+						sizeof(cagi_variable));
+		for (i = 0; i < profile->nnames; i++)
+			variables[i].name = profile->names[i];
+		chunk = vars_send(session, variables, profile->nnames,
+								&chunks);
+	}
+
+	/*
+	 * Then read the answers, in the same order. The keys are cached like
+	 * cagi_database_get() caches them, and vars_receive() caches the
+	 * variables.
+	 */
+	for (i = 0; pending != NULL && i < profile->nkeys; i++) {
+		if (!pending[i])
+			continue;
+		read_response(session, &response);
+		if (response.code != 200 || response.result < 0 ||
+							response.result > 1)
+			continue;
+		dbcache_put(session, profile->keys[i].family,
+			profile->keys[i].key, (response.result == 1 ?
+			cagi_arena_viewdup(session, response.data) : NULL));
+		fetched++;
+	}
+
+	if (variables != NULL)
+		fetched += vars_receive(session, variables, profile->nnames,
+								chunk, chunks);
+
+	return fetched;
+
+}
+
+/*
+ * prefetch_start
+ *	Run the profiles enabled with cagi_prefetch_enable() (if any) on
+ *	<session>, whose variables were just read.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: Ends the session (see session_fatal()).
+ */
+void prefetch_start(cagi_session *session) {
+
+	if (prefetch_enabled != NULL)
+		cagi_prefetch_run(session, prefetch_enabled);
+
+}
@@ -0,0 +1,360 @@
+/*
+ * cagi-server.c
+ *
+ * This source file contains the FastAGI server. Instead of asterisk forking a new AGI script
+ * for every call, the dialplan points at agi://host:port/script and asterisk connects to a
+ * single long-running process, which then talks the regular AGI protocol over the socket.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * stop_fd is an eventfd which is registered with the server's epoll set.
+ * fastagi_stop() writes to it to wake the event loop up and make it return.
+ */
+static int stop_fd = -1;
+
+/*
+ * user_handler is the handler passed to fastagi_serve(). Every call is run on
+ * the worker pool through serve_session(), which reads the variables first.
+ */
+static fastagi_handler user_handler = NULL;
+
+/*
+ * pending holds every accepted connection which is still waiting in the epoll
+ * set for asterisk to send its variables. Nobody else owns these sockets yet,
+ * so fastagi_serve() has to close whatever is left in here when it stops.
+ */
+static int *pending = NULL;
+static int pending_count = 0, pending_size = 0;
+
+/*
+ * serve_session
+ *	Pool handler for a single FastAGI call. Reads the variables asterisk
+ *	sends, and hands the session to the user's handler. Protocol errors or
+ *	hangups unwind back to the pool, which only ends this call.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void serve_session(cagi_session *session) {
+
+	cagi_readvars(session);
+	user_handler(session);
+
+}
+
+/*
+ * open_listener
+ *	Create a non-blocking TCP socket listening on <address>:<port>.
+ * params (optional, required)
+ *	[<address>] <port>
+ * returns
+ *	Success: The listening socket.
+ *	Failure: -1
+ */
+static int open_listener(const char *address, int port) {
+
+	int fd, on = 1;
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	/*
+	 * An empty (or NULL) address means that we listen on all interfaces,
+	 * which is what most people want for a FastAGI server.
+	 */
+	if (address == NULL || strcmp(address, "") == 0)
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	else if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+		log_error("ERROR! <address> is not a valid IPv4 address.");
+		return -1;
+	}
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		log_error("ERROR! Cannot create FastAGI socket.");
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		log_error("ERROR! Cannot bind FastAGI socket.");
+		close(fd);
+		return -1;
+	} else if (listen(fd, _FASTAGI_BACKLOG) == -1) {
+		log_error("ERROR! Cannot listen on FastAGI socket.");
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	return fd;
+
+}
+
+/*
+ * pending_add
+ *	Remember <fd> as a connection which has not been handed to the pool yet.
+ * params (required)
+ *	<fd>
+ * returns
+ *	Success: 0
+ *	Failure: -1
+ */
+static int pending_add(int fd) {
+
+	int *grown;
+
+	if (pending_count == pending_size) {
+		grown = realloc(pending, (pending_size ? pending_size * 2 : 16) *
+								sizeof(int));
+		if (grown == NULL)
+			return -1;
+		pending = grown;
+		pending_size = pending_size ? pending_size * 2 : 16;
+	}
+
+	pending[pending_count++] = fd;
+	return 0;
+
+}
+
+/*
+ * pending_remove
+ *	Forget <fd>, because it has been handed to the pool.
+ * params (required)
+ *	<fd>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void pending_remove(int fd) {
+
+	int i;
+
+	for (i = 0; i < pending_count; i++)
+		if (pending[i] == fd) {
+			pending[i] = pending[--pending_count];
+			return;
+		}
+
+}
+
+/*
+ * accept_connections
+ *	Accept every pending connection on <listen_fd> and register each of
+ *	them with the epoll set. Connections are only handed to the worker pool
+ *	once asterisk actually starts sending the variables, so idle or
+ *	half-open connections never cost a session.
+ * params (required)
+ *	<epfd> <listen_fd>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+static void accept_connections(int epfd, int listen_fd) {
+
+	int fd, on = 1;
+	struct epoll_event ev;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		/*
+		 * EPOLLONESHOT makes sure that we are woken up exactly once
+		 * for this connection, even if more data arrives before the
+		 * connection thread removes it from the set.
+		 */
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		ev.data.fd = fd;
+		if (pending_add(fd) == -1) {
+			log_error("ERROR! Cannot track FastAGI connection.");
+			close(fd);
+		} else if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			log_error("ERROR! Cannot watch FastAGI connection.");
+			pending_remove(fd);
+			close(fd);
+		}
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		log_error("ERROR! Cannot accept FastAGI connection.");
+
+}
+
+/*
+ * fastagi_serve
+ *	Run a FastAGI server on <address>:<port>. Every call that asterisk sends
+ *	is passed to <handler> along with a session bound to that call's socket.
+ *	Calls run on a worker pool with one worker per CPU, so a handler must
+ *	not block on anything but the AGI functions for long. This function
+ *	only returns once fastagi_stop() is called and every call in progress
+ *	has finished, or if the server could not be started.
+ * params (optional, optional, required)
+ *	[<address>] [<port>] <handler>
+ * returns
+ *	Success: 0
+ *	Failure: -1
+ * NOTE: If <port> is 0, _FASTAGI_PORT is used. SIGPIPE is ignored from here
+ *	on, otherwise a caller hanging up while we write to its socket would
+ *	kill the whole server.
+ */
+int fastagi_serve(const char *address, int port, fastagi_handler handler) {
+
+	int i, n, epfd, listen_fd, status = 0;
+	cagi_pool *pool;
+	cagi_session *session;
+	struct epoll_event ev, events[_FASTAGI_BACKLOG];
+
+	if (handler == NULL) {
+		log_error("ERROR! <handler> must not be empty.");
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((listen_fd = open_listener(address, (port ? port : _FASTAGI_PORT)))
+									== -1)
+		return -1;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		log_error("ERROR! Cannot create FastAGI event loop.");
+		close(listen_fd);
+		return -1;
+	}
+
+	if ((stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		log_error("ERROR! Cannot create FastAGI stop event.");
+		close(epfd);
+		close(listen_fd);
+		return -1;
+	}
+
+	if ((pool = cagi_pool_new(0, 0)) == NULL) {
+		close(stop_fd);
+		stop_fd = -1;
+		close(epfd);
+		close(listen_fd);
+		return -1;
+	}
+	user_handler = handler;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.fd = stop_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd, &ev);
+
+	for (;;) {
+
+		n = epoll_wait(epfd, events, _FASTAGI_BACKLOG, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log_error("ERROR! FastAGI event loop failed.");
+			status = -1;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+
+			if (events[i].data.fd == stop_fd)
+				goto done;
+
+			if (events[i].data.fd == listen_fd) {
+				accept_connections(epfd, listen_fd);
+				continue;
+			}
+
+			/*
+			 * Asterisk started talking on a connection (or hung up
+			 * on it). Either way it is now the pool's job, it will
+			 * notice a hangup when reading variables.
+			 */
+			epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+			pending_remove(events[i].data.fd);
+			session = cagi_session_new(events[i].data.fd,
+							events[i].data.fd);
+			if (cagi_pool_submit(pool, session, serve_session)
+									== -1) {
+				cagi_session_free(session);
+				close(events[i].data.fd);
+			}
+		}
+	}
+
+done:
+	/*
+	 * Connections asterisk never spoke on are still only ours, the pool
+	 * does not know about them, so they would leak if we did not close
+	 * them here.
+	 */
+	for (i = 0; i < pending_count; i++)
+		close(pending[i]);
+	free(pending);
+	pending = NULL;
+	pending_count = pending_size = 0;
+
+	cagi_pool_free(pool);
+	close(stop_fd);
+	stop_fd = -1;
+	close(epfd);
+	close(listen_fd);
+	return status;
+
+}
+
+/*
+ * fastagi_stop
+ *	Make a running fastagi_serve() stop accepting calls and return. Calls
+ *	which are already being handled keep running until their handler
+ *	returns. Safe to call from a signal handler, or from a handler.
+ * params
+ *	none
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void fastagi_stop(void) {
+
+	uint64_t one = 1;
+	ssize_t ret;
+
+	/*
+	 * The only way this write can fail is the eventfd counter being full,
+	 * and then a wake up is already pending. We cannot log from here since
+	 * this may be running in a signal handler.
+	 */
+	if (stop_fd != -1) {
+		ret = write(stop_fd, &one, sizeof(one));
+		(void)ret;
+	}
+
+}
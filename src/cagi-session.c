@@ -0,0 +1,446 @@
+/*
+ * cagi-session.c
+ *
+ * This source file contains the session functions. A session is a single conversation with
+ * asterisk over a pair of file descriptors, which lets one process talk to many channels at
+ * once (see cagi-server.c) while classic AGI scripts keep using stdin/stdout.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <sys/uio.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+#include "wpbx-cagi-trace.h"
+
+/*
+ * IOV_MAX is the most buffers a single writev() takes. POSIX guarantees at
+ * least 16, Linux takes 1024, which is what we assume if limits.h is shy.
+ */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * The semaphores of the tracepoints (see cagi-trace.h).
+ */
+#ifdef CAGI_TRACE
+#define TRACE_DEFINE(probe) \
+	unsigned short TRACE_SEMAPHORE(probe) \
+			__attribute__((unused, section(".probes")))
+TRACE_DEFINE(command__send);
+TRACE_DEFINE(response__receive);
+TRACE_DEFINE(parse__error);
+TRACE_DEFINE(session__start);
+TRACE_DEFINE(session__end);
+#endif
+
+/*
+ * stdio_session is the session classic AGI scripts use. It is shared by all
+ * threads of the process, since there is only one stdin and stdout.
+ * thread_session overrides it for the calling thread (the FastAGI server sets
+ * it for every call it handles).
+ */
+static cagi_session stdio_session = { .in_fd = 0, .out_fd = 1 };
+static __thread cagi_session *thread_session = NULL;
+
+/*
+ * cagi_session_new
+ *	Create a session which reads responses from <in_fd> and writes commands
+ *	to <out_fd>. Both may be the same descriptor (a socket, for instance).
+ * params (required)
+ *	<in_fd> <out_fd>
+ * returns
+ *	Success: A new session, which must be released with cagi_session_free().
+ *	Failure: Quits the program with exit status 1.
+ */
+cagi_session * cagi_session_new(const int in_fd, const int out_fd) {
+
+	cagi_session *session;
+
+	/*
+	 * The first block of the session's arena comes with the session, so
+	 * that most calls get through with a single allocation.
+	 */
+	session = safe_malloc(sizeof(struct cagi_session) +
+			sizeof(struct cagi_arena_block) + _ARENA_BLOCK_SIZE);
+	memset(session, 0, sizeof(struct cagi_session));
+
+	session->in_fd = in_fd;
+	session->out_fd = out_fd;
+	arena_init(session);
+
+	return session;
+
+}
+
+/*
+ * cagi_session_free
+ *	Release a session created with cagi_session_new() along with its
+ *	variables, buffers, arena and any queued commands. The file descriptors
+ *	are NOT closed, they belong to whoever created the session.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_session_free(cagi_session *session) {
+
+	if (session == NULL)
+		return;
+
+	TRACE_SESSION_END(session);
+
+	if (thread_session == session)
+		thread_session = NULL;
+
+	async_free(session);
+	varcache_free(session);
+	arena_free(session);
+	free(session->rbuf);
+	free(session->wbuf);
+	free(session->lbuf);
+	free(session->vars.strtab);
+	free(session->vars.args);
+	free(session->vars.extra);
+	free(session);
+
+}
+
+/*
+ * cagi_default_session
+ *	Return the session that the unprefixed AGI functions (answer(),
+ *	stream_file(), ...) run on for the calling thread.
+ * params
+ *	none
+ * returns
+ *	Success: The thread's session if one was set, the stdin/stdout session
+ *		otherwise.
+ *	Failure: Never fails. :)
+ */
+cagi_session * cagi_default_session(void) {
+
+	return (thread_session ? thread_session : &stdio_session);
+
+}
+
+/*
+ * cagi_set_default_session
+ *	Make <session> the default session of the calling thread. Passing NULL
+ *	goes back to the stdin/stdout session.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_set_default_session(cagi_session *session) {
+
+	thread_session = session;
+
+}
+
+/*
+ * session_fatal
+ *	Report an unrecoverable error on <session>. If the session has an
+ *	unwind point (see struct cagi_session) we jump to it, so that only this
+ *	session ends. Otherwise we quit the program like we always have.
+ * params (required)
+ *	<session> <debugmsg>
+ * returns
+ *	Never returns.
+ */
+void session_fatal(cagi_session *session, const char *debugmsg) {
+
+	log_error("%s", debugmsg);
+
+	if (session->unwind != NULL)
+		longjmp(*session->unwind, 1);
+
+	exit(1);
+
+}
+
+/*
+ * session_wait
+ *	Wait until <fd> of <session> is ready for <events> (POLLIN or POLLOUT).
+ *	Sessions running on a worker pool are parked, so that the worker can
+ *	run other sessions in the meantime. Everyone else simply blocks.
+ * params (required)
+ *	<session> <fd> <events>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void session_wait(cagi_session *session, int fd, int events) {
+
+	struct pollfd pfd;
+
+	session->stats.waits++;
+
+	if (session->park != NULL) {
+		session->park(session, fd, events);
+		return;
+	}
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+		;
+
+}
+
+/*
+ * session_fill
+ *	Read whatever asterisk has sent so far into <session>'s read buffer,
+ *	with a single read(). The buffer grows as needed, so lines of any
+ *	length fit. This never waits for more to arrive.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: The number of bytes read.
+ *	Failure: 0 if asterisk closed the connection, -1 if there is nothing to
+ *		read yet (errno is EAGAIN or EINTR).
+ */
+int session_fill(cagi_session *session) {
+
+	int n;
+
+	/*
+	 * Grow the read buffer when it is (nearly) full, so that every read()
+	 * can take in a good chunk of whatever asterisk sent. realloc() may
+	 * move the buffer, which leaves every line and response taken out of
+	 * it dangling, so callers holding on to those across a fill have to
+	 * find them again by their offset. Only session_reset_input() shifts
+	 * bytes within the buffer, this never does.
+	 */
+	if (session->rsize - session->rlen < _READ_BUFF_SIZE / 4) {
+		session->rsize = (session->rsize ? session->rsize * 2 :
+							_READ_BUFF_SIZE);
+		session->rbuf = realloc(session->rbuf, session->rsize);
+		if (session->rbuf == NULL) {
+			log_error("ERROR! Cannot allocate memory. Exiting.");
+			exit(1);
+		}
+	}
+
+	n = read(session->in_fd, session->rbuf + session->rlen, session->rsize -
+								session->rlen);
+	session->stats.reads++;
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return -1;
+
+	if (n <= 0)
+		return 0;
+
+	session->rlen += n;
+	session->stats.bytes_in += n;
+
+	return n;
+
+}
+
+/*
+ * session_nextline
+ *	Take the next complete line out of <session>'s read buffer, without
+ *	reading anything. The buffer is left untouched, so the line is NOT
+ *	null-terminated.
+ * params (required)
+ *	<session> <len>
+ * returns
+ *	Success: A pointer to the line (without its \n) in the read buffer, and
+ *		its length in <len>. Valid until session_reset_input().
+ *	Failure: NULL if no complete line has been read yet.
+ */
+char * session_nextline(cagi_session *session, int *len) {
+
+	char *line, *nl;
+
+	if (session->rpos == session->rlen)
+		return NULL;
+
+	line = session->rbuf + session->rpos;
+	nl = memchr(line, '\n', session->rlen - session->rpos);
+	if (nl == NULL)
+		return NULL;
+
+	*len = nl - line;
+	session->rpos += *len + 1;
+
+	return line;
+
+}
+
+/*
+ * session_readline
+ *	Read a line from <session>, waiting for asterisk to send it if need be
+ *	(see session_nextline()).
+ * params (required)
+ *	<session> <len>
+ * returns
+ *	Success: A pointer to the line (without its \n) in the read buffer, and
+ *		its length in <len>. Valid until session_reset_input().
+ *	Failure: NULL if asterisk closed the connection before sending a
+ *		complete line.
+ */
+char * session_readline(cagi_session *session, int *len) {
+
+	int n;
+	char *line;
+
+	while ((line = session_nextline(session, len)) == NULL) {
+		if ((n = session_fill(session)) == 0)
+			return NULL;
+
+		if (n == -1 && errno == EAGAIN)
+			session_wait(session, session->in_fd, POLLIN);
+	}
+
+	return line;
+
+}
+
+/*
+ * session_reset_input
+ *	Drop everything that has been consumed from <session>'s read buffer, and
+ *	move what hasn't to the front. Any response read so far is invalid
+ *	afterwards, so this is done right before a new command is sent.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void session_reset_input(cagi_session *session) {
+
+	if (session->rpos == 0)
+		return;
+
+	memmove(session->rbuf, session->rbuf + session->rpos, session->rlen -
+							session->rpos);
+	session->rlen -= session->rpos;
+	session->rpos = 0;
+
+}
+
+/*
+ * session_gets
+ *	Read a line from <session>, just like fgets() does with a stream. At
+ *	most <size>-1 bytes are stored (the rest of a longer line is dropped),
+ *	the line keeps its trailing \n, and the result is always
+ *	null-terminated.
+ * params (required)
+ *	<session> <buff> <size>
+ * returns
+ *	Success: <buff>
+ *	Failure: NULL if asterisk closed the connection.
+ */
+char * session_gets(cagi_session *session, char *buff, const int size) {
+
+	int len;
+	char *line;
+
+	if ((line = session_readline(session, &len)) == NULL)
+		return NULL;
+
+	if (len > size-2)
+		len = size-2;
+
+	memcpy(buff, line, len);
+	buff[len] = '\n';
+	buff[len+1] = '\0';
+
+	return buff;
+
+}
+
+/*
+ * session_writev
+ *	Write the <count> buffers of <iov> to <session> in order, retrying on
+ *	short writes. A command that is built in pieces goes out in a single
+ *	system call this way, without being copied into one string first.
+ * params (required)
+ *	<session> <iov> <count>
+ * returns
+ *	Success: void.
+ *	Failure: Ends the session (see session_fatal()).
+ * NOTE: <iov> is used as scratch space, its contents are undefined
+ *	afterwards.
+ */
+void session_writev(cagi_session *session, struct iovec *iov, int count) {
+
+	ssize_t n;
+
+	/*
+	 * Commands submitted asynchronously that asterisk couldn't take yet go
+	 * first, so that responses keep coming back in order.
+	 */
+	async_drain(session);
+
+	while (count > 0 && iov->iov_len == 0) {
+		iov++;
+		count--;
+	}
+
+	while (count > 0) {
+		n = writev(session->out_fd, iov, (count < IOV_MAX ? count :
+								IOV_MAX));
+		session->stats.writes++;
+		if (n == -1) {
+			if (errno == EAGAIN)
+				session_wait(session, session->out_fd, POLLOUT);
+			else if (errno != EINTR)
+				session_fatal(session, "ERROR! Cannot write to "
+								"asterisk.");
+			continue;
+		}
+		session->stats.bytes_out += n;
+
+		/*
+		 * Skip whatever made it out, and pick up where the kernel
+		 * stopped if it was in the middle of a buffer.
+		 */
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+}
+
+/*
+ * session_write
+ *	Write <len> bytes of <str> to <session>, retrying on short writes.
+ * params (required)
+ *	<session> <str> <len>
+ * returns
+ *	Success: void.
+ *	Failure: Ends the session (see session_fatal()).
+ */
+void session_write(cagi_session *session, const char *str, const int len) {
+
+	struct iovec iov;
+
+	iov.iov_base = (char *)str;
+	iov.iov_len = len;
+
+	session_writev(session, &iov, 1);
+
+}
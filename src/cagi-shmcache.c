@@ -0,0 +1,674 @@
+/*
+ * cagi-shmcache.c
+ *
+ * This source file contains the shared memory cache. Classic AGI scripts are a new process
+ * per call, so a cache of their own starts out empty every time. This one lives in a file
+ * (on a tmpfs such as /dev/shm, ideally) that every cAGI process maps, so a lookup made by
+ * one call is there for all the calls after it, whichever process runs them. It holds
+ * AstDB keys (see cagi_dbcache_share()) and any other slowly changing lookups a script cares
+ * to keep, as strings under string keys.
+ *
+ * The table is a fixed array of slots, so it never grows and never needs a lock. Each key
+ * can live in any of SHM_PROBE slots in a row starting at its hash. Every slot has a
+ * sequence number which is odd while it is being written: readers copy the slot and check
+ * that the number didn't change in the meantime (a seqlock), and writers claim a slot by
+ * making its number odd with a compare and swap, and give up rather than wait if somebody
+ * else has. When all of a key's slots are taken, the one that expires first is replaced,
+ * so the cache holds at most as many keys as it has slots.
+ *
+ * A process killed in the middle of writing a slot leaves it odd. Writers wait a little
+ * for a busy slot and then give up, but they remember it: a slot still odd with the same
+ * sequence number SHM_STUCK milliseconds later is taken back and freed, so a dead writer
+ * only keeps its keys out of the cache for a while. A writer merely stalled for that long
+ * finds its slot gone when it is done, and fails, but may have written over whatever took
+ * the slot over in the meantime. So every slot carries a checksum of its contents, which
+ * the writer computes before it starts copying them in: a slot that doesn't match its
+ * checksum reads as busy, and is taken back the same way.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * SHM_MAGIC marks a file that has been set up as a cache (and its layout).
+ * SHM_PROBE is the number of slots a key may live in, and SHM_DATA the room
+ * for a key and its value in a slot, which is 256 bytes all told. Longer
+ * keys and values aren't cached.
+ */
+#define SHM_MAGIC	0x63616732
+#define SHM_PROBE	8
+#define SHM_DATA	232
+
+/*
+ * SHM_TRIES is how many times we look at a busy slot, or try to claim one,
+ * before giving up, and SHM_STUCK how long (in milliseconds) a slot may stay
+ * busy before we decide its writer is dead.
+ */
+#define SHM_TRIES	32
+#define SHM_STUCK	1000
+
+/*
+ * struct shm_slot
+ *	A slot of the table. <data> holds the key followed by the value, with
+ *	no '\0's. A slot with a <klen> of 0 is free.
+ */
+struct shm_slot {
+	uint32_t seq;
+	uint32_t hash;
+	int64_t expires;			// see shm_now()
+	uint16_t klen;
+	uint16_t vlen;
+	uint32_t sum;				// see shm_sum()
+	char data[SHM_DATA];
+};
+
+/*
+ * struct shm_header
+ *	The start of the file. The slots follow it, from offset 64.
+ */
+struct shm_header {
+	uint32_t magic;
+	uint32_t slots;
+};
+
+/*
+ * struct cagi_shmcache
+ *	A process's mapping of the file. The counters are the process's own,
+ *	so that lookups don't fight over them across processes, and are
+ *	shared by its threads (see SHM_COUNT).
+ */
+struct cagi_shmcache {
+	struct shm_header *header;
+	struct shm_slot *slots;
+	uint32_t mask;
+	size_t size;
+	cagi_cache_stats stats;
+};
+
+/*
+ * SHM_COUNT
+ *	Add <n> to the counter <field> of <cache>. Sessions running on a pool
+ *	look things up from several threads at once.
+ */
+#define SHM_COUNT(cache, field, n) \
+	__atomic_fetch_add(&(cache)->stats.field, (n), __ATOMIC_RELAXED)
+
+/*
+ * struct shm_busy
+ *	A slot we found busy, with the sequence number it had and when we
+ *	first saw it so.
+ */
+struct shm_busy {
+	struct shm_slot *slot;
+	uint32_t seq;
+	int64_t since;
+};
+
+/*
+ * The last SHM_PROBE busy slots the calling thread saw (see shm_stuck()),
+ * enough for all of a key's slots.
+ */
+static __thread struct shm_busy busy_slots[SHM_PROBE];
+static __thread int busy_next = 0;
+
+/*
+ * shm_now
+ *	The time slots expire by, in milliseconds. The monotonic clock is the
+ *	same for every process on the machine, but starts over at boot, which
+ *	is one more reason to keep the file on a tmpfs.
+ */
+static int64_t shm_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
+/*
+ * shm_hash
+ *	Hash <key> (FNV-1a).
+ */
+static uint32_t shm_hash(const char *key, const int klen) {
+
+	int i;
+	uint32_t hash = 2166136261u;
+
+	for (i = 0; i < klen; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+
+	return hash;
+
+}
+
+/*
+ * shm_sum
+ *	Checksum the contents of <slot>, which are everything from <hash> on
+ *	but <sum> itself (FNV-1a). <klen> and <vlen> must fit in <data>.
+ */
+static uint32_t shm_sum(const struct shm_slot *slot) {
+
+	int i, len = offsetof(struct shm_slot, sum);
+	const unsigned char *p = (const unsigned char *)slot;
+	uint32_t sum = 2166136261u;
+
+	for (i = offsetof(struct shm_slot, hash); i < len; i++)
+		sum = (sum ^ p[i]) * 16777619u;
+
+	p = (const unsigned char *)slot->data;
+	len = slot->klen + slot->vlen;
+	for (i = 0; i < len; i++)
+		sum = (sum ^ p[i]) * 16777619u;
+
+	return sum;
+
+}
+
+/*
+ * shm_read
+ *	Copy <slot> into <copy>, as it was at some point in time.
+ * returns
+ *	Success: 0
+ *	Failure: -1 if it kept changing under us, is being written, or doesn't
+ *		match its checksum (see shm_stuck()).
+ */
+static int shm_read(struct shm_slot *slot, struct shm_slot *copy) {
+
+	int tries;
+	uint32_t seq;
+
+	for (tries = 0; tries < 4; tries++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(copy, slot, offsetof(struct shm_slot, data));
+		if (copy->klen + copy->vlen > SHM_DATA)
+			continue;
+		memcpy(copy->data, slot->data, copy->klen + copy->vlen);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		/*
+		 * Free slots are never checked, whatever a stray writer left in
+		 * them besides <klen> is ignored.
+		 */
+		if (copy->klen == 0 || shm_sum(copy) == copy->sum)
+			return 0;
+	}
+
+	return -1;
+
+}
+
+/*
+ * shm_stuck
+ *	Called when <slot> couldn't be read. If it has been unreadable with the
+ *	same sequence number for SHM_STUCK milliseconds, it is taken to be
+ *	broken: either its writer is dead (the number is odd), or a writer we
+ *	took a slot back from woke up and wrote over it (the checksum doesn't
+ *	match). Claim it and free it.
+ * returns
+ *	Success: 0 (the slot is free now).
+ *	Failure: -1 if it is busy, and not for long enough (yet).
+ */
+static int shm_stuck(struct shm_slot *slot) {
+
+	int i;
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE), claim;
+	int64_t now = shm_now();
+	struct shm_busy *busy;
+
+	for (i = 0; i < SHM_PROBE && busy_slots[i].slot != slot; i++)
+		;
+	if (i == SHM_PROBE) {
+		i = busy_next;
+		busy_next = (busy_next + 1) % SHM_PROBE;
+	}
+
+	busy = &busy_slots[i];
+	if (busy->slot != slot || busy->seq != seq) {
+		busy->slot = slot;
+		busy->seq = seq;
+		busy->since = now;
+		return -1;
+	}
+
+	/*
+	 * An odd number is moved on by two, which keeps it odd while we clear
+	 * it, and makes the writer fail if it turns out to be alive after all
+	 * (see shm_write()).
+	 */
+	claim = seq + 1 + (seq & 1);
+	if (now - busy->since < SHM_STUCK ||
+			!__sync_bool_compare_and_swap(&slot->seq, seq, claim))
+		return -1;
+
+	slot->hash = 0;
+	slot->expires = 0;
+	slot->klen = 0;
+	slot->vlen = 0;
+	__atomic_store_n(&slot->seq, claim + 1, __ATOMIC_RELEASE);
+	busy->slot = NULL;
+	return 0;
+
+}
+
+/*
+ * shm_settle
+ *	Copy <slot> into <copy> like shm_read(), waiting a little if it is
+ *	being written, and taking it back if it has been for too long.
+ * returns
+ *	Success: 0
+ *	Failure: -1 if it stayed busy.
+ */
+static int shm_settle(struct shm_slot *slot, struct shm_slot *copy) {
+
+	int tries;
+
+	for (tries = 0; tries < SHM_TRIES; tries++) {
+		if (shm_read(slot, copy) == 0)
+			return 0;
+		if (shm_stuck(slot) == -1)
+			sched_yield();
+	}
+
+	return -1;
+
+}
+
+/*
+ * shm_write
+ *	Claim <slot>, which was <seq> when we looked at it, and fill it in. A
+ *	<klen> of 0 frees it.
+ * returns
+ *	Success: 0
+ *	Failure: -1 if somebody else got to it first, or took it back from us
+ *		while we were writing (see shm_stuck()).
+ * NOTE: The new contents are put together and checksummed beforehand, the
+ *	checksum must not depend on what is in the slot while we copy them.
+ */
+static int shm_write(struct shm_slot *slot, const uint32_t seq, const uint32_t
+	hash, const char *key, const int klen, const char *value, const int
+					vlen, const int64_t expires) {
+
+	struct shm_slot fill;
+	int start = offsetof(struct shm_slot, hash);
+
+	fill.hash = hash;
+	fill.expires = expires;
+	fill.klen = klen;
+	fill.vlen = vlen;
+	memcpy(fill.data, key, klen);
+	memcpy(fill.data + klen, value, vlen);
+	fill.sum = shm_sum(&fill);
+
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq,
+								seq + 1))
+		return -1;
+
+	memcpy((char *)slot + start, (char *)&fill + start,
+		offsetof(struct shm_slot, data) - start + klen + vlen);
+
+	return (__sync_bool_compare_and_swap(&slot->seq, seq + 1, seq + 2) ? 0 :
+									-1);
+
+}
+
+/*
+ * shm_setup
+ *	Read the header of the cache file <fd> into <header>, setting the file
+ *	up with <slots> slots first if it is empty. Must be called with the
+ *	file locked.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (it can't be set up, or isn't a cache).
+ */
+static int shm_setup(const int fd, const uint32_t slots, struct shm_header
+								*header) {
+
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+
+	/*
+	 * A fresh file reads as zeroes, which is an empty table.
+	 */
+	if (st.st_size == 0) {
+		header->magic = SHM_MAGIC;
+		header->slots = slots;
+		if (ftruncate(fd, 64 + (off_t)slots *
+				(off_t)sizeof(struct shm_slot)) == -1 ||
+				pwrite(fd, header, sizeof(*header), 0) !=
+							sizeof(*header))
+			return -1;
+		return 0;
+	}
+
+	if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+		header->magic != SHM_MAGIC || header->slots < SHM_PROBE ||
+		(header->slots & (header->slots - 1)) != 0 ||
+		st.st_size < 64 + (off_t)header->slots *
+					(off_t)sizeof(struct shm_slot))
+		return -1;
+
+	return 0;
+
+}
+
+/*
+ * cagi_shmcache_open
+ *	Map the cache kept in the file <path>, creating it with room for
+ *	<slots> keys (rounded up to a power of two) if it doesn't exist yet.
+ *	Every process that opens the same file shares the same cache.
+ * params (required)
+ *	<path> <slots>
+ * returns
+ *	Success: The cache, which must be released with cagi_shmcache_close().
+ *	Failure: NULL (the file can't be opened, created or mapped).
+ * NOTE: A file that already exists keeps the number of slots it was
+ *	created with.
+ */
+cagi_shmcache * cagi_shmcache_open(const char *path, const int slots) {
+
+	int fd, status;
+	uint32_t n = SHM_PROBE;
+	struct shm_header header;
+	cagi_shmcache *cache;
+	void *map;
+
+	while (n < (uint32_t)slots)
+		n *= 2;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		log_error("ERROR! Cannot open shared cache %s.", path);
+		return NULL;
+	}
+
+	/*
+	 * Whoever finds the file empty sets it up, while the others wait.
+	 */
+	flock(fd, LOCK_EX);
+	status = shm_setup(fd, n, &header);
+	flock(fd, LOCK_UN);
+
+	if (status == -1) {
+		close(fd);
+		log_error("ERROR! Cannot set up shared cache %s.", path);
+		return NULL;
+	}
+
+	cache = safe_malloc(sizeof(struct cagi_shmcache));
+	memset(cache, 0, sizeof(struct cagi_shmcache));
+	cache->size = 64 + (size_t)header.slots * sizeof(struct shm_slot);
+	map = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+									0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error("ERROR! Cannot map shared cache %s.", path);
+		free(cache);
+		return NULL;
+	}
+
+	cache->header = map;
+	cache->slots = (struct shm_slot *)((char *)map + 64);
+	cache->mask = header.slots - 1;
+
+	return cache;
+
+}
+
+/*
+ * cagi_shmcache_close
+ *	Unmap <cache>. What is in it stays in the file for the other processes.
+ * params (required)
+ *	<cache>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_shmcache_close(cagi_shmcache *cache) {
+
+	if (cache == NULL)
+		return;
+
+	munmap(cache->header, cache->size);
+	free(cache);
+
+}
+
+/*
+ * cagi_shmcache_get
+ *	Look <key> up in <cache>, and copy its value into <value>, which has
+ *	room for <size> bytes (a '\0' included).
+ * params (required)
+ *	<cache> <key> <value> <size>
+ * returns
+ *	Success: The length of the value.
+ *	Failure: -1 if it isn't cached (or has expired, or doesn't fit).
+ */
+int cagi_shmcache_get(cagi_shmcache *cache, const char *key, char *value,
+							const int size) {
+
+	int i, klen = strlen(key);
+	uint32_t hash = shm_hash(key, klen);
+	struct shm_slot copy;
+
+	for (i = 0; i < SHM_PROBE; i++) {
+		if (shm_read(&cache->slots[(hash + i) & cache->mask], &copy) ==
+									-1)
+			continue;
+		if (copy.hash != hash || copy.klen != klen ||
+					memcmp(copy.data, key, klen) != 0)
+			continue;
+
+		if (copy.expires - shm_now() <= 0) {
+			SHM_COUNT(cache, expirations, 1);
+			break;
+		}
+		if (copy.vlen >= size)
+			break;
+
+		memcpy(value, copy.data + klen, copy.vlen);
+		value[copy.vlen] = '\0';
+		SHM_COUNT(cache, hits, 1);
+		return copy.vlen;
+	}
+
+	SHM_COUNT(cache, misses, 1);
+	return -1;
+
+}
+
+/*
+ * cagi_shmcache_put
+ *	Cache <value> under <key> in <cache> for <ttl> milliseconds, replacing
+ *	what was there.
+ * params (required)
+ *	<cache> <key> <value> <ttl>
+ * returns
+ *	Success: 0
+ *	Failure: -1 if it is too long, or its slots stayed busy being written
+ *		by other processes (nothing is cached, a later put will do).
+ * NOTE: A failed put may leave the key's old value in the cache, so
+ *	callers that care should cagi_shmcache_del() it.
+ */
+int cagi_shmcache_put(cagi_shmcache *cache, const char *key, const char
+						*value, const int ttl) {
+
+	int i, tries, found, busy, klen = strlen(key), vlen = strlen(value);
+	uint32_t hash = shm_hash(key, klen), seq;
+	int64_t now, expires;
+	struct shm_slot copy, *slot, *victim;
+
+	if (klen == 0 || klen + vlen > SHM_DATA || ttl <= 0)
+		return -1;
+
+	for (tries = 0; tries < SHM_TRIES; tries++) {
+		found = busy = 0;
+		seq = 0;
+		now = shm_now();
+		expires = INT64_MAX;
+		victim = NULL;
+
+		/*
+		 * The key's own slot if it has one, or else a free one, or else
+		 * an expired one, or else the one that would expire first. A
+		 * slot that is being written might be the key's own, and the
+		 * key must never be in two slots, so we wait for it rather than
+		 * guess.
+		 */
+		for (i = 0; i < SHM_PROBE && !found; i++) {
+			slot = &cache->slots[(hash + i) & cache->mask];
+			if (shm_settle(slot, &copy) == -1) {
+				busy = 1;
+				break;
+			}
+			if (copy.klen == klen && copy.hash == hash &&
+					memcmp(copy.data, key, klen) == 0)
+				found = 1;
+			else if (copy.klen == 0)
+				copy.expires = INT64_MIN;
+			if (found || copy.expires < expires) {
+				victim = slot;
+				seq = copy.seq;
+				expires = copy.expires;
+			}
+		}
+
+		if (busy)
+			return -1;
+
+		if (shm_write(victim, seq, hash, key, klen, value, vlen, now +
+								ttl) == 0) {
+			if (!found && expires > now)
+				SHM_COUNT(cache, evictions, 1);
+			SHM_COUNT(cache, stores, 1);
+			return 0;
+		}
+		sched_yield();
+	}
+
+	return -1;
+
+}
+
+/*
+ * shm_drop
+ *	Free <slot> if it holds <key> (or a key starting with it, if <prefix>
+ *	is set). Other writers getting in the way are waited for a while, a
+ *	stale value should not survive.
+ * returns
+ *	Success: 1 if it was freed, 0 if it didn't hold the key.
+ *	Failure: -1 if it stayed busy, or kept changing.
+ */
+static int shm_drop(struct shm_slot *slot, const char *key, const uint32_t
+						klen, const int prefix) {
+
+	int tries;
+	struct shm_slot copy;
+
+	for (tries = 0; tries < SHM_TRIES; tries++) {
+		if (shm_settle(slot, &copy) == -1)
+			return -1;
+		if (copy.klen < klen || (!prefix && copy.klen != klen) ||
+					memcmp(copy.data, key, klen) != 0)
+			return 0;
+		if (shm_write(slot, copy.seq, 0, "", 0, "", 0, 0) == 0)
+			return 1;
+		sched_yield();
+	}
+
+	return -1;
+
+}
+
+/*
+ * cagi_shmcache_del
+ *	Drop <key> from <cache>, or every key that starts with <key> if
+ *	<prefix> is set.
+ * params (required)
+ *	<cache> <key> <prefix>
+ * returns
+ *	Success: 0
+ *	Failure: -1 if a slot which may hold the key stayed busy, or kept
+ *		being written by others (its value may still be cached).
+ * NOTE: Dropping a prefix walks the whole table.
+ */
+int cagi_shmcache_del(cagi_shmcache *cache, const char *key, const int
+								prefix) {
+
+	int dropped, status = 0;
+	uint32_t i, first, count, klen = strlen(key);
+
+	first = (prefix ? 0 : shm_hash(key, klen));
+	count = (prefix ? cache->mask + 1 : SHM_PROBE);
+
+	for (i = 0; i < count; i++) {
+		dropped = shm_drop(&cache->slots[(first + i) & cache->mask],
+							key, klen, prefix);
+		if (dropped == -1)
+			status = -1;
+		else
+			SHM_COUNT(cache, invalidations, dropped);
+	}
+
+	return status;
+
+}
+
+/*
+ * cagi_shmcache_stats
+ *	Copy the counters of this process's lookups in <cache> into <stats>.
+ *	The number of entries is that of the whole table, which is counted.
+ * params (required)
+ *	<cache> <stats>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_shmcache_stats(cagi_shmcache *cache, cagi_cache_stats *stats) {
+
+	uint32_t i;
+	int64_t now = shm_now();
+	struct shm_slot *slot;
+
+	stats->hits = __atomic_load_n(&cache->stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&cache->stats.misses, __ATOMIC_RELAXED);
+	stats->stores = __atomic_load_n(&cache->stats.stores, __ATOMIC_RELAXED);
+	stats->invalidations = __atomic_load_n(&cache->stats.invalidations,
+							__ATOMIC_RELAXED);
+	stats->expirations = __atomic_load_n(&cache->stats.expirations,
+							__ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&cache->stats.evictions,
+							__ATOMIC_RELAXED);
+	stats->entries = 0;
+	for (i = 0; i <= cache->mask; i++) {
+		slot = &cache->slots[i];
+		if (__atomic_load_n(&slot->klen, __ATOMIC_RELAXED) != 0 &&
+			__atomic_load_n(&slot->expires, __ATOMIC_RELAXED) > now)
+			stats->entries++;
+	}
+
+}
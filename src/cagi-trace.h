@@ -0,0 +1,121 @@
+/*
+ * cagi-trace.h
+ *
+ * This header file contains the static tracepoints (USDT probes) of the command path, which
+ * perf, bpftrace and systemtap can attach to on a running program. Probes are only built in
+ * when <sys/sdt.h> is available (systemtap-sdt-dev, or -devel, provides it) and CAGI_NO_TRACE
+ * isn't defined. An unused probe is a single nop, and its arguments (which take string
+ * lookups) are only worked out while something is attached to it. The probes, of provider
+ * "cagi", are:
+ *
+ *	command__send (verb, uniqueid, bytes)		A command was written to asterisk.
+ *	response__receive (verb, uniqueid, bytes, code, result)
+ *							Its response was read and parsed.
+ *	parse__error (uniqueid, line, bytes)		A response couldn't be parsed.
+ *	session__start (uniqueid, request, bytes)	The variables were read.
+ *	session__end (uniqueid, commands, bytes_in, bytes_out)
+ *							The session was freed.
+ *
+ * <verb> is the command's verb (Ex: "STREAM FILE", "OTHER" for raw commands cAGI doesn't
+ * know, "BATCH" for a whole batch), and <uniqueid> is the agi_uniqueid of the call ("" until
+ * the variables are read). Ex:
+ *	bpftrace -e 'usdt:./ivr:cagi:response__receive { @[str(arg0)] = count(); }'
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#if !defined(CAGI_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CAGI_TRACE
+#endif
+#endif
+
+#ifdef CAGI_TRACE
+
+/*
+ * Every probe has a semaphore, which the tracer bumps while it is attached,
+ * so that the arguments are only worked out when somebody looks at them.
+ */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(probe)	cagi_##probe##_semaphore
+#define TRACE_ENABLED(probe)	__builtin_expect(TRACE_SEMAPHORE(probe), 0)
+
+extern unsigned short TRACE_SEMAPHORE(command__send);
+extern unsigned short TRACE_SEMAPHORE(response__receive);
+extern unsigned short TRACE_SEMAPHORE(parse__error);
+extern unsigned short TRACE_SEMAPHORE(session__start);
+extern unsigned short TRACE_SEMAPHORE(session__end);
+
+/*
+ * trace_uniqueid
+ *	The agi_uniqueid of <session>, or "" if it isn't known (yet).
+ */
+static inline const char * trace_uniqueid(cagi_session *session) {
+
+	const char *uniqueid = cagi_getvar_id(session, CAGI_VAR_UNIQUEID);
+
+	return (uniqueid != NULL ? uniqueid : "");
+
+}
+
+#define TRACE_COMMAND_SEND(session, verb, bytes) \
+	do { \
+		if (TRACE_ENABLED(command__send)) \
+			DTRACE_PROBE3(cagi, command__send, (verb), \
+				trace_uniqueid(session), (bytes)); \
+	} while (0)
+
+#define TRACE_RESPONSE_RECEIVE(session, verb, bytes, response) \
+	do { \
+		if (TRACE_ENABLED(response__receive)) \
+			DTRACE_PROBE5(cagi, response__receive, (verb), \
+				trace_uniqueid(session), (bytes), \
+				(response)->code, (response)->result); \
+	} while (0)
+
+#define TRACE_PARSE_ERROR(session, line, bytes) \
+	do { \
+		if (TRACE_ENABLED(parse__error)) \
+			DTRACE_PROBE3(cagi, parse__error, \
+				trace_uniqueid(session), (line), (bytes)); \
+	} while (0)
+
+#define TRACE_SESSION_START(session) \
+	do { \
+		if (TRACE_ENABLED(session__start)) \
+			DTRACE_PROBE3(cagi, session__start, \
+				trace_uniqueid(session), \
+				cagi_getvar_id(session, CAGI_VAR_REQUEST), \
+				(session)->stats.bytes_in); \
+	} while (0)
+
+#define TRACE_SESSION_END(session) \
+	do { \
+		if (TRACE_ENABLED(session__end)) \
+			DTRACE_PROBE4(cagi, session__end, \
+				trace_uniqueid(session), \
+				(session)->stats.commands, \
+				(session)->stats.bytes_in, \
+				(session)->stats.bytes_out); \
+	} while (0)
+
+#else
+
+/*
+ * Without probes, only the byte counts (which are plain variables) are looked
+ * at, so that they don't show up as unused.
+ */
+#define TRACE_ENABLED(probe)	0
+#define TRACE_COMMAND_SEND(session, verb, bytes)	((void)(bytes))
+#define TRACE_RESPONSE_RECEIVE(session, verb, bytes, response) \
+	((void)(bytes))
+#define TRACE_PARSE_ERROR(session, line, bytes)
+#define TRACE_SESSION_START(session)
+#define TRACE_SESSION_END(session)
+
+#endif
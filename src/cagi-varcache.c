@@ -0,0 +1,607 @@
+/*
+ * cagi-varcache.c
+ *
+ * This source file contains the channel variable cache. Dialplan logic reads the same
+ * variables over and over (CALLERID(num), things it set itself a moment ago), and every
+ * get_variable() is a round trip through asterisk. A session with a cache attached (see
+ * cagi_set_varcache()) remembers what cagi_get_variable() and cagi_get_full_variable() read
+ * on its own channel, and what cagi_set_variable() wrote, and answers from that instead.
+ *
+ * Variables don't expire, they are only ever changed by the channel itself, so the cache
+ * watches every command the session sends (whichever way it is sent: the cagi_ functions,
+ * raw, queued or async):
+ *	- SET VARIABLE drops what it may change: the variable itself, and every expression
+ *	  that mentions it. For a dialplan function (Ex: CALLERID(name)), that is everything
+ *	  that mentions the function.
+ *	- Commands that can change anything on the channel drop everything. By default, those
+ *	  are EXEC, GOSUB, SET CONTEXT, SET EXTENSION, SET PRIORITY, SET CALLERID, SPEECH
+ *	  RECOGNIZE, and raw commands cAGI doesn't know (see cagi_varcache_flush_on()).
+ *	- Variables that change on their own (CDR(), CHANNEL(), EPOCH, RAND(), ...) are never
+ *	  cached (see cagi_varcache_volatile()).
+ *	- Reading a function that changes things (SET(), INC(), POP(), ...) drops everything,
+ *	  and is never cached either.
+ * Lookups on another channel are never cached, since we can't see what happens there.
+ *
+ * The rules live in a cagi_varcache, which sessions may share. Every session keeps its own
+ * variables, as channels do.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * VARCACHE_BUCKETS is the number of hash buckets of every session's cache,
+ * which holds a few dozen variables at most in practice.
+ */
+#define VARCACHE_BUCKETS	64
+
+/*
+ * varcache_volatiles are the variables and functions that are never cached
+ * by default: their value changes without the channel doing anything.
+ */
+static const char *varcache_volatiles[] = {
+	"CDR(", "CHANNEL(", "DB(", "DB_", "EPOCH", "GLOBAL(", "RAND(",
+	"SHARED(", "SHELL(", "STAT(", "STRFTIME(", "TIMEOUT(", NULL
+};
+
+/*
+ * varcache_writers are the functions which change variables when they are
+ * read, so that a GET VARIABLE or GET FULL VARIABLE that mentions one may
+ * change anything (EVAL() may run any of them).
+ */
+static const char *varcache_writers[] = {
+	"DEC(", "EVAL(", "INC(", "POP(", "PUSH(", "SET(", "SHIFT(",
+	"UNSHIFT(", NULL
+};
+
+/*
+ * struct varcache_entry
+ *	A cached variable. <data> holds its name and value, each followed by a
+ *	'\0'. <kind> is VARCACHE_PLAIN for the names get_variable() takes, and
+ *	VARCACHE_FULL for the expressions get_full_variable() takes.
+ */
+struct varcache_entry {
+	struct varcache_entry *hnext;		// next in its bucket
+	struct varcache_entry *older;		// insertion order, for eviction
+	struct varcache_entry *newer;
+	unsigned int hash;
+	int kind;
+	int nlen;
+	int vlen;
+	char data[];
+};
+
+/*
+ * struct cagi_varcache
+ *	The rules of the cache, which sessions only ever read.
+ */
+struct cagi_varcache {
+	int size;				// most variables kept
+	unsigned char flush[CAGI_VERB_COUNT];	// verbs that drop everything
+	char **volatiles;
+	int nvolatiles;
+};
+
+/*
+ * struct cagi_varcache_state
+ *	The variables cached for one session.
+ */
+struct cagi_varcache_state {
+	cagi_varcache *rules;
+	struct varcache_entry *buckets[VARCACHE_BUCKETS];
+	struct varcache_entry *oldest;
+	struct varcache_entry *newest;
+	cagi_cache_stats stats;
+};
+
+/*
+ * varcache_hash
+ *	Hash <name> (FNV-1a), <kind> included.
+ */
+static unsigned int varcache_hash(const int kind, const char *name, const int
+									nlen) {
+
+	int i;
+	unsigned int hash = (2166136261u ^ kind) * 16777619u;
+
+	for (i = 0; i < nlen; i++)
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+	return hash;
+
+}
+
+/*
+ * varcache_find
+ *	Find the entry of <name> and <kind> in <state>.
+ * returns
+ *	Success: The entry.
+ *	Failure: NULL if it isn't cached.
+ */
+static struct varcache_entry * varcache_find(struct cagi_varcache_state
+	*state, const int kind, const char *name, const int nlen, const
+							unsigned int hash) {
+
+	struct varcache_entry *entry;
+
+	for (entry = state->buckets[hash % VARCACHE_BUCKETS]; entry != NULL;
+							entry = entry->hnext)
+		if (entry->hash == hash && entry->kind == kind &&
+				entry->nlen == nlen &&
+				memcmp(entry->data, name, nlen) == 0)
+			return entry;
+
+	return NULL;
+
+}
+
+/*
+ * varcache_remove
+ *	Remove <entry> from <state> and free it.
+ */
+static void varcache_remove(struct cagi_varcache_state *state, struct
+							varcache_entry *entry) {
+
+	struct varcache_entry **link;
+
+	for (link = &state->buckets[entry->hash % VARCACHE_BUCKETS]; *link !=
+						entry; link = &(*link)->hnext)
+		;
+	*link = entry->hnext;
+
+	if (entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		state->oldest = entry->newer;
+	if (entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		state->newest = entry->older;
+
+	state->stats.entries--;
+	free(entry);
+
+}
+
+/*
+ * varcache_mentions
+ *	Tell whether <str> mentions the first <len> bytes of <name>. Function
+ *	names are case insensitive in the dialplan, so this is too.
+ */
+static int varcache_mentions(const char *str, const char *name, const int
+									len) {
+
+	for (; *str != '\0'; str++)
+		if (strncasecmp(str, name, len) == 0)
+			return 1;
+
+	return 0;
+
+}
+
+/*
+ * varcache_writes
+ *	Tell whether the <len> bytes of <command> mention one of the
+ *	varcache_writers.
+ */
+static int varcache_writes(const char *command, const int len) {
+
+	int i, n;
+	const char *p;
+
+	for (p = command; p < command + len; p++)
+		for (i = 0; varcache_writers[i] != NULL; i++) {
+			n = strlen(varcache_writers[i]);
+			if (command + len - p >= n && strncasecmp(p,
+						varcache_writers[i], n) == 0)
+				return 1;
+		}
+
+	return 0;
+
+}
+
+/*
+ * varcache_is_volatile
+ *	Tell whether <name> mentions a variable that <rules> never cache.
+ */
+static int varcache_is_volatile(cagi_varcache *rules, const char *name) {
+
+	int i;
+
+	for (i = 0; i < rules->nvolatiles; i++)
+		if (varcache_mentions(name, rules->volatiles[i],
+						strlen(rules->volatiles[i])))
+			return 1;
+
+	return 0;
+
+}
+
+/*
+ * varcache_drop
+ *	Drop the entries of <state> that SET VARIABLE of <name> may change:
+ *	<name> itself, and the expressions that mention it. Setting a function
+ *	(Ex: CALLERID(all)) may change all of it, so for functions that is
+ *	everything that mentions the function's name.
+ */
+static void varcache_drop(struct cagi_varcache_state *state, const char
+							*name, const int nlen) {
+
+	int len;
+	const char *paren;
+	struct varcache_entry *entry, *newer;
+
+	paren = memchr(name, '(', nlen);
+	len = (paren != NULL ? paren - name : nlen);
+
+	for (entry = state->oldest; entry != NULL; entry = newer) {
+		newer = entry->newer;
+		if ((entry->kind == VARCACHE_PLAIN && paren == NULL) ?
+				(entry->nlen == nlen && memcmp(entry->data,
+							name, nlen) == 0) :
+				varcache_mentions(entry->data, name, len)) {
+			varcache_remove(state, entry);
+			state->stats.invalidations++;
+		}
+	}
+
+}
+
+/*
+ * cagi_varcache_new
+ *	Create the rules of a variable cache which keeps up to <size> variables
+ *	per session, with the default rules (see cagi-varcache.c).
+ * params (required)
+ *	<size>
+ * returns
+ *	Success: A new cache, which must be released with cagi_varcache_free()
+ *		once no session uses it anymore.
+ *	Failure: Quits the program with exit status 1.
+ */
+cagi_varcache * cagi_varcache_new(const int size) {
+
+	int i;
+	cagi_varcache *cache;
+
+	cache = safe_malloc(sizeof(struct cagi_varcache));
+	memset(cache, 0, sizeof(struct cagi_varcache));
+	cache->size = (size > 0 ? size : 1);
+
+	cache->flush[CAGI_VERB_exec] = 1;
+	cache->flush[CAGI_VERB_gosub] = 1;
+	cache->flush[CAGI_VERB_set_context] = 1;
+	cache->flush[CAGI_VERB_set_extension] = 1;
+	cache->flush[CAGI_VERB_set_priority] = 1;
+	cache->flush[CAGI_VERB_set_callerid] = 1;
+	cache->flush[CAGI_VERB_speech_recognize] = 1;
+	cache->flush[CAGI_VERB_OTHER] = 1;
+
+	for (i = 0; varcache_volatiles[i] != NULL; i++)
+		cagi_varcache_volatile(cache, varcache_volatiles[i]);
+	for (i = 0; varcache_writers[i] != NULL; i++)
+		cagi_varcache_volatile(cache, varcache_writers[i]);
+
+	return cache;
+
+}
+
+/*
+ * cagi_varcache_free
+ *	Release the rules <cache>.
+ * params (required)
+ *	<cache>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_varcache_free(cagi_varcache *cache) {
+
+	int i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < cache->nvolatiles; i++)
+		free(cache->volatiles[i]);
+	free(cache->volatiles);
+	free(cache);
+
+}
+
+/*
+ * cagi_varcache_flush_on
+ *	Tell whether sending a command of <verb> (see enum cagi_verb) drops
+ *	every variable the session has cached (<on> = 1) or not (<on> = 0).
+ * params (required)
+ *	<cache> <verb> <on>
+ * returns
+ *	Success: void.
+ *	Failure: void (<verb> is out of range).
+ * NOTE: The rules must be set before sessions use them. SET VARIABLE is
+ *	always handled on its own (see cagi-varcache.c), whatever this says.
+ */
+void cagi_varcache_flush_on(cagi_varcache *cache, const int verb, const int
+									on) {
+
+	if (verb < 0 || verb >= CAGI_VERB_COUNT)
+		return;
+
+	cache->flush[verb] = (on != 0);
+
+}
+
+/*
+ * cagi_varcache_volatile
+ *	Never cache a variable, or an expression, that mentions <name>. Ex:
+ *	"DIALSTATUS", or "CURL(" for a dialplan function.
+ * params (required)
+ *	<cache> <name>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ * NOTE: The rules must be set before sessions use them.
+ */
+void cagi_varcache_volatile(cagi_varcache *cache, const char *name) {
+
+	cache->volatiles = realloc(cache->volatiles, (cache->nvolatiles + 1) *
+							sizeof(char *));
+	if (cache->volatiles == NULL) {
+		log_error("ERROR! Cannot allocate memory. Exiting.");
+		exit(1);
+	}
+
+	cache->volatiles[cache->nvolatiles] = safe_malloc(strlen(name) + 1);
+	strcpy(cache->volatiles[cache->nvolatiles], name);
+	cache->nvolatiles++;
+
+}
+
+/*
+ * cagi_set_varcache
+ *	Cache the variables of <session>'s channel by the rules of <cache>, or
+ *	stop doing so if <cache> is NULL.
+ * params (required)
+ *	<session> <cache>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ * NOTE: Whatever the session had cached is dropped.
+ */
+void cagi_set_varcache(cagi_session *session, cagi_varcache *cache) {
+
+	varcache_free(session);
+
+	if (cache == NULL)
+		return;
+
+	session->varcache = safe_malloc(sizeof(struct cagi_varcache_state));
+	memset(session->varcache, 0, sizeof(struct cagi_varcache_state));
+	session->varcache->rules = cache;
+
+}
+
+/*
+ * cagi_varcache_clear
+ *	Drop every variable <session> has cached, after doing something the
+ *	cache can't see (Ex: another channel redirecting ours).
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_varcache_clear(cagi_session *session) {
+
+	struct cagi_varcache_state *state = session->varcache;
+
+	if (state == NULL)
+		return;
+
+	while (state->oldest != NULL) {
+		varcache_remove(state, state->oldest);
+		state->stats.invalidations++;
+	}
+
+}
+
+/*
+ * cagi_varcache_stats
+ *	Copy the counters of <session>'s variable cache into <stats>, which are
+ *	all 0 if it has none.
+ * params (required)
+ *	<session> <stats>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void cagi_varcache_stats(cagi_session *session, cagi_cache_stats *stats) {
+
+	if (session->varcache != NULL)
+		*stats = session->varcache->stats;
+	else
+		memset(stats, 0, sizeof(cagi_cache_stats));
+
+}
+
+/*
+ * varcache_free
+ *	Release the variables <session> has cached, if any.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void varcache_free(cagi_session *session) {
+
+	struct cagi_varcache_state *state = session->varcache;
+
+	if (state == NULL)
+		return;
+
+	while (state->oldest != NULL)
+		varcache_remove(state, state->oldest);
+	free(state);
+	session->varcache = NULL;
+
+}
+
+/*
+ * varcache_get
+ *	Look <name> (of <kind>, see struct varcache_entry) up in <session>'s
+ *	cache.
+ * params (required)
+ *	<session> <kind> <name> <value>
+ * returns
+ *	Success: 1, and <value> is set to a copy of the value in the session's
+ *		arena.
+ *	Failure: 0 if it isn't cached.
+ */
+int varcache_get(cagi_session *session, const int kind, const char *name,
+								char **value) {
+
+	int nlen = strlen(name);
+	struct cagi_varcache_state *state = session->varcache;
+	struct varcache_entry *entry;
+
+	entry = varcache_find(state, kind, name, nlen, varcache_hash(kind,
+								name, nlen));
+	if (entry == NULL) {
+		state->stats.misses++;
+		return 0;
+	}
+
+	state->stats.hits++;
+	*value = cagi_arena_alloc(session, entry->vlen + 1);
+	memcpy(*value, entry->data + nlen + 1, entry->vlen + 1);
+
+	return 1;
+
+}
+
+/*
+ * varcache_put
+ *	Cache <value> as the value of <name> (of <kind>, see struct
+ *	varcache_entry) in <session>'s cache, replacing what was there, unless
+ *	the rules say it is volatile.
+ * params (required)
+ *	<session> <kind> <name> <value>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ */
+void varcache_put(cagi_session *session, const int kind, const char *name,
+							const char *value) {
+
+	int nlen = strlen(name), vlen = strlen(value);
+	unsigned int hash = varcache_hash(kind, name, nlen);
+	struct cagi_varcache_state *state = session->varcache;
+	struct varcache_entry *entry, **bucket;
+
+	if ((entry = varcache_find(state, kind, name, nlen, hash)) != NULL)
+		varcache_remove(state, entry);
+
+	if (varcache_is_volatile(state->rules, name))
+		return;
+
+	while (state->stats.entries >= (unsigned long)state->rules->size) {
+		varcache_remove(state, state->oldest);
+		state->stats.evictions++;
+	}
+
+	entry = safe_malloc(sizeof(struct varcache_entry) + nlen + vlen + 2);
+	entry->hash = hash;
+	entry->kind = kind;
+	entry->nlen = nlen;
+	entry->vlen = vlen;
+	memcpy(entry->data, name, nlen + 1);
+	memcpy(entry->data + nlen + 1, value, vlen + 1);
+
+	bucket = &state->buckets[hash % VARCACHE_BUCKETS];
+	entry->hnext = *bucket;
+	*bucket = entry;
+	entry->older = state->newest;
+	entry->newer = NULL;
+	if (state->newest != NULL)
+		state->newest->newer = entry;
+	else
+		state->oldest = entry;
+	state->newest = entry;
+
+	state->stats.entries++;
+	state->stats.stores++;
+
+}
+
+/*
+ * varcache_sent
+ *	Drop what the command <command> (<len> bytes, of <verb>, see enum
+ *	cagi_verb) may change from <session>'s cache. Called for every command
+ *	the session sends, once it has a cache.
+ * params (required)
+ *	<session> <verb> <command> <len>
+ * returns
+ *	Success: void.
+ *	Failure: void.
+ */
+void varcache_sent(cagi_session *session, const int verb, const char
+						*command, const int len) {
+
+	int n = 0;
+	char name[256];
+	const char *p = command + sizeof("SET VARIABLE") - 1;
+	const char *end = command + len;
+	struct cagi_varcache_state *state = session->varcache;
+
+	if (state->oldest == NULL)
+		return;
+
+	if (verb != CAGI_VERB_set_variable) {
+		if (state->rules->flush[verb] || ((verb ==
+				CAGI_VERB_get_variable || verb ==
+				CAGI_VERB_get_full_variable) &&
+				varcache_writes(command, len)))
+			cagi_varcache_clear(session);
+		return;
+	}
+
+	/*
+	 * The name is the first argument after "SET VARIABLE", either bare or
+	 * in double quotes with backslash escapes (see cmd_quoted()). One we
+	 * can't make out drops everything.
+	 */
+	while (p < end && *p == ' ')
+		p++;
+	if (p < end && *p == '"') {
+		for (p++; p < end && *p != '"' && n < (int)sizeof(name); p++) {
+			if (*p == '\\' && p + 1 < end)
+				p++;
+			name[n++] = *p;
+		}
+		if (p == end || *p != '"')
+			n = 0;
+	} else {
+		for (; p < end && !isspace((unsigned char)*p) && n <
+						(int)sizeof(name); p++)
+			name[n++] = *p;
+	}
+
+	if (n == 0 || n == (int)sizeof(name)) {
+		cagi_varcache_clear(session);
+		return;
+	}
+
+	varcache_drop(state, name, n);
+
+}
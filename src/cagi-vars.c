@@ -0,0 +1,434 @@
+/*
+ * cagi-vars.c
+ *
+ * This source file contains the functions which read and look up the variables asterisk
+ * sends at the start of every AGI session. Sessions store them compactly (see struct
+ * cagi_vars), since a FastAGI server may hold thousands of calls at once. readvars() still
+ * hands out the original asterisk_vars struct.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+#include "wpbx-cagi-trace.h"
+
+/*
+ * var_names holds the name of every variable in enum cagi_var_id.
+ */
+static const char *var_names[CAGI_VAR_COUNT] = {
+	"agi_request", "agi_channel", "agi_language", "agi_type",
+	"agi_uniqueid", "agi_version", "agi_callerid", "agi_calleridname",
+	"agi_callingpres", "agi_callingani2", "agi_callington",
+	"agi_callingtns", "agi_dnid", "agi_rdnis", "agi_context",
+	"agi_extension", "agi_priority", "agi_enhanced", "agi_accountcode",
+	"agi_threadid", "agi_network", "agi_network_script"
+};
+
+/*
+ * var_slots is a perfect hash table of the names above, indexed by
+ * var_hash(). Empty slots are -1.
+ */
+static const signed char var_slots[32] = {
+	CAGI_VAR_CALLERID, CAGI_VAR_REQUEST, CAGI_VAR_PRIORITY,
+	CAGI_VAR_LANGUAGE, -1, CAGI_VAR_RDNIS, CAGI_VAR_THREADID, -1, -1,
+	CAGI_VAR_CHANNEL, -1, CAGI_VAR_NETWORK, CAGI_VAR_VERSION,
+	CAGI_VAR_UNIQUEID, CAGI_VAR_CONTEXT, -1, CAGI_VAR_NETWORK_SCRIPT,
+	CAGI_VAR_CALLERIDNAME, CAGI_VAR_CALLINGTON, -1, CAGI_VAR_ACCOUNTCODE,
+	CAGI_VAR_TYPE, CAGI_VAR_EXTENSION, CAGI_VAR_CALLINGTNS, -1, -1,
+	CAGI_VAR_CALLINGANI2, CAGI_VAR_CALLINGPRES, CAGI_VAR_ENHANCED,
+	CAGI_VAR_DNID, -1, -1
+};
+
+/*
+ * legacy_fields holds the offset of every variable in enum cagi_var_id in
+ * struct asterisk_vars, for readvars(). agi_network has no field there.
+ */
+static const int legacy_fields[CAGI_VAR_COUNT] = {
+	offsetof(asterisk_vars, agi_request),
+	offsetof(asterisk_vars, agi_channel),
+	offsetof(asterisk_vars, agi_language),
+	offsetof(asterisk_vars, agi_type),
+	offsetof(asterisk_vars, agi_uniqueid),
+	offsetof(asterisk_vars, agi_version),
+	offsetof(asterisk_vars, agi_callerid),
+	offsetof(asterisk_vars, agi_calleridname),
+	offsetof(asterisk_vars, agi_callingpres),
+	offsetof(asterisk_vars, agi_callingani2),
+	offsetof(asterisk_vars, agi_callington),
+	offsetof(asterisk_vars, agi_callingtns),
+	offsetof(asterisk_vars, agi_dnid),
+	offsetof(asterisk_vars, agi_rdnis),
+	offsetof(asterisk_vars, agi_context),
+	offsetof(asterisk_vars, agi_extension),
+	offsetof(asterisk_vars, agi_priority),
+	offsetof(asterisk_vars, agi_enhanced),
+	offsetof(asterisk_vars, agi_accountcode),
+	offsetof(asterisk_vars, agi_threadid),
+	-1,
+	offsetof(asterisk_vars, agi_network_script)
+};
+
+/*
+ * var_arg
+ *	Tell whether <name> (<len> bytes long) is one of the arguments,
+ *	agi_arg_1 -> agi_arg_127. The number must run to the end of the name
+ *	(agi_arg_1x is some other variable). It is read digit by digit and
+ *	stops growing as soon as it goes past _MAX_ARGS, so whatever asterisk
+ *	(or anybody else on the socket) sends can't make us allocate room for
+ *	it.
+ * params (required)
+ *	<name> <len>
+ * returns
+ *	Success: The argument's number, or 0 if <name> isn't an argument.
+ *	Failure: -1 if it is an argument past _MAX_ARGS.
+ */
+static int var_arg(const char *name, const int len) {
+
+	int i, number = 0;
+
+	if (len <= 8 || strncmp(name, "agi_arg_", 8) != 0)
+		return 0;
+
+	for (i = 8; i < len; i++) {
+		if (name[i] < '0' || name[i] > '9')
+			return 0;
+		if (number <= _MAX_ARGS)
+			number = number * 10 + (name[i] - '0');
+	}
+
+	return (number > _MAX_ARGS ? -1 : number);
+
+}
+
+/*
+ * var_lookup
+ *	Find the variable called <name> (<len> bytes long) in enum
+ *	cagi_var_id. The hash was picked so that every known name lands in a
+ *	slot of its own, so a single comparison settles it.
+ * params (required)
+ *	<name> <len>
+ * returns
+ *	Success: The variable's cagi_var_id.
+ *	Failure: -1 if it isn't one of the known variables.
+ */
+static int var_lookup(const char *name, const int len) {
+
+	int id;
+
+	if (len < 7)
+		return -1;
+
+	id = var_slots[((unsigned char)name[6] * 17 + (unsigned char)name[len-1]
+							+ len * 4) % 32];
+	if (id == -1 || strncmp(var_names[id], name, len) != 0 ||
+						var_names[id][len] != '\0')
+		return -1;
+
+	return id;
+
+}
+
+/*
+ * vars_add
+ *	Append <len> bytes of <str> to the string table of <vars>, and
+ *	null-terminate them.
+ * params (required)
+ *	<vars> <str> <len>
+ * returns
+ *	Success: The offset of the string in the table.
+ *	Failure: Quits the program with exit status 1.
+ */
+static int vars_add(cagi_vars *vars, const char *str, const int len) {
+
+	int offset = vars->len;
+
+	if (vars->len + len + 1 > vars->size) {
+		vars->size = (vars->size ? vars->size * 2 : 512);
+		while (vars->len + len + 1 > vars->size)
+			vars->size *= 2;
+		vars->strtab = realloc(vars->strtab, vars->size);
+		if (vars->strtab == NULL) {
+			log_error("ERROR! Cannot allocate memory. Exiting.");
+			exit(1);
+		}
+	}
+
+	memcpy(vars->strtab + offset, str, len);
+	vars->strtab[offset + len] = '\0';
+	vars->len += len + 1;
+
+	return offset;
+
+}
+
+/*
+ * vars_grow
+ *	Make sure that the array <*array> of <*size> integers has room for at
+ *	least <count> of them.
+ * params (required)
+ *	<array> <size> <count>
+ * returns
+ *	Success: void.
+ *	Failure: Quits the program with exit status 1.
+ */
+static void vars_grow(int **array, int *size, const int count) {
+
+	if (count <= *size)
+		return;
+
+	*size = (*size ? *size * 2 : 8);
+	while (count > *size)
+		*size *= 2;
+
+	*array = realloc(*array, *size * sizeof(int));
+	if (*array == NULL) {
+		log_error("ERROR! Cannot allocate memory. Exiting.");
+		exit(1);
+	}
+
+}
+
+/*
+ * readvars
+ *	Read in all asterisk pre-defined variables for the AGI script to use
+ *	and store them in a asterisk_vars struct.
+ * params
+ *	none
+ * returns
+ *	Success: Populated asterisk_vars structure (which needs to be free()'d
+ *		by the user.
+ *	Failure: Quits the program with exit status 1.
+ * NOTE: Values are cut at _BUFF_SIZE-1 bytes, arguments past _MAX_ARGS are
+ *	dropped, and empty values are a single space character, just like they
+ *	always have been. The session functions have none of these limits.
+ */
+asterisk_vars * readvars(void) {
+
+	int i;
+	const char *value;
+	asterisk_vars *vars;
+	cagi_session *session = cagi_default_session();
+
+	cagi_readvars(session);
+
+	vars = safe_malloc(sizeof(struct asterisk_vars));
+	memset(vars, 0, sizeof(struct asterisk_vars));
+
+	/*
+	 * Our strncpy() uses the len argument as _BUFF_SIZE-1 to guarantee
+	 * null-termination. =)
+	 */
+	for (i = 0; i < CAGI_VAR_COUNT; i++) {
+		if (legacy_fields[i] == -1 || (value = cagi_getvar_id(session,
+								i)) == NULL)
+			continue;
+		strncpy((char *)vars + legacy_fields[i], (*value ? value : " "),
+								_BUFF_SIZE-1);
+	}
+
+	/*
+	 * Asterisk names the arguments agi_arg_1 -> agi_arg_127. Since C
+	 * standards dictate NOT to start arrays with 1, they are stored as
+	 * agi_args[0] -> agi_args[126].
+	 */
+	for (i = 0; i < cagi_argc(session) && i < _MAX_ARGS; i++) {
+		if ((value = cagi_arg(session, i)) == NULL)
+			continue;
+		strncpy(vars->agi_args[i], (*value ? value : " "),
+								_BUFF_SIZE-1);
+	}
+
+	return vars;
+
+}
+
+/*
+ * cagi_readvars
+ *	Read in all asterisk pre-defined variables sent on <session> and store
+ *	them in the session.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: The session's variables, to be looked up with cagi_getvar()
+ *		and friends. They belong to the session.
+ *	Failure: Ends the session (see session_fatal()).
+ * NOTE: Variables are matched by name, so it doesn't matter which ones
+ *	asterisk sends or in what order. Anything read by a previous call is
+ *	replaced. Arguments past _MAX_ARGS are dropped.
+ */
+const cagi_vars * cagi_readvars(cagi_session *session) {
+
+	int i, len, id, n;
+	char *line, *value;
+	cagi_vars *vars = &session->vars;
+
+	vars->len = 0;
+	vars->argc = 0;
+	vars->nextra = 0;
+	for (i = 0; i < CAGI_VAR_COUNT; i++)
+		vars->known[i] = -1;
+
+	/*
+	 * Keep reading variables from the session that asterisk is passing us
+	 * until we have completely retrieved all values. Each variable is of
+	 * the form:
+	 *      variablename: value\n
+	 *
+	 * Asterisk signals that it is finished sending variables by sending a
+	 * trailing \n character, which is an empty line to us.
+	 */
+	for (;;) {
+
+		if ((line = session_readline(session, &len)) == NULL)
+			session_fatal(session, "ERROR! Connection closed while "
+							"reading variables.");
+		if (len == 0)
+			break;
+
+		value = memchr(line, ':', len);
+		if (value == NULL)
+			session_fatal(session, "ERROR! Problem reading "
+								"variables.");
+
+		/*
+		 * The name runs up to the colon, and the value starts after
+		 * the space that follows it. Values may be empty.
+		 */
+		n = value - line;
+		value++;
+		if (value < line + len && *value == ' ')
+			value++;
+		len -= value - line;
+
+		/*
+		 * User-passed arguments are of the form agi_arg_1 ->
+		 * agi_arg_127, and are kept in order of their number. Asterisk
+		 * may skip some, whose slots stay empty. Any past _MAX_ARGS
+		 * are dropped.
+		 */
+		if ((id = var_arg(line, n)) == -1)
+			continue;
+		else if (id > 0) {
+			vars_grow(&vars->args, &vars->argsize, id);
+			for (i = vars->argc; i < id; i++)
+				vars->args[i] = -1;
+			if (id > vars->argc)
+				vars->argc = id;
+			vars->args[id-1] = vars_add(vars, value, len);
+		} else if ((id = var_lookup(line, n)) != -1)
+			vars->known[id] = vars_add(vars, value, len);
+		else {
+			vars_grow(&vars->extra, &vars->extrasize,
+						(vars->nextra + 1) * 2);
+			vars->extra[vars->nextra * 2] = vars_add(vars, line, n);
+			vars->extra[vars->nextra * 2 + 1] = vars_add(vars,
+								value, len);
+			vars->nextra++;
+		}
+	}
+
+	TRACE_SESSION_START(session);
+
+	/*
+	 * The session is set up, which is when prefetch profiles run (see
+	 * cagi-prefetch.c).
+	 */
+	prefetch_start(session);
+
+	return vars;
+
+}
+
+/*
+ * cagi_getvar
+ *	Look up the variable called <name> that asterisk sent on <session>.
+ * params (required)
+ *	<session> <name>
+ * returns
+ *	Success: The variable's value. It belongs to the session.
+ *	Failure: NULL if asterisk didn't send it.
+ * NOTE: Any name works, including the agi_arg_* ones and variables that
+ *	cAGI doesn't know about.
+ */
+const char * cagi_getvar(cagi_session *session, const char *name) {
+
+	int i, id, len = strlen(name);
+	cagi_vars *vars = &session->vars;
+
+	if ((id = var_arg(name, len)) == -1)
+		return NULL;
+	else if (id > 0)
+		return cagi_arg(session, id-1);
+	else if ((id = var_lookup(name, len)) != -1)
+		return cagi_getvar_id(session, id);
+
+	for (i = 0; i < vars->nextra; i++)
+		if (strcmp(vars->strtab + vars->extra[i * 2], name) == 0)
+			return vars->strtab + vars->extra[i * 2 + 1];
+
+	return NULL;
+
+}
+
+/*
+ * cagi_getvar_id
+ *	Look up the variable <id> (see enum cagi_var_id) that asterisk sent on
+ *	<session>, without comparing any strings.
+ * params (required)
+ *	<session> <id>
+ * returns
+ *	Success: The variable's value. It belongs to the session.
+ *	Failure: NULL if asterisk didn't send it.
+ */
+const char * cagi_getvar_id(cagi_session *session, const cagi_var_id id) {
+
+	if (id < 0 || id >= CAGI_VAR_COUNT || session->vars.strtab == NULL ||
+						session->vars.known[id] == -1)
+		return NULL;
+
+	return session->vars.strtab + session->vars.known[id];
+
+}
+
+/*
+ * cagi_argc
+ *	Return the number of arguments passed to the AGI script on <session>.
+ * params (required)
+ *	<session>
+ * returns
+ *	Success: The highest agi_arg_* number asterisk sent, 0 if none.
+ *	Failure: Never fails. :)
+ */
+int cagi_argc(cagi_session *session) {
+
+	return session->vars.argc;
+
+}
+
+/*
+ * cagi_arg
+ *	Look up argument <n> passed to the AGI script on <session>. Like
+ *	agi_args[] in struct asterisk_vars, arguments are counted from 0, so
+ *	cagi_arg(session, 0) is agi_arg_1.
+ * params (required)
+ *	<session> <n>
+ * returns
+ *	Success: The argument's value. It belongs to the session.
+ *	Failure: NULL if asterisk didn't send it.
+ */
+const char * cagi_arg(cagi_session *session, const int n) {
+
+	if (n < 0 || n >= session->vars.argc || session->vars.args[n] == -1)
+		return NULL;
+
+	return session->vars.strtab + session->vars.args[n];
+
+}
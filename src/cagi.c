@@ -6,6 +6,23 @@
  * header file, give developers a complete AGI toolset to develop their own Asterisk AGI
  * programs.
  *
+ * Every command takes the session it runs on as its first argument. The unprefixed functions
+ * at the bottom of this file are the original API, and run on the default session.
+ *
+ * Commands which return several values (exec(), stream_file(), ...) fill in a cagi_response
+ * when called with a session. Its code, result_text and data fields are what the comments
+ * below call data[0], data[1] and data[2], and the function returns the numeric result. The
+ * unprefixed functions still return those values as an array which must be freed.
+ *
+ * The commands themselves are sent by the table driven cagi_cmd_<name>() functions (see
+ * cagi-commands.def). The functions here add the checks and return values they have always
+ * had on top of them.
+ *
+ * Strings returned by the session functions come from the session's arena (see
+ * cagi-arena.c) and must NOT be freed, they are valid until the arena is reset or freed.
+ * The unprefixed functions return copies which must be freed, like they always have, and
+ * give back whatever they took from the arena before returning.
+ *
  * NOTE: This has been written for Asterisk 1.6, and will not work with older versions of
  * Asterisk.
  *
@@ -32,23 +49,22 @@
  *	Success: 0
  *	Failure: -1
  */
-int answer(void) {
+int cagi_answer(cagi_session *session) {
 
 	int status;
-	char **data;
+	cagi_response response;
 
 	/*
 	 * Asterisk will return:
 	 * Success: 200 result=0
 	 * Failure: 200 result=-1
 	 */
-	data = evaluate("ANSWER\n");
-	if (strncmp(data[1], "-1", _BUFF_SIZE) == 0)
+	cagi_cmd_answer(session, &response);
+	if (response.result == -1)
 		status = -1;
 	else
 		status = 0;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -72,43 +88,22 @@ int answer(void) {
  *		7 - Line is busy.
  *	Failure: -1
  */
-int channel_status(const char *channel_name) {
+int cagi_channel_status(cagi_session *session, const char *channel_name) {
 
 	int status;
-	char **data, *cmd;
-
-	if (strcmp(channel_name, "") == 0)
-		data = evaluate("CHANNEL STATUS\n");
-	else {
-		cmd = format_str(3, "CHANNEL STATUS ", channel_name, "\n");
-		data = evaluate(cmd);
-		free(cmd);
-	}
+	cagi_response response;
+
+	cagi_cmd_channel_status(session, channel_name, &response);
 
 	/*
-	 * Set the correct return status of the command. If we get to the
-	 * bottom, it means we failed.
+	 * The result is the status itself, anything outside of the known
+	 * range means we failed.
 	 */
-	if (strcmp(data[1], "0") == 0)
-		status = 0;
-	else if (strcmp(data[1], "1") == 0)
-		status = 1;
-	else if (strcmp(data[1], "2") == 0)
-		status = 2;
-	else if (strcmp(data[1], "3") == 0)
-		status = 3;
-	else if (strcmp(data[1], "4") == 0)
-		status = 4;
-	else if (strcmp(data[1], "5") == 0)
-		status = 5;
-	else if (strcmp(data[1], "6") == 0)
-		status = 6;
-	else if (strcmp(data[1], "7") == 0)
-		status = 7;
+	if (response.result >= 0 && response.result <= 7)
+		status = response.result;
 	else
 		status = -1;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -124,37 +119,26 @@ int channel_status(const char *channel_name) {
  *	Success: 1
  *	Failure: 0
  */
-int database_del(const char *family, const char *key) {
+int cagi_database_del(cagi_session *session, const char *family,
+	const char *key) {
 
 	int status;
-	char **data, *cmd;
+	cagi_response response;
 
-	/*
-	 * If the user didn't specify a value for <family> or <key>, notify
-	 * them and fail gracefully.
-	 */
-	if (strcmp(family, "") == 0) {
-		print_debug("ERROR! <family> must not be empty.");
-		return 0;
-	} else if (strcmp(key, "") == 0) {
-		print_debug("ERROR! <key> must not be empty.");
-		return 0;
-	}
+	cagi_cmd_database_del(session, family, key, &response);
 
-	cmd = format_str(5, "DATABASE DEL ", family, " ", key, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	if (session->dbcache != NULL)
+		dbcache_invalidate(session, family, key, NULL);
 
 	/*
 	 * If the result of the command is 1, it means that we successfully
 	 * removed the key from the database. Otherwise, we failed.
 	 */
-	if (strcmp(data[1], "1") == 0)
+	if (response.result == 1)
 		status = 1;
 	else
 		status = 0;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -182,43 +166,30 @@ int database_del(const char *family, const char *key) {
  *
  *	-Randall (6/16/09)
  */
-int database_deltree(const char *family, const char *keytree) {
+int cagi_database_deltree(cagi_session *session, const char *family,
+	const char *keytree) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If <family> is not specified by the user, notify them and fail
-	 * gracefully.
-	 */
-	if (strcmp(family, "") == 0) {
-		print_debug("ERROR! <family> must not be empty.");
-		return 0;
-	}
+	cagi_response response;
 
 	/*
 	 * If the keytree value is not specified, then remove the entire
 	 * family, otherwise, remove only the specific keytree.
 	 */
-	if (strcmp(keytree, "") == 0)
-		cmd = format_str(3, "DATABASE DELTREE ", family, "\n");
-	else
-		cmd = format_str(5, "DATABASE DELTREE ", family, " ", keytree,
-						"\n");
+	cagi_cmd_database_deltree(session, family, keytree, &response);
 
-	data = evaluate(cmd);
-	free(cmd);
+	if (session->dbcache != NULL)
+		dbcache_invalidate(session, family, NULL, keytree);
 
 	/*
 	 * If asterisk deleted the family/keytree successfully, we return 1,
 	 * otherwise we failed.
 	 */
-	if (strcmp(data[1], "1") == 0)
+	if (response.result == 1)
 		status = 1;
 	else
 		status = 0;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -233,49 +204,44 @@ int database_deltree(const char *family, const char *keytree) {
  * returns
  *	Success: Returns a string containing the value of the lookup.
  *	Failure: Returns an empty string.
- * NOTE: This array MUST BE FREED BY THE USER! Also--if this function fails
- *	because of user input, we don't even bother sending the command to
- *	asterisk, we just return the failed array. This will decrease execution
- *	time and increase stability :)
+ * NOTE: The string returned comes from <session>'s arena, so it must NOT be
+ *	freed. It is valid until the arena is reset or freed (see
+ *	cagi_arena_reset()). Also--if this function fails because of user
+ *	input, we don't even bother sending the command to asterisk, we just
+ *	return an empty string. This will decrease execution time and
+ *	increase stability :)
  */
-char * database_get(const char *family, const char *key) {
+char * cagi_database_get(cagi_session *session, const char *family,
+	const char *key) {
 
-	char **data, *cmd, *value;
+	cagi_response response;
+	char *value;
 
 	/*
-	 * If either the <family> or <key> paramaters are empty, fail
-	 * gracefully by returning a 'dumb' failed array. As mentioned above,
-	 * the array MUST BE FREED BY THE USER!
+	 * A cached lookup (see cagi-dbcache.c) never reaches asterisk.
 	 */
-	if (strcmp(family, "") == 0) {
-		print_debug("ERROR! <family> must not be empty.");
-		value = safe_malloc(1);
-		*value = '\0';
+	if (session->dbcache != NULL && dbcache_get(session, family, key,
+								&value))
 		return value;
-	} else if (strcmp(key, "") == 0) {
-		print_debug("ERROR! <key> must not be empty.");
-		value = safe_malloc(1);
-		*value = '\0';
-		return value;
-	}
 
-	cmd = format_str(5, "DATABASE GET ", family, " ", key, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_database_get(session, family, key, &response);
 
 	/*
 	 * If we were able to get the value from the key, then return it as a
-	 * string. Otherwise, we failed, so return an empty string.
+	 * string. Otherwise, we failed, so return an empty string. A key that
+	 * doesn't exist (result 0) is cached as such, errors aren't cached.
 	 */
-	if (strcmp(data[1], "1") == 0) {
-		value = safe_malloc(strlen(data[2]) + 1);
-		strcpy(value, data[2]);
+	if (response.result == 1) {
+		value = cagi_arena_viewdup(session, response.data);
 	} else {
-		value = safe_malloc(1);
-		*value = '\0';
+		value = cagi_arena_strdup(session, "");
 	}
 
-	free_2d_array(data);
+	if (session->dbcache != NULL && response.code == 200 &&
+				response.result >= 0 && response.result <= 1)
+		dbcache_put(session, family, key, (response.result == 1 ?
+								value : NULL));
+
 	return value;
 
 }
@@ -292,42 +258,38 @@ char * database_get(const char *family, const char *key) {
  *	Success: 1
  *	Failure: 0
  */
-int database_put(const char *family, const char *key, const char *value) {
+int cagi_database_put(cagi_session *session, const char *family,
+	const char *key, const char *value) {
 
 	int status;
-	char **data, *cmd;
+	char *cached;
+	cagi_response response;
+
+	cagi_cmd_database_put(session, family, key, value, &response);
 
 	/*
-	 * If either the <family> or <key> or <value> paramaters are empty,
-	 * fail gracefully by returning a 'dumb' failed array. As mentioned
-	 * above, the array MUST BE FREED BY THE USER!
+	 * What we just wrote is what the next lookup would get, which
+	 * cagi_database_get() returns in parentheses, as asterisk sends it. If
+	 * the write failed, who knows what is in the database now.
 	 */
-	if (strcmp(family, "") == 0) {
-		print_debug("ERROR! <family> must not be empty.");
-		return 0;
-	} else if (strcmp(key, "") == 0) {
-		print_debug("ERROR! <key> must not be empty.");
-		return 0;
-	} else if (strcmp(value, "") == 0) {
-		print_debug("ERROR! <value> must not be empty.");
-		return 0;
+	if (session->dbcache != NULL) {
+		if (response.result == 1) {
+			cached = cagi_arena_alloc(session, strlen(value) + 3);
+			sprintf(cached, "(%s)", value);
+			dbcache_put(session, family, key, cached);
+		} else
+			dbcache_invalidate(session, family, key, NULL);
 	}
 
-	cmd = format_str(7, "DATABASE PUT ", family, " ", key, " ", value,
-									"\n");
-	data = evaluate(cmd);
-	free(cmd);
-
 	/*
 	 * If asterisk put the new values into the astdb, then the result will
 	 * be 1, so we can return it. Otherwise, we failed, so return 0.
 	 */
-	if (strcmp(data[1], "1") == 0)
+	if (response.result == 1)
 		status = 1;
 	else
 		status = 0;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -348,84 +310,20 @@ int database_put(const char *family, const char *key, const char *value) {
  *              char *data[0] = "200"
  *              char *data[1] = "-2"
  *              char *data[2] = ""
- *	NOTE: The array returned MUST BE FREED BY THE USER! Also--if this
- *		function fails because of user input, we don't even bother
- *		sending the command to asterisk, we just return the failed
- *		array. This will decrease execution time and increase stability
- *		:)
+ *	NOTE: <response> points into <session>'s read buffer, and is valid
+ *		until the next command is sent. Also--if this function fails
+ *		because of user input, we don't even bother sending the
+ *		command to asterisk, we just fill in the failed values. This
+ *		will decrease execution time and increase stability :)
  */
-char ** exec(const char *application, const char *options) {
+int cagi_exec(cagi_session *session, const char *application,
+	const char *options, cagi_response *response) {
 
-	int escopt = 0, i, j;
-	char **data, *cmd, *buff;
-
-	/*
-	 * If the <application> paramater is empty, fail gracefully by
-	 * returning a 'dumb' failed array. Otherwise, execute the command. As
-	 * mentioned above, the array MUST BE FREED BY THE USER!
-	 */
-	if (strcmp(application, "") == 0) {
-		print_debug("ERROR! <application> must not be empty.");
-		data = create_dummy("200", "-2", "");
-		return data;
-	} else if (strcmp(options, "") == 0)
-		cmd = format_str(3, "EXEC ", application, "\n");
-	else {
-		/*
-		 * If the options string contains any spaces, we need to escape
-		 * them since asterisk requires this.
-		 */
-		for (i = 0; i < strlen(options); i++)
-			if (options[i] == ' ')
-				escopt += 1;
-
-		/*
-		 * If the user string contains spaces, we now know how large
-		 * the string needs to be in order to fix it. The extra byte is
-		 * for null-termination.
-		 */
-		if (escopt) {
-			FILE*f=fopen("/tmp/shit", "w");
-			fprintf(f, "%d is the size of buff", 
-				(int)strlen(options) + escopt + 1);
-			fclose(f);
-
-			buff = safe_malloc(strlen(options) + escopt + 1);
-
-			/*
-			 * i will keep track of the original options the user
-			 * entered. j will keep track of our position in the
-			 * buff (fixed copy).
-			 */
-			for (i = 0, j = 0; i < strlen(options); i++, j++) {
-				if (options[i] == ' ') {
-					buff[j++] = '\\';
-					buff[j] = ' ';
-				} else	
-					/*
-					 * If the current options letter had no
-					 * spaces, just copy it over normally.
-					 */
-					buff[j] = options[i];
-			}
-			buff[j] = '\0';
-
-			cmd = format_str(5, "EXEC ", application, " ", buff,
-									"\n");
-			free(buff);
-		} else
-			/*
-			 * If we get here, it means that the option string had
-			 * no spaces in it, so treat it normally.
-			 */
-			cmd = format_str(5, "EXEC ", application, " ", options,
-									"\n");
-	}
+	int status;
 
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_exec(session, application, options, response);
 
-	return data;
+	return status;
 
 }
 
@@ -455,47 +353,20 @@ char ** exec(const char *application, const char *options) {
  *			char *data[1] = ""
  *			char *data[2] = <string with timeout OR empty string
  *				"">
- *	NOTE: The array returned MUST BE FREED BY THE USER! Also--if this
- *		function fails because of user input, we don't even bother
- *		sending the command to asterisk, we just return the failed
- *		array. This will decrease execution time and increase stability
- *		:)
+ *	NOTE: <response> points into <session>'s read buffer, and is valid
+ *		until the next command is sent. Also--if this function fails
+ *		because of user input, we don't even bother sending the
+ *		command to asterisk, we just fill in the failed values. This
+ *		will decrease execution time and increase stability :)
  */
-char ** get_data(const char *file, const char *timeout, const char *maxdigits){
-
-	int given = 0;
-	char **data, *cmd;
-
-	/*
-	 * If the <file> paramater is empty, fail gracefully by
-	 * returning a 'dumb' failed array. Otherwise, execute the command. As
-	 * mentioned above, the array MUST BE FREED BY THE USER!
-	 */
-	if (strcmp(file, "") == 0) {
-		print_debug("ERROR! <file> must not be empty.");
-		data = create_dummy("200", "-1", "");
-		return data;
-	}
-
-	if (strcmp(timeout, "") == 0)
-		given = 1;
+int cagi_get_data(cagi_session *session, const char *file,
+	const char *timeout, const char *maxdigits, cagi_response *response) {
 
-	/*
-	 * If <timeout> or <maxdigits> is specified, then use them.
-	 */
-	if (strcmp(maxdigits, "") == 0) {
-		cmd = format_str(5, "GET DATA ", file, " ",
-			(given ? timeout : _DEFAULT_TIMEOUT), "\n");
-	} else {
-		cmd = format_str(7, "GET DATA ", file, " ",
-			(given ? timeout : _DEFAULT_TIMEOUT), " ", maxdigits,
-									"\n");
-	}
+	int status;
 
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_get_data(session, file, timeout, maxdigits, response);
 
-	return data;
+	return status;
 
 }
 
@@ -512,11 +383,12 @@ char ** get_data(const char *file, const char *timeout, const char *maxdigits){
  * returns
  *	Success: Returns the variable value as a string.
  *	Failure: Returns an empty string.
- *	NOTE: The array returned MUST BE FREED BY THE USER! Also--if this
- *		function fails because of user input, we don't even bother
- *		sending the command to asterisk, we just return the failed
- *		array. This will decrease execution time and increase stability
- *		:)
+ *	NOTE: The string returned comes from <session>'s arena, so it must
+ *		NOT be freed. It is valid until the arena is reset or freed
+ *		(see cagi_arena_reset()). Also--if this function fails because
+ *		of user input, we don't even bother sending the command to
+ *		asterisk, we just return an empty string. This will decrease
+ *		execution time and increase stability :)
  *
  *		After much testing I discovered that this command will only
  *		fail if the channel specified does not exist. So be careful
@@ -524,49 +396,42 @@ char ** get_data(const char *file, const char *timeout, const char *maxdigits){
  *		exists before using it, otherwise you won't be able to tell
  *		whether or not you actually got its value reliably. -Randall
  */
-char * get_full_variable(const char *variablename, const char *channel) {
+char * cagi_get_full_variable(cagi_session *session,
+	const char *variablename, const char *channel) {
 
-	char **data, *cmd, *value;
+	int own;
+	cagi_response response;
+	char *value;
 
+	
 	/*
-	 * If the <variablename> paramater is empty, fail gracefully by
-	 * returning a 'dumb' failed array. Otherwise, execute the command. As
-	 * mentioned above, the array MUST BE FREED BY THE USER!
+	 * Only our own channel's variables are cached (see cagi-varcache.c).
 	 */
-	if (strcmp(variablename, "") == 0) {
-		print_debug("ERROR! <variablename> cannot be empty.");
-		value = safe_malloc(1);
-		*value = '\0';
+	own = (channel == NULL || strcmp(channel, "") == 0);
+	if (session->varcache != NULL && own && varcache_get(session,
+					VARCACHE_FULL, variablename, &value))
 		return value;
-	}
-	
+
 	/*
 	 * If the channel is specified by the user, then use it. Otherwise,
 	 * don't.
 	 */
-	if (strcmp(channel, "") == 0) {
-		cmd = format_str(3, "GET FULL VARIABLE ", variablename, "\n");
-	} else {
-		cmd = format_str(5, "GET FULL VARIABLE ", variablename, " ",
-								channel, "\n");
-	}
-
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_get_full_variable(session, variablename, channel, &response);
 
 	/*
 	 * If the result is 1, then we were able to get the variable, so return
 	 * it. Otherwise, return an empty string.
 	 */
-	if (strcmp(data[1], "1") == 0) {
-		value = safe_malloc(strlen(data[2]) + 1);
-		strcpy(value, data[2]);
+	if (response.result == 1) {
+		value = cagi_arena_viewdup(session, response.data);
 	} else {
-		value = safe_malloc(1);
-		*value = '\0';
+		value = cagi_arena_strdup(session, "");
 	}
 
-	free_2d_array(data);
+	if (session->varcache != NULL && own && response.code == 200 &&
+							response.result >= 0)
+		varcache_put(session, VARCACHE_FULL, variablename, value);
+
 	return value;
 
 }
@@ -601,11 +466,11 @@ char * get_full_variable(const char *variablename, const char *channel) {
  *			char *data[1] = "0"
  *			char *data[2] = <string with endpos=0 or empty string
  *				"">
- *	NOTE: The array returned MUST BE FREED BY THE USER! Also--if this
- *		function fails because of user input, we don't even bother
- *		sending the command to asterisk, we just return the failed
- *		array. This will decrease execution time and increase stability
- *		:)
+ *	NOTE: <response> points into <session>'s read buffer, and is valid
+ *		until the next command is sent. Also--if this function fails
+ *		because of user input, we don't even bother sending the
+ *		command to asterisk, we just fill in the failed values. This
+ *		will decrease execution time and increase stability :)
  *	ALSO--it appears that when the user does hit one of the escape digits,
  *	when asterisk returns <digit> in the result field (*data[1]), it is in
  *	decimal ASCII value form. EG: If your escape digit is 1, and the user
@@ -613,37 +478,16 @@ char * get_full_variable(const char *variablename, const char *channel) {
  *	have the value 49 (which is the decimal value of the ASCII digit '1').
  *	-Randall
  */
-char ** get_option(const char *file, const char *escapedigits, const char
-								*timeout) {
-
-	char **data, *cmd;
-
-	/*
-	 * If <file> or <escapedigits> is empty, fail gracefully by returning a
-	 * 'dumb' failed array. Otherwise, execute the command. As mentioned
-	 * above, the array MUST BE FREED BY THE USER!
-	 */
-	if (strcmp(file, "") == 0) {
-		print_debug("ERROR! <file> must not be empty.");
-		data = create_dummy("200", "-1", "endpos=0");
-		return data;
-	} else if (strcmp(escapedigits, "") == 0) {
-		print_debug("ERROR! <escapedigits> must not be empty.");
-		data = create_dummy("200", "-1", "endpos=0");
-		return data;
-	}
+int cagi_get_option(cagi_session *session, const char *file,
+	const char *escapedigits, const char *timeout,
+	cagi_response *response) {
 
-	if (strcmp(timeout, "") == 0)
-		cmd = format_str(5, "GET OPTION ", file, " ", escapedigits,
-									"\n");
-	else
-		cmd = format_str(7, "GET OPTION ", file, " ", escapedigits,
-							" ", timeout, "\n");
+	int status;
 
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_get_option(session, file, escapedigits, timeout,
+		response);
 
-	return data;
+	return status;
 
 }
 
@@ -658,45 +502,42 @@ char ** get_option(const char *file, const char *escapedigits, const char
  * returns
  *	Success: Returns the value of the variable as a string.
  *	Failure: Returns an empty string.
- *	NOTE: The array returned MUST BE FREED BY THE USER! Also--if this
- *		function fails because of user input, we don't even bother
- *		sending the command to asterisk, we just return the failed
- *		array. This will decrease execution time and increase stability
- *		:)
+ *	NOTE: The string returned comes from <session>'s arena, so it must
+ *		NOT be freed. It is valid until the arena is reset or freed
+ *		(see cagi_arena_reset()). Also--if this function fails because
+ *		of user input, we don't even bother sending the command to
+ *		asterisk, we just return an empty string. This will decrease
+ *		execution time and increase stability :)
  */
-char * get_variable(const char *variablename) {
+char * cagi_get_variable(cagi_session *session, const char *variablename) {
 
-	char **data, *cmd, *value;
+	cagi_response response;
+	char *value;
 
 	/*
-	 * If the <variablename> paramater is empty, fail gracefully by
-	 * returning a 'dumb' failed array. Otherwise, execute the command. As
-	 * mentioned above, the array MUST BE FREED BY THE USER!
+	 * A cached variable (see cagi-varcache.c) never reaches asterisk.
 	 */
-	if (strcmp(variablename, "") == 0) {
-		print_debug("ERROR! <variablename> cannot be empty.");
-		value = safe_malloc(1);
-		*value = '\0';
+	if (session->varcache != NULL && varcache_get(session, VARCACHE_PLAIN,
+							variablename, &value))
 		return value;
-	}
 
-	cmd = format_str(3, "GET VARIABLE ", variablename, "\n");
-        data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_get_variable(session, variablename, &response);
 
 	/*
 	 * If we were able to get the variable's value, then return it.
-	 * Otherwise, we failed, so return the empty string.
+	 * Otherwise, we failed, so return the empty string. A variable that
+	 * isn't set (result 0) is cached as such.
 	 */
-	if (strcmp(data[1], "1") == 0) {
-		value = safe_malloc(strlen(data[2]) + 1);
-		strcpy(value, data[2]);
+	if (response.result == 1) {
+		value = cagi_arena_viewdup(session, response.data);
 	} else {
-		value = safe_malloc(1);
-		*value = '\0';
+		value = cagi_arena_strdup(session, "");
 	}
 
-	free_2d_array(data);
+	if (session->varcache != NULL && response.code == 200 &&
+							response.result >= 0)
+		varcache_put(session, VARCACHE_PLAIN, variablename, value);
+
 	return value;
 
 }
@@ -717,29 +558,22 @@ char * get_variable(const char *variablename) {
  *	also prevent any other commands from executing. Haven't found a
  *	workaround for this yet. Not sure what is causing this. -Randall
  */
-int hangup(const char *channel_name) {
+int cagi_hangup(cagi_session *session, const char *channel_name) {
 
 	int status;
-	char **data, *cmd;
+	cagi_response response;
 
-	if (strcmp(channel_name, "") == 0) {
-		data = evaluate("HANGUP\n");
-	} else {
-		cmd = format_str(3, "HANGUP ", channel_name, "\n");
-		data = evaluate(cmd);
-		free(cmd);
-	}
+	cagi_cmd_hangup(session, channel_name, &response);
 
 	/*
 	 * Set the correct return status of the command. If the result is 1, it
 	 * means we succeeded, otherwise, we failed.
 	 */
-	if (strcmp(data[1], "1") == 0)
+	if (response.result == 1)
 		status = 1;
 	else
 		status = -1;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -755,19 +589,12 @@ int hangup(const char *channel_name) {
  *	Success: 0
  *	Failure: never fails :)
  */
-int noop(const char *str) {
+int cagi_noop(cagi_session *session, const char *str) {
 
-	char **data, *cmd;
+	cagi_response response;
 
-	if (strcmp(str, "") == 0) {
-		data = evaluate("NOOP\n");
-	} else {
-		cmd = format_str(3, "NOOP ", str, "\n");
-		data = evaluate(cmd);
-		free(cmd);
-	}
+	cagi_cmd_noop(session, str, &response);
 
-	free_2d_array(data);
 	return 0;
 
 }
@@ -803,33 +630,18 @@ int noop(const char *str) {
  *		doesn't execute properly. I'm going to continue to investigate
  *		this, but I'm about 75% sure this is an asterisk bug. -Randall
  */
-char ** receive_char(const char *timeout) {
+int cagi_receive_char(cagi_session *session, const char *timeout,
+	cagi_response *response) {
 
-	char **data, *cmd;
-	FILE *f = fopen("/tmp/wtf", "w");
+	int status;
 
 	/*
 	 * If <timeout> isn't specified, use the default timeout (defined in
 	 * the header file).
 	 */
-	if (strcmp(timeout, "") == 0)
-		cmd = format_str(3, "RECEIVE CHAR ", _DEFAULT_TIMEOUT, "\n");
-	else
-		cmd = format_str(3, "RECEIVE CHAR ", timeout, "\n");
-
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_receive_char(session, timeout, response);
 
-	fprintf(f, "---\n");
-	fprintf(f, "data[0]=%s\n", data[0]);
-	fprintf(f, "data[1]=%s\n", data[1]);
-	fprintf(f, "data[2]=%s\n", data[2]);
-	fprintf(f, "---\n");
-	//fgets(data[0], 500, stdin);
-	//fprintf(f, "xxx=%s", data[0]);
-	fclose(f);
-
-	return data;
+	return status;
 
 }
 
@@ -850,35 +662,27 @@ char ** receive_char(const char *timeout) {
  *		infinite amount of time. It will instantly end. This is the new
  *		(undocumented) asterisk behavior. -Randall
  */
-char * receive_text(const char *timeout) {
+char * cagi_receive_text(cagi_session *session, const char *timeout) {
 
-	char **data, *cmd, *value;
+	cagi_response response;
+	char *value;
 
 	/*
 	 * If <timeout> isn't specified, use the default timeout (defined in
 	 * the header file).
 	 */
-	if (strcmp(timeout, "") == 0)
-		cmd = format_str(3, "RECEIVE TEXT ", _DEFAULT_TIMEOUT, "\n");
-	else
-		cmd = format_str(3, "RECEIVE TEXT ", timeout, "\n");
-
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_receive_text(session, timeout, &response);
 
 	/*
 	 * If the result field contains text, then return it. Otherwise, we
 	 * failed, so return the empty string.
 	 */
-	if (strcmp(data[1], "-1") != 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result != -1) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(1);
-		*value = '\0';
+		value = cagi_arena_strdup(session, "");
 	}
 
-	free_2d_array(data);
 	return value;
 
 }
@@ -927,55 +731,17 @@ char * receive_text(const char *timeout) {
  *			char *data[1] = "<error>"
  *			char *data[2] = "(randomerror) endpos=<offset>"
  */
-char ** record_file(const char *file, const char *format, const char
-	*escape_digits, const char *timeout, const char *offset_samples, const
-					char *beep, const char *silence) {
+int cagi_record_file(cagi_session *session, const char *file,
+	const char *format, const char *escape_digits, const char *timeout,
+	const char *offset_samples, const char *beep, const char *silence,
+	cagi_response *response) {
 
-	char **data, *cmd;
-
-	/*
-	 * If any of the required params are not given, exit quickly by failing
-	 * without passing to asterisk. This greatly reduces execution time.
-	 */
-	if (strcmp(file, "") == 0) {
-		print_debug("ERROR! <file> must not be empty.");
-		data = create_dummy("200", "-1", "(randomerror) endpos=0");
-		return data;
-	} else if (strcmp(format, "") == 0) {
-		print_debug("ERROR! <format> must not be empty.");
-		data = create_dummy("200", "-1", "(randomerror) endpos=0");
-		return data;
-	} else if (strcmp(escape_digits, "") == 0) {
-		print_debug("ERROR! <escape_digits> must not be empty.");
-		data = create_dummy("200", "-1", "(randomerror) endpos=0");
-		return data;
-	} else if (strcmp(timeout, "") == 0) {
-		print_debug("ERROR! <timeout> must not be empty.");
-		data = create_dummy("200", "-1", "(randomerror) endpos=0");
-		return data;
-	}
-
-	if (strcmp(offset_samples, "") == 0) {
-		cmd = format_str(9, "RECORD FILE ", file, " ", format, " ",
-					escape_digits, " ", timeout, "\n");
-	} else if (strcmp(beep, "") == 0) {
-		cmd = format_str(11, "RECORD FILE ", file, " ", format, " ",
-			escape_digits, " ", timeout, " ", offset_samples,
-									"\n");
-	} else if (strcmp(silence, "") == 0) {
-		cmd = format_str(13, "RECORD FILE ", file, " ", format, " ",
-			escape_digits, " ", timeout, " ", offset_samples,
-							" ", beep, "\n");
-	} else {
-		cmd = format_str(15, "RECORD FILE ", file, " ", format, " ",
-			escape_digits, " ", timeout, " ", offset_samples,
-						" ", beep, " ", silence, "\n");
-	}
+	int status;
 
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_record_file(session, file, format, escape_digits,
+		timeout, offset_samples, beep, silence, response);
 
-	return data;
+	return status;
 
 }
 
@@ -994,47 +760,27 @@ char ** record_file(const char *file, const char *format, const char
  *		Digit pressed: Returns a string with the digit in it.
  *	Failure: Returns a string with -1 in it. "-1"
  */
-char * say_alpha(const char *letters, const char *escape_digits) {
-
-	char **data, *cmd, *value;
+char * cagi_say_alpha(cagi_session *session, const char *letters,
+	const char *escape_digits) {
 
-	/*
-	 * If the parameters aren't specified, quit quickly to save on
-	 * execution time.
-	 */
-	if (strcmp(letters, "") == 0) {
-		print_debug("ERROR! <letter> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	} else if (strcmp(escape_digits, "") == 0) {
-		print_debug("ERROR! <escape_digits> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	}
+	cagi_response response;
+	char *value;
 
-	cmd = format_str(5, "SAY ALPHA ", letters, " ", escape_digits, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_say_alpha(session, letters, escape_digits, &response);
 
 	/*
 	 * If the result is -1 we failed. If the result is 0, we succeeded, but
 	 * the user didn't enter any digits. Otherwise, we got a digit from the
 	 * user, so return it.
 	 */
-	if (strcmp(data[1], "-1") == 0) {
-		value = safe_malloc(1);
-		*value = '\0';
-	} else if (strcmp(data[1], "0") == 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result == -1) {
+		value = cagi_arena_strdup(session, "-1");
+	} else if (response.result == 0) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+		value = cagi_arena_viewdup(session, response.result_text);
 	}
 
-	free_2d_array(data);
 	return value;
 
 }
@@ -1054,47 +800,27 @@ char * say_alpha(const char *letters, const char *escape_digits) {
  *		Digit pressed: Returns a string with the digit in it.
  *	Failure: Returns a string with -1 in it. "-1"
  */
-char * say_digits(const char *numbers, const char *escape_digits) {
+char * cagi_say_digits(cagi_session *session, const char *numbers,
+	const char *escape_digits) {
 
-	char **data, *cmd, *value;
-
-	/*
-	 * If any of the parameters weren't specified by the user, exit quickly
-	 * for speed purposes.
-	 */
-	if (strcmp(numbers, "") == 0) {
-		print_debug("ERROR! <numbers> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	} else if (strcmp(escape_digits, "") == 0) {
-		print_debug("ERROR! <escape_digits> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	}
+	cagi_response response;
+	char *value;
 
-	cmd = format_str(5, "SAY DIGITS ", numbers, " ", escape_digits, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_say_digits(session, numbers, escape_digits, &response);
 
 	/*
 	 * If the result is -1 we failed. If the result is 0, we succeeded, but
 	 * the user didn't enter any digits. Otherwise, we got a digit from the
 	 * user, so return it.
 	 */
-	if (strcmp(data[1], "-1") == 0) {
-		value = safe_malloc(1);
-		*value = '\0';
-	} else if (strcmp(data[1], "0") == 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result == -1) {
+		value = cagi_arena_strdup(session, "-1");
+	} else if (response.result == 0) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+		value = cagi_arena_viewdup(session, response.result_text);
 	}
 
-	free_2d_array(data);
 	return value;
 
 }
@@ -1118,55 +844,27 @@ char * say_digits(const char *numbers, const char *escape_digits) {
  *		boy, BOY, b, and B, none of which worked. If you figure it out,
  *		let me know. -Randall
  */
-char * say_number(const char *number, const char *escape_digits, const char *
-								gender) {
+char * cagi_say_number(cagi_session *session, const char *number,
+	const char *escape_digits, const char *gender) {
 
-	char **data, *cmd, *value;
+	cagi_response response;
+	char *value;
 
-	/*
-	 * If any of the parameters weren't specified by the user, exit quickly
-	 * for speed purposes.
-	 */
-	if (strcmp(number, "") == 0) {
-		print_debug("ERROR! <number> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	} else if (strcmp(escape_digits, "") == 0) {
-		print_debug("ERROR! <escape_digits> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	}
-
-	if (strcmp(gender, "") == 0) {
-		cmd = format_str(5, "SAY NUMBER ", number, " ", escape_digits,
-									"\n");
-	} else {
-		cmd = format_str(7, "SAY NUMBER ", number, " ", escape_digits,
-							" ", gender, "\n");
-	}
-
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_say_number(session, number, escape_digits, gender, &response);
 
 	/*
 	 * If the result is -1 we failed. If the result is 0, we succeeded, but
 	 * the user didn't enter any digits. Otherwise, we got a digit from the
 	 * user, so return it.
 	 */
-	if (strcmp(data[1], "-1") == 0) {
-		value = safe_malloc(1);
-		*value = '\0';
-	} else if (strcmp(data[1], "0") == 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result == -1) {
+		value = cagi_arena_strdup(session, "-1");
+	} else if (response.result == 0) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+		value = cagi_arena_viewdup(session, response.result_text);
 	}
 
-	free_2d_array(data);
 	return value;
 
 }
@@ -1186,47 +884,27 @@ char * say_number(const char *number, const char *escape_digits, const char *
  *	Digit pressed: Returns a string with the digit in it.
  * Failure: Returns the string "-1"
  */
-char * say_phonetic(const char *string, const char *escape_digits) {
+char * cagi_say_phonetic(cagi_session *session, const char *string,
+	const char *escape_digits) {
 
-	char **data, *cmd, *value;
-
-	/*
-	 * If any of the parameters weren't specified by the user, exit quickly
-	 * for speed purposes.
-	 */
-	if (strcmp(string, "") == 0) {
-		print_debug("ERROR! <string> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	} else if (strcmp(escape_digits, "") == 0) {
-		print_debug("ERROR! <escape_digits> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	}
+	cagi_response response;
+	char *value;
 
-	cmd = format_str(5, "SAY PHONETIC ", string, " ", escape_digits, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_say_phonetic(session, string, escape_digits, &response);
 
 	/*
 	 * If the result is -1 we failed. If the result is 0, we succeeded, but
 	 * the user didn't enter any digits. Otherwise, we got a digit from the
 	 * user, so return it.
 	 */
-	if (strcmp(data[1], "-1") == 0) {
-		value = safe_malloc(1);
-		*value = '\0';
-	} else if (strcmp(data[1], "0") == 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result == -1) {
+		value = cagi_arena_strdup(session, "-1");
+	} else if (response.result == 0) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+		value = cagi_arena_viewdup(session, response.result_text);
 	}
 
-	free_2d_array(data);
 	return value;
 
 }
@@ -1246,47 +924,27 @@ char * say_phonetic(const char *string, const char *escape_digits) {
  *		Digit pressed: Returns a string with the digit in it.
  *	Failure: Returns the string "-1".
  */
-char * say_date(const char *date, const char *escape_digits) {
-
-        char **data, *cmd, *value;
+char * cagi_say_date(cagi_session *session, const char *date,
+	const char *escape_digits) {
 
-        /*
-         * If any of the parameters weren't specified by the user, exit quickly
-         * for speed purposes.
-         */
-        if (strcmp(date, "") == 0) {
-                print_debug("ERROR! <date> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-        } else if (strcmp(escape_digits, "") == 0) {
-                print_debug("ERROR! <escape_digits> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-        }
+        cagi_response response;
+	char *value;
 
-        cmd = format_str(5, "SAY DATE ", date, " ", escape_digits, "\n");
-        data = evaluate(cmd);
-        free(cmd);
+	cagi_cmd_say_date(session, date, escape_digits, &response);
 
 	/*
 	 * If the result is -1 we failed. If the result is 0, we succeeded, but
 	 * the user didn't enter any digits. Otherwise, we got a digit from the
 	 * user, so return it.
 	 */
-	if (strcmp(data[1], "-1") == 0) {
-		value = safe_malloc(1);
-		*value = '\0';
-	} else if (strcmp(data[1], "0") == 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result == -1) {
+		value = cagi_arena_strdup(session, "-1");
+	} else if (response.result == 0) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+		value = cagi_arena_viewdup(session, response.result_text);
 	}
 
-	free_2d_array(data);
         return value;
 
 }
@@ -1306,47 +964,27 @@ char * say_date(const char *date, const char *escape_digits) {
  *	Digit pressed: Returns a string with the digit in it.
  * Failure: Returns the string "-1".
  */
-char * say_time(const char *time, const char *escape_digits) {
-
-        char **data, *cmd, *value;
+char * cagi_say_time(cagi_session *session, const char *time,
+	const char *escape_digits) {
 
-        /*
-         * If any of the parameters weren't specified by the user, exit quickly
-         * for speed purposes.
-         */
-        if (strcmp(time, "") == 0) {
-                print_debug("ERROR! <time> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-        } else if (strcmp(escape_digits, "") == 0) {
-                print_debug("ERROR! <escape_digits> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-        }
+        cagi_response response;
+	char *value;
 
-        cmd = format_str(5, "SAY TIME ", time, " ", escape_digits, "\n");
-        data = evaluate(cmd);
-        free(cmd);
+	cagi_cmd_say_time(session, time, escape_digits, &response);
 
 	/*
 	 * If the result is -1 we failed. If the result is 0, we succeeded, but
 	 * the user didn't enter any digits. Otherwise, we got a digit from the
 	 * user, so return it.
 	 */
-	if (strcmp(data[1], "-1") == 0) {
-		value = safe_malloc(1);
-		*value = '\0';
-	} else if (strcmp(data[1], "0") == 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result == -1) {
+		value = cagi_arena_strdup(session, "-1");
+	} else if (response.result == 0) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+		value = cagi_arena_viewdup(session, response.result_text);
 	}
 
-	free_2d_array(data);
         return value;
 
 }
@@ -1370,58 +1008,28 @@ char * say_time(const char *time, const char *escape_digits) {
  *	Digit pressed: Returns a string with the digit in it.
  * Failure: Returns the string "-1".
  */
-char * say_datetime(const char *time, const char *escape_digits, const char
-					*format, const char *timezone) {
+char * cagi_say_datetime(cagi_session *session, const char *time,
+	const char *escape_digits, const char *format, const char *timezone) {
 
-	char **data, *cmd, *value;
-
-	/*
-	 * If any of the parameters weren't specified by the user, exit quickly
-	 * for speed purposes.
-	 */
-	if (strcmp(time, "") == 0) {
-		print_debug("ERROR! <time> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	} else if (strcmp(escape_digits, "") == 0) {
-		print_debug("ERROR! <escape_digits> must not be empty.");
-		value = safe_malloc(strlen("-1") + 1);
-		strcpy(value, "-1");
-		return value;
-	}
-
-	if (strcmp(format, "") == 0) {
-		cmd = format_str(5, "SAY DATETIME ", time, " ", escape_digits,
-									"\n");
-	} else if (strcmp(timezone, "") == 0) {
-		cmd = format_str(7, "SAY DATETIME ", time, " ", escape_digits,
-							" ", format, "\n");
-	} else {
-        	cmd = format_str(9, "SAY DATETIME ", time, " ", escape_digits,
-					" ", format, " ", timezone, "\n");
-	}
+	cagi_response response;
+	char *value;
 
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_say_datetime(session, time, escape_digits, format,
+		timezone, &response);
 
 	/*
 	 * If the result is -1 we failed. If the result is 0, we succeeded, but
 	 * the user didn't enter any digits. Otherwise, we got a digit from the
 	 * user, so return it.
 	 */
-	if (strcmp(data[1], "-1") == 0) {
-		value = safe_malloc(1);
-		*value = '\0';
-	} else if (strcmp(data[1], "0") == 0) {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+	if (response.result == -1) {
+		value = cagi_arena_strdup(session, "-1");
+	} else if (response.result == 0) {
+		value = cagi_arena_viewdup(session, response.result_text);
 	} else {
-		value = safe_malloc(strlen(data[1]) + 1);
-		strcpy(value, data[1]);
+		value = cagi_arena_viewdup(session, response.result_text);
 	}
 
-	free_2d_array(data);
 	return value;
 
 }
@@ -1443,29 +1051,18 @@ char * say_datetime(const char *time, const char *escape_digits, const char
  *	even when you CANNOT send images over the channel... Needs to be
  *	further investigated. -Randall
  */
-int send_image(const char *image) {
+int cagi_send_image(cagi_session *session, const char *image) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If <image> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(image, "") == 0) {
-		print_debug("ERROR! <image> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SEND IMAGE ", image, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_send_image(session, image, &response);
 
-	if (strcmp(data[1], "0") == 0)
+	if (response.result == 0)
 		status = 0;
 	else
 		status = -1;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -1485,29 +1082,18 @@ int send_image(const char *image) {
  *	Success: 0
  *	Failure: -1
  */
-int send_text(const char *text) {
+int cagi_send_text(cagi_session *session, const char *text) {
 
 	int status;
-	char **data, *cmd;
+	cagi_response response;
 
-	/*
-	 * If <text> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(text, "") == 0) {
-		print_debug("ERROR! <text> must not be empty.");
-		return -1;
-	}
+	cagi_cmd_send_text(session, text, &response);
 
-	cmd = format_str(3, "SEND TEXT \"", text, "\"\n");
-	data = evaluate(cmd);
-	free(cmd);
-
-	if (strcmp(data[1], "0") == 0)
+	if (response.result == 0)
 		status = 0;
 	else
 		status = -1;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -1525,23 +1111,12 @@ int send_text(const char *text) {
  *	Success: 0
  *	Failure: Never fails. :)
  */
-int set_autohangup(const char *time) {
+int cagi_set_autohangup(cagi_session *session, const char *time) {
 
-	char **data, *cmd;
-
-	/*
-	 * If <time> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(time, "") == 0) {
-		print_debug("ERROR! <time> must not be empty.");
-		return 0;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SET AUTOHANGUP ", time, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_set_autohangup(session, time, &response);
 
-	free_2d_array(data);
 	return 0;
 
 }
@@ -1557,23 +1132,12 @@ int set_autohangup(const char *time) {
  *      Success: 1
  *      Failure: Never fails. :)
  */
-int set_callerid(const char *number) {
-
-	char **data, *cmd;
+int cagi_set_callerid(cagi_session *session, const char *number) {
 
-	/*
-	 * If <number> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(number, "") == 0) {
-		print_debug("ERROR! <number> must not be empty.");
-		return 1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SET CALLERID ", number, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_set_callerid(session, number, &response);
 
-	free_2d_array(data);
 	return 1;
 
 }
@@ -1592,23 +1156,12 @@ int set_callerid(const char *number) {
  *	able to produce a working context. I always get an error. Need to do
  *	more testing to produce a case where it will work. -Randall
  */
-int set_context(const char *context) {
+int cagi_set_context(cagi_session *session, const char *context) {
 
-	char **data, *cmd;
+	cagi_response response;
 
-	/*
-	 * If <context> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(context, "") == 0) {
-		print_debug("ERROR! <context> must not be emnpty.");
-		return 0;
-	}
-
-	cmd = format_str(3, "SET CONTEXT ", context, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_set_context(session, context, &response);
 
-	free_2d_array(data);
 	return 0;
 
 }
@@ -1624,23 +1177,12 @@ int set_context(const char *context) {
  *	Success: 0
  *	Failure: Never fails. :)
  */
-int set_extension(const char *extension) {
-
-	char **data, *cmd;
+int cagi_set_extension(cagi_session *session, const char *extension) {
 
-	/*
-	 * If <extension> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(extension, "") == 0) {
-		print_debug("ERROR! <extension> must not be empty.");
-		return 0;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SET EXTENSION ", extension, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_set_extension(session, extension, &response);
 
-	free_2d_array(data);
 	return 0;
 
 }
@@ -1657,27 +1199,13 @@ int set_extension(const char *extension) {
  *	Success: 0
  *	Failure: 0
  */
-int set_music(const char *onoff, const char *mclass) {
-
-	char **data, *cmd;
-
-	/*
-	 * If <onoff> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(onoff, "") == 0) {
-		print_debug("ERROR! <onoff> must not be empty.");
-		return 0;
-	}
+int cagi_set_music(cagi_session *session, const char *onoff,
+	const char *mclass) {
 
-	if (strcmp(mclass, "") == 0)
-		cmd = format_str(3, "SET MUSIC ", onoff, "\n");
-	else
-		cmd = format_str(5, "SET MUSIC ", onoff, " ", mclass, "\n");
+	cagi_response response;
 
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_set_music(session, onoff, mclass, &response);
 
-	free_2d_array(data);
 	return 0;
 
 }
@@ -1695,23 +1223,12 @@ int set_music(const char *onoff, const char *mclass) {
  *	Failure: Never fails :)
  * NOTE: Must specify a valid priority, otherwise, program execution will stop.
  */
-int set_priority(const char *priority) {
-
-	char **data, *cmd;
+int cagi_set_priority(cagi_session *session, const char *priority) {
 
-	/*
-	 * If <num> isn't specified, quit early and save processing time.
-	 */
-	if (strcmp(priority, "") == 0) {
-		print_debug("ERROR! <priority> must not be empty.");
-		return 0;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SET PRIORITY ", priority, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_set_priority(session, priority, &response);
 
-	free_2d_array(data);
 	return 0;
 
 }
@@ -1727,27 +1244,27 @@ int set_priority(const char *priority) {
  *	Success: 1
  *	Failure: 1
  */
-int set_variable(const char *variablename, const char *value) {
+int cagi_set_variable(cagi_session *session, const char *variablename,
+	const char *value) {
 
-	char **data, *cmd;
+	char *cached;
+	cagi_response response;
+
+	cagi_cmd_set_variable(session, variablename, value, &response);
 
 	/*
-	 * If <variablename> or <value> is not set, return early to save
-	 * processing time.
+	 * Sending the command dropped whatever it may have changed from the
+	 * cache, and what we just set is what the next lookup would get, in
+	 * parentheses as asterisk sends it. Functions may store what they are
+	 * given differently, so they are left for the next lookup to fetch.
 	 */
-	if (strcmp(variablename, "") == 0) {
-		print_debug("ERROR! <variablename> must not be empty.");
-		return 1;
-	} else if (strcmp(value, "") == 0) {
-		print_debug("ERROR! <value> must not be empty.");
-		return 1;
+	if (session->varcache != NULL && response.result == 1 &&
+					strchr(variablename, '(') == NULL) {
+		cached = cagi_arena_alloc(session, strlen(value) + 3);
+		sprintf(cached, "(%s)", value);
+		varcache_put(session, VARCACHE_PLAIN, variablename, cached);
 	}
 
-	cmd = format_str(5, "SET VARIABLE ", variablename, " ", value, "\n");
-	data = evaluate(cmd);
-	free(cmd);
-
-	free_2d_array(data);
 	return 1;
 
 }
@@ -1784,46 +1301,16 @@ int set_variable(const char *variablename, const char *value) {
  *			char *data[1] = "0"
  *			char *data[2] = "endpos=0"
  */
-char ** stream_file(const char *file, const char *escape_digits, const char
-							*sample_offset) {
+int cagi_stream_file(cagi_session *session, const char *file,
+	const char *escape_digits, const char *sample_offset,
+	cagi_response *response) {
 
-	char **data, *cmd;
-
-	/*
-	 * If <file> is not specified by the user, quit early to save
-	 * processing time.
-	 */
-	if (strcmp(file, "") == 0) {
-		print_debug("ERROR! <file> must not be empty.");
-		data = create_dummy("200", "0", "endpos=0");
-		return data;
-	}
-
-	/*
-	 * If <sample_offset> is not defined, then just use escape_digits.
-	 * Otherwise, <sample_offset> is defined, so use it.
-	 */
-	if (strcmp(sample_offset, "") == 0) {
-		if (strcmp(escape_digits, "") == 0) {
-			cmd = format_str(3, "STREAM FILE ", file, " \"\"\n");
-		} else {
-			cmd = format_str(5, "STREAM FILE ", file, " ",
-							escape_digits, "\n");
-		}
-	} else {
-		if (strcmp(escape_digits, "") == 0) {
-			cmd = format_str(5, "STREAM FILE ", file, " \"\" ",
-							sample_offset, "\n");
-		} else {
-			cmd = format_str(5, "STREAM FILE ", file, " ",
-							escape_digits, "\n");
-		}
-	}
+	int status;
 
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_stream_file(session, file, escape_digits,
+		sample_offset, response);
 
-	return data;
+	return status;
 
 }
 
@@ -1858,50 +1345,16 @@ char ** stream_file(const char *file, const char *escape_digits, const char
  *			char *data[2] = "endpos=0"
  * NOTE: <ffchar> and <rewchar> default to * and # respectively.
  */
-char ** control_stream_file(const char *file, const char *escape_digits, const
-	char *skipms, const char *ffchar, const char *rewchr, const char
-								*pausechr) {
-
-	int given = 0;
-	char **data, *cmd;
-
-	/*
-	 * If <file> is not specified by the user, quit to save processing
-	 * time.
-	 */
-	if (strcmp(file, "") == 0) {
-		print_debug("ERROR! <file> must not be empty.");
-		data = create_dummy("200", "0", "endpos=0");
-		return data;
-	}
+int cagi_control_stream_file(cagi_session *session, const char *file,
+	const char *escape_digits, const char *skipms, const char *ffchar,
+	const char *rewchr, const char *pausechr, cagi_response *response) {
 
-	if (strcmp(escape_digits, "") != 0)
-		given = 1;
-
-	if (strcmp(skipms, "") == 0) {
-		cmd = format_str(5, "CONTROL STREAM FILE ", file, " ",
-				(given ? escape_digits : "\"\""), "\n");
-	} else if (strcmp(ffchar, "") == 0) {
-		cmd = format_str(7, "CONTROL STREAM FILE ", file, " ",
-			(given ? escape_digits : "\"\""), " ", skipms, "\n");
-	} else if (strcmp(rewchr, "") == 0) {
-		cmd = format_str(9, "CONTROL STREAM FILE ", file, " ",
-			(given ? escape_digits : "\"\""), " ", skipms, " ",
-								ffchar, "\n");
-	} else if (strcmp(pausechr, "") == 0) {
-		cmd = format_str(11, "CONTROL STREAM FILE ", file, " ",
-			(given ? escape_digits : "\"\""), " ", skipms, " ",
-						ffchar, " ", rewchr, "\n");
-	} else {
-		cmd = format_str(13, "CONTROL STREAM FILE ", file, " ",
-			(given ? escape_digits : "\"\""), " ", skipms, " ",
-				ffchar, " ", rewchr, " ", pausechr, "\n");
-	}
+	int status;
 
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_control_stream_file(session, file, escape_digits,
+		skipms, ffchar, rewchr, pausechr, response);
 
-	return data;
+	return status;
 
 }
 
@@ -1917,32 +1370,20 @@ char ** control_stream_file(const char *file, const char *escape_digits, const
  *	Success: 1
  *	Failure: -1 OR 0
  */
-int tdd_mode(const char *toggle) {
+int cagi_tdd_mode(cagi_session *session, const char *toggle) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If <toggle> isn't specified by the user, quit early to save
-	 * processing power.
-	 */
-	if (strcmp(toggle, "") == 0) {
-		print_debug("ERROR! <toggle> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "TDD MODE ", toggle, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_tdd_mode(session, toggle, &response);
 
-	if (strcmp(data[1], "1") == 0)
+	if (response.result == 1)
 		status = 1;
-	else if (strcmp(data[1], "0") == 0)
+	else if (response.result == 0)
 		status = 0;
 	else
 		status = -1;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -1958,28 +1399,13 @@ int tdd_mode(const char *toggle) {
  *	Success: 1
  *	Failure: Never fails. :)
  */
-int verbose(const char *message, const char *level) {
-
-	char **data, *cmd;
+int cagi_verbose(cagi_session *session, const char *message,
+	const char *level) {
 
-	/*
-	 * If the parameters weren't specified by the user, quit early and save
-	 * processing time.
-	 */
-	if (strcmp(message, "") == 0) {
-		print_debug("ERROR! <message> must not be empty.");
-		return 1;
-	}
-
-	if (strcmp(level, "") == 0)
-		cmd = format_str(3, "VERBOSE \"", message, "\"\n");
-	else
-		cmd = format_str(5, "VERBOSE \"", message, "\" ", level, "\n");
+	cagi_response response;
 
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_verbose(session, message, level, &response);
 
-	free_2d_array(data);
 	return 1;
 
 }
@@ -2000,30 +1426,20 @@ int verbose(const char *message, const char *level) {
  *	Failure: -1
  *		Timeout: 0
  */
-int wait_for_digit(const char *timeout) {
+int cagi_wait_for_digit(cagi_session *session, const char *timeout) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If the user didn't specify <timeout>, return a failure quickly.
-	 */
-	if (strcmp(timeout, "") == 0) {
-		print_debug("ERROR! <timeout> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "WAIT FOR DIGIT ", timeout, "\n");
-	data = evaluate(cmd);
+	cagi_cmd_wait_for_digit(session, timeout, &response);
 
-	if (strcmp(data[1], "0") == 0)
+	if (response.result == 0)
 		status = 0;
-	else if (strcmp(data[1], "-1") == 0)
+	else if (response.result == -1)
 		status = -1;
 	else
-		status = atoi(data[1]);
+		status = response.result;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -2041,26 +1457,15 @@ int wait_for_digit(const char *timeout) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-int speech_create(const char *engine) {
+int cagi_speech_create(cagi_session *session, const char *engine) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If <engine> isn't specified, exit quickly.
-	 */
-	if (strcmp(engine, "") == 0) {
-		print_debug("ERROR! <engine> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SPEECH CREATE ", engine, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_speech_create(session, engine, &response);
 
-	status = atoi(data[1]);
+	status = response.result;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -2078,29 +1483,16 @@ int speech_create(const char *engine) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-int speech_set(const char *name, const char *value) {
+int cagi_speech_set(cagi_session *session, const char *name,
+	const char *value) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If <name> or <value> isn't specified, exit quickly.
-	 */
-	if (strcmp(name, "") == 0) {
-		print_debug("ERROR! <name> must not be empty.");
-		return -1;
-	} else if (strcmp(value, "") == 0) {
-		print_debug("ERROR! <value> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(5, "SPEECH SET ", name, " ", value, "\n");
-	data = evaluate(cmd);
-	free(cmd);
+	cagi_cmd_speech_set(session, name, value, &response);
 
-	status = atoi(data[1]);
+	status = response.result;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -2118,15 +1510,14 @@ int speech_set(const char *name, const char *value) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-int speech_destroy(void) {
+int cagi_speech_destroy(cagi_session *session) {
 
 	int status;
-	char **data;
+	cagi_response response;
 
-	data = evaluate("SPEECH DESTROY\n");
-	status = atoi(data[1]);
+	cagi_cmd_speech_destroy(session, &response);
+	status = response.result;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -2144,28 +1535,16 @@ int speech_destroy(void) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-int speech_load_grammar(const char *name, const char *path) {
+int cagi_speech_load_grammar(cagi_session *session, const char *name,
+	const char *path) {
 
 	int status;
-	char **data, *cmd;
+	cagi_response response;
 
-	/*
-	 * If the user didn't specify the required parameters, exit quickly.
-	 */
-	if (strcmp(name, "") == 0) {
-		print_debug("ERROR! <name> must not be empty.");
-		return -1;
-	} else if (strcmp(path, "") == 0) {
-		print_debug("ERROR! <path> must not be empty.");
-		return -1;
-	}
+	cagi_cmd_speech_load_grammar(session, name, path, &response);
 
-	cmd = format_str(5, "SPEECH LOAD GRAMMAR ", name, " ", path, "\n");
-	data = evaluate(cmd);
+	status = response.result;
 
-	status = atoi(data[1]);
-
-	free_2d_array(data);
 	return status;
 
 }
@@ -2183,25 +1562,15 @@ int speech_load_grammar(const char *name, const char *path) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-int speech_unload_grammar(const char *name) {
+int cagi_speech_unload_grammar(cagi_session *session, const char *name) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If the user didn't specify <name>, exit quickly.
-	 */
-	if (strcmp(name, "") == 0) {
-		print_debug("ERROR! <name> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SPEECH UNLOAD GRAMMAR ", name, "\n");
-	data = evaluate(cmd);
+	cagi_cmd_speech_unload_grammar(session, name, &response);
 
-	status = atoi(data[1]);
+	status = response.result;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -2219,25 +1588,15 @@ int speech_unload_grammar(const char *name) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-int speech_activate_grammar(const char *name) {
+int cagi_speech_activate_grammar(cagi_session *session, const char *name) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If the user didn't specify <name>, exit quickly.
-	 */
-	if (strcmp(name, "") == 0) {
-		print_debug("ERROR! <name> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SPEECH ACTIVATE GRAMMAR ", name, "\n");
-	data = evaluate(cmd);
+	cagi_cmd_speech_activate_grammar(session, name, &response);
 
-	status = atoi(data[1]);
+	status = response.result;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -2255,25 +1614,15 @@ int speech_activate_grammar(const char *name) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-int speech_deactivate_grammar(const char *name) {
+int cagi_speech_deactivate_grammar(cagi_session *session, const char *name) {
 
 	int status;
-	char **data, *cmd;
-
-	/*
-	 * If the user didn't specify <name>, exit quickly.
-	 */
-	if (strcmp(name, "") == 0) {
-		print_debug("ERROR! <name> must not be empty.");
-		return -1;
-	}
+	cagi_response response;
 
-	cmd = format_str(3, "SPEECH DEACTIVATE GRAMMAR ", name, "\n");
-	data = evaluate(cmd);
+	cagi_cmd_speech_deactivate_grammar(session, name, &response);
 
-	status = atoi(data[1]);
+	status = response.result;
 
-	free_2d_array(data);
 	return status;
 
 }
@@ -2297,37 +1646,15 @@ int speech_deactivate_grammar(const char *name) {
  * NOTE: This command doesn't appear to be fully implemented by asterisk. DO
  *	NOT USE IT!
  */
-char ** speech_recognize(const char *prompt, const char *timeout, const char
-								*offset) {
-
-	int given = 0;
-	char **data, *cmd;
+int cagi_speech_recognize(cagi_session *session, const char *prompt,
+	const char *timeout, const char *offset, cagi_response *response) {
 
-	/*
-	 * If any of the required parameters weren't specified. Quit quickly.
-	 */
-	if (strcmp(prompt, "") == 0) {
-		print_debug("ERROR! <prompt> must be specified.");
-		data = create_dummy("200", "-1", "");
-		return data;
-	}
-
-	if (strcmp(timeout, "") != 0)
-		given = 1;
-
-	if (strcmp(offset, "") == 0) {
-		cmd = format_str(5, "SPEECH RECOGNIZE ", prompt, " ",
-				(given ? timeout : _DEFAULT_TIMEOUT), "\n");
-	} else {
-		cmd = format_str(7, "SPEECH RECOGNIZE ", prompt, " ",
-			(given ? timeout : _DEFAULT_TIMEOUT), " ", offset,
-									"\n");
-	}
+	int status;
 
-	data = evaluate(cmd);
-	free(cmd);
+	status = cagi_cmd_speech_recognize(session, prompt, timeout, offset,
+		response);
 
-	return data;
+	return status;
 
 }
 
@@ -2344,40 +1671,515 @@ char ** speech_recognize(const char *prompt, const char *timeout, const char
  *	Failure: -1
  * NOTE: This command has NOT YET BEEN IMPLEMENTED by asterisk. DO NOT USE IT!
  */
-int gosub(const char *context, const char *extension, const char *priority,
-						const char *arguments) {
+int cagi_gosub(cagi_session *session, const char *context,
+	const char *extension, const char *priority, const char *arguments) {
+
+	int status;
+	cagi_response response;
+
+	cagi_cmd_gosub(session, context, extension, priority, arguments,
+		&response);
+
+	status = response.result;
+
+	return status;
+
+}
+
+/*
+ * The functions below are the original cAGI API. Each one runs the command of
+ * the same name on the default session of the calling thread (see
+ * cagi_default_session()), which is stdin/stdout for classic AGI scripts and
+ * the current connection inside a FastAGI handler.
+ */
+
+/*
+ * legacy_string
+ *	Move <str>, which a session function just returned from <session>'s
+ *	arena, to the heap, and roll the arena back to <mark>. The original API
+ *	hands out strings that the caller frees, so they can't stay in the
+ *	arena.
+ * params (required)
+ *	<session> <mark> <str>
+ * returns
+ *	Success: A string which has been malloc'ed. IT MUST BE FREE'd by the
+ *		user!
+ *	Failure: Quits the program with exit status 1.
+ */
+static char * legacy_string(cagi_session *session, cagi_arena_mark mark,
+	const char *str) {
+
+	char *value;
+
+	value = safe_malloc(strlen(str) + 1);
+	strcpy(value, str);
+	cagi_arena_rollback(session, mark);
+
+	return value;
+
+}
+
+/*
+ * legacy_array
+ *	Copy <response>, which a session function just filled in, into an array
+ *	like the original API returns (see response_array()), and roll
+ *	<session>'s arena back to <mark>.
+ * params (required)
+ *	<session> <mark> <response>
+ * returns
+ *	Success: Returns a two-dimensional array of values. IT MUST BE FREE'd
+ *		by the user with free_2d_array()!
+ *	Failure: Quits the program with exit status 1.
+ */
+static char ** legacy_array(cagi_session *session, cagi_arena_mark mark,
+	const cagi_response *response) {
+
+	char **data;
+
+	data = response_array(response);
+	cagi_arena_rollback(session, mark);
+
+	return data;
+
+}
+
+int answer(void) {
+
+	return cagi_answer(cagi_default_session());
+
+}
+
+int channel_status(const char *channel_name) {
+
+	return cagi_channel_status(cagi_default_session(), channel_name);
+
+}
+
+int database_del(const char *family, const char *key) {
+
+	return cagi_database_del(cagi_default_session(), family, key);
+
+}
+
+int database_deltree(const char *family, const char *keytree) {
+
+	return cagi_database_deltree(cagi_default_session(), family, keytree);
+
+}
+
+char * database_get(const char *family, const char *key) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_database_get(session, family,
+			key));
+
+}
+
+int database_put(const char *family, const char *key, const char *value) {
 
 	int status;
-	char **data, *cmd;
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
 
 	/*
-	 * If the user didn't specify the required arguments, exit quickly.
+	 * A cached value is put in the arena (see cagi_database_put()), and it
+	 * has been copied into the cache by now.
 	 */
-	if (strcmp(context, "") == 0) {
-		print_debug("ERROR! <context> must not be empty.");
-		return -1;
-	} else if (strcmp(extension, "") == 0) {
-		print_debug("ERROR! <extension> must not be empty.");
-		return -1;
-	} else if (strcmp(priority, "") == 0) {
-		print_debug("ERROR! <priority> must not be empty.");
+	status = cagi_database_put(session, family, key, value);
+	cagi_arena_rollback(session, mark);
+
+	return status;
+
+}
+
+char ** exec(const char *application, const char *options) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_exec(session, application, options, &response);
+	return legacy_array(session, mark, &response);
+
+}
+
+char ** get_data(const char *file, const char *timeout,
+	const char *maxdigits) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_get_data(session, file, timeout, maxdigits,
+			&response);
+	return legacy_array(session, mark, &response);
+
+}
+
+char * get_full_variable(const char *variablename, const char *channel) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_get_full_variable(session,
+			variablename, channel));
+
+}
+
+char ** get_option(const char *file, const char *escapedigits,
+	const char *timeout) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_get_option(session, file, escapedigits,
+			timeout, &response);
+	return legacy_array(session, mark, &response);
+
+}
+
+char * get_variable(const char *variablename) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_get_variable(session,
+			variablename));
+
+}
+
+int get_variables(cagi_variable *variables, const int count) {
+
+	int i, size, fetched;
+	char *copy;
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	fetched = cagi_get_variables(session, variables, count);
+	if (fetched == -1) {
+		cagi_arena_rollback(session, mark);
 		return -1;
 	}
 
-	if (strcmp(arguments, "") == 0) {
-		cmd = format_str(7, "GOSUB ", context, " ", extension, " ",
-							priority, "\n");
-	} else {
-		cmd = format_str(9, "GOSUB ", context, " ", extension, " ",
-					priority, " \"", arguments, "\n");
+	/*
+	 * Some of the values are in the arena, so they are all copied into the
+	 * session's legacy buffer, which is reused by every call. They are
+	 * then valid until the next get_variables().
+	 */
+	for (i = 0, size = 1; i < count; i++)
+		size += variables[i].value.len;
+
+	if (size > session->lsize) {
+		session->lbuf = realloc(session->lbuf, size);
+		if (session->lbuf == NULL) {
+			log_error("ERROR! Cannot allocate memory. Exiting.");
+			exit(1);
+		}
+		session->lsize = size;
+	}
+
+	for (i = 0, copy = session->lbuf; i < count; i++) {
+		if (variables[i].value.len > 0)
+			memcpy(copy, variables[i].value.str,
+						variables[i].value.len);
+		variables[i].value.str = copy;
+		copy += variables[i].value.len;
 	}
+	cagi_arena_rollback(session, mark);
+
+	return fetched;
+
+}
+
+int hangup(const char *channel_name) {
+
+	return cagi_hangup(cagi_default_session(), channel_name);
+
+}
+
+int noop(const char *str) {
+
+	return cagi_noop(cagi_default_session(), str);
+
+}
+
+char ** receive_char(const char *timeout) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_receive_char(session, timeout, &response);
+	return legacy_array(session, mark, &response);
+
+}
 
-	data = evaluate(cmd);
-	free(cmd);
+char * receive_text(const char *timeout) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_receive_text(session,
+			timeout));
+
+}
 
-	status = atoi(data[1]);
+char ** record_file(const char *file, const char *format,
+	const char *escape_digits, const char *timeout,
+	const char *offset_samples, const char *beep, const char *silence) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_record_file(session, file, format,
+			escape_digits, timeout, offset_samples, beep, silence,
+			&response);
+	return legacy_array(session, mark, &response);
+
+}
+
+char * say_alpha(const char *letters, const char *escape_digits) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_say_alpha(session, letters,
+			escape_digits));
+
+}
+
+char * say_digits(const char *numbers, const char *escape_digits) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_say_digits(session, numbers,
+			escape_digits));
+
+}
+
+char * say_number(const char *number, const char *escape_digits,
+	const char *gender) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_say_number(session, number,
+			escape_digits, gender));
+
+}
+
+char * say_phonetic(const char *string, const char *escape_digits) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_say_phonetic(session, string,
+			escape_digits));
+
+}
+
+char * say_date(const char *date, const char *escape_digits) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_say_date(session, date,
+			escape_digits));
+
+}
+
+char * say_time(const char *time, const char *escape_digits) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_say_time(session, time,
+			escape_digits));
+
+}
+
+char * say_datetime(const char *time, const char *escape_digits,
+	const char *format, const char *timezone) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	return legacy_string(session, mark, cagi_say_datetime(session, time,
+			escape_digits, format, timezone));
+
+}
+
+int send_image(const char *image) {
+
+	return cagi_send_image(cagi_default_session(), image);
+
+}
+
+int send_text(const char *text) {
+
+	return cagi_send_text(cagi_default_session(), text);
+
+}
+
+int set_autohangup(const char *time) {
+
+	return cagi_set_autohangup(cagi_default_session(), time);
+
+}
+
+int set_callerid(const char *number) {
+
+	return cagi_set_callerid(cagi_default_session(), number);
+
+}
+
+int set_context(const char *context) {
+
+	return cagi_set_context(cagi_default_session(), context);
+
+}
+
+int set_extension(const char *extension) {
+
+	return cagi_set_extension(cagi_default_session(), extension);
+
+}
+
+int set_music(const char *onoff, const char *mclass) {
+
+	return cagi_set_music(cagi_default_session(), onoff, mclass);
+
+}
+
+int set_priority(const char *priority) {
+
+	return cagi_set_priority(cagi_default_session(), priority);
+
+}
+
+int set_variable(const char *variablename, const char *value) {
+
+	int status;
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+
+	status = cagi_set_variable(session, variablename, value);
+	cagi_arena_rollback(session, mark);
 
-	free_2d_array(data);
 	return status;
 
 }
+
+char ** stream_file(const char *file, const char *escape_digits,
+	const char *sample_offset) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_stream_file(session, file, escape_digits,
+			sample_offset, &response);
+	return legacy_array(session, mark, &response);
+
+}
+
+char ** control_stream_file(const char *file, const char *escape_digits,
+	const char *skipms, const char *ffchar, const char *rewchr,
+	const char *pausechr) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_control_stream_file(session, file,
+			escape_digits, skipms, ffchar, rewchr, pausechr,
+			&response);
+	return legacy_array(session, mark, &response);
+
+}
+
+int tdd_mode(const char *toggle) {
+
+	return cagi_tdd_mode(cagi_default_session(), toggle);
+
+}
+
+int verbose(const char *message, const char *level) {
+
+	return cagi_verbose(cagi_default_session(), message, level);
+
+}
+
+int wait_for_digit(const char *timeout) {
+
+	return cagi_wait_for_digit(cagi_default_session(), timeout);
+
+}
+
+int speech_create(const char *engine) {
+
+	return cagi_speech_create(cagi_default_session(), engine);
+
+}
+
+int speech_set(const char *name, const char *value) {
+
+	return cagi_speech_set(cagi_default_session(), name, value);
+
+}
+
+int speech_destroy(void) {
+
+	return cagi_speech_destroy(cagi_default_session());
+
+}
+
+int speech_load_grammar(const char *name, const char *path) {
+
+	return cagi_speech_load_grammar(cagi_default_session(), name, path);
+
+}
+
+int speech_unload_grammar(const char *name) {
+
+	return cagi_speech_unload_grammar(cagi_default_session(), name);
+
+}
+
+int speech_activate_grammar(const char *name) {
+
+	return cagi_speech_activate_grammar(cagi_default_session(), name);
+
+}
+
+int speech_deactivate_grammar(const char *name) {
+
+	return cagi_speech_deactivate_grammar(cagi_default_session(), name);
+
+}
+
+char ** speech_recognize(const char *prompt, const char *timeout,
+	const char *offset) {
+
+	cagi_session *session = cagi_default_session();
+	cagi_arena_mark mark = cagi_arena_checkpoint(session);
+	cagi_response response;
+
+	cagi_speech_recognize(session, prompt, timeout,
+			offset, &response);
+	return legacy_array(session, mark, &response);
+
+}
+
+int gosub(const char *context, const char *extension, const char *priority,
+	const char *arguments) {
+
+	return cagi_gosub(cagi_default_session(), context, extension,
+			priority, arguments);
+
+}
@@ -14,6 +14,7 @@
  */
 
 #include <stdio.h>
+#include <setjmp.h>
 
 /*
  * _BUFF_SIZE is the maximum amount of bytes that are allowed for variable 
@@ -54,10 +55,96 @@
 #define _DEFAULT_TIMEOUT "2000"
 #endif
 
+/*
+ * _READ_BUFF_SIZE is the initial size (in bytes) of every session's read
+ * buffer. It grows as needed, for very long responses or a large batch of
+ * them (see cagi_batch_run()).
+ */
+#ifndef _READ_BUFF_SIZE
+#define _READ_BUFF_SIZE 4096
+#endif
+
+/*
+ * _ARENA_BLOCK_SIZE is the size (in bytes) of the blocks that a session's
+ * arena is made of. The first block is allocated along with the session, so
+ * a call whose strings fit in it never touches malloc() for them.
+ */
+#ifndef _ARENA_BLOCK_SIZE
+#define _ARENA_BLOCK_SIZE 4096
+#endif
+
+/*
+ * _VARS_LINE_SIZE is the longest command (in bytes, \n included) that
+ * cagi_get_variables() sends. Asterisk reads AGI commands into a 2048 byte
+ * buffer, so longer lists of variables are split over several commands.
+ */
+#ifndef _VARS_LINE_SIZE
+#define _VARS_LINE_SIZE 2048
+#endif
+
+/*
+ * _VARS_DELIMITER is what cagi_get_variables() puts between the variables
+ * it asks for, to tell their values apart. It should be something no value
+ * ever contains (values which do are still fetched right, one by one).
+ */
+#ifndef _VARS_DELIMITER
+#define _VARS_DELIMITER "|~#~|"
+#endif
+
+/*
+ * _FASTAGI_PORT is the TCP port that asterisk connects to by default when the
+ * dialplan uses FastAGI. Ex: AGI(agi://127.0.0.1:4573/myscript)
+ */
+#ifndef _FASTAGI_PORT
+#define _FASTAGI_PORT 4573
+#endif
+
+/*
+ * _FASTAGI_BACKLOG is the listen() backlog of the FastAGI server, and also the
+ * maximum amount of epoll events that are processed per loop iteration.
+ */
+#ifndef _FASTAGI_BACKLOG
+#define _FASTAGI_BACKLOG 128
+#endif
+
+/*
+ * _POOL_STACK_SIZE is the default stack size (in bytes) of every session that
+ * runs on a worker pool. Stacks are only backed by memory as far as they are
+ * actually used, so this is an upper bound rather than a cost per call.
+ */
+#ifndef _POOL_STACK_SIZE
+#define _POOL_STACK_SIZE (256 * 1024)
+#endif
+
+/*
+ * _LOG_LEVEL is the most verbose level of messages (see cagi_log()) that is
+ * compiled in. Messages above it cost nothing, not even a test at run time.
+ * The default (2) is CAGI_LOG_NOTICE, so debug messages are left out.
+ */
+#ifndef _LOG_LEVEL
+#define _LOG_LEVEL 2
+#endif
+
+/*
+ * _LOG_RING_SIZE is the number of messages (a power of two) that each thread
+ * can have waiting to be logged. Messages logged while its ring is full are
+ * dropped. _LOG_LINE_SIZE is the longest message (in bytes), longer ones are
+ * truncated.
+ */
+#ifndef _LOG_RING_SIZE
+#define _LOG_RING_SIZE 256
+#endif
+
+#ifndef _LOG_LINE_SIZE
+#define _LOG_LINE_SIZE 256
+#endif
+
 /*
  * struct asterisk_vars
  *	A collection of pre-defined variables that asterisk sends to each AGI
- *	script.
+ *	script. This is what readvars() returns. It is about 73 KB no matter
+ *	what asterisk sent, so sessions keep their variables in a struct
+ *	cagi_vars instead.
  *
  * char agi_request[]:
  *	Name of the AGI script that is being called. Ex: myscript
@@ -102,6 +189,9 @@
  *	character. Decimal value 32, 0x20, ' '.
  * char agi_threadid[]:
  *	Thread ID of the AGI script (only in 1.6+). Ex: 139973785782592
+ * char agi_network_script[]:
+ *	Script part of a FastAGI URL (FastAGI sessions only, empty otherwise).
+ *	Ex: myscript
  * char agi_args[][]:
  *	Array of arguments passed to the AGI script. There can be at most
  *	_MAX_ARGS arguments. Asterisk passes these arguments in the form
@@ -131,9 +221,491 @@ typedef struct asterisk_vars {
 	char agi_enhanced[_BUFF_SIZE];
 	char agi_accountcode[_BUFF_SIZE];
 	char agi_threadid[_BUFF_SIZE];
+	char agi_network_script[_BUFF_SIZE];
 	char agi_args[_MAX_ARGS][_BUFF_SIZE];
 } asterisk_vars;
 
+/*
+ * enum cagi_var_id
+ *	The variables asterisk sends at the start of every AGI session (see
+ *	struct asterisk_vars for what each one holds), for cagi_getvar_id().
+ *	The agi_arg_* variables are looked up with cagi_arg() instead.
+ */
+typedef enum cagi_var_id {
+	CAGI_VAR_REQUEST,
+	CAGI_VAR_CHANNEL,
+	CAGI_VAR_LANGUAGE,
+	CAGI_VAR_TYPE,
+	CAGI_VAR_UNIQUEID,
+	CAGI_VAR_VERSION,
+	CAGI_VAR_CALLERID,
+	CAGI_VAR_CALLERIDNAME,
+	CAGI_VAR_CALLINGPRES,
+	CAGI_VAR_CALLINGANI2,
+	CAGI_VAR_CALLINGTON,
+	CAGI_VAR_CALLINGTNS,
+	CAGI_VAR_DNID,
+	CAGI_VAR_RDNIS,
+	CAGI_VAR_CONTEXT,
+	CAGI_VAR_EXTENSION,
+	CAGI_VAR_PRIORITY,
+	CAGI_VAR_ENHANCED,
+	CAGI_VAR_ACCOUNTCODE,
+	CAGI_VAR_THREADID,
+	CAGI_VAR_NETWORK,
+	CAGI_VAR_NETWORK_SCRIPT,
+	CAGI_VAR_COUNT
+} cagi_var_id;
+
+/*
+ * struct cagi_vars
+ *	The variables asterisk sent on a session, stored compactly: every value
+ *	is a null-terminated string in a single table, and the rest are offsets
+ *	into it. Use cagi_getvar() and friends rather than the fields.
+ *
+ * char *strtab:
+ *	The string table, <len> bytes used out of <size>.
+ * int known[]:
+ *	Offset of the value of each variable in enum cagi_var_id, or -1 if
+ *	asterisk didn't send it.
+ * int *args:
+ *	Offset of the value of agi_arg_1 -> agi_arg_<argc>, or -1 for any that
+ *	asterisk skipped. Room for <argsize> of them.
+ * int *extra:
+ *	Offsets of the name and value of every other variable, in pairs.
+ *	<nextra> pairs, room for <extrasize>.
+ */
+typedef struct cagi_vars {
+	char *strtab;
+	int size;
+	int len;
+	int known[CAGI_VAR_COUNT];
+	int *args;
+	int argc;
+	int argsize;
+	int *extra;
+	int nextra;
+	int extrasize;
+} cagi_vars;
+
+/*
+ * struct cagi_view
+ *	A piece of a string, which is NOT null-terminated.
+ *
+ * const char *str:
+ *	First character of the piece.
+ * int len:
+ *	Length of the piece in bytes.
+ */
+typedef struct cagi_view {
+	const char *str;
+	int len;
+} cagi_view;
+
+/*
+ * struct cagi_variable
+ *	A channel variable, for cagi_get_variables().
+ *
+ * const char *name:
+ *	The name of the variable, as get_variable() takes it (Ex: "FOO",
+ *	"CALLERID(num)").
+ * cagi_view value:
+ *	Its value, without the parentheses get_variable() keeps. Empty if the
+ *	variable isn't set (or couldn't be fetched).
+ */
+typedef struct cagi_variable {
+	const char *name;
+	cagi_view value;
+} cagi_variable;
+
+/*
+ * CAGI_TIMEOUT, CAGI_DTMF and CAGI_HANGUP are the flags of a cagi_response,
+ * for responses which say "(timeout)", "(dtmf)" or "(hangup)".
+ */
+#define CAGI_TIMEOUT	0x01
+#define CAGI_DTMF	0x02
+#define CAGI_HANGUP	0x04
+
+/*
+ * enum cagi_outcome
+ *	The class of outcome of a command, decoded once along with the rest of
+ *	its response so that callers can switch on it:
+ *		CAGI_OUTCOME_SUCCESS	The command ran (the result tells how).
+ *		CAGI_OUTCOME_FAILURE	An error response, or a negative result.
+ *		CAGI_OUTCOME_HANGUP	The channel hung up during the command.
+ *		CAGI_OUTCOME_TIMEOUT	Nothing was entered in time.
+ *		CAGI_OUTCOME_DTMF	A key was pressed (see the digit
+ *					field of cagi_response).
+ */
+typedef enum cagi_outcome {
+	CAGI_OUTCOME_SUCCESS,
+	CAGI_OUTCOME_FAILURE,
+	CAGI_OUTCOME_HANGUP,
+	CAGI_OUTCOME_TIMEOUT,
+	CAGI_OUTCOME_DTMF
+} cagi_outcome;
+
+/*
+ * struct cagi_response
+ *	Asterisk's response to a single AGI command. Every response is of the
+ *	form "<code> result=<result> [<data>]". The views point straight into
+ *	the session's read buffer, so a response costs no allocations, but it
+ *	is only valid until the next command is sent on the same session.
+ *
+ * int code:
+ *	An HTTP-like response code (200 for success, 5xx for error).
+ * int result:
+ *	The result of the command, converted to an integer. -1 for error
+ *	responses (5xx), and 0 if the result isn't a number.
+ * cagi_view result_text:
+ *	The result as asterisk sent it. Ex: -1
+ * cagi_view data:
+ *	Everything after the result, or the message of an error response.
+ *	Ex: (timeout) endpos=12000
+ * cagi_view value:
+ *	The part of data in parentheses, without them. Empty if there is none.
+ *	This is the actual value for get_variable(), database_get() and
+ *	friends. Ex: timeout
+ * long endpos:
+ *	The offset given by endpos=<offset> in data, or -1 if there is none.
+ * int flags:
+ *	CAGI_TIMEOUT, CAGI_DTMF and CAGI_HANGUP, set when value says so.
+ * cagi_outcome outcome:
+ *	The class of outcome (see enum cagi_outcome).
+ * char digit:
+ *	The key that was pressed (Ex: '5', '#') if outcome is
+ *	CAGI_OUTCOME_DTMF, '\0' otherwise.
+ */
+typedef struct cagi_response {
+	int code;
+	int result;
+	cagi_view result_text;
+	cagi_view data;
+	cagi_view value;
+	long endpos;
+	int flags;
+	cagi_outcome outcome;
+	char digit;
+} cagi_response;
+
+/*
+ * struct cagi_stats
+ *	Counters that are kept for every session.
+ *
+ * unsigned long commands:
+ *	Number of AGI commands sent to asterisk.
+ * unsigned long bytes_in:
+ *	Number of bytes read from asterisk (variables included).
+ * unsigned long bytes_out:
+ *	Number of bytes written to asterisk.
+ * unsigned long reads:
+ *	Number of read() system calls made.
+ * unsigned long writes:
+ *	Number of write() (writev(), really) system calls made.
+ * unsigned long waits:
+ *	Number of times the session had to wait for asterisk, either in poll()
+ *	or parked on a worker pool.
+ */
+typedef struct cagi_stats {
+	unsigned long commands;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long waits;
+} cagi_stats;
+
+/*
+ * struct cagi_arena_block
+ *	A block of memory that arena allocations are carved from. Blocks are
+ *	chained from the newest to the oldest.
+ *
+ * struct cagi_arena_block *prev:
+ *	The block that was in use before this one, or NULL for the first.
+ * size_t size:
+ *	Number of bytes in data[].
+ * size_t used:
+ *	Number of bytes of data[] handed out so far.
+ * char data[]:
+ *	The memory itself.
+ */
+typedef struct cagi_arena_block {
+	struct cagi_arena_block *prev;
+	size_t size;
+	size_t used;
+	char data[];
+} cagi_arena_block;
+
+/*
+ * struct cagi_arena_mark
+ *	A position in a session's arena, taken by cagi_arena_checkpoint().
+ *	Rolling back to it releases everything allocated since.
+ */
+typedef struct cagi_arena_mark {
+	cagi_arena_block *block;
+	size_t used;
+} cagi_arena_mark;
+
+/*
+ * struct cagi_session
+ *	A single conversation with asterisk. Classic AGI scripts have exactly
+ *	one (stdin/stdout), while a FastAGI server has one per connected call.
+ *	Sessions are independent of each other, so different threads may each
+ *	drive their own session at the same time.
+ *
+ * int in_fd:
+ *	File descriptor that asterisk's responses are read from.
+ * int out_fd:
+ *	File descriptor that AGI commands are written to.
+ * char *rbuf:
+ *	Read buffer of <rsize> bytes. Bytes in [rpos, rlen) have been read from
+ *	in_fd but not consumed yet. Bytes before rpos belong to responses that
+ *	are still in use, and are only dropped when the next command is sent.
+ * char *wbuf:
+ *	Commands queued with cagi_batch_add(), <wlen> bytes long, in a buffer
+ *	of <wsize> bytes. <queued> is the number of commands in it. The
+ *	command being encoded (see cagi-encode.c) follows them, and is <wcmd>
+ *	bytes long so far.
+ * int wverb:
+ *	The verb of the command being encoded (see enum cagi_verb), which its
+ *	latency is filed under (see cagi-latency.c).
+ * cagi_vars vars:
+ *	The variables asterisk sent for this session, once they have been read
+ *	(see cagi_readvars()).
+ * cagi_stats stats:
+ *	Counters for this session.
+ * int hungup:
+ *	Set once asterisk has told us that the channel hung up.
+ * cagi_arena_block *arena:
+ *	The arena that strings returned by the session functions come from
+ *	(see cagi_arena_alloc()). Everything in it is released at once when
+ *	the session is freed, so those strings must NOT be freed one by one.
+ * jmp_buf *unwind:
+ *	If set, a fatal protocol error (or the channel going away) longjmp()s
+ *	here instead of quitting the program. The FastAGI server uses this to
+ *	drop a single call.
+ * void (*park)():
+ *	If set, called instead of blocking whenever <fd> isn't ready for
+ *	<events> (POLLIN or POLLOUT) yet, and returns once it is. The worker
+ *	pool uses this to run other sessions in the meantime. The descriptors
+ *	must be non-blocking for this to be used.
+ * void *sched:
+ *	Private data of whoever installed the park hook.
+ * struct cagi_async_state *async:
+ *	The commands in flight and the loop that delivers their responses, once
+ *	the session is attached to one (see cagi-async.c).
+ * struct cagi_dbcache *dbcache:
+ *	The cache that database lookups are answered from, if any (see
+ *	cagi_set_dbcache()). It may be shared with other sessions.
+ * struct cagi_varcache_state *varcache:
+ *	The variables of the channel that have been cached, and the rules they
+ *	are cached by, if any (see cagi_set_varcache()).
+ * char *lbuf:
+ *	Buffer of <lsize> bytes that get_variables() copies its values into,
+ *	so that the original API never grows the arena (see cagi.c).
+ * void *data:
+ *	Free for the user to attach their own per-call state.
+ */
+typedef struct cagi_session {
+	int in_fd;
+	int out_fd;
+	char *rbuf;
+	int rsize;
+	int rpos;
+	int rlen;
+	char *wbuf;
+	int wlen;
+	int wcmd;
+	int wsize;
+	int queued;
+	int wverb;
+	cagi_vars vars;
+	cagi_stats stats;
+	int hungup;
+	cagi_arena_block *arena;
+	jmp_buf *unwind;
+	void (*park)(struct cagi_session *session, int fd, int events);
+	void *sched;
+	struct cagi_async_state *async;
+	struct cagi_dbcache *dbcache;
+	struct cagi_varcache_state *varcache;
+	char *lbuf;
+	int lsize;
+	void *data;
+} cagi_session;
+
+cagi_session * cagi_session_new(const int in_fd, const int out_fd);
+void cagi_session_free(cagi_session *session);
+cagi_session * cagi_default_session(void);
+void * cagi_arena_alloc(cagi_session *session, size_t size);
+char * cagi_arena_strdup(cagi_session *session, const char *str);
+char * cagi_arena_viewdup(cagi_session *session, const cagi_view view);
+cagi_arena_mark cagi_arena_checkpoint(cagi_session *session);
+void cagi_arena_rollback(cagi_session *session, cagi_arena_mark mark);
+void cagi_arena_reset(cagi_session *session);
+void cagi_set_default_session(cagi_session *session);
+const cagi_vars * cagi_readvars(cagi_session *session);
+const char * cagi_getvar(cagi_session *session, const char *name);
+const char * cagi_getvar_id(cagi_session *session, const cagi_var_id id);
+int cagi_argc(cagi_session *session);
+const char * cagi_arg(cagi_session *session, const int n);
+int cagi_batch_add(cagi_session *session, const char *command);
+int cagi_batch_run(cagi_session *session, cagi_response *results);
+
+/*
+ * struct cagi_cache_stats
+ *	Counters that are kept for every cache.
+ *
+ * unsigned long hits, misses:
+ *	Number of lookups that were, and weren't, answered from the cache.
+ * unsigned long stores:
+ *	Number of values cached.
+ * unsigned long invalidations:
+ *	Number of values dropped because they were changed or deleted.
+ * unsigned long expirations, evictions:
+ *	Number of values dropped because they were too old, or to make room.
+ * unsigned long entries:
+ *	Number of values in the cache right now.
+ */
+typedef struct cagi_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long stores;
+	unsigned long invalidations;
+	unsigned long expirations;
+	unsigned long evictions;
+	unsigned long entries;
+} cagi_cache_stats;
+
+/*
+ * cagi_dbcache
+ *	A cache of AstDB keys (see cagi-dbcache.c).
+ */
+typedef struct cagi_dbcache cagi_dbcache;
+
+cagi_dbcache * cagi_dbcache_new(const int ttl, const int size);
+void cagi_dbcache_free(cagi_dbcache *cache);
+void cagi_dbcache_ttl(cagi_dbcache *cache, const char *family, const int ttl);
+void cagi_dbcache_clear(cagi_dbcache *cache);
+void cagi_dbcache_stats(cagi_dbcache *cache, cagi_cache_stats *stats);
+void cagi_set_dbcache(cagi_session *session, cagi_dbcache *cache);
+
+/*
+ * cagi_shmcache
+ *	A cache shared by every process that maps the same file (see
+ *	cagi-shmcache.c).
+ */
+typedef struct cagi_shmcache cagi_shmcache;
+
+cagi_shmcache * cagi_shmcache_open(const char *path, const int slots);
+void cagi_shmcache_close(cagi_shmcache *cache);
+int cagi_shmcache_get(cagi_shmcache *cache, const char *key, char *value,
+							const int size);
+int cagi_shmcache_put(cagi_shmcache *cache, const char *key, const char
+						*value, const int ttl);
+int cagi_shmcache_del(cagi_shmcache *cache, const char *key, const int
+								prefix);
+void cagi_shmcache_stats(cagi_shmcache *cache, cagi_cache_stats *stats);
+void cagi_dbcache_share(cagi_dbcache *cache, cagi_shmcache *shm);
+
+/*
+ * cagi_varcache
+ *	The rules of a channel variable cache (see cagi-varcache.c).
+ */
+typedef struct cagi_varcache cagi_varcache;
+
+cagi_varcache * cagi_varcache_new(const int size);
+void cagi_varcache_free(cagi_varcache *cache);
+void cagi_varcache_flush_on(cagi_varcache *cache, const int verb, const int
+									on);
+void cagi_varcache_volatile(cagi_varcache *cache, const char *name);
+void cagi_set_varcache(cagi_session *session, cagi_varcache *cache);
+void cagi_varcache_clear(cagi_session *session);
+void cagi_varcache_stats(cagi_session *session, cagi_cache_stats *stats);
+
+/*
+ * cagi_prefetch
+ *	What to fetch for every call as it starts, by agi_request (see
+ *	cagi-prefetch.c).
+ */
+typedef struct cagi_prefetch cagi_prefetch;
+
+cagi_prefetch * cagi_prefetch_new(cagi_varcache *varcache, cagi_dbcache
+								*dbcache);
+void cagi_prefetch_free(cagi_prefetch *prefetch);
+int cagi_prefetch_variable(cagi_prefetch *prefetch, const char *request,
+							const char *name);
+int cagi_prefetch_database(cagi_prefetch *prefetch, const char *request,
+				const char *family, const char *key);
+void cagi_prefetch_enable(cagi_prefetch *prefetch);
+int cagi_prefetch_run(cagi_session *session, cagi_prefetch *prefetch);
+
+/*
+ * cagi_callback
+ *	A function which receives the response to a command submitted with
+ *	cagi_async_<name>() or cagi_async_command(), along with the <arg> it
+ *	was submitted with. It is called from cagi_async_poll(), and <response>
+ *	is only valid during the call. It may submit more commands, and even
+ *	run blocking ones (see cagi_async_attach()).
+ */
+typedef void (*cagi_callback)(cagi_session *session, cagi_response *response,
+								void *arg);
+
+/*
+ * struct cagi_completion
+ *	The response to a command submitted without a callback, as returned by
+ *	cagi_async_poll().
+ */
+typedef struct cagi_completion {
+	cagi_session *session;
+	cagi_response response;
+	void *arg;
+} cagi_completion;
+
+/*
+ * cagi_async
+ *	An event loop which delivers the responses to commands submitted on the
+ *	sessions attached to it. See cagi-async.c.
+ */
+typedef struct cagi_async cagi_async;
+
+cagi_async * cagi_async_new(void);
+int cagi_async_attach(cagi_async *loop, cagi_session *session);
+int cagi_async_command(cagi_session *session, const char *command,
+	cagi_callback callback, void *arg);
+int cagi_async_poll(cagi_async *loop, int timeout, cagi_completion
+							**completions);
+void cagi_async_free(cagi_async *loop);
+
+/*
+ * fastagi_handler
+ *	A function which handles a single FastAGI call. It is called with the
+ *	call's session, whose variables have already been read, as a fiber on
+ *	the worker pool: many calls share the same few threads, and a handler
+ *	which parks waiting on asterisk may resume on a different thread. So a
+ *	handler must not keep thread-local state or hold a lock across AGI
+ *	calls. The session is the default session whenever the handler runs,
+ *	so the unprefixed AGI functions below work exactly like they do in a
+ *	classic AGI script. The session is free()'d once the handler returns.
+ */
+typedef void (*fastagi_handler)(cagi_session *session);
+
+/*
+ * cagi_pool
+ *	A pool of worker threads which runs many sessions at once, parking each
+ *	session while it waits on asterisk instead of tying up a thread. See
+ *	cagi-pool.c.
+ */
+typedef struct cagi_pool cagi_pool;
+
+cagi_pool * cagi_pool_new(int workers, size_t stack_size);
+int cagi_pool_submit(cagi_pool *pool, cagi_session *session, fastagi_handler
+								handler);
+void cagi_pool_free(cagi_pool *pool);
+
+int fastagi_serve(const char *address, int port, fastagi_handler handler);
+void fastagi_stop(void);
+
 int answer(void);
 int channel_status(const char *channel_name);
 int database_del(const char *family, const char *key);
@@ -146,6 +718,7 @@ char * get_full_variable(const char *variablename, const char *channel);
 char ** get_option(const char *file, const char *escapedigits, const char
 								*timeout);
 char * get_variable(const char *variablename);
+int get_variables(cagi_variable *variables, const int count);
 int hangup(const char *channel_name);
 int noop(const char *str);
 char ** receive_char(const char *timeout);
@@ -190,3 +763,245 @@ char ** speech_recognize(const char *prompt, const char *timeout, const char
 								*offset);
 int gosub(const char *context, const char *extension, const char *priority,
 							const char *arguments);
+
+int cagi_answer(cagi_session *session);
+int cagi_channel_status(cagi_session *session, const char *channel_name);
+int cagi_database_del(cagi_session *session, const char *family,
+	const char *key);
+int cagi_database_deltree(cagi_session *session, const char *family,
+	const char *keytree);
+char * cagi_database_get(cagi_session *session, const char *family,
+	const char *key);
+int cagi_database_put(cagi_session *session, const char *family,
+	const char *key, const char *value);
+int cagi_exec(cagi_session *session, const char *application,
+	const char *options, cagi_response *response);
+int cagi_get_data(cagi_session *session, const char *file,
+	const char *timeout, const char *maxdigits, cagi_response *response);
+char * cagi_get_full_variable(cagi_session *session, const char *variablename,
+	const char *channel);
+int cagi_get_option(cagi_session *session, const char *file,
+	const char *escapedigits, const char *timeout,
+	cagi_response *response);
+char * cagi_get_variable(cagi_session *session, const char *variablename);
+int cagi_get_variables(cagi_session *session, cagi_variable *variables,
+	const int count);
+int cagi_hangup(cagi_session *session, const char *channel_name);
+int cagi_noop(cagi_session *session, const char *str);
+int cagi_receive_char(cagi_session *session, const char *timeout,
+	cagi_response *response);
+char * cagi_receive_text(cagi_session *session, const char *timeout);
+int cagi_record_file(cagi_session *session, const char *file,
+	const char *format, const char *escape_digits, const char *timeout,
+	const char *offset_samples, const char *beep, const char *silence,
+	cagi_response *response);
+char * cagi_say_alpha(cagi_session *session, const char *letters,
+	const char *escape_digits);
+char * cagi_say_digits(cagi_session *session, const char *numbers,
+	const char *escape_digits);
+char * cagi_say_number(cagi_session *session, const char *number,
+	const char *escape_digits, const char *gender);
+char * cagi_say_phonetic(cagi_session *session, const char *string,
+	const char *escape_digits);
+char * cagi_say_date(cagi_session *session, const char *date,
+	const char *escape_digits);
+char * cagi_say_time(cagi_session *session, const char *time,
+	const char *escape_digits);
+char * cagi_say_datetime(cagi_session *session, const char *time,
+	const char *escape_digits, const char *format, const char *timezone);
+int cagi_send_image(cagi_session *session, const char *image);
+int cagi_send_text(cagi_session *session, const char *text);
+int cagi_set_autohangup(cagi_session *session, const char *time);
+int cagi_set_callerid(cagi_session *session, const char *number);
+int cagi_set_context(cagi_session *session, const char *context);
+int cagi_set_extension(cagi_session *session, const char *extension);
+int cagi_set_music(cagi_session *session, const char *onoff,
+	const char *mclass);
+int cagi_set_priority(cagi_session *session, const char *priority);
+int cagi_set_variable(cagi_session *session, const char *variablename,
+	const char *value);
+int cagi_stream_file(cagi_session *session, const char *file,
+	const char *escape_digits, const char *sample_offset,
+	cagi_response *response);
+int cagi_control_stream_file(cagi_session *session, const char *file,
+	const char *escape_digits, const char *skipms, const char *ffchar,
+	const char *rewchr, const char *pausechr, cagi_response *response);
+int cagi_tdd_mode(cagi_session *session, const char *toggle);
+int cagi_verbose(cagi_session *session, const char *message,
+	const char *level);
+int cagi_wait_for_digit(cagi_session *session, const char *timeout);
+int cagi_speech_create(cagi_session *session, const char *engine);
+int cagi_speech_set(cagi_session *session, const char *name,
+	const char *value);
+int cagi_speech_destroy(cagi_session *session);
+int cagi_speech_load_grammar(cagi_session *session, const char *name,
+	const char *path);
+int cagi_speech_unload_grammar(cagi_session *session, const char *name);
+int cagi_speech_activate_grammar(cagi_session *session, const char *name);
+int cagi_speech_deactivate_grammar(cagi_session *session, const char *name);
+int cagi_speech_recognize(cagi_session *session, const char *prompt,
+	const char *timeout, const char *offset, cagi_response *response);
+int cagi_gosub(cagi_session *session, const char *context,
+	const char *extension, const char *priority, const char *arguments);
+
+/*
+ * CAGI_COMMAND0 ... CAGI_COMMAND7
+ *	Expand a row of the command table (see cagi-commands.def) into a call
+ *	of CAGI_COMMAND(), which whoever includes the table defines:
+ *		CAGI_COMMAND(<name>, <verb>, <decode>, <params>, <checks>,
+ *							<encoders>, <names>)
+ *	<params> is the argument list, ready to follow the session in a
+ *	prototype. <checks>, <encoders> and <names> are CAGI_CHECK(),
+ *	CAGI_ENCODE() and CAGI_NAME() applied to each argument in turn.
+ */
+#define CAGI_PARAM(kind, name)	, const char *name
+#define CAGI_COMMAND0(name, verb, decode) \
+	CAGI_COMMAND(name, verb, decode, , , , )
+#define CAGI_COMMAND1(name, verb, decode, a1) \
+	CAGI_COMMAND(name, verb, decode, CAGI_PARAM a1, CAGI_CHECK a1, \
+		CAGI_ENCODE a1, CAGI_NAME a1)
+#define CAGI_COMMAND2(name, verb, decode, a1, a2) \
+	CAGI_COMMAND(name, verb, decode, CAGI_PARAM a1 CAGI_PARAM a2, \
+		CAGI_CHECK a1 CAGI_CHECK a2, CAGI_ENCODE a1 CAGI_ENCODE a2, \
+		CAGI_NAME a1 CAGI_NAME a2)
+#define CAGI_COMMAND3(name, verb, decode, a1, a2, a3) \
+	CAGI_COMMAND(name, verb, decode, CAGI_PARAM a1 CAGI_PARAM a2 \
+		CAGI_PARAM a3, CAGI_CHECK a1 CAGI_CHECK a2 CAGI_CHECK a3, \
+		CAGI_ENCODE a1 CAGI_ENCODE a2 CAGI_ENCODE a3, \
+		CAGI_NAME a1 CAGI_NAME a2 CAGI_NAME a3)
+#define CAGI_COMMAND4(name, verb, decode, a1, a2, a3, a4) \
+	CAGI_COMMAND(name, verb, decode, CAGI_PARAM a1 CAGI_PARAM a2 \
+		CAGI_PARAM a3 CAGI_PARAM a4, CAGI_CHECK a1 CAGI_CHECK a2 \
+		CAGI_CHECK a3 CAGI_CHECK a4, CAGI_ENCODE a1 CAGI_ENCODE a2 \
+		CAGI_ENCODE a3 CAGI_ENCODE a4, CAGI_NAME a1 CAGI_NAME a2 \
+		CAGI_NAME a3 CAGI_NAME a4)
+#define CAGI_COMMAND5(name, verb, decode, a1, a2, a3, a4, a5) \
+	CAGI_COMMAND(name, verb, decode, CAGI_PARAM a1 CAGI_PARAM a2 \
+		CAGI_PARAM a3 CAGI_PARAM a4 CAGI_PARAM a5, CAGI_CHECK a1 \
+		CAGI_CHECK a2 CAGI_CHECK a3 CAGI_CHECK a4 CAGI_CHECK a5, \
+		CAGI_ENCODE a1 CAGI_ENCODE a2 CAGI_ENCODE a3 CAGI_ENCODE a4 \
+		CAGI_ENCODE a5, CAGI_NAME a1 CAGI_NAME a2 CAGI_NAME a3 \
+		CAGI_NAME a4 CAGI_NAME a5)
+#define CAGI_COMMAND6(name, verb, decode, a1, a2, a3, a4, a5, a6) \
+	CAGI_COMMAND(name, verb, decode, CAGI_PARAM a1 CAGI_PARAM a2 \
+		CAGI_PARAM a3 CAGI_PARAM a4 CAGI_PARAM a5 CAGI_PARAM a6, \
+		CAGI_CHECK a1 CAGI_CHECK a2 CAGI_CHECK a3 CAGI_CHECK a4 \
+		CAGI_CHECK a5 CAGI_CHECK a6, CAGI_ENCODE a1 CAGI_ENCODE a2 \
+		CAGI_ENCODE a3 CAGI_ENCODE a4 CAGI_ENCODE a5 CAGI_ENCODE a6, \
+		CAGI_NAME a1 CAGI_NAME a2 CAGI_NAME a3 CAGI_NAME a4 \
+		CAGI_NAME a5 CAGI_NAME a6)
+#define CAGI_COMMAND7(name, verb, decode, a1, a2, a3, a4, a5, a6, a7) \
+	CAGI_COMMAND(name, verb, decode, CAGI_PARAM a1 CAGI_PARAM a2 \
+		CAGI_PARAM a3 CAGI_PARAM a4 CAGI_PARAM a5 CAGI_PARAM a6 \
+		CAGI_PARAM a7, CAGI_CHECK a1 CAGI_CHECK a2 CAGI_CHECK a3 \
+		CAGI_CHECK a4 CAGI_CHECK a5 CAGI_CHECK a6 CAGI_CHECK a7, \
+		CAGI_ENCODE a1 CAGI_ENCODE a2 CAGI_ENCODE a3 CAGI_ENCODE a4 \
+		CAGI_ENCODE a5 CAGI_ENCODE a6 CAGI_ENCODE a7, CAGI_NAME a1 \
+		CAGI_NAME a2 CAGI_NAME a3 CAGI_NAME a4 CAGI_NAME a5 \
+		CAGI_NAME a6 CAGI_NAME a7)
+
+/*
+ * The table driven functions. For every row of the command table there is:
+ *	int cagi_cmd_<name>(cagi_session *session, <args...>,
+ *						cagi_response *response);
+ *		Send the command and parse the response into <response>.
+ *		Returns the result, decoded as the row says. If a required
+ *		argument is empty nothing is sent, and <response> is filled in
+ *		with a result of -1 (or whatever the command's legacy wrapper
+ *		has always answered, see cmd_dummies in cagi-commands.c). The same goes for an argument containing
+ *		a line break (\r or \n), which asterisk can't take.
+ *	int cagi_queue_<name>(cagi_session *session, <args...>);
+ *		Queue the command for the next cagi_batch_run(). Returns its
+ *		position in the batch, or -1 if a required argument is empty
+ *		or an argument contains a line break.
+ *	int cagi_async_<name>(cagi_session *session, <args...>,
+ *					cagi_callback callback, void *arg);
+ *		Send the command without waiting, and have its response
+ *		delivered by cagi_async_poll() (see cagi-async.c). Returns 0, or
+ *		-1 if a required argument is empty, an argument contains a
+ *		line break or the session isn't attached to a loop.
+ * A NULL argument counts as an empty one.
+ */
+#define CAGI_COMMAND(name, verb, decode, params, checks, encoders, names) \
+	int cagi_cmd_##name(cagi_session *session params, \
+					cagi_response *response); \
+	int cagi_queue_##name(cagi_session *session params); \
+	int cagi_async_##name(cagi_session *session params, \
+				cagi_callback callback, void *arg);
+#include "wpbx-cagi-commands.def"
+#undef CAGI_COMMAND
+
+/*
+ * enum cagi_verb
+ *	Every command of the command table, as CAGI_VERB_<name>, and
+ *	CAGI_VERB_OTHER for raw commands that aren't in it.
+ */
+#define CAGI_COMMAND(name, verb, decode, params, checks, encoders, names) \
+	CAGI_VERB_##name,
+typedef enum cagi_verb {
+#include "wpbx-cagi-commands.def"
+	CAGI_VERB_OTHER,
+	CAGI_VERB_COUNT
+} cagi_verb;
+#undef CAGI_COMMAND
+
+const char * cagi_verb_name(const int verb);
+
+/*
+ * struct cagi_latency
+ *	The round trip latency of the commands with one verb, from sending them
+ *	to having asterisk's response, over every thread. See cagi-latency.c.
+ *
+ * const char *verb:
+ *	The verb (Ex: "DATABASE GET"), or "OTHER".
+ * unsigned long count:
+ *	Number of commands that were timed.
+ * double mean, p50, p90, p99, p999, max:
+ *	The average, percentiles and maximum, in microseconds.
+ */
+typedef struct cagi_latency {
+	const char *verb;
+	unsigned long count;
+	double mean;
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+	double max;
+} cagi_latency;
+
+void cagi_latency_enable(const int on);
+int cagi_latency_snapshot(cagi_latency *latency, const int size);
+void cagi_latency_reset(void);
+
+/*
+ * enum cagi_log_level
+ *	The levels of log messages, from the most to the least important.
+ */
+typedef enum cagi_log_level {
+	CAGI_LOG_ERROR,
+	CAGI_LOG_WARNING,
+	CAGI_LOG_NOTICE,
+	CAGI_LOG_DEBUG
+} cagi_log_level;
+
+/*
+ * cagi_log
+ *	Log a message (formatted like printf()) of <level>, without waiting for
+ *	it to be written (see cagi-log.c). Ex:
+ *		cagi_log(CAGI_LOG_WARNING, "No such menu: %s", name);
+ *	When <level> is a constant above _LOG_LEVEL, the compiler drops the
+ *	call, arguments and all.
+ */
+#define cagi_log(level, ...) \
+	do { \
+		if ((level) <= _LOG_LEVEL) \
+			log_write((level), __VA_ARGS__); \
+	} while (0)
+
+void log_write(const int level, const char *format, ...)
+					__attribute__((format(printf, 2, 3)));
+int cagi_log_open(const char *path);
+void cagi_log_close(void);
+void cagi_log_set_level(const int level);
+unsigned long cagi_log_dropped(void);
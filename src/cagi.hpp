@@ -0,0 +1,416 @@
+/*
+ * cagi.hpp
+ *
+ * This header file is a C++20 coroutine front end to the asynchronous command interface (see
+ * cagi-async.c). A call script is written as a coroutine, straight-line like a classic AGI
+ * script, but every command is co_await'ed:
+ *
+ *	cagi::task ivr(cagi::loop &loop, int fd) {
+ *		cagi::call call(fd);
+ *		call.readvars();
+ *		loop.attach(call);
+ *		co_await call.answer();
+ *		cagi::result r = co_await call.stream_file("welcome", "#");
+ *		if (r.outcome() == CAGI_OUTCOME_DTMF)
+ *			...
+ *	}
+ *	loop.spawn(ivr(loop, fd));
+ *	loop.run();
+ *
+ * Awaiting a command suspends the coroutine instead of blocking the thread, so one loop runs
+ * as many calls as it has sessions attached, and a handful of threads (one loop each) can
+ * run tens of thousands. There is a member function for every row of the command table
+ * (cagi-commands.def), taking the same arguments as cagi_cmd_<name>(), except that
+ * trailing optional ones can be left out.
+ *
+ * Results own no heap memory: they point into the session's read buffer, and are valid until
+ * the next command on the same call is awaited.
+ *
+ * This header is all there is to it, there is nothing more to link than the C library.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef CAGI_HPP
+#define CAGI_HPP
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "wpbx-cagi.h"
+}
+
+namespace cagi {
+
+class loop;
+
+namespace detail {
+
+/*
+ * arity
+ *	The number of command arguments <fn> (a cagi_async_<name>() function)
+ *	takes, besides the session, callback and argument.
+ */
+template <typename... Params>
+constexpr std::size_t arity(int (*)(cagi_session *, Params...)) noexcept {
+	return sizeof...(Params) - 2;
+}
+
+/*
+ * submit
+ *	Call <fn> with the first N of <args>.
+ */
+template <typename Fn, std::size_t... I>
+int submit(Fn fn, cagi_session *session, const char *const *args,
+	cagi_callback callback, void *arg, std::index_sequence<I...>) noexcept {
+	return fn(session, args[I]..., callback, arg);
+}
+
+} // namespace detail
+
+/*
+ * result
+ *	The response to a command (see struct cagi_response), as returned by
+ *	co_await. Copying one is cheap, it holds no resources.
+ */
+class result {
+public:
+	result() noexcept : response_() {
+		response_.result = -1;
+		response_.endpos = -1;
+		response_.outcome = CAGI_OUTCOME_FAILURE;
+		response_.result_text.str = response_.data.str =
+						response_.value.str = "";
+	}
+
+	explicit result(const cagi_response &response) noexcept :
+						response_(response) {}
+
+	int code() const noexcept { return response_.code; }
+	int number() const noexcept { return response_.result; }
+	std::string_view text() const noexcept {
+		return view(response_.result_text);
+	}
+	std::string_view data() const noexcept { return view(response_.data); }
+	std::string_view value() const noexcept {
+		return view(response_.value);
+	}
+	long endpos() const noexcept { return response_.endpos; }
+	cagi_outcome outcome() const noexcept { return response_.outcome; }
+	char digit() const noexcept { return response_.digit; }
+	const cagi_response &response() const noexcept { return response_; }
+
+	/*
+	 * A command succeeded if it ran, whether or not a key was pressed.
+	 */
+	bool ok() const noexcept {
+		return (response_.outcome == CAGI_OUTCOME_SUCCESS ||
+				response_.outcome == CAGI_OUTCOME_DTMF);
+	}
+
+	explicit operator bool() const noexcept { return ok(); }
+
+private:
+	static std::string_view view(const cagi_view &v) noexcept {
+		return std::string_view(v.str, v.len);
+	}
+
+	cagi_response response_;
+};
+
+/*
+ * command
+ *	The awaitable returned by the command functions of call. The command is
+ *	submitted when the coroutine suspends, and the coroutine is resumed
+ *	(from loop::run()) once the response is in. <Submit> submits the
+ *	command with a given callback and argument, like cagi_async_<name>().
+ */
+template <typename Submit>
+class command {
+public:
+	command(Submit submit, cagi_session *session) noexcept :
+				submit_(std::move(submit)), session_(session) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	/*
+	 * If the command can't be submitted (an empty required argument, or
+	 * the call is gone) there is nothing to wait for, so the coroutine
+	 * goes on right away with a failed result.
+	 */
+	bool await_suspend(std::coroutine_handle<> handle) noexcept {
+		handle_ = handle;
+		if (submit_(&command::complete, this) == 0)
+			return true;
+
+		if (session_->hungup)
+			result_ = hangup();
+		return false;
+	}
+
+	result await_resume() const noexcept { return result_; }
+
+private:
+	static void complete(cagi_session *, cagi_response *response,
+							void *arg) noexcept {
+		command *self = static_cast<command *>(arg);
+
+		self->result_ = result(*response);
+		self->handle_.resume();
+	}
+
+	static result hangup() noexcept {
+		cagi_response response = result().response();
+
+		response.outcome = CAGI_OUTCOME_HANGUP;
+		return result(response);
+	}
+
+	Submit submit_;
+	cagi_session *session_;
+	std::coroutine_handle<> handle_;
+	result result_;
+};
+
+/*
+ * call
+ *	A single call, which owns its session. The session is freed along with
+ *	the call (or after the current poll, if that is where the call ends).
+ */
+class call {
+public:
+	call(int in_fd, int out_fd) :
+		session_(cagi_session_new(in_fd, out_fd)), loop_(nullptr) {}
+	explicit call(int fd) : call(fd, fd) {}
+
+	call(const call &) = delete;
+	call &operator=(const call &) = delete;
+
+	call(call &&other) noexcept :
+			session_(std::exchange(other.session_, nullptr)),
+			loop_(std::exchange(other.loop_, nullptr)) {}
+
+	inline ~call();
+
+	cagi_session *session() const noexcept { return session_; }
+	bool hungup() const noexcept { return session_->hungup; }
+
+	/*
+	 * The variables asterisk sends first thing. This blocks until they are
+	 * in, which they are as soon as asterisk connects.
+	 */
+	const cagi_vars *readvars() { return cagi_readvars(session_); }
+	const char *getvar(const char *name) {
+		return cagi_getvar(session_, name);
+	}
+	const char *arg(int n) { return cagi_arg(session_, n); }
+
+	/*
+	 * raw
+	 *	A raw AGI command (see cagi_async_command()).
+	 */
+	auto raw(const char *text) noexcept {
+		cagi_session *session = session_;
+
+		return command([=](cagi_callback callback, void *arg) {
+			return cagi_async_command(session, text, callback, arg);
+		}, session);
+	}
+
+	/*
+	 * One member function per command of the table. Trailing arguments
+	 * may be left out, they are sent as empty strings (which is what the
+	 * C functions take for an optional argument that isn't given).
+	 */
+#define CAGI_COMMAND(name, verb, decode, params, checks, encoders, names) \
+	template <typename... Args> \
+	auto name(Args... args) noexcept { \
+		constexpr std::size_t n = detail::arity(&cagi_async_##name); \
+		static_assert(sizeof...(Args) <= n, "too many arguments"); \
+		cagi_session *session = session_; \
+		std::array<const char *, n + 1> a = { args... }; \
+		for (std::size_t i = sizeof...(Args); i < n; i++) \
+			a[i] = ""; \
+		return command([=](cagi_callback callback, void *arg) { \
+			return detail::submit(&cagi_async_##name, session, \
+				a.data(), callback, arg, \
+				std::make_index_sequence<n>()); \
+		}, session); \
+	}
+#include "wpbx-cagi-commands.def"
+#undef CAGI_COMMAND
+
+private:
+	friend class loop;
+
+	cagi_session *session_;
+	loop *loop_;
+};
+
+/*
+ * task
+ *	A call script. Tasks start running once they are handed to
+ *	loop::spawn(), and clean up after themselves when they are done.
+ */
+class task {
+public:
+	struct promise_type {
+		loop *owner = nullptr;
+
+		task get_return_object() noexcept {
+			return task(std::coroutine_handle<promise_type>::
+							from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+		inline ~promise_type();
+	};
+
+	task(task &&other) noexcept :
+			handle_(std::exchange(other.handle_, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task() {
+		if (handle_)
+			handle_.destroy();
+	}
+
+private:
+	friend class loop;
+
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept :
+							handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+/*
+ * loop
+ *	An event loop (see cagi_async_poll()) and the tasks running on it. A
+ *	loop belongs to a single thread.
+ */
+class loop {
+public:
+	loop() : loop_(cagi_async_new()), live_(0), polling_(false) {
+		if (loop_ == nullptr)
+			throw std::runtime_error("cagi: cannot create loop");
+	}
+
+	loop(const loop &) = delete;
+	loop &operator=(const loop &) = delete;
+
+	~loop() {
+		release();
+		cagi_async_free(loop_);
+	}
+
+	/*
+	 * attach
+	 *	Have <c>'s commands delivered by this loop.
+	 */
+	void attach(call &c) {
+		if (cagi_async_attach(loop_, c.session_) != 0)
+			throw std::runtime_error("cagi: cannot attach call");
+		c.loop_ = this;
+	}
+
+	/*
+	 * spawn
+	 *	Start <t>, which runs up to its first co_await right away.
+	 */
+	void spawn(task t) {
+		std::coroutine_handle<task::promise_type> handle =
+					std::exchange(t.handle_, nullptr);
+
+		handle.promise().owner = this;
+		live_++;
+		handle.resume();
+	}
+
+	/*
+	 * run_once
+	 *	Wait up to <timeout> milliseconds for responses, and resume the
+	 *	tasks they are for. Returns false if the loop failed.
+	 */
+	bool run_once(int timeout = -1) {
+		cagi_completion *completions;
+		int n;
+
+		polling_ = true;
+		n = cagi_async_poll(loop_, timeout, &completions);
+		polling_ = false;
+		release();
+
+		return (n != -1);
+	}
+
+	/*
+	 * run
+	 *	Run until every task spawned on this loop is done.
+	 */
+	void run() {
+		while (live_ > 0 && run_once(-1))
+			;
+	}
+
+	std::size_t live() const noexcept { return live_; }
+
+private:
+	friend class call;
+	friend struct task::promise_type;
+
+	/*
+	 * A call that ends while the loop is polling (in the middle of a
+	 * task) can't free its session right away, since the loop is still
+	 * looking at it. It is freed once the poll is over.
+	 */
+	void free_session(cagi_session *session) {
+		if (polling_)
+			dead_.push_back(session);
+		else
+			cagi_session_free(session);
+	}
+
+	void release() {
+		for (cagi_session *session : dead_)
+			cagi_session_free(session);
+		dead_.clear();
+	}
+
+	cagi_async *loop_;
+	std::size_t live_;
+	bool polling_;
+	std::vector<cagi_session *> dead_;
+};
+
+inline call::~call() {
+	if (session_ == nullptr)
+		return;
+
+	if (loop_ != nullptr)
+		loop_->free_session(session_);
+	else
+		cagi_session_free(session_);
+}
+
+inline task::promise_type::~promise_type() {
+	if (owner != nullptr)
+		owner->live_--;
+}
+
+} // namespace cagi
+
+#endif
@@ -0,0 +1,969 @@
+/*
+ * agi-loadgen.c
+ *
+ * This program simulates many asterisk channels at once, to see how many calls a cAGI
+ * program (and the box it runs on) can take. Every channel either connects to a FastAGI
+ * server, or runs a classic AGI program over pipes, and plays asterisk for it with the rules
+ * of agi-sim.c (canned responses, simulated latencies, hangups). A single thread drives all
+ * of the channels with epoll, so tens of thousands of them don't need tens of thousands of
+ * threads. At the end it reports calls per second, the latency percentiles of every command,
+ * and the CPU time and memory the program used per call, for people or (with -J) as JSON.
+ *
+ * The latency of a command is the time from asterisk's previous response (or the variables,
+ * for the first command) to the command arriving: the time cAGI and the program took to get
+ * from one command to the next. Asterisk's own (simulated) latency is not part of it.
+ *
+ * The program under test runs the call flow (-F) it is given as agi_arg_1, which is a comma
+ * separated list of steps, each optionally repeated (Ex: answer,set_variable*3,hangup). This
+ * program runs flows itself when started with -R, either as a classic AGI program (the
+ * default one in fork mode), or as a FastAGI server (-R -l <port>).
+ *
+ * Build it from a directory where the cAGI headers are available as wpbx-cagi.h,
+ * wpbx-cagi-internals.h and wpbx-cagi-commands.def, next to agi-sim.c:
+ *	gcc -O2 -o agi-loadgen agi-loadgen.c cagi*.c -lpthread -lm
+ *
+ * usage:	agi-loadgen [<options>] -c <host>:<port>	(FastAGI)
+ *		agi-loadgen [<options>] [<program> [<args>...]]	(fork mode)
+ *		agi-loadgen -R [-l <port>]			(run call flows)
+ * options:	-n <calls>	Run <calls> calls in all (1000).
+ *		-C <channels>	Keep up to <channels> calls up at once (100).
+ *		-F <flow>	The call flow (answer,set_variable*3,
+ *				stream_file,get_data,hangup).
+ *		-f <script>	Answer commands with the rules of <script> (see
+ *				agi-sim.c).
+ *		-L <latency>	Asterisk's latency, for commands no rule gives one.
+ *		-s <seed>	Seed the random latencies and probabilities.
+ *		-P <pid>	Measure the CPU time and memory of <pid> (the
+ *				FastAGI server).
+ *		-J		Print the results as JSON, on stdout.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * Commands are short, so channels make do with a smaller buffer than
+ * agi-sim's, which adds up over thousands of them.
+ */
+#define SIM_BUFF_SIZE		2048
+#define AGI_SIM_NO_MAIN
+#include "agi-sim.c"
+
+#define DEFAULT_FLOW	"answer,set_variable*3,stream_file,get_data,hangup"
+
+/*
+ * verbs holds the verb of every command in the command table, and "OTHER"
+ * for whatever isn't one of them. "CALL" is for whole calls.
+ */
+#define CAGI_COMMAND(name, verb, decode, params, checks, encoders, names) \
+	verb,
+static const char *verbs[] = {
+#include "wpbx-cagi-commands.def"
+	"OTHER",
+	"CALL"
+};
+#undef CAGI_COMMAND
+
+#define VERBS		((int)(sizeof(verbs) / sizeof(verbs[0])))
+#define VERB_OTHER	(VERBS - 2)
+#define VERB_CALL	(VERBS - 1)
+
+/*
+ * struct samples
+ *	The latencies (in microseconds) measured for one verb.
+ */
+struct samples {
+	double *values;
+	long count;
+	long size;
+};
+
+/*
+ * struct channel
+ *	A simulated channel, and the call it is on.
+ *
+ * struct sim_call call:
+ *	The connection, as agi-sim sees it. Commands are read into its buffer.
+ * long id:
+ *	The number of the call, counting from 0.
+ * pid_t pid:
+ *	The program running the call (fork mode), or 0.
+ * double started, last:
+ *	When the call started, and when asterisk last said something on it.
+ * const struct sim_rule *rule:
+ *	The rule that answers the command being delayed, or NULL if there is
+ *	none. It goes out at <due>.
+ * int heap:
+ *	The channel's position in the timer heap, while <rule> is set.
+ */
+struct channel {
+	struct sim_call call;
+	long id;
+	pid_t pid;
+	double started;
+	double last;
+	const struct sim_rule *rule;
+	double due;
+	int heap;
+};
+
+/*
+ * What main() was asked to do, and how it is going.
+ */
+static long total_calls = 1000;
+static long next_call = 0;
+static long live_calls = 0;
+static long failed_calls = 0;
+static char **program = NULL;
+static struct addrinfo *address = NULL;
+static int epfd;
+static struct channel **timers;
+static int ntimers = 0;
+static struct samples samples[VERBS];
+static struct sim_stats stats;
+
+/*
+ * now
+ *	Return a monotonic timestamp in microseconds.
+ */
+static double now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+
+}
+
+/*
+ * record
+ *	Add the latency <us> to the samples of <verb>.
+ */
+static void record(const int verb, const double us) {
+
+	struct samples *s = &samples[verb];
+
+	if (s->count == s->size) {
+		s->size = (s->size ? s->size * 2 : 1024);
+		s->values = realloc(s->values, s->size * sizeof(double));
+		if (s->values == NULL) {
+			fprintf(stderr, "agi-loadgen: out of memory\n");
+			exit(1);
+		}
+	}
+
+	s->values[s->count++] = us;
+
+}
+
+/*
+ * verb_of
+ *	Find the verb of <command>: the longest one of the table that it starts
+ *	with, as a whole word.
+ */
+static int verb_of(const char *command) {
+
+	int i, len, best = VERB_OTHER, bestlen = 0;
+
+	for (i = 0; i < VERB_OTHER; i++) {
+		len = strlen(verbs[i]);
+		if (len > bestlen && strncasecmp(command, verbs[i], len) == 0 &&
+				(command[len] == ' ' || command[len] == '\0')) {
+			best = i;
+			bestlen = len;
+		}
+	}
+
+	return best;
+
+}
+
+/*
+ * timer_swap, timer_up, timer_down
+ *	Keep <timers> a binary heap, soonest first.
+ */
+static void timer_swap(const int a, const int b) {
+
+	struct channel *tmp = timers[a];
+
+	timers[a] = timers[b];
+	timers[b] = tmp;
+	timers[a]->heap = a;
+	timers[b]->heap = b;
+
+}
+
+static void timer_up(int i) {
+
+	while (i > 0 && timers[(i - 1) / 2]->due > timers[i]->due) {
+		timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+}
+
+static void timer_down(int i) {
+
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= ntimers)
+			break;
+		if (child + 1 < ntimers && timers[child + 1]->due <
+							timers[child]->due)
+			child++;
+		if (timers[i]->due <= timers[child]->due)
+			break;
+		timer_swap(i, child);
+		i = child;
+	}
+
+}
+
+/*
+ * timer_remove
+ *	Take <channel> off the timer heap.
+ */
+static void timer_remove(struct channel *channel) {
+
+	int i = channel->heap;
+
+	ntimers--;
+	if (i != ntimers) {
+		timer_swap(i, ntimers);
+		timer_up(i);
+		timer_down(i);
+	}
+	channel->rule = NULL;
+
+}
+
+/*
+ * call_end
+ *	Hang <channel> up for good, and start the next call in its place.
+ */
+static void start_call(void);
+
+static void call_end(struct channel *channel, const int failed) {
+
+	if (channel->rule != NULL)
+		timer_remove(channel);
+
+	record(VERB_CALL, now() - channel->started);
+	failed_calls += failed;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, channel->call.in_fd, NULL);
+	close(channel->call.in_fd);
+	if (channel->call.out_fd != channel->call.in_fd)
+		close(channel->call.out_fd);
+
+	free(channel);
+	live_calls--;
+
+	start_call();
+
+}
+
+/*
+ * call_command
+ *	Handle every command <channel> has in its buffer, until one of them
+ *	has to wait for asterisk's latency.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the call is over, and <channel> is gone).
+ */
+static int call_command(struct channel *channel) {
+
+	int status;
+	char *line, *nl;
+	double ms, t;
+	const struct sim_rule *rule;
+	struct sim_call *call = &channel->call;
+
+	while (channel->rule == NULL) {
+		nl = memchr(call->buf + call->start, '\n', call->end -
+								call->start);
+		if (nl == NULL)
+			return 0;
+
+		line = call->buf + call->start;
+		call->start = nl + 1 - call->buf;
+		if (nl > line && nl[-1] == '\r')
+			nl--;
+		*nl = '\0';
+		if (*line == '\0')
+			continue;
+
+		t = now();
+		record(verb_of(line), t - channel->last);
+		stats.commands++;
+
+		rule = sim_match(call, line);
+		ms = sim_draw(call, &rule->latency);
+		if (ms > 0) {
+			channel->rule = rule;
+			channel->due = t + ms * 1000;
+			channel->heap = ntimers;
+			timers[ntimers++] = channel;
+			timer_up(channel->heap);
+			return 0;
+		}
+
+		status = sim_apply(call, rule, &stats);
+		channel->last = now();
+		if (status != 0) {
+			call_end(channel, status == -1);
+			return -1;
+		}
+	}
+
+	return 0;
+
+}
+
+/*
+ * call_read
+ *	Read what the program sent on <channel>, and handle it.
+ */
+static void call_read(struct channel *channel) {
+
+	int n;
+	struct sim_call *call = &channel->call;
+
+	if (call->start > 0) {
+		memmove(call->buf, call->buf + call->start, call->end -
+								call->start);
+		call->end -= call->start;
+		call->start = 0;
+	}
+
+	/*
+	 * A command longer than the whole buffer is dropped. Flows don't send
+	 * any.
+	 */
+	if (call->end == SIM_BUFF_SIZE)
+		call->end = 0;
+
+	n = read(call->in_fd, call->buf + call->end, SIM_BUFF_SIZE - call->end);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		call_end(channel, 0);
+		return;
+	}
+
+	call->end += n;
+	call_command(channel);
+
+}
+
+/*
+ * call_timers
+ *	Answer the delayed commands whose time has come.
+ * returns
+ *	The number of milliseconds until the next one, or -1 if there is none.
+ */
+static int call_timers(void) {
+
+	int status;
+	double t;
+	struct channel *channel;
+	const struct sim_rule *rule;
+
+	while (ntimers > 0) {
+		t = now();
+		channel = timers[0];
+		if (channel->due > t)
+			return (int)((channel->due - t) / 1000) + 1;
+
+		rule = channel->rule;
+		timer_remove(channel);
+
+		status = sim_apply(&channel->call, rule, &stats);
+		channel->last = now();
+		if (status != 0)
+			call_end(channel, status == -1);
+		else
+			call_command(channel);
+	}
+
+	return -1;
+
+}
+
+/*
+ * start_program
+ *	Start the program for a new call on <channel> (fork mode).
+ * returns
+ *	Success: 0
+ *	Failure: -1
+ */
+static int start_program(struct channel *channel) {
+
+	int in[2], out[2];
+
+	if (pipe2(in, O_CLOEXEC) == -1)
+		return -1;
+	if (pipe2(out, O_CLOEXEC) == -1) {
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+
+	channel->pid = fork();
+	if (channel->pid == 0) {
+		dup2(out[0], 0);
+		dup2(in[1], 1);
+		execvp(program[0], program);
+		_exit(127);
+	}
+
+	close(out[0]);
+	close(in[1]);
+	if (channel->pid == -1) {
+		close(in[0]);
+		close(out[1]);
+		return -1;
+	}
+
+	channel->call.in_fd = in[0];
+	channel->call.out_fd = out[1];
+	return 0;
+
+}
+
+/*
+ * start_fastagi
+ *	Connect a new call on <channel> to the FastAGI server.
+ * returns
+ *	Success: 0
+ *	Failure: -1
+ */
+static int start_fastagi(struct channel *channel) {
+
+	int fd;
+
+	fd = socket(address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, address->ai_addr, address->ai_addrlen) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	channel->call.in_fd = channel->call.out_fd = fd;
+	return 0;
+
+}
+
+/*
+ * start_call
+ *	Start the next call, if there is one left.
+ */
+static void start_call(void) {
+
+	struct channel *channel;
+	struct epoll_event event;
+
+	while (next_call < total_calls) {
+		channel = calloc(1, sizeof(struct channel));
+		if (channel == NULL) {
+			fprintf(stderr, "agi-loadgen: out of memory\n");
+			exit(1);
+		}
+		channel->id = next_call++;
+		channel->call.rand = (sim_seed + channel->id) *
+						0x9E3779B97F4A7C15ULL | 1;
+		channel->started = now();
+		stats.calls++;
+
+		if ((program ? start_program(channel) :
+					start_fastagi(channel)) == -1 ||
+					sim_header(&channel->call,
+						channel->id) == -1) {
+			if (channel->call.in_fd > 0)
+				close(channel->call.in_fd);
+			if (channel->call.out_fd > 0 &&
+				channel->call.out_fd != channel->call.in_fd)
+				close(channel->call.out_fd);
+			failed_calls++;
+			free(channel);
+			continue;
+		}
+		channel->last = now();
+
+		fcntl(channel->call.in_fd, F_SETFL, O_NONBLOCK);
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = channel;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, channel->call.in_fd, &event);
+
+		live_calls++;
+		return;
+	}
+
+}
+
+/*
+ * reap
+ *	Collect the programs which have exited, counting the ones which failed.
+ */
+static void reap(const int wait) {
+
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, wait ? 0 : WNOHANG)) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed_calls++;
+
+}
+
+/*
+ * proc_usage
+ *	Read the CPU time (in seconds) and the peak memory (in KB) of the
+ *	process <pid> from /proc.
+ * returns
+ *	Success: 0
+ *	Failure: -1
+ */
+static int proc_usage(const pid_t pid, double *cpu, long *rss) {
+
+	char path[64], line[1024], *p;
+	unsigned long utime, stime;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((file = fopen(path, "r")) == NULL)
+		return -1;
+	p = fgets(line, sizeof(line), file);
+	fclose(file);
+
+	/*
+	 * The command name may contain anything, so fields are counted from
+	 * the parenthesis which ends it. utime and stime are the 12th and
+	 * 13th after it.
+	 */
+	if (p == NULL || (p = strrchr(line, ')')) == NULL || sscanf(p + 2,
+		"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+						&utime, &stime) != 2)
+		return -1;
+	*cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if ((file = fopen(path, "r")) == NULL)
+		return -1;
+	*rss = 0;
+	while (fgets(line, sizeof(line), file) != NULL)
+		if (strncmp(line, "VmHWM:", 6) == 0)
+			*rss = atol(line + 6);
+	fclose(file);
+
+	return 0;
+
+}
+
+/*
+ * compare
+ *	qsort() comparison of two latencies.
+ */
+static int compare(const void *a, const void *b) {
+
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+
+}
+
+/*
+ * percentile
+ *	The <q> quantile of <s>, which is sorted.
+ */
+static double percentile(const struct samples *s, const double q) {
+
+	return s->values[(long)(q * (s->count - 1))];
+
+}
+
+/*
+ * report
+ *	Print the results, as JSON if <json> is set.
+ */
+static void report(const int json, const char *mode, const int channels,
+	const double elapsed, const double cpu, const long rss) {
+
+	int i, first = 1;
+	double calls = stats.calls - failed_calls;
+	struct samples *s;
+
+	if (json) {
+		printf("{\"mode\":\"%s\",\"calls\":%ld,\"failed\":%ld,"
+			"\"channels\":%d,\"elapsed\":%.3f,"
+			"\"calls_per_sec\":%.1f,"
+			"\"commands\":%ld,\"cpu_ms_per_call\":%.3f,"
+			"\"rss_kb\":%ld,\"latency_us\":{", mode, stats.calls,
+			failed_calls, channels, elapsed, calls / elapsed,
+			stats.commands, (calls > 0 ? cpu * 1000 / calls : 0),
+			rss);
+	} else {
+		fprintf(stderr, "calls:     %ld (%ld failed) over %d channels "
+			"in %.3fs, %.1f calls/s\n", stats.calls, failed_calls,
+			channels, elapsed, calls / elapsed);
+		fprintf(stderr, "commands:  %ld\n", stats.commands);
+		fprintf(stderr, "cpu:       %.3f ms/call\n",
+					(calls > 0 ? cpu * 1000 / calls : 0));
+		fprintf(stderr, "rss:       %ld KB\n", rss);
+		fprintf(stderr, "%-26s %9s %10s %10s %10s %10s %10s\n",
+			"latency (us)", "count", "p50", "p90", "p99", "p999",
+									"max");
+	}
+
+	for (i = 0; i < VERBS; i++) {
+		s = &samples[i];
+		if (s->count == 0)
+			continue;
+		qsort(s->values, s->count, sizeof(double), compare);
+
+		if (json)
+			printf("%s\"%s\":{\"count\":%ld,\"p50\":%.1f,"
+				"\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,"
+				"\"max\":%.1f}", (first ? "" : ","), verbs[i],
+				s->count, percentile(s, 0.5),
+				percentile(s, 0.9), percentile(s, 0.99),
+				percentile(s, 0.999), s->values[s->count - 1]);
+		else
+			fprintf(stderr, "%-26s %9ld %10.1f %10.1f %10.1f "
+				"%10.1f %10.1f\n", verbs[i], s->count,
+				percentile(s, 0.5), percentile(s, 0.9),
+				percentile(s, 0.99), percentile(s, 0.999),
+				s->values[s->count - 1]);
+		first = 0;
+	}
+
+	if (json)
+		printf("}}\n");
+
+}
+
+/*
+ * Flows. Every step runs one command on the session.
+ */
+static int step_answer(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_answer(s, r);
+}
+
+static int step_set_variable(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_set_variable(s, "LOADGEN", "1", r);
+}
+
+static int step_get_variable(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_get_variable(s, "CALLERID(num)", r);
+}
+
+static int step_stream_file(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_stream_file(s, "welcome", "#", "", r);
+}
+
+static int step_get_data(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_get_data(s, "menu", "", "4", r);
+}
+
+static int step_database_get(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_database_get(s, "callers", "1001", r);
+}
+
+static int step_database_put(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_database_put(s, "callers", "1001", "seen", r);
+}
+
+static int step_say_digits(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_say_digits(s, "1234", "#", r);
+}
+
+static int step_wait_for_digit(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_wait_for_digit(s, "1000", r);
+}
+
+static int step_verbose(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_verbose(s, "agi-loadgen", "1", r);
+}
+
+static int step_noop(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_noop(s, "", r);
+}
+
+static int step_hangup(cagi_session *s, cagi_response *r) {
+	return cagi_cmd_hangup(s, "", r);
+}
+
+static const struct {
+	const char *name;
+	int (*run)(cagi_session *session, cagi_response *response);
+} steps[] = {
+	{ "answer", step_answer },
+	{ "set_variable", step_set_variable },
+	{ "get_variable", step_get_variable },
+	{ "stream_file", step_stream_file },
+	{ "get_data", step_get_data },
+	{ "database_get", step_database_get },
+	{ "database_put", step_database_put },
+	{ "say_digits", step_say_digits },
+	{ "wait_for_digit", step_wait_for_digit },
+	{ "verbose", step_verbose },
+	{ "noop", step_noop },
+	{ "hangup", step_hangup }
+};
+
+#define STEPS ((int)(sizeof(steps) / sizeof(steps[0])))
+
+/*
+ * run_flow
+ *	Run the call flow <flow> on <session>.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (a step is unknown).
+ */
+static int run_flow(cagi_session *session, const char *flow) {
+
+	int i, len, count;
+	const char *end, *star;
+	cagi_response response;
+
+	while (*flow != '\0') {
+		end = flow + strcspn(flow, ",");
+		star = memchr(flow, '*', end - flow);
+		len = (star ? star : end) - flow;
+		count = (star ? atoi(star + 1) : 1);
+
+		for (i = 0; i < STEPS; i++)
+			if ((int)strlen(steps[i].name) == len &&
+					strncmp(steps[i].name, flow, len) == 0)
+				break;
+		if (i == STEPS) {
+			fprintf(stderr, "agi-loadgen: no step %.*s\n", len,
+									flow);
+			return -1;
+		}
+
+		while (count-- > 0)
+			steps[i].run(session, &response);
+
+		flow = (*end ? end + 1 : end);
+	}
+
+	return 0;
+
+}
+
+/*
+ * serve_flow
+ *	FastAGI handler which runs the flow of the call.
+ */
+static void serve_flow(cagi_session *session) {
+
+	const char *flow = cagi_arg(session, 0);
+
+	run_flow(session, (flow && *flow ? flow : DEFAULT_FLOW));
+
+}
+
+/*
+ * usage
+ *	Print how to run the load generator, and quit.
+ */
+static void usage(void) {
+
+	fprintf(stderr,
+		"usage: agi-loadgen [<options>] -c <host>:<port>\n"
+		"       agi-loadgen [<options>] [<program> [<args>...]]\n"
+		"       agi-loadgen -R [-l <port>]\n"
+		"options: -n <calls> -C <channels> -F <flow> -f <script>\n"
+		"         -L <latency> -s <seed> -P <pid> -J\n");
+	exit(2);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	int i, n, opt, timeout, runner = 0, port = 0, channels = 100, json = 0;
+	char *target = NULL, *portstr, *flow = DEFAULT_FLOW, request[256];
+	char *self[] = { "/proc/self/exe", "-R", NULL };
+	pid_t pid = 0;
+	double start, elapsed, cpu = 0, cpu0 = 0;
+	long rss = 0;
+	struct addrinfo hints;
+	struct epoll_event events[_FASTAGI_BACKLOG];
+	struct rlimit limit;
+	struct rusage usage_children;
+	cagi_session *session;
+	const char *argflow;
+
+	while ((opt = getopt(argc, argv, "+n:C:F:f:L:s:P:c:Rl:J")) != -1) {
+		switch (opt) {
+			case 'n':
+				total_calls = atol(optarg);
+				break;
+			case 'C':
+				channels = atoi(optarg);
+				break;
+			case 'F':
+				flow = optarg;
+				break;
+			case 'f':
+				if (sim_load(optarg) == -1)
+					return 2;
+				break;
+			case 'L':
+				if (sim_parse_latency(optarg, &sim_latency)
+									== -1)
+					usage();
+				break;
+			case 's':
+				sim_seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'P':
+				pid = atoi(optarg);
+				break;
+			case 'c':
+				target = optarg;
+				break;
+			case 'R':
+				runner = 1;
+				break;
+			case 'l':
+				port = atoi(optarg);
+				break;
+			case 'J':
+				json = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	/*
+	 * Running flows, as a classic AGI program or a FastAGI server.
+	 */
+	if (runner) {
+		if (port > 0)
+			return fastagi_serve(NULL, port, serve_flow);
+
+		session = cagi_default_session();
+		cagi_readvars(session);
+		argflow = cagi_arg(session, 0);
+		return (run_flow(session, (argflow && *argflow ? argflow :
+							DEFAULT_FLOW)) ? 1 : 0);
+	}
+
+	if ((target != NULL && optind < argc) || channels < 1 ||
+							total_calls < 1)
+		usage();
+
+	if (target != NULL) {
+		snprintf(request, sizeof(request), "agi://%s/", target);
+		if ((portstr = strrchr(target, ':')) == NULL)
+			usage();
+		*portstr++ = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(target, portstr, &hints, &address) != 0) {
+			fprintf(stderr, "agi-loadgen: cannot resolve %s\n",
+									target);
+			return 2;
+		}
+		sim_defaults(request, 1);
+	} else {
+		program = (optind < argc ? argv + optind : self);
+		sim_defaults(program[0], 0);
+	}
+	sim_args[sim_nargs++] = flow;
+
+	/*
+	 * Every channel takes a descriptor or two, more than the usual limit
+	 * allows for.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	timers = malloc(channels * sizeof(struct channel *));
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || timers == NULL) {
+		fprintf(stderr, "agi-loadgen: cannot create event loop\n");
+		return 1;
+	}
+
+	if (pid > 0 && proc_usage(pid, &cpu0, &rss) == -1) {
+		fprintf(stderr, "agi-loadgen: cannot read process %d\n",
+								(int)pid);
+		return 2;
+	}
+
+	start = now();
+	for (i = 0; i < channels; i++)
+		start_call();
+
+	while (live_calls > 0) {
+		timeout = call_timers();
+		if (live_calls == 0)
+			break;
+
+		n = epoll_wait(epfd, events, _FASTAGI_BACKLOG, timeout);
+		for (i = 0; i < n; i++)
+			call_read(events[i].data.ptr);
+
+		if (program != NULL)
+			reap(0);
+	}
+	elapsed = (now() - start) / 1e6;
+
+	/*
+	 * CPU time and memory are the children's in fork mode (the memory of
+	 * the largest one), and <pid>'s otherwise.
+	 */
+	if (program != NULL) {
+		reap(1);
+		getrusage(RUSAGE_CHILDREN, &usage_children);
+		cpu = usage_children.ru_utime.tv_sec +
+			usage_children.ru_utime.tv_usec / 1e6 +
+			usage_children.ru_stime.tv_sec +
+			usage_children.ru_stime.tv_usec / 1e6;
+		rss = usage_children.ru_maxrss;
+	} else if (pid > 0 && proc_usage(pid, &cpu, &rss) == 0)
+		cpu -= cpu0;
+
+	report(json, (program != NULL ? "fork" : "fastagi"), channels,
+							elapsed, cpu, rss);
+
+	if (address != NULL)
+		freeaddrinfo(address);
+
+	return (failed_calls > 0 ? 1 : 0);
+
+}
@@ -0,0 +1,421 @@
+/*
+ * agi-sim-check.c
+ *
+ * This program checks cAGI against agi-sim.c, for the things that are hard to get right and
+ * easy to break: responses to pipelined commands, asterisk hanging up in the middle of a
+ * command, blocking commands mixed in with asynchronous ones, and the variable and AstDB
+ * caches noticing the commands that make them stale. Every check is a call of its own, with
+ * the simulator playing asterisk on the other end of a socketpair, in a thread. The rules it
+ * answers with (check_rules) give every command a response of its own, so that an answer
+ * handed to the wrong command shows.
+ *
+ * Build it from a directory where the cAGI headers are available as wpbx-cagi.h,
+ * wpbx-cagi-internals.h and wpbx-cagi-commands.def, next to agi-sim.c:
+ *	gcc -O2 -o agi-sim-check agi-sim-check.c cagi*.c -lpthread -lm
+ *
+ * usage:	agi-sim-check [<options>]
+ * options:	-f <script>	Read more rules from <script> (see agi-sim.c), which
+ *				come after the checks' own.
+ *		-L <latency>	The latency of commands no rule gives one.
+ *		-t		Trace commands and responses to stderr.
+ *
+ * Exits with status 0 if every check passed, and 1 otherwise.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+#define AGI_SIM_NO_MAIN
+#include "agi-sim.c"
+
+/*
+ * check_rules are the simulator's rules for every check (see agi-sim.c).
+ */
+static const char *check_rules[] = {
+	"on \"NOOP one\" reply \"200 result=1 (one)\"",
+	"on \"NOOP two\" reply \"200 result=2 (two)\" latency 5",
+	"on \"NOOP three\" reply \"200 result=3 (three)\"",
+	"on \"NOOP four\" reply \"200 result=4 (four)\"",
+	"on \"GET DATA hangup\" hangup latency 5",
+	"on \"GET VARIABLE X\" reply \"200 result=1 (x)\"",
+	"on \"GET FULL VARIABLE\" reply \"200 result=1 (full)\"",
+	"on \"DATABASE GET fam key\" reply \"200 result=1 (stored)\"",
+	NULL
+};
+
+/*
+ * CHECK makes the running check fail if <cond> doesn't hold, and says where.
+ */
+#define CHECK(cond) \
+	check_that((cond), #cond, __LINE__)
+
+/*
+ * The failures of the running check, and the responses the async check's
+ * callback was handed.
+ */
+static int failures = 0;
+static int called = 0;
+
+/*
+ * check_that
+ *	Count a failure (and print it) unless <ok>.
+ */
+static void check_that(const int ok, const char *cond, const int line) {
+
+	if (ok)
+		return;
+
+	fprintf(stderr, "agi-sim-check.c:%d: %s\n", line, cond);
+	failures++;
+
+}
+
+/*
+ * view_is
+ *	Tell whether <view> holds exactly <str>.
+ */
+static int view_is(const cagi_view view, const char *str) {
+
+	return (view.len == (int)strlen(str) && memcmp(view.str, str,
+							view.len) == 0);
+
+}
+
+/*
+ * check_pipeline
+ *	Queue a few commands, one of them slower to answer, and check that each
+ *	gets its own response back from the batch.
+ */
+static void check_pipeline(cagi_session *session) {
+
+	cagi_response results[3];
+
+	CHECK(cagi_queue_noop(session, "one") == 0);
+	CHECK(cagi_queue_noop(session, "two") == 1);
+	CHECK(cagi_queue_noop(session, "three") == 2);
+	CHECK(cagi_batch_run(session, results) == 3);
+
+	CHECK(results[0].result == 1 && view_is(results[0].value, "one"));
+	CHECK(results[1].result == 2 && view_is(results[1].value, "two"));
+	CHECK(results[2].result == 3 && view_is(results[2].value, "three"));
+
+}
+
+/*
+ * check_hangup
+ *	Have asterisk hang up during a blocking command, and check that the
+ *	command fails, the hangup is noted, and every command after it (queued
+ *	ones too) is refused as on a dead channel.
+ */
+static void check_hangup(cagi_session *session) {
+
+	cagi_response response, results[2];
+
+	CHECK(cagi_cmd_noop(session, "one", &response) == 1);
+	CHECK(cagi_cmd_get_data(session, "hangup", "", "", &response) == -1);
+	CHECK(response.code == 200 && session->hungup);
+
+	cagi_cmd_noop(session, "two", &response);
+	CHECK(response.code == 511);
+
+	cagi_queue_noop(session, "three");
+	cagi_queue_noop(session, "four");
+	CHECK(cagi_batch_run(session, results) == 2);
+	CHECK(results[0].code == 511 && results[1].code == 511);
+
+}
+
+/*
+ * async_delivered
+ *	The callback of the async check: checks that the response is the one
+ *	<arg> says, then runs a blocking command from within the callback.
+ */
+static void async_delivered(cagi_session *session, cagi_response *response,
+								void *arg) {
+
+	cagi_response blocking;
+
+	CHECK(response->result == (int)(long)arg);
+	CHECK(cagi_cmd_noop(session, "four", &blocking) == 4);
+	called++;
+
+}
+
+/*
+ * check_async
+ *	Submit a few commands without waiting, run blocking ones while they are
+ *	pending (and from a callback), and check that every command gets its
+ *	own response, in order.
+ */
+static void check_async(cagi_session *session) {
+
+	int i, n, polls;
+	long next = 1;
+	cagi_async *loop = cagi_async_new();
+	cagi_completion *completions;
+	cagi_response response;
+
+	called = 0;
+	CHECK(cagi_async_attach(loop, session) == 0);
+
+	CHECK(cagi_async_noop(session, "one", NULL, (void *)1L) == 0);
+	CHECK(cagi_async_noop(session, "two", async_delivered, (void *)2L) ==
+									0);
+	CHECK(cagi_async_noop(session, "three", NULL, (void *)3L) == 0);
+	CHECK(cagi_cmd_noop(session, "four", &response) == 4);
+	CHECK(view_is(response.value, "four"));
+
+	/*
+	 * The responses of one and three come back as completions, in order,
+	 * and two's goes to the callback in between.
+	 */
+	for (polls = 0; (next < 5 || called == 0) && polls < 100; polls++) {
+		n = cagi_async_poll(loop, 100, &completions);
+		for (i = 0; i < n; i++, next += 2) {
+			CHECK(completions[i].session == session);
+			CHECK((long)completions[i].arg == next);
+			CHECK(completions[i].response.result == next);
+		}
+	}
+	CHECK(next == 5 && called == 1);
+
+	cagi_session_free(session);
+	cagi_async_free(loop);
+
+}
+
+/*
+ * check_varcache
+ *	Check that the variable cache answers repeated reads, and forgets what
+ *	SET VARIABLE (as a function, or queued raw) and EXEC may have changed.
+ */
+static void check_varcache(cagi_session *session) {
+
+	cagi_varcache *cache = cagi_varcache_new(16);
+	cagi_response results[1];
+	unsigned long commands;
+
+	cagi_set_varcache(session, cache);
+	commands = session->stats.commands;
+
+	CHECK(strcmp(cagi_get_variable(session, "X"), "(x)") == 0);
+	CHECK(strcmp(cagi_get_variable(session, "X"), "(x)") == 0);
+	CHECK(strcmp(cagi_get_full_variable(session, "${X}-1", NULL), "(full)")
+									== 0);
+	CHECK(strcmp(cagi_get_full_variable(session, "${X}-1", NULL), "(full)")
+									== 0);
+	CHECK(session->stats.commands == commands + 2);
+
+	cagi_set_variable(session, "X", "mine");
+	CHECK(strcmp(cagi_get_variable(session, "X"), "(mine)") == 0);
+	CHECK(session->stats.commands == commands + 3);
+	cagi_get_full_variable(session, "${X}-1", NULL);
+	CHECK(session->stats.commands == commands + 4);
+
+	cagi_exec(session, "Noop", "", results);
+	CHECK(strcmp(cagi_get_variable(session, "X"), "(x)") == 0);
+	CHECK(session->stats.commands == commands + 6);
+
+	cagi_batch_add(session, "SET VARIABLE X raw");
+	cagi_batch_run(session, results);
+	CHECK(strcmp(cagi_get_variable(session, "X"), "(x)") == 0);
+	CHECK(session->stats.commands == commands + 8);
+
+	cagi_session_free(session);
+	cagi_varcache_free(cache);
+
+}
+
+/*
+ * check_dbcache
+ *	Check that the AstDB cache answers repeated lookups, keeps what
+ *	DATABASE PUT wrote, and forgets what DATABASE DEL and DATABASE DELTREE
+ *	removed.
+ */
+static void check_dbcache(cagi_session *session) {
+
+	cagi_dbcache *cache = cagi_dbcache_new(60000, 16);
+	unsigned long commands;
+
+	cagi_set_dbcache(session, cache);
+	commands = session->stats.commands;
+
+	CHECK(strcmp(cagi_database_get(session, "fam", "key"), "(stored)")
+									== 0);
+	CHECK(strcmp(cagi_database_get(session, "fam", "key"), "(stored)")
+									== 0);
+	CHECK(session->stats.commands == commands + 1);
+
+	CHECK(cagi_database_put(session, "fam", "key", "new") == 1);
+	CHECK(strcmp(cagi_database_get(session, "fam", "key"), "(new)") == 0);
+	CHECK(session->stats.commands == commands + 2);
+
+	CHECK(cagi_database_del(session, "fam", "key") == 1);
+	CHECK(strcmp(cagi_database_get(session, "fam", "key"), "(stored)")
+									== 0);
+	CHECK(session->stats.commands == commands + 4);
+
+	CHECK(cagi_database_deltree(session, "fam", "") == 1);
+	CHECK(strcmp(cagi_database_get(session, "fam", "key"), "(stored)")
+									== 0);
+	CHECK(session->stats.commands == commands + 6);
+
+	cagi_session_free(session);
+	cagi_dbcache_free(cache);
+
+}
+
+/*
+ * struct check
+ *	A check, and whether it frees the session itself (because it has to
+ *	free it before what is attached to it).
+ */
+static const struct check {
+	const char *name;
+	void (*run)(cagi_session *session);
+	int frees;
+} checks[] = {
+	{ "pipeline", check_pipeline, 0 },
+	{ "hangup", check_hangup, 0 },
+	{ "async", check_async, 1 },
+	{ "varcache", check_varcache, 1 },
+	{ "dbcache", check_dbcache, 1 }
+};
+
+#define CHECKS ((int)(sizeof(checks) / sizeof(checks[0])))
+
+/*
+ * struct peer
+ *	The simulator's end of a call.
+ */
+struct peer {
+	int fd;
+	long id;
+	struct sim_stats stats;
+};
+
+/*
+ * peer_run
+ *	Play asterisk for the call of <arg> (a struct peer), until the check
+ *	closes its end.
+ */
+static void * peer_run(void *arg) {
+
+	struct peer *peer = arg;
+
+	sim_run(peer->fd, peer->fd, peer->id, &peer->stats);
+	return NULL;
+
+}
+
+/*
+ * run_check
+ *	Run <check> as call number <id>.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the check failed, or couldn't run).
+ */
+static int run_check(const struct check *check, const long id) {
+
+	int fds[2];
+	pthread_t thread;
+	struct peer peer;
+	cagi_session *session;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		fprintf(stderr, "agi-sim-check: cannot create a socketpair\n");
+		return -1;
+	}
+
+	memset(&peer, 0, sizeof(peer));
+	peer.fd = fds[1];
+	peer.id = id;
+	if (pthread_create(&thread, NULL, peer_run, &peer) != 0) {
+		fprintf(stderr, "agi-sim-check: cannot start the peer\n");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	failures = 0;
+	session = cagi_session_new(fds[0], fds[0]);
+	cagi_readvars(session);
+	check->run(session);
+	if (!check->frees)
+		cagi_session_free(session);
+
+	/*
+	 * Closing our end ends the peer's call.
+	 */
+	close(fds[0]);
+	pthread_join(thread, NULL);
+	close(fds[1]);
+
+	printf("%-10s %s\n", check->name, (failures == 0 ? "ok" : "FAILED"));
+	return (failures == 0 ? 0 : -1);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	int i, opt, status = 0;
+	char line[SIM_BUFF_SIZE];
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/*
+	 * The first rule that matches wins, so ours go in first.
+	 */
+	for (i = 0; check_rules[i] != NULL; i++) {
+		snprintf(line, sizeof(line), "%s", check_rules[i]);
+		if (sim_parse_line(line) == -1) {
+			fprintf(stderr, "agi-sim-check: bad rule: %s\n",
+							check_rules[i]);
+			return 2;
+		}
+	}
+
+	while ((opt = getopt(argc, argv, "f:L:t")) != -1) {
+		switch (opt) {
+			case 'f':
+				if (sim_load(optarg) == -1)
+					return 2;
+				break;
+			case 'L':
+				if (sim_parse_latency(optarg, &sim_latency)
+									== -1) {
+					fprintf(stderr, "agi-sim-check: bad "
+						"latency: %s\n", optarg);
+					return 2;
+				}
+				break;
+			case 't':
+				sim_trace = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: agi-sim-check [-f "
+					"<script>] [-L <latency>] [-t]\n");
+				return 2;
+		}
+	}
+	sim_defaults("agi-sim-check", 0);
+
+	for (i = 0; i < CHECKS; i++)
+		if (run_check(&checks[i], i) == -1)
+			status = 1;
+
+	return status;
+
+}
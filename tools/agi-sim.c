@@ -0,0 +1,1067 @@
+/*
+ * agi-sim.c
+ *
+ * This program stands in for asterisk on the other end of an AGI session, so that cAGI
+ * programs can be tested and benchmarked without a PBX. It sends the variables readvars()
+ * expects, then answers every command with a canned response after a simulated delay, and
+ * can hang the call up in the middle of a command. It talks to a classic AGI program over
+ * pipes (or a socketpair), or to a FastAGI server over TCP.
+ *
+ * Responses are picked by rules, read from a script (-f) which looks like:
+ *	# Comments start with a '#'.
+ *	var agi_callerid 1001
+ *	arg sales
+ *	on "STREAM FILE" reply "200 result=0 endpos=8000" latency exp:2
+ *	on "GET DATA" hangup latency uniform:500,3000 p 0.05
+ *	on "GET DATA" reply "200 result=1234" latency 800
+ *	on "DATABASE GET" reply "200 result=0"
+ * The first rule whose (case insensitive) prefix matches the command wins, unless it has a
+ * probability (p) and the dice say otherwise. A reply sends the response, a hangup sends
+ * HANGUP and "200 result=-1" (dead channel, every command after that gets a 511), and a close
+ * drops the connection without a word. Latencies are in milliseconds, and are either fixed
+ * (<ms>), uniform:<min>,<max> or exp:<mean>. Commands no rule matches get a sensible default
+ * (see default_rules), after the default latency (-L).
+ *
+ * Build it with:
+ *	gcc -O2 -o agi-sim agi-sim.c -lpthread -lm
+ * It doesn't need cAGI itself. Other tools can embed the simulator (to run peers on
+ * socketpairs, for instance) by defining AGI_SIM_NO_MAIN and including this file; they
+ * should ignore SIGPIPE, like main() does.
+ *
+ * usage:	agi-sim [<options>] <program> [<args>...]	(classic AGI)
+ *		agi-sim [<options>] -c <host>:<port>[/<script>]	(FastAGI)
+ * options:	-f <script>	Read rules and variables from <script>.
+ *		-v <name>=<value> Set (or add) a variable of the header.
+ *		-a <arg>	Add an argument (agi_arg_1, agi_arg_2, ...).
+ *		-L <latency>	The latency of commands no rule gives one.
+ *		-n <calls>	Run <calls> calls (1).
+ *		-j <parallel>	Run up to <parallel> calls at once (1).
+ *		-s <seed>	Seed the random delays and probabilities.
+ *		-S		Use a socketpair instead of pipes (classic AGI).
+ *		-x		Close the connection when the call hangs up.
+ *		-t		Trace commands and responses to stderr.
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#ifndef SIM_BUFF_SIZE
+#define SIM_BUFF_SIZE		8192
+#endif
+#define SIM_MAX_VARS		64
+#define SIM_DEAD_RESPONSE \
+	"511 Command Not Permitted on a dead channel or intercept routine"
+
+/*
+ * enum sim_action
+ *	What a rule does with the commands it matches.
+ */
+enum sim_action {
+	SIM_REPLY,			// send the rule's response
+	SIM_HANGUP,			// hang the channel up
+	SIM_CLOSE,			// drop the connection
+	SIM_HUNGUP			// the program hung up (HANGUP)
+};
+
+/*
+ * enum sim_dist
+ *	The distribution of a latency.
+ */
+enum sim_dist {
+	SIM_NONE,			// not given (use the default)
+	SIM_FIXED,			// always <a>
+	SIM_UNIFORM,			// between <a> and <b>
+	SIM_EXP				// exponential, with a mean of <a>
+};
+
+/*
+ * struct sim_latency
+ *	A simulated delay, in milliseconds.
+ */
+struct sim_latency {
+	enum sim_dist dist;
+	double a;
+	double b;
+};
+
+/*
+ * struct sim_rule
+ *	A rule matching the commands which start with <prefix>.
+ */
+struct sim_rule {
+	const char *prefix;
+	int prefixlen;
+	enum sim_action action;
+	const char *response;
+	struct sim_latency latency;
+	double probability;
+};
+
+/*
+ * struct sim_stats
+ *	What happened over one or more calls.
+ */
+struct sim_stats {
+	long calls;
+	long commands;
+	long hangups;			// calls hung up by a rule or the script
+	long closes;			// connections dropped by a rule
+	long failures;			// calls which couldn't run, or failed
+};
+
+/*
+ * struct sim_call
+ *	A call in progress: its connection and the command being read.
+ */
+struct sim_call {
+	int in_fd;
+	int out_fd;
+	uint64_t rand;
+	int dead;
+	char buf[SIM_BUFF_SIZE];
+	int start;
+	int end;
+};
+
+/*
+ * SIM_DEFAULT makes a rule replying <reply> to the commands which start with
+ * <text>, after the default latency.
+ */
+#define SIM_DEFAULT(text, reply) { .prefix = text,			\
+	.prefixlen = sizeof(text) - 1, .action = SIM_REPLY, .response = reply }
+
+/*
+ * default_rules answer whatever the script's rules (and -f) don't, roughly
+ * like asterisk would on a call where nobody presses anything.
+ */
+static struct sim_rule default_rules[] = {
+	SIM_DEFAULT("STREAM FILE", "200 result=0 endpos=8000"),
+	SIM_DEFAULT("CONTROL STREAM FILE", "200 result=0 endpos=8000"),
+	SIM_DEFAULT("GET OPTION", "200 result=0 endpos=8000"),
+	SIM_DEFAULT("GET DATA", "200 result=1234"),
+	SIM_DEFAULT("GET VARIABLE", "200 result=1 (value)"),
+	SIM_DEFAULT("GET FULL VARIABLE", "200 result=1 (value)"),
+	SIM_DEFAULT("DATABASE GET", "200 result=1 (value)"),
+	SIM_DEFAULT("DATABASE", "200 result=1"),
+	SIM_DEFAULT("SET VARIABLE", "200 result=1"),
+	SIM_DEFAULT("SPEECH RECOGNIZE", "200 result=1 (speech) endpos=0 "
+		"results=1 score0=1000 text0=\"yes\" grammar0=yesno"),
+	SIM_DEFAULT("SPEECH", "200 result=1"),
+	SIM_DEFAULT("RECORD FILE", "200 result=0 (timeout) endpos=16000"),
+	SIM_DEFAULT("RECEIVE TEXT", "200 result=1 (text)"),
+	SIM_DEFAULT("CHANNEL STATUS", "200 result=6"),
+	SIM_DEFAULT("VERBOSE", "200 result=1"),
+	SIM_DEFAULT("TDD MODE", "200 result=1"),
+	SIM_DEFAULT("SET CALLERID", "200 result=1"),
+	SIM_DEFAULT("", "200 result=0")
+};
+
+#define DEFAULT_RULES ((int)(sizeof(default_rules) / sizeof(default_rules[0])))
+
+/*
+ * hungup_rule answers the program's own HANGUP, and dead_rule everything
+ * after the channel is gone.
+ */
+static struct sim_rule hungup_rule = {
+	.prefix = "HANGUP",
+	.prefixlen = 6,
+	.action = SIM_HUNGUP,
+	.response = "200 result=1"
+};
+static struct sim_rule dead_rule = {
+	.prefix = "",
+	.prefixlen = 0,
+	.action = SIM_REPLY,
+	.response = SIM_DEAD_RESPONSE,
+	.latency = { .dist = SIM_FIXED, .a = 0, .b = 0 }
+};
+
+/*
+ * The simulator's configuration, set up before any call starts and only
+ * read after that.
+ */
+static struct sim_rule *sim_rules = NULL;
+static int sim_nrules = 0;
+static char *sim_names[SIM_MAX_VARS];
+static char *sim_values[SIM_MAX_VARS];
+static int sim_nvars = 0;
+static char *sim_args[SIM_MAX_VARS];
+static int sim_nargs = 0;
+static struct sim_latency sim_latency = { .dist = SIM_FIXED, .a = 0, .b = 0 };
+static uint64_t sim_seed = 1;
+static int sim_exit_on_hangup = 0;
+static int sim_trace = 0;
+
+/*
+ * sim_random
+ *	Draw a number in [0, 1) from the generator of <call> (xorshift64*).
+ */
+static double sim_random(struct sim_call *call) {
+
+	call->rand ^= call->rand >> 12;
+	call->rand ^= call->rand << 25;
+	call->rand ^= call->rand >> 27;
+
+	return (call->rand * 0x2545F4914F6CDD1DULL >> 11) /
+							9007199254740992.0;
+
+}
+
+/*
+ * sim_draw
+ *	Draw a delay from <latency> (the default latency if it has none), in
+ *	milliseconds.
+ */
+static double sim_draw(struct sim_call *call, const struct sim_latency
+								*latency) {
+
+	if (latency->dist == SIM_NONE)
+		latency = &sim_latency;
+
+	switch (latency->dist) {
+		case SIM_UNIFORM:
+			return latency->a + (latency->b - latency->a) *
+							sim_random(call);
+		case SIM_EXP:
+			return -latency->a * log(1.0 - sim_random(call));
+		default:
+			return latency->a;
+	}
+
+}
+
+/*
+ * sim_sleep
+ *	Sleep for <ms> milliseconds.
+ */
+static void sim_sleep(const double ms) {
+
+	struct timespec ts;
+
+	if (ms <= 0)
+		return;
+
+	ts.tv_sec = (time_t)(ms / 1000);
+	ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1e6);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+
+}
+
+/*
+ * sim_parse_latency
+ *	Parse <str> (Ex: 5, uniform:1,10, exp:2.5) into <latency>.
+ * returns
+ *	Success: 0
+ *	Failure: -1
+ */
+static int sim_parse_latency(const char *str, struct sim_latency *latency) {
+
+	char *end;
+
+	memset(latency, 0, sizeof(struct sim_latency));
+
+	if (strncmp(str, "uniform:", 8) == 0) {
+		latency->dist = SIM_UNIFORM;
+		latency->a = strtod(str + 8, &end);
+		if (*end != ',')
+			return -1;
+		latency->b = strtod(end + 1, &end);
+	} else if (strncmp(str, "exp:", 4) == 0) {
+		latency->dist = SIM_EXP;
+		latency->a = strtod(str + 4, &end);
+	} else {
+		latency->dist = SIM_FIXED;
+		latency->a = strtod(str, &end);
+	}
+
+	return (*end == '\0' && end != str ? 0 : -1);
+
+}
+
+/*
+ * sim_set_var
+ *	Set the variable <name> of the header to <value>, adding it if it
+ *	isn't there yet.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (too many variables).
+ */
+static int sim_set_var(const char *name, const char *value) {
+
+	int i;
+
+	for (i = 0; i < sim_nvars; i++)
+		if (strcmp(sim_names[i], name) == 0)
+			break;
+
+	if (i == SIM_MAX_VARS)
+		return -1;
+
+	if (i == sim_nvars) {
+		sim_names[i] = strdup(name);
+		sim_nvars++;
+	} else
+		free(sim_values[i]);
+
+	sim_values[i] = strdup(value);
+	return 0;
+
+}
+
+/*
+ * sim_token
+ *	Cut the next token out of <*str>, which is moved past it. Tokens are
+ *	separated by whitespace, and may be double quoted (with backslash
+ *	escapes) to contain some.
+ * returns
+ *	Success: The token.
+ *	Failure: NULL (no more tokens, or a comment starts).
+ */
+static char * sim_token(char **str) {
+
+	char *p = *str, *token, *out;
+
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+
+	if (*p == '\0' || *p == '#') {
+		*str = p;
+		return NULL;
+	}
+
+	if (*p != '"') {
+		token = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' &&
+								*p != '\n')
+			p++;
+		if (*p != '\0')
+			*p++ = '\0';
+		*str = p;
+		return token;
+	}
+
+	token = out = ++p;
+	while (*p != '\0' && *p != '"') {
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+		*out++ = *p++;
+	}
+	if (*p == '"')
+		p++;
+	*out = '\0';
+
+	*str = p;
+	return token;
+
+}
+
+/*
+ * sim_parse_line
+ *	Apply one line of a script (see the top of this file).
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the line makes no sense).
+ */
+static int sim_parse_line(char *line) {
+
+	char *word, *name, *value;
+	struct sim_rule rule;
+
+	if ((word = sim_token(&line)) == NULL)
+		return 0;
+
+	if (strcmp(word, "var") == 0) {
+		if ((name = sim_token(&line)) == NULL)
+			return -1;
+		value = line + strspn(line, " \t");
+		value[strcspn(value, "\r\n")] = '\0';
+		return sim_set_var(name, value);
+	}
+
+	if (strcmp(word, "arg") == 0) {
+		if ((value = sim_token(&line)) == NULL ||
+						sim_nargs == SIM_MAX_VARS)
+			return -1;
+		sim_args[sim_nargs++] = strdup(value);
+		return 0;
+	}
+
+	if (strcmp(word, "on") != 0 || (name = sim_token(&line)) == NULL ||
+					(word = sim_token(&line)) == NULL)
+		return -1;
+
+	memset(&rule, 0, sizeof(rule));
+	rule.prefix = strdup(name);
+	rule.prefixlen = strlen(name);
+	rule.probability = 1;
+
+	if (strcmp(word, "reply") == 0) {
+		rule.action = SIM_REPLY;
+		if ((value = sim_token(&line)) == NULL)
+			return -1;
+		rule.response = strdup(value);
+	} else if (strcmp(word, "hangup") == 0)
+		rule.action = SIM_HANGUP;
+	else if (strcmp(word, "close") == 0)
+		rule.action = SIM_CLOSE;
+	else
+		return -1;
+
+	while ((word = sim_token(&line)) != NULL) {
+		if ((value = sim_token(&line)) == NULL)
+			return -1;
+		if (strcmp(word, "latency") == 0) {
+			if (sim_parse_latency(value, &rule.latency) == -1)
+				return -1;
+		} else if (strcmp(word, "p") == 0)
+			rule.probability = atof(value);
+		else
+			return -1;
+	}
+
+	sim_rules = realloc(sim_rules, (sim_nrules + 1) *
+						sizeof(struct sim_rule));
+	if (sim_rules == NULL)
+		return -1;
+	sim_rules[sim_nrules++] = rule;
+
+	return 0;
+
+}
+
+/*
+ * sim_load
+ *	Apply every line of the script at <path>.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (an error is printed).
+ */
+static int sim_load(const char *path) {
+
+	int n = 0;
+	char line[SIM_BUFF_SIZE];
+	FILE *file;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "agi-sim: cannot open %s\n", path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		n++;
+		if (sim_parse_line(line) == -1) {
+			fprintf(stderr, "agi-sim: %s:%d: bad line\n", path, n);
+			fclose(file);
+			return -1;
+		}
+	}
+
+	fclose(file);
+	return 0;
+
+}
+
+/*
+ * sim_defaults
+ *	Fill in the header variables nobody set, like asterisk would for a call
+ *	running <request> (a program, or an agi:// URL).
+ */
+static void sim_defaults(const char *request, const int network) {
+
+	int i;
+	static const char *defaults[][2] = {
+		{ "agi_channel", "SIP/1001-00000001" },
+		{ "agi_language", "en" },
+		{ "agi_type", "SIP" },
+		{ "agi_uniqueid", "" },
+		{ "agi_version", "1.6.2.0" },
+		{ "agi_callerid", "1001" },
+		{ "agi_calleridname", "Simulated Caller" },
+		{ "agi_callingpres", "0" },
+		{ "agi_callingani2", "0" },
+		{ "agi_callington", "0" },
+		{ "agi_callingtns", "0" },
+		{ "agi_dnid", "2000" },
+		{ "agi_rdnis", "unknown" },
+		{ "agi_context", "default" },
+		{ "agi_extension", "2000" },
+		{ "agi_priority", "1" },
+		{ "agi_enhanced", "0.0" },
+		{ "agi_accountcode", "" },
+		{ "agi_threadid", "140000000000000" }
+	};
+
+	if (network) {
+		for (i = 0; i < sim_nvars; i++)
+			if (strcmp(sim_names[i], "agi_network") == 0)
+				break;
+		if (i == sim_nvars)
+			sim_set_var("agi_network", "yes");
+	}
+
+	for (i = 0; i < sim_nvars; i++)
+		if (strcmp(sim_names[i], "agi_request") == 0)
+			break;
+	if (i == sim_nvars)
+		sim_set_var("agi_request", request);
+
+	for (i = 0; i < (int)(sizeof(defaults) / sizeof(defaults[0])); i++) {
+		int j;
+
+		for (j = 0; j < sim_nvars; j++)
+			if (strcmp(sim_names[j], defaults[i][0]) == 0)
+				break;
+		if (j == sim_nvars)
+			sim_set_var(defaults[i][0], defaults[i][1]);
+	}
+
+}
+
+/*
+ * sim_write
+ *	Write all <len> bytes of <str> to <fd>.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the other end is gone).
+ */
+static int sim_write(const int fd, const char *str, int len) {
+
+	int n;
+
+	while (len > 0) {
+		n = write(fd, str, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		str += n;
+		len -= n;
+	}
+
+	return 0;
+
+}
+
+/*
+ * sim_send
+ *	Send the line <str> (without its newline) on <call>.
+ */
+static int sim_send(struct sim_call *call, const char *str) {
+
+	char line[SIM_BUFF_SIZE];
+	int len;
+
+	len = snprintf(line, sizeof(line) - 1, "%s", str);
+	if (len > (int)sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	if (sim_trace)
+		fprintf(stderr, "<< %.*s", len, line);
+
+	return sim_write(call->out_fd, line, len);
+
+}
+
+/*
+ * sim_header
+ *	Send the variables of a new call, which is call number <id>.
+ */
+static int sim_header(struct sim_call *call, const long id) {
+
+	int i, len = 0;
+	char header[SIM_BUFF_SIZE * 2];
+
+	for (i = 0; i < sim_nvars; i++) {
+		if (strcmp(sim_names[i], "agi_uniqueid") == 0 &&
+							*sim_values[i] == '\0')
+			len += snprintf(header + len, sizeof(header) - len,
+				"agi_uniqueid: %ld.%ld\n", (long)time(NULL),
+									id);
+		else
+			len += snprintf(header + len, sizeof(header) - len,
+				"%s: %s\n", sim_names[i], sim_values[i]);
+		if (len >= (int)sizeof(header) - 1)
+			return -1;
+	}
+
+	for (i = 0; i < sim_nargs; i++) {
+		len += snprintf(header + len, sizeof(header) - len,
+				"agi_arg_%d: %s\n", i + 1, sim_args[i]);
+		if (len >= (int)sizeof(header) - 1)
+			return -1;
+	}
+	header[len++] = '\n';
+
+	return sim_write(call->out_fd, header, len);
+
+}
+
+/*
+ * sim_readline
+ *	Read the next command of <call>, and null-terminate it (without its
+ *	newline).
+ * returns
+ *	Success: The command.
+ *	Failure: NULL (the program closed the connection).
+ */
+static char * sim_readline(struct sim_call *call) {
+
+	int n;
+	char *line, *nl;
+
+	for (;;) {
+		nl = memchr(call->buf + call->start, '\n',
+						call->end - call->start);
+		if (nl != NULL) {
+			line = call->buf + call->start;
+			call->start = nl + 1 - call->buf;
+			if (nl > line && nl[-1] == '\r')
+				nl--;
+			*nl = '\0';
+			return line;
+		}
+
+		if (call->start > 0) {
+			memmove(call->buf, call->buf + call->start,
+						call->end - call->start);
+			call->end -= call->start;
+			call->start = 0;
+		}
+
+		/*
+		 * A command longer than the whole buffer is cut, the rest of it
+		 * comes out as the next one. No real command is that long.
+		 */
+		if (call->end == SIM_BUFF_SIZE - 1) {
+			call->buf[call->end] = '\0';
+			call->start = call->end = 0;
+			return call->buf;
+		}
+
+		n = read(call->in_fd, call->buf + call->end,
+						SIM_BUFF_SIZE - 1 - call->end);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
+		call->end += n;
+	}
+
+}
+
+/*
+ * sim_match
+ *	Find the rule for <command>: the first of the script's rules which
+ *	matches (and wins its draw), else the first default one. A dead
+ *	channel, and the program's own HANGUP, have rules of their own.
+ */
+static const struct sim_rule * sim_match(struct sim_call *call,
+	const char *command) {
+
+	int i;
+
+	if (call->dead)
+		return &dead_rule;
+
+	if (strncasecmp(command, "HANGUP", 6) == 0)
+		return &hungup_rule;
+
+	for (i = 0; i < sim_nrules; i++) {
+		if (strncasecmp(command, sim_rules[i].prefix,
+					sim_rules[i].prefixlen) != 0)
+			continue;
+		if (sim_rules[i].probability >= 1 ||
+				sim_random(call) < sim_rules[i].probability)
+			return &sim_rules[i];
+	}
+
+	for (i = 0; i < DEFAULT_RULES; i++)
+		if (strncasecmp(command, default_rules[i].prefix,
+					default_rules[i].prefixlen) == 0)
+			break;
+
+	return &default_rules[i];
+
+}
+
+/*
+ * sim_apply
+ *	Answer a command of <call> according to <rule>, once its delay is over.
+ *	The program hanging up itself works like it does on asterisk: the
+ *	command succeeds, and the channel is dead from then on.
+ * returns
+ *	Success: 0 if the call goes on, 1 if it is over.
+ *	Failure: -1 (the connection broke while sending).
+ */
+static int sim_apply(struct sim_call *call, const struct sim_rule *rule,
+	struct sim_stats *stats) {
+
+	switch (rule->action) {
+		case SIM_CLOSE:
+			stats->closes++;
+			return 1;
+		case SIM_HANGUP:
+			stats->hangups++;
+			call->dead = 1;
+			if (sim_send(call, "HANGUP") == -1 ||
+					sim_send(call, "200 result=-1") == -1)
+				return 1;
+			return sim_exit_on_hangup;
+		case SIM_HUNGUP:
+			stats->hangups++;
+			call->dead = 1;
+			if (sim_send(call, rule->response) == -1 ||
+						sim_send(call, "HANGUP") == -1)
+				return 1;
+			return sim_exit_on_hangup;
+		default:
+			return sim_send(call, rule->response);
+	}
+
+}
+
+/*
+ * sim_run
+ *	Play asterisk on the connection (<in_fd>, <out_fd>) for one call,
+ *	number <id>, until the program closes it or a rule drops it. The
+ *	descriptors are left open.
+ * returns
+ *	Success: 0
+ *	Failure: -1 (the connection broke while sending).
+ * NOTE: This isn't static, so that programs which embed the simulator but
+ *	don't use it get no warning.
+ */
+int sim_run(const int in_fd, const int out_fd, const long id,
+	struct sim_stats *stats) {
+
+	char *command;
+	const struct sim_rule *rule;
+	struct sim_call *call;
+	int status = 0;
+
+	call = calloc(1, sizeof(struct sim_call));
+	if (call == NULL)
+		return -1;
+	call->in_fd = in_fd;
+	call->out_fd = out_fd;
+	call->rand = (sim_seed + id) * 0x9E3779B97F4A7C15ULL | 1;
+
+	stats->calls++;
+	if (sim_header(call, id) == -1) {
+		stats->failures++;
+		free(call);
+		return -1;
+	}
+
+	while ((command = sim_readline(call)) != NULL) {
+
+		if (*command == '\0')
+			continue;
+
+		stats->commands++;
+		if (sim_trace)
+			fprintf(stderr, ">> %s\n", command);
+
+		rule = sim_match(call, command);
+		sim_sleep(sim_draw(call, &rule->latency));
+
+		if ((status = sim_apply(call, rule, stats)) != 0)
+			break;
+	}
+
+	free(call);
+	return (status == -1 ? -1 : 0);
+
+}
+
+#ifndef AGI_SIM_NO_MAIN
+
+/*
+ * What main() was asked to do, shared by the threads running the calls.
+ */
+static char **sim_program = NULL;
+static int sim_socketpair = 0;
+static struct addrinfo *sim_addr = NULL;
+static long sim_calls = 1;
+static long sim_next = 0;
+static struct sim_stats sim_total;
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * run_program
+ *	Run call number <id> with a new instance of the program, like asterisk
+ *	runs a classic AGI script.
+ */
+static void run_program(const long id, struct sim_stats *stats) {
+
+	int in[2], out[2], status;
+	pid_t pid;
+
+	/*
+	 * Other threads fork too, so every descriptor is close-on-exec, lest
+	 * another call's program hold our ends open (dup2() clears it on the
+	 * program's own).
+	 */
+	if (sim_socketpair) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, in)
+									== -1) {
+			stats->failures++;
+			return;
+		}
+		out[0] = in[1];
+		out[1] = in[0];
+	} else if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC)
+									== -1) {
+		stats->failures++;
+		return;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		stats->failures++;
+		return;
+	}
+
+	if (pid == 0) {
+		dup2(out[0], 0);
+		dup2(in[1], 1);
+		execvp(sim_program[0], sim_program);
+		fprintf(stderr, "agi-sim: cannot run %s\n", sim_program[0]);
+		_exit(127);
+	}
+
+	if (sim_socketpair)
+		close(in[1]);
+	else {
+		close(out[0]);
+		close(in[1]);
+	}
+
+	sim_run(in[0], out[1], id, stats);
+
+	close(in[0]);
+	if (!sim_socketpair)
+		close(out[1]);
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+						WEXITSTATUS(status) != 0)
+		stats->failures++;
+
+}
+
+/*
+ * run_fastagi
+ *	Run call number <id> on a new connection to the FastAGI server.
+ */
+static void run_fastagi(const long id, struct sim_stats *stats) {
+
+	int fd;
+
+	fd = socket(sim_addr->ai_family, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, sim_addr->ai_addr, sim_addr->ai_addrlen)
+									== -1) {
+		if (fd != -1)
+			close(fd);
+		stats->calls++;
+		stats->failures++;
+		return;
+	}
+
+	if (sim_run(fd, fd, id, stats) == -1)
+		stats->failures++;
+	close(fd);
+
+}
+
+/*
+ * worker
+ *	Run calls until there are none left.
+ */
+static void * worker(void *unused) {
+
+	long id;
+	struct sim_stats stats;
+
+	(void)unused;
+	memset(&stats, 0, sizeof(stats));
+
+	for (;;) {
+		pthread_mutex_lock(&sim_lock);
+		id = sim_next++;
+		pthread_mutex_unlock(&sim_lock);
+		if (id >= sim_calls)
+			break;
+
+		if (sim_program != NULL)
+			run_program(id, &stats);
+		else
+			run_fastagi(id, &stats);
+	}
+
+	pthread_mutex_lock(&sim_lock);
+	sim_total.calls += stats.calls;
+	sim_total.commands += stats.commands;
+	sim_total.hangups += stats.hangups;
+	sim_total.closes += stats.closes;
+	sim_total.failures += stats.failures;
+	pthread_mutex_unlock(&sim_lock);
+
+	return NULL;
+
+}
+
+/*
+ * usage
+ *	Print how to run the simulator, and quit.
+ */
+static void usage(void) {
+
+	fprintf(stderr,
+		"usage: agi-sim [<options>] <program> [<args>...]\n"
+		"       agi-sim [<options>] -c <host>:<port>[/<script>]\n"
+		"options: -f <script> -v <name>=<value> -a <arg> -L <latency>\n"
+		"         -n <calls> -j <parallel> -s <seed> -S -x -t\n");
+	exit(2);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	int i, opt, parallel = 1;
+	char *target = NULL, *port, *script, *eq, request[SIM_BUFF_SIZE];
+	double start, elapsed;
+	struct addrinfo hints;
+	struct timespec ts;
+	pthread_t *threads;
+
+	while ((opt = getopt(argc, argv, "+f:v:a:L:n:j:s:c:Sxt")) != -1) {
+		switch (opt) {
+			case 'f':
+				if (sim_load(optarg) == -1)
+					return 2;
+				break;
+			case 'v':
+				if ((eq = strchr(optarg, '=')) == NULL)
+					usage();
+				*eq = '\0';
+				sim_set_var(optarg, eq + 1);
+				break;
+			case 'a':
+				if (sim_nargs < SIM_MAX_VARS)
+					sim_args[sim_nargs++] = optarg;
+				break;
+			case 'L':
+				if (sim_parse_latency(optarg, &sim_latency)
+									== -1)
+					usage();
+				break;
+			case 'n':
+				sim_calls = atol(optarg);
+				break;
+			case 'j':
+				parallel = atoi(optarg);
+				break;
+			case 's':
+				sim_seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'c':
+				target = optarg;
+				break;
+			case 'S':
+				sim_socketpair = 1;
+				break;
+			case 'x':
+				sim_exit_on_hangup = 1;
+				break;
+			case 't':
+				sim_trace = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if ((target == NULL) == (optind == argc) || parallel < 1)
+		usage();
+
+	/*
+	 * Programs may well exit without reading the last thing we send them
+	 * (the HANGUP after a hangup, for instance).
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (target == NULL) {
+		sim_program = argv + optind;
+		sim_defaults(sim_program[0], 0);
+	} else {
+		snprintf(request, sizeof(request), "agi://%s", target);
+		script = strchr(target, '/');
+		if (script != NULL)
+			*script++ = '\0';
+		if ((port = strrchr(target, ':')) == NULL)
+			usage();
+		*port++ = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(target, port, &hints, &sim_addr) != 0) {
+			fprintf(stderr, "agi-sim: cannot resolve %s\n", target);
+			return 2;
+		}
+
+		if (script != NULL)
+			sim_set_var("agi_network_script", script);
+		sim_defaults(request, 1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	threads = malloc(parallel * sizeof(pthread_t));
+	for (i = 0; i < parallel; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	for (i = 0; i < parallel; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = ts.tv_sec + ts.tv_nsec / 1e9 - start;
+
+	fprintf(stderr, "calls:     %ld (%ld hung up, %ld dropped, "
+		"%ld failed)\n",
+		sim_total.calls, sim_total.hangups, sim_total.closes,
+		sim_total.failures);
+	fprintf(stderr, "commands:  %ld in %.3fs (%.0f/s)\n",
+		sim_total.commands, elapsed, sim_total.commands / elapsed);
+
+	if (sim_addr != NULL)
+		freeaddrinfo(sim_addr);
+
+	return (sim_total.failures > 0 ? 1 : 0);
+
+}
+
+#endif
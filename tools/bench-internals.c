@@ -0,0 +1,445 @@
+/*
+ * bench-internals.c
+ *
+ * This program times the internals every call goes through: reading the variables, sending
+ * commands and parsing their responses, and the old string helpers. Each benchmark reports
+ * the time, heap allocations and system calls per operation. Asterisk is replaced by a pipe
+ * which is filled with canned input ahead of time (outside of the timed sections), and
+ * commands go to /dev/null, so nothing but cAGI is measured and the numbers are comparable
+ * from one commit to the next.
+ *
+ * Allocations are counted by overriding malloc() and friends (glibc only). System calls are
+ * the reads, writes and waits in the session's counters (see struct cagi_stats). Responses
+ * are queued in the pipe many at a time, so a single read() picks up several of them, just
+ * like it does for a pipelined batch.
+ *
+ * Build it like any cAGI program, from a directory where the cAGI headers are available as
+ * wpbx-cagi.h and wpbx-cagi-internals.h:
+ *	gcc -O2 -o bench-internals bench-internals.c cagi*.c -lpthread
+ *
+ * usage:	bench-internals [<iterations>]
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * The pipe holds 64 KB, so responses are queued at most this many bytes at a
+ * time.
+ */
+#define FEED_BYTES	(48 * 1024)
+
+/*
+ * The allocator's real entry points, which ours forward to.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/*
+ * allocs counts the allocations made while <counting> is set.
+ */
+static long allocs = 0;
+static int counting = 0;
+
+void * malloc(size_t size) {
+
+	allocs += counting;
+	return __libc_malloc(size);
+
+}
+
+void * calloc(size_t count, size_t size) {
+
+	allocs += counting;
+	return __libc_calloc(count, size);
+
+}
+
+void * realloc(void *ptr, size_t size) {
+
+	allocs += counting;
+	return __libc_realloc(ptr, size);
+
+}
+
+void free(void *ptr) {
+
+	__libc_free(ptr);
+
+}
+
+/*
+ * The state of the benchmark being run: its session (whose input is the
+ * pipe), and what it has used so far.
+ */
+static cagi_session *session;
+static int feed_fd;
+static double elapsed;
+static double started;
+static long syscalls;
+static long sink = 0;
+
+/*
+ * now
+ *	Return a monotonic timestamp in nanoseconds.
+ */
+static double now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+
+}
+
+/*
+ * session_syscalls
+ *	The system calls <session> has made so far.
+ */
+static long session_syscalls(void) {
+
+	return session->stats.reads + session->stats.writes +
+							session->stats.waits;
+
+}
+
+/*
+ * bench_resume
+ *	Start (or go on) measuring.
+ */
+static void bench_resume(void) {
+
+	syscalls -= session_syscalls();
+	counting = 1;
+	started = now();
+
+}
+
+/*
+ * bench_pause
+ *	Stop measuring, while the benchmark sets the next operations up.
+ */
+static void bench_pause(void) {
+
+	elapsed += now() - started;
+	counting = 0;
+	syscalls += session_syscalls();
+
+}
+
+/*
+ * bench_begin
+ *	Start a benchmark.
+ */
+static void bench_begin(void) {
+
+	elapsed = 0;
+	allocs = 0;
+	syscalls = 0;
+	bench_resume();
+
+}
+
+/*
+ * bench_end
+ *	Finish the benchmark <name>, which ran <n> operations, and print what
+ *	they cost.
+ */
+static void bench_end(const char *name, const long n) {
+
+	bench_pause();
+	printf("%-32s %10.1f %10.2f %10.3f\n", name, elapsed / n,
+				(double)allocs / n, (double)syscalls / n);
+
+}
+
+/*
+ * feed
+ *	Queue <count> copies of <input> in the pipe, for the session to read.
+ */
+static void feed(const char *input, const int count) {
+
+	static char buff[FEED_BYTES];
+	int i, len = strlen(input);
+
+	for (i = 0; i < count; i++)
+		memcpy(buff + i * len, input, len);
+
+	if (write(feed_fd, buff, count * len) != count * len) {
+		fprintf(stderr, "bench-internals: cannot feed the pipe\n");
+		exit(1);
+	}
+
+}
+
+/*
+ * make_header
+ *	Write a variable header like asterisk's, with <args> arguments, into
+ *	<buff>.
+ */
+static void make_header(char *buff, const int size, const int args) {
+
+	int i, len;
+
+	len = snprintf(buff, size,
+		"agi_request: ivr.agi\n"
+		"agi_channel: SIP/1001-00000a3f\n"
+		"agi_language: en\n"
+		"agi_type: SIP\n"
+		"agi_uniqueid: 1245040107.63\n"
+		"agi_version: 1.6.2.0\n"
+		"agi_callerid: 1001\n"
+		"agi_calleridname: Randall Degges\n"
+		"agi_callingpres: 0\n"
+		"agi_callingani2: 0\n"
+		"agi_callington: 0\n"
+		"agi_callingtns: 0\n"
+		"agi_dnid: 2000\n"
+		"agi_rdnis: unknown\n"
+		"agi_context: default\n"
+		"agi_extension: 2000\n"
+		"agi_priority: 1\n"
+		"agi_enhanced: 0.0\n"
+		"agi_accountcode: \n"
+		"agi_threadid: -1254126704\n");
+
+	for (i = 1; i <= args; i++)
+		len += snprintf(buff + len, size - len, "agi_arg_%d: value%d\n",
+									i, i);
+
+	snprintf(buff + len, size - len, "\n");
+
+}
+
+/*
+ * bench_readvars
+ *	readvars() and cagi_readvars() with <args> arguments. Every header is
+ *	fed on its own, since a session only ever reads one.
+ */
+static void bench_readvars(const long n, const int args) {
+
+	long i;
+	char name[64], header[16384];
+	asterisk_vars *vars;
+
+	make_header(header, sizeof(header), args);
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_pause();
+		feed(header, 1);
+		bench_resume();
+		vars = readvars();
+		sink += vars->agi_callerid[0];
+		free(vars);
+	}
+	snprintf(name, sizeof(name), "readvars() %d args", args);
+	bench_end(name, n);
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_pause();
+		feed(header, 1);
+		bench_resume();
+		cagi_readvars(session);
+		sink += cagi_argc(session);
+	}
+	snprintf(name, sizeof(name), "cagi_readvars() %d args", args);
+	bench_end(name, n);
+
+}
+
+/*
+ * bench_evaluate
+ *	evaluate() (which is session_evaluate() on the default session) and
+ *	session_command() of NOOP, with <response> as the response.
+ */
+static void bench_evaluate(const long n, const char *name, const char
+	*response) {
+
+	long i, batch;
+	char label[64];
+	char **data;
+	cagi_response parsed;
+
+	batch = FEED_BYTES / strlen(response);
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		if (i % batch == 0) {
+			bench_pause();
+			feed(response, (n - i < batch ? n - i : batch));
+			bench_resume();
+		}
+		data = evaluate("NOOP");
+		sink += data[1][0];
+		free_2d_array(data);
+	}
+	snprintf(label, sizeof(label), "evaluate() %s", name);
+	bench_end(label, n);
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		if (i % batch == 0) {
+			bench_pause();
+			feed(response, (n - i < batch ? n - i : batch));
+			bench_resume();
+		}
+		sink += session_command(session, "NOOP", &parsed);
+	}
+	snprintf(label, sizeof(label), "session_command() %s", name);
+	bench_end(label, n);
+
+}
+
+/*
+ * bench_format_str
+ *	format_str() of 3, 5 and 9 pieces.
+ */
+static void bench_format_str(const long n) {
+
+	long i;
+	char *str;
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		str = format_str(3, "GET VARIABLE ", "CALLERID(num)", "\n");
+		sink += str[0];
+		free(str);
+	}
+	bench_end("format_str() 3 pieces", n);
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		str = format_str(5, "STREAM FILE ", "welcome", " ", "#", "\n");
+		sink += str[0];
+		free(str);
+	}
+	bench_end("format_str() 5 pieces", n);
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		str = format_str(9, "SAY DATETIME ", "1245040107", " ",
+			"\"#\"", " ", "ABdY", " ", "America/New_York", "\n");
+		sink += str[0];
+		free(str);
+	}
+	bench_end("format_str() 9 pieces", n);
+
+}
+
+/*
+ * bench_create_dummy
+ *	create_dummy(), and response_dummy() which replaced it.
+ */
+static void bench_create_dummy(const long n) {
+
+	long i;
+	char **data;
+	cagi_response response;
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		data = create_dummy("200", "-1", "");
+		sink += data[1][0];
+		free_2d_array(data);
+	}
+	bench_end("create_dummy()", n);
+
+	bench_begin();
+	for (i = 0; i < n; i++)
+		sink += response_dummy(&response, "200", "-1", "");
+	bench_end("response_dummy()", n);
+
+}
+
+/*
+ * bench_exec
+ *	Encoding EXEC with options that need quoting and escaping, as
+ *	cagi_exec() does, and a whole cagi_exec() round trip.
+ */
+static void bench_exec(const long n) {
+
+	long i, batch;
+	const char *response = "200 result=0\n";
+	cagi_response parsed;
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		cmd_start(session, "EXEC");
+		cmd_arg(session, "Dial");
+		cmd_arg(session, "SIP/1001&SIP/1002,30,tTM(\"greet\" \\x)");
+		sink += session->wcmd;
+		session->wcmd = 0;
+	}
+	bench_end("exec() option escaping", n);
+
+	batch = FEED_BYTES / strlen(response);
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		if (i % batch == 0) {
+			bench_pause();
+			feed(response, (n - i < batch ? n - i : batch));
+			bench_resume();
+		}
+		sink += cagi_exec(session, "Dial", "SIP/1001&SIP/1002,30,"
+						"tTM(\"greet\" \\x)", &parsed);
+	}
+	bench_end("cagi_exec() round trip", n);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	int fds[2], null_fd;
+	long n = (argc > 1 ? atol(argv[1]) : 200000);
+
+	if (pipe(fds) == -1 || (null_fd = open("/dev/null", O_WRONLY)) == -1) {
+		fprintf(stderr, "bench-internals: cannot set up the pipes\n");
+		return 1;
+	}
+	feed_fd = fds[1];
+
+	/*
+	 * The session is also the thread's default one, so that the legacy
+	 * functions (readvars(), evaluate()) use it as well.
+	 */
+	session = cagi_session_new(fds[0], null_fd);
+	cagi_set_default_session(session);
+
+	printf("%-32s %10s %10s %10s\n", "benchmark", "ns/op", "allocs/op",
+								"syscalls/op");
+
+	bench_readvars(n / 10, 0);
+	bench_readvars(n / 10, 10);
+	bench_readvars(n / 10, 127);
+	bench_evaluate(n, "short", "200 result=1\n");
+	bench_evaluate(n, "long", "200 result=1 (https://example.com/api/"
+		"v1/callers/1001?fields=name,balance,language,last_call,plan&"
+		"token=0123456789abcdef0123456789abcdef) endpos=84320\n");
+	bench_format_str(n);
+	bench_create_dummy(n);
+	bench_exec(n);
+
+	printf("(checksum %ld)\n", sink);
+
+	cagi_set_default_session(NULL);
+	cagi_session_free(session);
+
+	return 0;
+
+}
@@ -0,0 +1,171 @@
+/*
+ * bench-parse.c
+ *
+ * This program compares the response parser (parse_response()) with the one evaluate() used
+ * to have, over a corpus of responses like the ones asterisk sends during a typical call.
+ * Both parse the same lines, and the time per line is printed for each.
+ *
+ * Build it like any cAGI program, from a directory where the cAGI headers are available as
+ * wpbx-cagi.h and wpbx-cagi-internals.h:
+ *	gcc -O2 -o bench-parse bench-parse.c cagi*.c -lpthread
+ * Add -mavx2 to try the AVX2 scanner (SSE2 is always used on x86-64).
+ *
+ * usage:	bench-parse [<iterations>]
+ *
+ * author:	Randall Degges
+ * email:	rdegges@gmail.com
+ * date:	10-16-26
+ * license:	GPLv3 (http://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "wpbx-cagi.h"
+#include "wpbx-cagi-internals.h"
+
+/*
+ * corpus holds the responses we parse, roughly in the proportions a call
+ * produces them: mostly bare results, then playback and variable reads.
+ */
+static const char *corpus[] = {
+	"200 result=0\n",
+	"200 result=1\n",
+	"200 result=0\n",
+	"200 result=1\n",
+	"200 result=0 endpos=84320\n",
+	"200 result=49 endpos=12000\n",
+	"200 result=1 (SIP/1001-00000a3f)\n",
+	"200 result=1 (1245040107.63)\n",
+	"200 result=1 (Randall Degges <1001>)\n",
+	"200 result=0 (timeout)\n",
+	"200 result=1234 (timeout)\n",
+	"200 result=50 (dtmf) endpos=31200\n",
+	"200 result=0 (hangup) endpos=8000\n",
+	"200 result=-1\n",
+	"200 result=1 (https://example.com/api/v1/callers/1001?fields=name,"
+		"balance,language&token=0123456789abcdef)\n",
+	"510 Invalid or unknown command\n",
+};
+
+#define CORPUS_SIZE ((int)(sizeof(corpus) / sizeof(corpus[0])))
+
+/*
+ * legacy_parse
+ *	The parser evaluate() had, taken as is (minus the I/O), including the
+ *	array it returned. <buff> is modified, like it was.
+ * params (required)
+ *	<buff>
+ * returns
+ *	Success: The array (see free_2d_array()).
+ *	Failure: NULL
+ */
+static char ** legacy_parse(char *buff) {
+
+	int i;
+	char *begin, *end, **data;
+
+	data = safe_malloc(_RETURN_ELEMENTS * sizeof(char *));
+	for (i = 0; i < _RETURN_ELEMENTS; i++)
+		data[i] = safe_malloc(_BUFF_SIZE);
+
+	begin = buff;
+	end = strchr(buff, ' ');
+	if (end == NULL)
+		goto fail;
+	*end = '\0';
+	end++;
+	snprintf(data[0], _BUFF_SIZE, "%s", begin);
+
+	begin = strchr(end, '=');
+	if (begin == NULL)
+		goto fail;
+	begin++;
+
+	end = strchr(begin, ' ');
+	if (end == NULL) {
+		end = strrchr(begin, '\n');
+		if (end == NULL)
+			goto fail;
+		*end = '\0';
+		snprintf(data[1], _BUFF_SIZE, "%s", begin);
+		data[2][0] = '\0';
+		return data;
+	}
+	*end = '\0';
+	end++;
+	snprintf(data[1], _BUFF_SIZE, "%s", begin);
+
+	begin = end;
+	end = strrchr(begin, '\n');
+	if (end == NULL)
+		goto fail;
+	*end = '\0';
+	snprintf(data[2], _BUFF_SIZE, "%s", begin);
+	return data;
+
+fail:
+	free_2d_array(data);
+	return NULL;
+
+}
+
+/*
+ * now
+ *	Return a monotonic timestamp in nanoseconds.
+ */
+static double now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+
+}
+
+int main(int argc, char *argv[]) {
+
+	int i, n, lens[CORPUS_SIZE];
+	long iterations = (argc > 1 ? atol(argv[1]) : 2000000);
+	long sink = 0;
+	double start, legacy, single;
+	char buff[_BUFF_SIZE], **data;
+	cagi_response response;
+
+	for (i = 0; i < CORPUS_SIZE; i++)
+		lens[i] = strlen(corpus[i]) - 1;
+
+	/*
+	 * The legacy parser chokes on error responses (there is no '='), so
+	 * it is fed the same lines but its failures are simply counted.
+	 */
+	start = now();
+	for (n = 0; n < iterations; n++) {
+		i = n % CORPUS_SIZE;
+		memcpy(buff, corpus[i], lens[i] + 2);
+		if ((data = legacy_parse(buff)) != NULL) {
+			sink += data[1][0];
+			free_2d_array(data);
+		}
+	}
+	legacy = (now() - start) / iterations;
+
+	start = now();
+	for (n = 0; n < iterations; n++) {
+		i = n % CORPUS_SIZE;
+		parse_response(corpus[i], lens[i], &response);
+		sink += response.result + response.endpos + response.value.len;
+	}
+	single = (now() - start) / iterations;
+
+	printf("lines:               %ld (%d distinct)\n", iterations,
+								CORPUS_SIZE);
+	printf("evaluate() parser:   %.1f ns/line\n", legacy);
+	printf("parse_response():    %.1f ns/line (%.1fx)\n", single,
+							legacy / single);
+	printf("(checksum %ld)\n", sink);
+
+	return 0;
+
+}